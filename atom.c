@@ -37,54 +37,159 @@ THE SOFTWARE.
 
 */
 
+/* Small atoms are carved out of slabs rather than malloced one by one,
+   which avoids the malloc overhead and keeps atoms close together.
+   Freed atoms are kept on a free list per size class; slabs are never
+   returned to the system. */
+
+#define ATOM_SLAB_SIZE 16384
+#define ATOM_ALIGN 16
+#define ATOM_MAX_SLAB_SIZE 512
+#define ATOM_BYTES(n) \
+    ((int)(sizeof(AtomRec) - 1 + (n) + 1 + ATOM_ALIGN - 1) & ~(ATOM_ALIGN - 1))
+#define ATOM_CLASS(size) ((size) / ATOM_ALIGN - 1)
+
 static AtomPtr *atomHashTable;
-int used_atoms;
+static int log2AtomHashTableSize;
+static AtomPtr atomFreeList[ATOM_MAX_SLAB_SIZE / ATOM_ALIGN];
+static char *atomSlab;
+static int atomSlabUsed;
+int used_atoms, used_atom_bytes, atomSlabBytes;
 
 void
 initAtoms()
 {
-    atomHashTable = calloc((1 << LOG2_ATOM_HASH_TABLE_SIZE),
-                           sizeof(AtomPtr));
+    log2AtomHashTableSize = LOG2_ATOM_HASH_TABLE_SIZE;
+    atomHashTable = calloc((1 << log2AtomHashTableSize), sizeof(AtomPtr));
 
     if(atomHashTable == NULL) {
         do_log(L_ERROR, "Couldn't allocate atom hash table.\n");
         exit(1);
     }
     used_atoms = 0;
+    used_atom_bytes = 0;
+}
+
+static AtomPtr
+allocateAtom(int n)
+{
+    int size = ATOM_BYTES(n), left;
+    AtomPtr atom;
+    char *slab;
+
+    if(size > ATOM_MAX_SLAB_SIZE) {
+        atom = malloc(size);
+        if(atom == NULL)
+            return NULL;
+    } else if(atomFreeList[ATOM_CLASS(size)]) {
+        atom = atomFreeList[ATOM_CLASS(size)];
+        atomFreeList[ATOM_CLASS(size)] = atom->next;
+    } else {
+        if(atomSlab == NULL || atomSlabUsed + size > ATOM_SLAB_SIZE) {
+            slab = malloc(ATOM_SLAB_SIZE);
+            if(slab == NULL)
+                return NULL;
+            /* The end of the old slab fits exactly in a smaller class. */
+            left = atomSlab ? ATOM_SLAB_SIZE - atomSlabUsed : 0;
+            if(left >= ATOM_BYTES(0)) {
+                atom = (AtomPtr)(atomSlab + atomSlabUsed);
+                atom->next = atomFreeList[ATOM_CLASS(left)];
+                atomFreeList[ATOM_CLASS(left)] = atom;
+            }
+            atomSlab = slab;
+            atomSlabUsed = 0;
+            atomSlabBytes += ATOM_SLAB_SIZE;
+        }
+        atom = (AtomPtr)(atomSlab + atomSlabUsed);
+        atomSlabUsed += size;
+    }
+    used_atom_bytes += size;
+    return atom;
+}
+
+static void
+freeAtom(AtomPtr atom)
+{
+    int size = ATOM_BYTES(atom->length);
+
+    used_atom_bytes -= size;
+    if(size > ATOM_MAX_SLAB_SIZE) {
+        free(atom);
+    } else {
+        atom->next = atomFreeList[ATOM_CLASS(size)];
+        atomFreeList[ATOM_CLASS(size)] = atom;
+    }
+}
+
+/* Since the hash is stored in the atom, rehashing is cheap enough to be
+   done all at once. */
+static void
+atomHashGrow()
+{
+    AtomPtr *new_table, atom, next;
+    int i, h, size = 1 << log2AtomHashTableSize;
+
+    if(log2AtomHashTableSize >= 24)
+        return;
+
+    new_table = calloc(2 * size, sizeof(AtomPtr));
+    if(new_table == NULL) {
+        do_log(L_WARN, "Couldn't grow atom hash table.\n");
+        return;
+    }
+
+    for(i = 0; i < size; i++) {
+        atom = atomHashTable[i];
+        while(atom) {
+            next = atom->next;
+            h = atom->hash & (2 * size - 1);
+            atom->next = new_table[h];
+            new_table[h] = atom;
+            atom = next;
+        }
+    }
+    free(atomHashTable);
+    atomHashTable = new_table;
+    log2AtomHashTableSize++;
 }
 
 AtomPtr
 internAtomN(const char *string, int n)
 {
     AtomPtr atom;
-    int h;
+    unsigned int h;
+    int i;
 
     if(n < 0 || n >= (1 << (8 * sizeof(unsigned short))))
         return NULL;
 
-    h = hash(0, string, n, LOG2_ATOM_HASH_TABLE_SIZE);
-    atom = atomHashTable[h];
+    h = hash(0, string, n, 32);
+    atom = atomHashTable[h & ((1 << log2AtomHashTableSize) - 1)];
     while(atom) {
-        if(atom->length == n &&
+        if(atom->hash == h && atom->length == n &&
            (n == 0 || memcmp(atom->string, string, n) == 0))
             break;
         atom = atom->next;
     }
 
     if(!atom) {
-        atom = malloc(sizeof(AtomRec) - 1 + n + 1);
+        if(used_atoms >= (1 << log2AtomHashTableSize))
+            atomHashGrow();
+        atom = allocateAtom(n);
         if(atom == NULL) {
             return NULL;
         }
         atom->refcount = 0;
+        atom->hash = h;
         atom->length = n;
         /* Atoms are used both for binary data and strings.  To make
            their use as strings more convenient, atoms are always
            NUL-terminated. */
         memcpy(atom->string, string, n);
         atom->string[n] = '\0';
-        atom->next = atomHashTable[h];
-        atomHashTable[h] = atom;
+        i = h & ((1 << log2AtomHashTableSize) - 1);
+        atom->next = atomHashTable[i];
+        atomHashTable[i] = atom;
         used_atoms++;
     }
     do_log(D_ATOM_REFCOUNT, "A 0x%lx %d++\n",
@@ -189,12 +294,11 @@ releaseAtom(AtomPtr atom)
     atom->refcount--;
 
     if(atom->refcount == 0) {
-        int h = hash(0, atom->string, atom->length, LOG2_ATOM_HASH_TABLE_SIZE);
+        int h = atom->hash & ((1 << log2AtomHashTableSize) - 1);
         assert(atomHashTable[h] != NULL);
 
         if(atom == atomHashTable[h]) {
             atomHashTable[h] = atom->next;
-            free(atom);
         } else {
             AtomPtr previous = atomHashTable[h];
             while(previous->next) {
@@ -204,8 +308,8 @@ releaseAtom(AtomPtr atom)
             }
             assert(previous->next != NULL);
             previous->next = atom->next;
-            free(atom);
         }
+        freeAtom(atom);
         used_atoms--;
     }
 }
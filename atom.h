@@ -22,6 +22,7 @@ THE SOFTWARE.
 
 typedef struct _Atom {
     unsigned int refcount;
+    unsigned int hash;
     struct _Atom *next;
     unsigned short length;
     char string[1];
@@ -33,10 +34,11 @@ typedef struct _AtomList {
     AtomPtr *list;
 } AtomListRec, *AtomListPtr;
 
+/* Initial size; the table grows as atoms are interned. */
 #define LOG2_ATOM_HASH_TABLE_SIZE 10
 #define LARGE_ATOM_REFCOUNT 0xFFFFFF00U
 
-extern int used_atoms;
+extern int used_atoms, used_atom_bytes, atomSlabBytes;
 
 void initAtoms(void);
 AtomPtr internAtom(const char *string);
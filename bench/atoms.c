@@ -0,0 +1,118 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Atom interning.  For each count given on the command line, interns
+   that many URL-sized atoms, looks each of them up again and releases
+   both references, three times over; then interns them once more and
+   reports the resident set size.
+
+   Usage: bench/atoms [count...]    (default 1000 100000 200000) */
+
+#include <sys/wait.h>
+#include "bench.h"
+
+static int
+makeUrl(char *buf, int size, int i)
+{
+    return snprintf(buf, size,
+                    "http://www.example%d.com/path/to/resource/%d.html",
+                    i % 977, i);
+}
+
+static long
+residentKB()
+{
+    char buf[256];
+    long rss = -1;
+    FILE *f;
+
+    f = fopen("/proc/self/status", "r");
+    if(f == NULL)
+        return -1;
+    while(fgets(buf, sizeof(buf), f)) {
+        if(strncmp(buf, "VmRSS:", 6) == 0)
+            rss = atol(buf + 6);
+    }
+    fclose(f);
+    return rss;
+}
+
+static void
+run(int n)
+{
+    AtomPtr *atoms, atom;
+    char buf[200];
+    int i, r, len;
+    double t;
+
+    atoms = malloc(n * sizeof(AtomPtr));
+    if(atoms == NULL)
+        abort();
+
+    t = benchTime();
+    for(r = 0; r < 3; r++) {
+        for(i = 0; i < n; i++) {
+            len = makeUrl(buf, sizeof(buf), i);
+            atoms[i] = internAtomN(buf, len);
+        }
+        for(i = 0; i < n; i++) {
+            atom = internAtomN(atoms[i]->string, atoms[i]->length);
+            releaseAtom(atom);
+        }
+        for(i = 0; i < n; i++)
+            releaseAtom(atoms[i]);
+    }
+    t = benchTime() - t;
+
+    for(i = 0; i < n; i++) {
+        len = makeUrl(buf, sizeof(buf), i);
+        atoms[i] = internAtomN(buf, len);
+    }
+    printf("%8d atoms  %8.1f ns/op  RSS %ld kB\n",
+           n, t / (3.0 * 3 * n), residentKB());
+}
+
+int
+main(int argc, char **argv)
+{
+    static const int defaults[] = {1000, 100000, 200000};
+    int i, n;
+    pid_t pid;
+
+    initHash();
+    initAtoms();
+    n = argc > 1 ? argc - 1 : 3;
+    for(i = 0; i < n; i++) {
+        fflush(stdout);
+        pid = fork();
+        if(pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if(pid == 0) {
+            run(argc > 1 ? atoi(argv[i + 1]) : defaults[i]);
+            exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
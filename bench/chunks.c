@@ -0,0 +1,128 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Chunk allocator churn.  For each value of chunkHighMark given on the
+   command line, fills 90% of it with chunks, then repeatedly frees 64
+   random chunks and allocates 64 new ones.  Finally, frees everything
+   and checks that the arenas are returned and can be used again.
+
+   Usage: bench/chunks [chunkHighMark...]
+   (default 24MB, 256MB and 1536MB) */
+
+#include <sys/wait.h>
+#include "bench.h"
+
+#define BATCH 64
+
+static void
+run(int highMark)
+{
+    char buf[100];
+    void **chunks;
+    int n, i, j, k, rounds;
+    double t;
+
+    preinitChunks();
+    preinitObject();
+    snprintf(buf, sizeof(buf), "chunkHighMark = %d", highMark);
+    parseConfigLine(buf, "command line", 0, 0);
+    initChunks();
+    initObject();
+
+    n = CHUNKS(chunkHighMark) / 10 * 9;
+    chunks = malloc(n * sizeof(void*));
+    if(chunks == NULL)
+        abort();
+    for(i = 0; i < n; i++) {
+        chunks[i] = get_chunk();
+        if(chunks[i] == NULL)
+            abort();
+        memset(chunks[i], 0, 1);
+    }
+
+    srandom(1);
+    rounds = 2000000 / BATCH;
+    t = benchTime();
+    for(k = 0; k < rounds; k++) {
+        int victims[BATCH];
+        for(j = 0; j < BATCH; j++) {
+            victims[j] = random() % n;
+            if(chunks[victims[j]]) {
+                dispose_chunk(chunks[victims[j]]);
+                chunks[victims[j]] = NULL;
+            }
+        }
+        for(j = 0; j < BATCH; j++) {
+            if(chunks[victims[j]] == NULL) {
+                chunks[victims[j]] = get_chunk();
+                if(chunks[victims[j]] == NULL)
+                    abort();
+            }
+        }
+    }
+    t = benchTime() - t;
+    printf("chunkHighMark %5dMB  %7d chunks in use  %8.1f ns per free+alloc\n",
+           highMark >> 20, used_chunks, t / rounds / BATCH);
+
+    for(i = 0; i < n; i++)
+        dispose_chunk(chunks[i]);
+    free_chunk_arenas();
+    if(used_chunks != 0 || totalChunkArenaSize() != 0) {
+        fprintf(stderr, "%d chunks, %d bytes of arenas left over.\n",
+                used_chunks, totalChunkArenaSize());
+        exit(1);
+    }
+    for(i = 0; i < n; i++) {
+        chunks[i] = get_chunk();
+        if(chunks[i] == NULL)
+            abort();
+        memset(chunks[i], 0, 1);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    static const int defaults[] = {24, 256, 1536};
+    int i, n, status;
+    pid_t pid;
+
+    initAtoms();
+    initEvents();
+    n = argc > 1 ? argc - 1 : 3;
+    for(i = 0; i < n; i++) {
+        fflush(stdout);
+        pid = fork();
+        if(pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if(pid == 0) {
+            run(argc > 1 ? atoi(argv[i + 1]) : defaults[i] << 20);
+            exit(0);
+        }
+        waitpid(pid, &status, 0);
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Per-wakeup cost of the event loop.  For each count given on the
+   command line, registers that many idle descriptors, then keeps one
+   eventfd readable so that every iteration of eventLoop dispatches
+   exactly one event.  Build with EXTRA_DEFINES=-DNO_EPOLL to measure
+   the poll backend.
+
+   Usage: bench/eventloop [count...]    (default 1000 10000 50000) */
+
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "bench.h"
+
+static int idle_fds, wakeups, count, active_fd;
+static double start;
+
+static int
+idleHandler(int status, FdEventHandlerPtr event)
+{
+    return 0;
+}
+
+static int
+activeHandler(int status, FdEventHandlerPtr event)
+{
+    unsigned long long v;
+    int rc;
+
+    rc = read(active_fd, &v, 8);
+    if(rc != 8)
+        abort();
+    if(count == 0)
+        start = benchTime();
+    if(++count > wakeups) {
+        printf("%8d idle fds  %10.2f us/wakeup\n", idle_fds,
+               (benchTime() - start) / wakeups / 1000.0);
+        exit(0);
+    }
+    v = 1;
+    rc = write(active_fd, &v, 8);
+    if(rc != 8)
+        abort();
+    return 0;
+}
+
+static void
+run(int n)
+{
+    struct rlimit rl;
+    unsigned long long v = 1;
+    int i, fd, rc;
+
+    rc = getrlimit(RLIMIT_NOFILE, &rl);
+    if(rc >= 0 && rl.rlim_cur < n + 64) {
+        rl.rlim_cur = n + 64;
+        if(rl.rlim_max != RLIM_INFINITY && rl.rlim_cur > rl.rlim_max)
+            rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    initEvents();
+    for(i = 0; i < n; i++) {
+        fd = eventfd(0, EFD_NONBLOCK);
+        if(fd < 0) {
+            fprintf(stderr, "%d idle fds: %s\n", n, strerror(errno));
+            exit(1);
+        }
+        registerFdEvent(fd, POLLIN, idleHandler, 0, NULL);
+    }
+    active_fd = eventfd(0, EFD_NONBLOCK);
+    if(active_fd < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+    registerFdEvent(active_fd, POLLIN, activeHandler, 0, NULL);
+
+    idle_fds = n;
+    wakeups = n > 5000 ? 2000 : 20000;
+    rc = write(active_fd, &v, 8);
+    if(rc != 8)
+        abort();
+    eventLoop();
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const int defaults[] = {1000, 10000, 50000};
+    int i, n, status;
+    pid_t pid;
+
+    initAtoms();
+    n = argc > 1 ? argc - 1 : 3;
+    for(i = 0; i < n; i++) {
+        fflush(stdout);
+        pid = fork();
+        if(pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if(pid == 0)
+            run(argc > 1 ? atoi(argv[i + 1]) : defaults[i]);
+        waitpid(pid, &status, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,247 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Trace-driven simulation of the memory cache.  Each request in the
+   trace looks its object up with findObject; on a miss, the object is
+   created and filled with objectAddData, as if fetched from the
+   server.  The trace is replayed once per eviction policy, using the
+   real discardObjects, and the object and byte hit ratios are
+   reported.  The disk cache is disabled.
+
+   A trace file has one request per line: a key and a size in bytes.
+   Without one, a trace is generated: Zipf(0.8) requests over 20000
+   objects of 1 to 64kB, interrupted every 1000 requests by a burst of
+   eight 512kB downloads that are never requested again.
+
+   Usage: bench/eviction [-t trace] [var=value...]
+   where the variables are configuration variables such as
+   objectHighMark or chunkHighMark. */
+
+#include <math.h>
+#include <sys/wait.h>
+#include "bench.h"
+
+typedef struct _TraceEntry {
+    char *key;
+    int key_size;
+    int size;
+} TraceEntryRec, *TraceEntryPtr;
+
+static TraceEntryPtr trace;
+static int traceLength, traceSize;
+static char filler[CHUNK_SIZE];
+
+static void
+addRequest(const char *key, int key_size, int size)
+{
+    if(traceLength >= traceSize) {
+        traceSize = traceSize ? 2 * traceSize : 1024;
+        trace = realloc(trace, traceSize * sizeof(TraceEntryRec));
+        if(trace == NULL)
+            abort();
+    }
+    trace[traceLength].key = malloc(key_size);
+    if(trace[traceLength].key == NULL)
+        abort();
+    memcpy(trace[traceLength].key, key, key_size);
+    trace[traceLength].key_size = key_size;
+    trace[traceLength].size = size;
+    traceLength++;
+}
+
+static void
+readTrace(const char *filename)
+{
+    char buf[4096], key[4096];
+    int size;
+    FILE *f;
+
+    f = fopen(filename, "r");
+    if(f == NULL) {
+        perror(filename);
+        exit(1);
+    }
+    while(fgets(buf, sizeof(buf), f)) {
+        if(sscanf(buf, "%4095s %d", key, &size) == 2 && size >= 0)
+            addRequest(key, strlen(key), size);
+    }
+    fclose(f);
+}
+
+static void
+generateTrace(int objects, int requests)
+{
+    double *cumulative, total = 0.0, r;
+    char buf[100];
+    int i, j, lo, hi, len, scans = 0;
+
+    cumulative = malloc(objects * sizeof(double));
+    if(cumulative == NULL)
+        abort();
+    for(i = 0; i < objects; i++) {
+        total += 1.0 / pow(i + 1, 0.8);
+        cumulative[i] = total;
+    }
+
+    srandom(1);
+    for(i = 0; i < requests; i++) {
+        if(i % 1000 == 999) {
+            for(j = 0; j < 8; j++) {
+                len = snprintf(buf, sizeof(buf),
+                               "http://downloads.example.org/%d", scans++);
+                addRequest(buf, len, 512 * 1024);
+            }
+        }
+        r = (double)random() / RAND_MAX * total;
+        lo = 0;
+        hi = objects - 1;
+        while(lo < hi) {
+            j = (lo + hi) / 2;
+            if(cumulative[j] < r)
+                lo = j + 1;
+            else
+                hi = j;
+        }
+        /* Object sizes don't depend on popularity. */
+        j = (lo * 2654435761U) % 64;
+        len = snprintf(buf, sizeof(buf),
+                       "http://www.example.com/%d", lo);
+        addRequest(buf, len, 1024 * (j + 1));
+    }
+    free(cumulative);
+}
+
+static int
+objectComplete(ObjectPtr object, int size)
+{
+    return !(object->flags & OBJECT_INITIAL) && object->length == size &&
+        objectHasData(object, 0, size) == 2;
+}
+
+static void
+fetch(ObjectPtr object, int size)
+{
+    int offset, n, rc;
+
+    object->flags &= ~OBJECT_INITIAL;
+    object->length = size;
+    for(offset = 0; offset < size; offset += n) {
+        n = MIN(size - offset, CHUNK_SIZE);
+        rc = objectAddData(object, filler, offset, n);
+        if(rc < 0)
+            break;
+    }
+}
+
+static void
+run(const char *policy, int argc, char **argv)
+{
+    double requests = 0, hits = 0, bytes = 0, byteHits = 0;
+    ObjectPtr object;
+    TraceEntryPtr e;
+    char buf[100];
+    int i;
+
+    preinitChunks();
+    preinitLog();
+    preinitObject();
+    preinitDiskcache();
+    for(i = 0; i < argc; i++) {
+        if(parseConfigLine(argv[i], "command line", 0, 0) < 0)
+            exit(1);
+    }
+    snprintf(buf, sizeof(buf), "objectEvictionPolicy = %s", policy);
+    parseConfigLine(buf, "command line", 0, 0);
+    parseConfigLine("diskCacheRoot = \"\"", "command line", 0, 0);
+    parseConfigLine("localDocumentRoot = \"\"", "command line", 0, 0);
+    initChunks();
+    initLog();
+    initObject();
+    initDiskcache();
+    gettimeofday(&current_time, NULL);
+
+    for(i = 0; i < traceLength; i++) {
+        e = &trace[i];
+        /* 100 requests per second */
+        current_time.tv_usec += 10000;
+        if(current_time.tv_usec >= 1000000) {
+            current_time.tv_sec++;
+            current_time.tv_usec -= 1000000;
+            runTimeEventQueue();
+        }
+
+        requests++;
+        bytes += e->size;
+        object = findObject(OBJECT_HTTP, e->key, e->key_size);
+        if(object && objectComplete(object, e->size)) {
+            hits++;
+            byteHits += e->size;
+        } else {
+            if(object) {
+                privatiseObject(object, 0);
+                releaseObject(object);
+            }
+            object = makeObject(OBJECT_HTTP, e->key, e->key_size,
+                                1, 0, NULL, NULL);
+            if(object == NULL)
+                continue;
+            fetch(object, e->size);
+        }
+        objectAccessed(object);
+        releaseObject(object);
+    }
+
+    printf("%-5s %d requests  object hit ratio %.3f  byte hit ratio %.3f\n",
+           policy, traceLength, hits / requests, byteHits / bytes);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const char *policies[] = {"lru", "gdsf"};
+    int i = 1, j;
+    pid_t pid;
+
+    if(i + 1 < argc && strcmp(argv[i], "-t") == 0) {
+        readTrace(argv[i + 1]);
+        i += 2;
+    } else {
+        generateTrace(20000, 200000);
+    }
+
+    initAtoms();
+    initEvents();
+    for(j = 0; j < 2; j++) {
+        fflush(stdout);
+        pid = fork();
+        if(pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if(pid == 0) {
+            run(policies[j], argc - i, argv + i);
+            exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
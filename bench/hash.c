@@ -0,0 +1,209 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Throughput and bucket distribution of hash(), compared with the
+   shift-add hash that Polipo used before.  Keys are read one per line
+   from the file given on the command line, or generated to look like
+   the URLs a proxy sees: article pages, images, API calls and
+   versioned assets spread over 320 hosts.
+
+   Usage: bench/hash [-b log2-buckets] [file] */
+
+#include <math.h>
+#include "bench.h"
+
+#define MAX_KEYS 400000
+
+static char *keys[MAX_KEYS];
+static int lengths[MAX_KEYS];
+static int numkeys;
+
+static unsigned int
+shiftAddHash(unsigned int seed, const void *key, int key_size,
+             unsigned int hash_size)
+{
+    int i;
+    unsigned int h;
+
+    h = seed;
+    for(i = 0; i < key_size; i++)
+        h = (h << 5) + (h >> (hash_size - 5)) +
+            ((unsigned char*)key)[i];
+    return h & ((1 << hash_size) - 1);
+}
+
+static unsigned int
+bucket(int old, int i, int log2)
+{
+    if(old)
+        return shiftAddHash(0, keys[i], lengths[i], log2);
+    else
+        return hash(0, keys[i], lengths[i], 32) & ((1 << log2) - 1);
+}
+
+static void
+addKey(const char *key, int len)
+{
+    keys[numkeys] = malloc(len);
+    if(keys[numkeys] == NULL)
+        abort();
+    memcpy(keys[numkeys], key, len);
+    lengths[numkeys] = len;
+    numkeys++;
+}
+
+static void
+readKeys(const char *filename)
+{
+    char buf[4096];
+    int len;
+    FILE *f;
+
+    f = fopen(filename, "r");
+    if(f == NULL) {
+        perror(filename);
+        exit(1);
+    }
+    while(numkeys < MAX_KEYS && fgets(buf, sizeof(buf), f)) {
+        len = strlen(buf);
+        while(len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+            len--;
+        if(len > 0)
+            addKey(buf, len);
+    }
+    fclose(f);
+}
+
+static void
+generateKeys(int n)
+{
+    char host[64], buf[256], slug[64];
+    int i, j, len;
+
+    srandom(1);
+    for(i = 0; i < n; i++) {
+        j = random() % 320;
+        if(j < 300)
+            snprintf(host, sizeof(host), "www.site%d.example.com", j);
+        else
+            snprintf(host, sizeof(host), "cdn%d.akamaized.net", j - 300);
+        switch(i % 4) {
+        case 0:
+            len = 8 + random() % 40;
+            for(j = 0; j < len; j++)
+                slug[j] = random() % 8 == 0 ? '-' : 'a' + random() % 16;
+            slug[len] = '\0';
+            len = snprintf(buf, sizeof(buf),
+                           "http://%s/article/%ld/%s?ref=%ld",
+                           host, random() % 100000, slug, random() % 30);
+            break;
+        case 1:
+            len = snprintf(buf, sizeof(buf), "http://%s/images/%d.jpg",
+                           host, i);
+            break;
+        case 2:
+            len = snprintf(buf, sizeof(buf),
+                           "http://%s/api/v1/items?id=%d&page=%ld",
+                           host, i, random() % 10);
+            break;
+        default:
+            len = snprintf(buf, sizeof(buf),
+                           "http://%s/static/js/app.%08lx.js",
+                           host, random() & 0xFFFFFFFF);
+            break;
+        }
+        addKey(buf, len);
+    }
+}
+
+static void
+run(int old, int log2)
+{
+    int size = 1 << log2;
+    int *counts;
+    int i, r, max = 0, empty = 0;
+    double t, best = 1.0E30, bytes = 0, probes = 0, load;
+    volatile unsigned int sink = 0;
+
+    for(r = 0; r < 5; r++) {
+        t = benchTime();
+        for(i = 0; i < numkeys; i++)
+            sink += old ?
+                shiftAddHash(0, keys[i], lengths[i], log2) :
+                hash(0, keys[i], lengths[i], 32);
+        t = benchTime() - t;
+        if(t < best)
+            best = t;
+    }
+
+    counts = calloc(size, sizeof(int));
+    if(counts == NULL)
+        abort();
+    for(i = 0; i < numkeys; i++) {
+        counts[bucket(old, i, log2)]++;
+        bytes += lengths[i];
+    }
+    for(i = 0; i < size; i++) {
+        if(counts[i] > max)
+            max = counts[i];
+        if(counts[i] == 0)
+            empty++;
+        probes += counts[i] * (counts[i] + 1) / 2.0;
+    }
+    free(counts);
+
+    /* A uniform hash leaves exp(-load) of the buckets empty and takes
+       1 + load/2 probes per successful lookup. */
+    load = (double)numkeys / size;
+    printf("  %-9s %6.1f ns/key %5.2f GB/s  max chain %3d  "
+           "empty %5.1f%% (ideal %4.1f%%)  probes/hit %.3f (ideal %.3f)\n",
+           old ? "shift-add" : "hash", best / numkeys, bytes / best, max,
+           100.0 * empty / size, 100.0 * exp(-load),
+           probes / numkeys, 1 + load / 2);
+}
+
+int
+main(int argc, char **argv)
+{
+    int log2 = 18;
+    int i = 1;
+
+    if(i + 1 < argc && strcmp(argv[i], "-b") == 0) {
+        log2 = atoi(argv[i + 1]);
+        i += 2;
+    }
+    if(log2 < 6 || log2 > 26) {
+        fprintf(stderr, "Usage: %s [-b log2-buckets] [file]\n", argv[0]);
+        return 1;
+    }
+
+    initHash();
+    if(i < argc)
+        readKeys(argv[i]);
+    else
+        generateKeys(200000);
+
+    printf("%d keys, %d buckets\n", numkeys, 1 << log2);
+    run(1, log2);
+    run(0, log2);
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* HTTP header parsing.  Replays a corpus of header blocks through
+   findEndOfHeaders, the first-line parser and httpParseHeaders, and
+   reports the time per header line, separately for requests (client
+   side) and replies (server side).  Each block is copied to the start
+   of its own chunk-aligned buffer, as when read from the network.
+
+   A corpus is a file of concatenated header blocks, each ending with
+   an empty line; blocks starting with "HTTP/" are replies.  The
+   default, bench/headers.txt, mimics the traffic of a few desktop and
+   mobile browsers.
+
+   Usage: bench/parse [corpus] */
+
+#include "bench.h"
+
+typedef struct _Block {
+    char *buf;
+    int len;
+    int lines;
+} BlockRec, *BlockPtr;
+
+static BlockRec requests[1000], replies[1000];
+static int numRequests, numReplies;
+
+static void
+addBlock(const char *data, int len)
+{
+    BlockPtr block;
+    int i, rc;
+
+    if(len > CHUNK_SIZE)
+        return;
+    if(len >= 5 && memcmp(data, "HTTP/", 5) == 0) {
+        if(numReplies >= 1000)
+            return;
+        block = &replies[numReplies++];
+    } else {
+        if(numRequests >= 1000)
+            return;
+        block = &requests[numRequests++];
+    }
+    rc = posix_memalign((void**)&block->buf, CHUNK_SIZE, CHUNK_SIZE);
+    if(rc != 0)
+        abort();
+    memcpy(block->buf, data, len);
+    memset(block->buf + len, 'x', CHUNK_SIZE - len);
+    block->len = len;
+    /* Not counting the first line and the final empty line. */
+    block->lines = -2;
+    for(i = 0; i < len; i++)
+        if(data[i] == '\n')
+            block->lines++;
+}
+
+static void
+readCorpus(const char *filename)
+{
+    char *data;
+    int size, start, i;
+    FILE *f;
+
+    f = fopen(filename, "rb");
+    if(f == NULL) {
+        perror(filename);
+        exit(1);
+    }
+    data = malloc(4 * 1024 * 1024);
+    if(data == NULL)
+        abort();
+    size = fread(data, 1, 4 * 1024 * 1024, f);
+    fclose(f);
+
+    start = 0;
+    for(i = 0; i < size; i++) {
+        if(data[i] != '\n')
+            continue;
+        if((i >= 1 && data[i - 1] == '\n') ||
+           (i >= 3 && memcmp(data + i - 3, "\r\n\r\n", 4) == 0)) {
+            addBlock(data + start, i + 1 - start);
+            start = i + 1;
+        }
+    }
+    free(data);
+}
+
+static void
+parseBlock(BlockPtr block, int server)
+{
+    AtomPtr headers = NULL, url = NULL, via = NULL, auth = NULL;
+    AtomPtr expect = NULL, message = NULL;
+    int len, te, method, version, code, age, body_offset, body, rc;
+    time_t date, last_modified, expires, polipo_age, polipo_access;
+    char *etag = NULL, *location = NULL;
+    HTTPConditionPtr condition = NULL;
+    HTTPRangeRec range, content_range;
+    CacheControlRec cache_control;
+
+    rc = findEndOfHeaders(block->buf, 0, block->len, &body);
+    if(rc < 0)
+        abort();
+    if(!server) {
+        rc = httpParseClientFirstLine(block->buf, 0,
+                                      &method, &url, &version);
+        if(rc <= 0)
+            abort();
+        rc = httpParseHeaders(1, url, block->buf, rc, NULL,
+                              &headers, &len, &cache_control, &condition,
+                              &te, NULL, NULL, NULL, NULL, NULL,
+                              NULL, NULL, NULL, &expect, &range, NULL,
+                              NULL, &via, &auth);
+    } else {
+        rc = httpParseServerFirstLine(block->buf, &code, &version, &message);
+        if(rc <= 0)
+            abort();
+        rc = httpParseHeaders(0, NULL, block->buf, rc, NULL,
+                              &headers, &len, &cache_control, NULL,
+                              &te, &date, &last_modified, &expires,
+                              &polipo_age, &polipo_access, &body_offset,
+                              &age, &etag, NULL, NULL, &content_range,
+                              &location, &via, NULL);
+    }
+    if(rc < 0)
+        abort();
+
+    releaseAtom(headers);
+    releaseAtom(url);
+    releaseAtom(via);
+    releaseAtom(auth);
+    releaseAtom(expect);
+    releaseAtom(message);
+    if(condition)
+        httpDestroyCondition(condition);
+    free(etag);
+    free(location);
+}
+
+static void
+run(BlockPtr blocks, int n, int server)
+{
+    int i, r, k, lines = 0;
+    double t, best = 1.0E30;
+
+    if(n == 0)
+        return;
+    for(i = 0; i < n; i++)
+        lines += blocks[i].lines;
+
+    /* Warm up the caches and the atom table. */
+    for(i = 0; i < n; i++)
+        parseBlock(&blocks[i], server);
+
+    for(k = 0; k < 7; k++) {
+        t = benchTime();
+        for(r = 0; r < 200; r++)
+            for(i = 0; i < n; i++)
+                parseBlock(&blocks[i], server);
+        t = benchTime() - t;
+        if(t < best)
+            best = t;
+    }
+    printf("%s: %d blocks  %6.1f ns/header  %7.0f ns/block\n",
+           server ? "server" : "client", n,
+           best / (200.0 * lines), best / (200.0 * n));
+}
+
+int
+main(int argc, char **argv)
+{
+    initHash();
+    initAtoms();
+    preinitHttpParser();
+    initHttpParser();
+
+    readCorpus(argc > 1 ? argv[1] : "bench/headers.txt");
+    if(numRequests + numReplies == 0) {
+        fprintf(stderr, "No header blocks found.\n");
+        return 1;
+    }
+    run(requests, numRequests, 0);
+    run(replies, numReplies, 1);
+    return 0;
+}
@@ -0,0 +1,103 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Timer churn.  Schedules a number of time events, then repeatedly
+   cancels a random one and schedules a replacement, as connection
+   timeouts do.  The clock advances by 3us between operations.  Delays
+   are either spread over 1 to 600 seconds or all 120 seconds.
+
+   Usage: bench/timers [timers [operations]]  (default 100000 1000000) */
+
+#include "bench.h"
+
+static TimeEventHandlerPtr *events;
+
+static int
+timeHandler(TimeEventHandlerPtr event)
+{
+    return 1;
+}
+
+static void
+tick()
+{
+    current_time.tv_usec += 3;
+    if(current_time.tv_usec >= 1000000) {
+        current_time.tv_sec++;
+        current_time.tv_usec -= 1000000;
+    }
+}
+
+static void
+run(int fixed, int n, int m)
+{
+    int i, k;
+    double t;
+
+    srandom(1);
+    for(i = 0; i < n; i++) {
+        events[i] = scheduleTimeEvent(fixed ? 120 : 1 + random() % 600,
+                                      timeHandler, 0, NULL);
+        if(events[i] == NULL)
+            abort();
+        tick();
+    }
+
+    t = benchTime();
+    for(k = 0; k < m; k++) {
+        i = random() % n;
+        cancelTimeEvent(events[i]);
+        tick();
+        events[i] = scheduleTimeEvent(fixed ? 120 : 1 + random() % 600,
+                                      timeHandler, 0, NULL);
+        if(events[i] == NULL)
+            abort();
+    }
+    t = benchTime() - t;
+    printf("%-16s %d timers  %8.0f ns per cancel+schedule\n",
+           fixed ? "fixed, 120s" : "random, 1-600s", n, t / m);
+
+    for(i = 0; i < n; i++)
+        cancelTimeEvent(events[i]);
+}
+
+int
+main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+    int m = argc > 2 ? atoi(argv[2]) : 1000000;
+
+    if(n <= 0 || m <= 0) {
+        fprintf(stderr, "Usage: %s [timers [operations]]\n", argv[0]);
+        return 1;
+    }
+    events = malloc(n * sizeof(TimeEventHandlerPtr));
+    if(events == NULL)
+        abort();
+
+    initAtoms();
+    initEvents();
+    gettimeofday(&current_time, NULL);
+    run(0, n, m);
+    run(1, n, m);
+    return 0;
+}
@@ -26,6 +26,9 @@ THE SOFTWARE.
 int chunkLowMark = 0, 
     chunkCriticalMark = 0,
     chunkHighMark = 0;
+int chunkHugePages = 0;
+int chunkPrefault = 0;
+int chunkRetainMark = 0;
 
 void
 preinitChunks()
@@ -36,6 +39,12 @@ preinitChunks()
                     "Critical mark for chunk memory (0 = auto).");
     CONFIG_VARIABLE(chunkHighMark, CONFIG_INT,
                     "High mark for chunk memory.");
+    CONFIG_VARIABLE(chunkHugePages, CONFIG_TRISTATE,
+                    "Use huge pages for chunk memory.");
+    CONFIG_VARIABLE(chunkPrefault, CONFIG_BOOLEAN,
+                    "Allocate all chunk memory at startup.");
+    CONFIG_VARIABLE_SETTABLE(chunkRetainMark, CONFIG_INT, configIntSetter,
+                             "Chunk memory never given back to the OS.");
 }
 
 static void
@@ -125,6 +134,12 @@ initChunks(void)
     initChunksCommon();
 }
 
+void
+prefaultChunks(void)
+{
+    return;
+}
+
 void
 free_chunk_arenas()
 {
@@ -163,6 +178,33 @@ maybe_get_chunk()
     return chunk;
 }
 
+void *
+get_chunks(int n)
+{
+    void *chunk;
+
+    if(n == 1)
+        return get_chunk();
+    if(used_chunks + n > CHUNKS(chunkHighMark))
+        maybe_free_chunks(0, 0);
+    chunk = maybe_get_chunks(n);
+    while(chunk == NULL && discardOldestObject())
+        chunk = maybe_get_chunks(n);
+    return chunk;
+}
+
+void *
+maybe_get_chunks(int n)
+{
+    void *chunk;
+    if(used_chunks + n > CHUNKS(chunkHighMark))
+        return NULL;
+    chunk = malloc(n * CHUNK_SIZE);
+    if(chunk)
+        used_chunks += n;
+    return chunk;
+}
+
 void
 dispose_chunk(void *chunk)
 {
@@ -171,6 +213,14 @@ dispose_chunk(void *chunk)
     used_chunks--;
 }
 
+void
+dispose_chunks(void *chunk, int n)
+{
+    assert(chunk != NULL);
+    free(chunk);
+    used_chunks -= n;
+}
+
 void
 free_chunks()
 {
@@ -184,19 +234,38 @@ totalChunkArenaSize()
 }
 #else
 
+/* Address space for all the arenas is reserved at startup, and arenas
+   are then committed and decommitted within it.  This way, the arena
+   holding a chunk is found by a mere division. */
+
+/* With huge pages, the whole reservation is mapped read-write from the
+   start, since committing an arena with MAP_FIXED would create a
+   mapping of its own and lose the huge page advice.  hugeArenas is 1
+   for transparent huge pages, 2 for explicit (hugetlbfs) ones. */
+static int hugeArenas = 0;
+
 #ifdef WIN32 /*MINGW*/
 #define MAP_FAILED NULL
 #define getpagesize() (64 * 1024)
 static void *
-alloc_arena(size_t size)
+reserve_arenas(size_t size)
 {
-    return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if(chunkHugePages)
+        do_log(L_WARN, "Huge pages are not supported on this system.\n");
+    return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+static int
+alloc_arena(void *addr, size_t size)
+{
+    void *p;
+    p = VirtualAlloc(addr, size, MEM_COMMIT, PAGE_READWRITE);
+    return p == NULL ? -1 : 0;
 }
 static int
 free_arena(void *addr, size_t size)
 {
     int rc;
-    rc = VirtualFree(addr, size, MEM_RELEASE);
+    rc = VirtualFree(addr, size, MEM_DECOMMIT);
     if(!rc)
         rc = -1;
     return rc;
@@ -205,16 +274,91 @@ free_arena(void *addr, size_t size)
 #ifndef MAP_FAILED
 #define MAP_FAILED ((void*)((long int)-1))
 #endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+#ifdef MADV_HUGEPAGE
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static void *
+reserve_huge_arenas(size_t size)
+{
+    char *p, *q;
+
+#ifdef MAP_HUGETLB
+    if(chunkHugePages >= 2) {
+        p = mmap(NULL,
+                 (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1),
+                 PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(p != MAP_FAILED) {
+            hugeArenas = 2;
+            return p;
+        }
+        do_log_error(L_WARN, errno,
+                     "Couldn't allocate huge pages, "
+                     "using transparent huge pages");
+    }
+#endif
+
+    /* Map one huge page too many, then trim to alignment. */
+    p = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(p == MAP_FAILED)
+        return p;
+    q = (char*)(((unsigned long)p + HUGE_PAGE_SIZE - 1) &
+                ~(unsigned long)(HUGE_PAGE_SIZE - 1));
+    if(q > p)
+        munmap(p, q - p);
+    if(p + HUGE_PAGE_SIZE > q)
+        munmap(q + size, p + HUGE_PAGE_SIZE - q);
+    if(madvise(q, size, MADV_HUGEPAGE) < 0)
+        do_log_error(L_WARN, errno, "Couldn't enable transparent huge pages");
+    hugeArenas = 1;
+    return q;
+}
+#endif
+
 static void *
-alloc_arena(size_t size)
+reserve_arenas(size_t size)
+{
+#ifdef MADV_HUGEPAGE
+    if(chunkHugePages) {
+        void *p = reserve_huge_arenas(size);
+        if(p != MAP_FAILED)
+            return p;
+        do_log_error(L_WARN, errno, "Couldn't reserve huge pages");
+    }
+#else
+    if(chunkHugePages)
+        do_log(L_WARN, "Huge pages are not supported on this system.\n");
+#endif
+    return mmap(NULL, size, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+}
+static int
+alloc_arena(void *addr, size_t size)
 {
-    return mmap(NULL, size, PROT_READ | PROT_WRITE,
-                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *p;
+    if(hugeArenas)
+        return 0;
+    p = mmap(addr, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    return p == MAP_FAILED ? -1 : 0;
 }
 static int
 free_arena(void *addr, size_t size)
 {
-    return munmap(addr, size);
+    void *p;
+#ifdef MADV_HUGEPAGE
+    if(hugeArenas)
+        return madvise(addr, size, MADV_DONTNEED);
+#endif
+    /* Not munmap, which would give the range back to whoever asks. */
+    p = mmap(addr, size, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? -1 : 0;
 }
 #endif
 
@@ -291,7 +435,35 @@ typedef struct _ChunkArena {
 } ChunkArenaRec, *ChunkArenaPtr;
 
 static ChunkArenaPtr chunkArenas, currentArena;
-static int numArenas;
+static int numArenas, committedArenas;
+static char *arenaBase;
+
+#define ARENA_SIZE (CHUNK_SIZE * ARENA_CHUNKS)
+
+/* The arenas that have free chunks, with one bit per arena, and a
+   summary with one bit per word of the former.  The first arena with
+   free chunks is found by looking at a single summary word for every
+   ARENA_CHUNKS * ARENA_CHUNKS arenas. */
+static ChunkBitmap *arenaFree, *arenaFreeSummary;
+static int arenaFreeWords, arenaFreeSummaryWords;
+
+static void
+arenaFull(int n)
+{
+    int w = n / ARENA_CHUNKS;
+    arenaFree[w] &= ~BITMAP_BIT(n % ARENA_CHUNKS);
+    if(arenaFree[w] == 0)
+        arenaFreeSummary[w / ARENA_CHUNKS] &= ~BITMAP_BIT(w % ARENA_CHUNKS);
+}
+
+static void
+arenaNotFull(int n)
+{
+    int w = n / ARENA_CHUNKS;
+    arenaFree[w] |= BITMAP_BIT(n % ARENA_CHUNKS);
+    arenaFreeSummary[w / ARENA_CHUNKS] |= BITMAP_BIT(w % ARENA_CHUNKS);
+}
+
 #define CHUNK_IN_ARENA(chunk, arena)                                    \
     ((arena)->chunks &&                                                 \
      (char*)(chunk) >= (arena)->chunks &&                               \
@@ -301,6 +473,22 @@ static int numArenas;
     ((unsigned)((unsigned long)(((char*)(chunk) - (arena)->chunks)) /   \
                 CHUNK_SIZE))
 
+static int
+commitArena(int i)
+{
+    ChunkArenaPtr arena = &(chunkArenas[i]);
+    char *p;
+
+    if(arena->chunks)
+        return 0;
+    p = arenaBase + (size_t)i * ARENA_SIZE;
+    if(alloc_arena(p, ARENA_SIZE) < 0)
+        return -1;
+    arena->chunks = p;
+    committedArenas++;
+    return 1;
+}
+
 void
 initChunks(void)
 {
@@ -317,43 +505,73 @@ initChunks(void)
     }
     numArenas = 
         (CHUNKS(chunkHighMark) + (ARENA_CHUNKS - 1)) / ARENA_CHUNKS;
+    arenaFreeWords = (numArenas + ARENA_CHUNKS - 1) / ARENA_CHUNKS;
+    arenaFreeSummaryWords =
+        (arenaFreeWords + ARENA_CHUNKS - 1) / ARENA_CHUNKS;
     chunkArenas = malloc(numArenas * sizeof(ChunkArenaRec));
-    if(chunkArenas == NULL) {
+    arenaFree = calloc(arenaFreeWords, sizeof(ChunkBitmap));
+    arenaFreeSummary = calloc(arenaFreeSummaryWords, sizeof(ChunkBitmap));
+    if(chunkArenas == NULL || arenaFree == NULL || arenaFreeSummary == NULL) {
         do_log(L_ERROR, "Couldn't allocate chunk arenas.\n");
         exit (1);
     }
+    arenaBase = reserve_arenas((size_t)numArenas * ARENA_SIZE);
+    if(arenaBase == MAP_FAILED) {
+        do_log_error(L_ERROR, errno, "Couldn't reserve chunk memory");
+        exit(1);
+    }
     for(i = 0; i < numArenas; i++) {
         chunkArenas[i].bitmap = EMPTY_BITMAP;
         chunkArenas[i].chunks = NULL;
+        arenaNotFull(i);
     }
+    committedArenas = 0;
     currentArena = NULL;
 }
 
+/* Called in each worker after fork, so that the pages are private to
+   the worker and local to the node it runs on. */
+void
+prefaultChunks(void)
+{
+    int i, j;
+
+    if(!chunkPrefault)
+        return;
+
+    for(i = 0; i < numArenas; i++) {
+        if(commitArena(i) < 0)
+            break;
+        for(j = 0; j < ARENA_SIZE; j += pagesize)
+            chunkArenas[i].chunks[j] = 0;
+    }
+    /* Faulting it all in again later would defeat the point. */
+    if(chunkRetainMark < chunkHighMark)
+        chunkRetainMark = chunkHighMark;
+}
+
 static ChunkArenaPtr
 findArena()
 {
-    ChunkArenaPtr arena = NULL;
-    int i;
+    ChunkArenaPtr arena;
+    int i, w;
 
-    for(i = 0; i < numArenas; i++) {
-        arena = &(chunkArenas[i]);
-        if(arena->bitmap != 0)
+    for(i = 0; i < arenaFreeSummaryWords; i++) {
+        if(arenaFreeSummary[i] != 0)
             break;
-        else
-            arena = NULL;
     }
 
-    assert(arena != NULL);
+    assert(i < arenaFreeSummaryWords);
 
-    if(!arena->chunks) {
-        void *p;
-        p = alloc_arena(CHUNK_SIZE * ARENA_CHUNKS);
-        if(p == MAP_FAILED) {
-            do_log_error(L_ERROR, errno, "Couldn't allocate chunk");
-            maybe_free_chunks(1, 1);
-            return NULL;
-        }
-        arena->chunks = p;
+    w = i * ARENA_CHUNKS + BITMAP_FFS(arenaFreeSummary[i]) - 1;
+    i = w * ARENA_CHUNKS + BITMAP_FFS(arenaFree[w]) - 1;
+    arena = &(chunkArenas[i]);
+    assert(arena->bitmap != 0);
+
+    if(commitArena(i) < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't allocate chunk");
+        maybe_free_chunks(1, 1);
+        return NULL;
     }
     return arena;
 }
@@ -380,6 +598,8 @@ get_chunk()
     }
     i = BITMAP_FFS(arena->bitmap) - 1;
     arena->bitmap &= ~BITMAP_BIT(i);
+    if(arena->bitmap == 0)
+        arenaFull(arena - chunkArenas);
     used_chunks++;
     return arena->chunks + CHUNK_SIZE * i;
 }
@@ -403,6 +623,8 @@ maybe_get_chunk()
     }
     i = BITMAP_FFS(arena->bitmap) - 1;
     arena->bitmap &= ~BITMAP_BIT(i);
+    if(arena->bitmap == 0)
+        arenaFull(arena - chunkArenas);
     used_chunks++;
     return arena->chunks + CHUNK_SIZE * i;
 }
@@ -415,39 +637,171 @@ dispose_chunk(void *chunk)
 
     assert(chunk != NULL);
 
-    if(currentArena && CHUNK_IN_ARENA(chunk, currentArena)) {
-        arena = currentArena;
-    } else {
-        for(i = 0; i < numArenas; i++) {
-            arena = &(chunkArenas[i]);
-            if(CHUNK_IN_ARENA(chunk, arena))
+    i = (unsigned)((unsigned long)((char*)chunk - arenaBase) / ARENA_SIZE);
+    assert(i < numArenas);
+    arena = &(chunkArenas[i]);
+    assert(CHUNK_IN_ARENA(chunk, arena));
+    currentArena = arena;
+
+    if(arena->bitmap == 0)
+        arenaNotFull(i);
+    i = CHUNK_ARENA_INDEX(chunk, arena);
+    arena->bitmap |= BITMAP_BIT(i);
+    used_chunks--;
+}
+
+/* Runs of chunks are aligned on their size within an arena.  They are
+   looked for from the top down, away from single chunks, which are
+   allocated from the bottom up, starting with the arena where the last
+   run was found.  This is linear in the number of arenas in the worst
+   case, but a run holds a lot of data. */
+static int runArena = -1;
+
+static void *
+find_chunk_run(int n)
+{
+    ChunkBitmap mask =
+        n >= ARENA_CHUNKS ? EMPTY_BITMAP : BITMAP_BIT(n) - 1;
+    ChunkArenaPtr arena;
+    int i, j, k;
+
+    assert(n > 1 && n <= ARENA_CHUNKS && (n & (n - 1)) == 0);
+
+    if(runArena < 0 || runArena >= numArenas)
+        runArena = numArenas - 1;
+
+    for(k = 0, i = runArena; k < numArenas;
+        k++, i = (i == 0 ? numArenas - 1 : i - 1)) {
+        arena = &(chunkArenas[i]);
+        if(arena->bitmap == 0)
+            continue;
+        for(j = ARENA_CHUNKS - n; j >= 0; j -= n) {
+            if(((arena->bitmap >> j) & mask) == mask)
                 break;
         }
-        assert(arena != NULL);
-        currentArena = arena;
+        if(j < 0)
+            continue;
+        if(commitArena(i) < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't allocate chunk");
+            return NULL;
+        }
+        runArena = i;
+        arena->bitmap &= ~(mask << j);
+        if(arena->bitmap == 0)
+            arenaFull(i);
+        used_chunks += n;
+        return arena->chunks + CHUNK_SIZE * j;
     }
+    return NULL;
+}
+
+void *
+get_chunks(int n)
+{
+    void *chunk;
+
+    if(n == 1)
+        return get_chunk();
+
+    if(used_chunks + n > CHUNKS(chunkHighMark))
+        maybe_free_chunks(0, 0);
 
+    chunk = maybe_get_chunks(n);
+    /* Either we're just below chunkHighMark, or there's room but not
+       in one piece. */
+    while(chunk == NULL && discardOldestObject())
+        chunk = maybe_get_chunks(n);
+    return chunk;
+}
+
+void *
+maybe_get_chunks(int n)
+{
+    if(n == 1)
+        return maybe_get_chunk();
+    if(used_chunks + n > CHUNKS(chunkHighMark))
+        return NULL;
+    return find_chunk_run(n);
+}
+
+void
+dispose_chunks(void *chunk, int n)
+{
+    ChunkBitmap mask =
+        n >= ARENA_CHUNKS ? EMPTY_BITMAP : BITMAP_BIT(n) - 1;
+    ChunkArenaPtr arena;
+    unsigned i;
+
+    if(n == 1) {
+        dispose_chunk(chunk);
+        return;
+    }
+
+    assert(chunk != NULL);
+
+    /* Unlike dispose_chunk, don't make this the current arena, since
+       we don't want single chunks to fill the hole. */
+    i = (unsigned)((unsigned long)((char*)chunk - arenaBase) / ARENA_SIZE);
+    assert(i < numArenas);
+    arena = &(chunkArenas[i]);
+    assert(CHUNK_IN_ARENA(chunk, arena));
+
+    if(arena->bitmap == 0)
+        arenaNotFull(i);
     i = CHUNK_ARENA_INDEX(chunk, arena);
-    arena->bitmap |= BITMAP_BIT(i);
-    used_chunks--;
+    assert(i % n == 0 && (arena->bitmap & (mask << i)) == 0);
+    arena->bitmap |= mask << i;
+    used_chunks -= n;
+}
+
+/* Number of consecutive arenas that are given back together. */
+static int
+arenaGroup(void)
+{
+#ifdef MADV_HUGEPAGE
+    if(hugeArenas == 1 && ARENA_SIZE < HUGE_PAGE_SIZE)
+        return HUGE_PAGE_SIZE / ARENA_SIZE;
+#endif
+    return 1;
 }
 
 void
 free_chunk_arenas()
 {
-    ChunkArenaPtr arena;
-    int i, rc;
+    int i, j, n, group, committed, rc;
 
-    for(i = 0; i < numArenas; i++) {
-        arena = &(chunkArenas[i]);
-        if(arena->bitmap == EMPTY_BITMAP && arena->chunks) {
-            rc = free_arena(arena->chunks, CHUNK_SIZE * ARENA_CHUNKS);
-            if(rc < 0) {
-                do_log_error(L_ERROR, errno, "Couldn't unmap memory");
-                continue;
-            }
-            arena->chunks = NULL;
+    /* Explicit huge pages are reserved for us anyway. */
+    if(hugeArenas == 2)
+        return;
+
+    /* Giving back part of a transparent huge page would split it, so
+       only whole huge pages are given back, and only once all of the
+       arenas within are empty. */
+    group = arenaGroup();
+
+    /* The highest arenas are the least likely to be used again soon. */
+    for(i = (numArenas - 1) / group * group; i >= 0; i -= group) {
+        if(committedArenas <= CHUNKS(chunkRetainMark) / ARENA_CHUNKS)
+            break;
+        n = MIN(group, numArenas - i);
+        committed = 0;
+        for(j = i; j < i + n; j++) {
+            if(chunkArenas[j].bitmap != EMPTY_BITMAP)
+                break;
+            if(chunkArenas[j].chunks)
+                committed++;
         }
+        if(j < i + n || committed == 0)
+            continue;
+        rc = free_arena(arenaBase + (size_t)i * ARENA_SIZE,
+                        (size_t)n * ARENA_SIZE);
+        if(rc < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't unmap memory");
+            continue;
+        }
+        for(j = i; j < i + n; j++)
+            chunkArenas[j].chunks = NULL;
+        committedArenas -= committed;
     }
     if(currentArena && currentArena->chunks == NULL)
         currentArena = NULL;
@@ -456,14 +810,6 @@ free_chunk_arenas()
 int
 totalChunkArenaSize()
 {
-    ChunkArenaPtr arena;
-    int i, size = 0;
-
-    for(i = 0; i < numArenas; i++) {
-        arena = &(chunkArenas[i]);
-        if(arena->chunks)
-            size += (CHUNK_SIZE * ARENA_CHUNKS);
-    }
-    return size;
+    return committedArenas * ARENA_SIZE;
 }
 #endif
@@ -38,14 +38,27 @@ THE SOFTWARE.
 
 #define CHUNKS(bytes) ((unsigned long)(bytes) / CHUNK_SIZE)
 
+/* Large objects may be stored in runs of up to this many contiguous
+   chunks, which must be a power of two no larger than the number of
+   bits in a ChunkBitmap. */
+#ifndef MAX_CHUNK_RUN
+#define MAX_CHUNK_RUN 32
+#endif
+#define MAX_CHUNK_SIZE (MAX_CHUNK_RUN * CHUNK_SIZE)
+
 extern int chunkLowMark, chunkHighMark, chunkCriticalMark;
+extern int chunkHugePages, chunkPrefault, chunkRetainMark;
 extern int used_chunks;
 
 void preinitChunks(void);
 void initChunks(void);
+void prefaultChunks(void);
 void *get_chunk(void) ATTRIBUTE ((malloc));
 void *maybe_get_chunk(void) ATTRIBUTE ((malloc));
+void *get_chunks(int n) ATTRIBUTE ((malloc));
+void *maybe_get_chunks(int n) ATTRIBUTE ((malloc));
 
 void dispose_chunk(void *chunk);
+void dispose_chunks(void *chunk, int n);
 void free_chunk_arenas(void);
 int totalChunkArenaSize(void);
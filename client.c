@@ -22,6 +22,12 @@ THE SOFTWARE.
 
 #include "polipo.h"
 
+/* Client requests that joined a fetch started by another request, and
+   how many of them would otherwise have been revalidated once it
+   completed.  Both are upstream requests saved. */
+int coalescedRequests = 0, coalescedRevalidations = 0;
+int refreshedAhead = 0;
+
 static int 
 httpAcceptAgain(TimeEventHandlerPtr event)
 {
@@ -44,8 +50,6 @@ int
 httpAccept(int fd, FdEventHandlerPtr event, AcceptRequestPtr request)
 {
     int rc;
-    HTTPConnectionPtr connection;
-    TimeEventHandlerPtr timeout;
 
     if(fd < 0) {
         if(-fd == EINTR || -fd == EAGAIN || -fd == EWOULDBLOCK)
@@ -92,17 +96,37 @@ httpAccept(int fd, FdEventHandlerPtr event, AcceptRequestPtr request)
     if(rc < 0) 
         do_log_error(L_WARN, errno, "Couldn't disable Nagle's algorithm");
 
+    httpAcceptConnection(fd, NULL);
+    return 0;
+}
+
+/* Start reading requests from a new client connection, which is either
+   a freshly accepted socket or, if fd is -1, a stream of an HTTP/2
+   session. */
+HTTPConnectionPtr
+httpAcceptConnection(int fd, struct _H2Stream *stream)
+{
+    HTTPConnectionPtr connection;
+    TimeEventHandlerPtr timeout;
+
     connection = httpMakeConnection();
+    if(connection == NULL) {
+        if(fd >= 0)
+            CLOSE(fd);
+        return NULL;
+    }
 
     timeout = scheduleTimeEvent(clientTimeout, httpTimeoutHandler,
                                 sizeof(connection), &connection);
     if(!timeout) {
-        CLOSE(fd);
+        if(fd >= 0)
+            CLOSE(fd);
         free(connection);
-        return 0;
+        return NULL;
     }
 
     connection->fd = fd;
+    connection->h2stream = stream;
     connection->timeout = timeout;
 
     do_log(D_CLIENT_CONN, "Accepted client connection 0x%lx\n",
@@ -110,10 +134,15 @@ httpAccept(int fd, FdEventHandlerPtr event, AcceptRequestPtr request)
 
     connection->flags = CONN_READER;
 
-    do_stream_buf(IO_READ | IO_NOTNOW, connection->fd, 0,
-                  &connection->reqbuf, CHUNK_SIZE,
-                  httpClientHandler, connection);
-    return 0;
+    if(connection->h2stream)
+        h2DoStreamBuf(IO_READ | IO_NOTNOW, connection, 0,
+                      &connection->reqbuf, CHUNK_SIZE,
+                      httpClientHandler, connection);
+    else
+        do_stream_buf(IO_READ | IO_NOTNOW, connection->fd, 0,
+                      &connection->reqbuf, CHUNK_SIZE,
+                      httpClientHandler, connection);
+    return connection;
 }
 
 /* Abort a client connection.  It is only safe to abort the requests
@@ -123,7 +152,10 @@ httpClientAbort(HTTPConnectionPtr connection, int closed)
 {
     HTTPRequestPtr request = connection->request;
 
-    pokeFdEvent(connection->fd, -EDOSHUTDOWN, POLLOUT);
+    if(connection->h2stream)
+        h2PokeStream(connection, -EDOSHUTDOWN, POLLOUT);
+    else
+        pokeFdEvent(connection->fd, -EDOSHUTDOWN, POLLOUT);
     if(closed) {
         while(request) {
             if(request->chandler) {
@@ -148,23 +180,37 @@ httpClientFinish(HTTPConnectionPtr connection, int s)
              && request->request->request != request));
 
     if(s == 0) {
-        if(!request || !(request->flags & REQUEST_PERSISTENT))
+        /* An HTTP/2 stream carries a single request. */
+        if(!request || !(request->flags & REQUEST_PERSISTENT) ||
+           connection->h2stream)
             s = 1;
     }
 
     httpConnectionDestroyBuf(connection);
 
+    if(connection->disk_fd >= 0) {
+        CLOSE(connection->disk_fd);
+        connection->disk_fd = -1;
+    }
+
     connection->flags &= ~CONN_WRITER;
 
+    /* The reply is over, end or reset the stream now rather than once
+       the reader is done. */
+    if(connection->h2stream)
+        h2StreamFinish(connection, 0);
+
     if(connection->flags & CONN_SIDE_READER) {
         /* We're in POST or PUT and the reader isn't done yet.
            Wait for the read side to close the connection. */
         assert(request && (connection->flags & CONN_READER));
-        if(s >= 2) {
+        if(connection->h2stream)
+            h2PokeStream(connection, s >= 2 ? -EDOSHUTDOWN : -EDOGRACEFUL,
+                         POLLIN);
+        else if(s >= 2)
             pokeFdEvent(connection->fd, -EDOSHUTDOWN, POLLIN);
-        } else {
+        else
             pokeFdEvent(connection->fd, -EDOGRACEFUL, POLLIN);
-        }
         return;
     }
 
@@ -241,6 +287,11 @@ httpClientFinish(HTTPConnectionPtr connection, int s)
 
     if(connection->flags & CONN_READER) {
         httpSetTimeout(connection, 10);
+        if(connection->h2stream) {
+            h2PokeStream(connection, s >= 2 ? -EDOSHUTDOWN : -EDOGRACEFUL,
+                         POLLIN);
+            return;
+        }
         if(connection->fd < 0) return;
         if(s >= 2) {
             pokeFdEvent(connection->fd, -EDOSHUTDOWN, POLLIN);
@@ -272,6 +323,8 @@ httpClientFinish(HTTPConnectionPtr connection, int s)
     if(connection->timeout)
         cancelTimeEvent(connection->timeout);
     connection->timeout = NULL;
+    if(connection->h2stream)
+        h2StreamFinish(connection, 1);
     if(connection->fd >= 0) {
         if(s >= 2)
             CLOSE(connection->fd);
@@ -348,9 +401,14 @@ httpClientDelayedShutdownHandler(TimeEventHandlerPtr event)
         httpClientFinish(connection, 1);
         return 1;
     }
-    do_stream(IO_READ | IO_NOTNOW, connection->fd, 
-              0, client_shutdown_buffer, 17, 
-              httpClientShutdownHandler, connection);
+    if(connection->h2stream)
+        h2DoStream(IO_READ | IO_NOTNOW, connection,
+                   0, client_shutdown_buffer, 17,
+                   httpClientShutdownHandler, connection);
+    else
+        do_stream(IO_READ | IO_NOTNOW, connection->fd, 
+                  0, client_shutdown_buffer, 17, 
+                  httpClientShutdownHandler, connection);
     return 1;
 }
 
@@ -399,9 +457,14 @@ httpClientHandler(int status,
             rc = httpConnectionBigifyReqbuf(connection);
         if((connection->flags & CONN_BIGREQBUF) &&
            connection->reqlen < bigBufferSize) {
-            do_stream(IO_READ, connection->fd, connection->reqlen,
-                      connection->reqbuf, bigBufferSize,
-                      httpClientHandler, connection);
+            if(connection->h2stream)
+                h2DoStream(IO_READ, connection, connection->reqlen,
+                           connection->reqbuf, bigBufferSize,
+                           httpClientHandler, connection);
+            else
+                do_stream(IO_READ, connection->fd, connection->reqlen,
+                          connection->reqbuf, bigBufferSize,
+                          httpClientHandler, connection);
             return 1;
         }
         connection->reqlen = 0;
@@ -465,18 +528,28 @@ httpClientRawErrorHeaders(HTTPConnectionPtr connection,
                               code, message, close > 0, headers,
                               url, url_len, etag);
     if(n <= 0) {
-        shutdown(connection->fd, 1);
+        if(connection->h2stream)
+            h2Shutdown(connection);
+        else
+            shutdown(connection->fd, 1);
         if(close >= 0)
             httpClientFinish(connection, 1);
         return 1;
     }
 
     httpSetTimeout(connection, clientTimeout);
-    do_stream(IO_WRITE, fd, 0, connection->buf, n, 
-              close > 0 ? httpErrorStreamHandler :
-              close == 0 ? httpErrorNocloseStreamHandler :
-              httpErrorNofinishStreamHandler,
-              connection);
+    if(connection->h2stream)
+        h2DoStream(IO_WRITE, connection, 0, connection->buf, n,
+                   close > 0 ? httpErrorStreamHandler :
+                   close == 0 ? httpErrorNocloseStreamHandler :
+                   httpErrorNofinishStreamHandler,
+                   connection);
+    else
+        do_stream(IO_WRITE, fd, 0, connection->buf, n, 
+                  close > 0 ? httpErrorStreamHandler :
+                  close == 0 ? httpErrorNocloseStreamHandler :
+                  httpErrorNofinishStreamHandler,
+                  connection);
 
     return 1;
 }
@@ -611,6 +684,21 @@ httpClientHandlerHeaders(FdEventHandlerPtr event, StreamRequestPtr srequest,
     int code;
     AtomPtr message;
 
+    /* The first request on a connection may switch it to HTTP/2. */
+    if(connection->serviced == 0 && connection->request == NULL &&
+       !connection->h2stream) {
+        rc = h2ClientAccept(connection->fd,
+                            connection->reqbuf, connection->reqlen);
+        if(rc > 0) {
+            connection->fd = -1;
+            connection->reqlen = 0;
+            httpConnectionDestroyReqbuf(connection);
+            connection->flags &= ~CONN_READER;
+            httpClientFinish(connection, 2);
+            return 1;
+        }
+    }
+
     start = 0;
     /* Work around clients working around NCSA lossage. */
     if(connection->reqbuf[0] == '\n')
@@ -667,7 +755,8 @@ httpClientHandlerHeaders(FdEventHandlerPtr event, StreamRequestPtr srequest,
 
  fail:
     if(url) releaseAtom(url);
-    shutdown(connection->fd, 0);
+    if(!connection->h2stream)
+        shutdown(connection->fd, 0);
     connection->reqlen = 0;
     connection->reqbegin = 0;
     httpConnectionDestroyReqbuf(connection);
@@ -727,7 +816,8 @@ httpClientRequest(HTTPRequestPtr request, AtomPtr url)
     if(i < 0) {
         releaseAtom(url);
         do_log(L_ERROR, "Couldn't parse client headers.\n");
-        shutdown(connection->fd, 0);
+        if(!connection->h2stream)
+            shutdown(connection->fd, 0);
         request->flags &= ~REQUEST_PERSISTENT;
         connection->flags &= ~CONN_READER;
         httpClientNoticeError(request, 503,
@@ -812,6 +902,15 @@ httpClientRequest(HTTPRequestPtr request, AtomPtr url)
                                              "not supported"));
             return 1;
         }
+        if(connection->h2stream) {
+            /* Whatever follows the header belongs to the tunnel. */
+            request->flags &= ~REQUEST_PERSISTENT;
+            connection->flags &= ~CONN_READER;
+            httpClientNoticeError(request, 501,
+                                  internAtom("CONNECT not supported "
+                                             "over HTTP/2"));
+            return 1;
+        }
         connection->flags &= ~CONN_READER;
         do_tunnel(connection->fd, connection->reqbuf, 
                   connection->reqbegin, connection->reqlen, url);
@@ -979,10 +1078,16 @@ httpClientDiscardBody(HTTPConnectionPtr connection)
 
     if(connection->bodylen > 0) {
         httpSetTimeout(connection, clientTimeout);
-        do_stream_buf(IO_READ | IO_NOTNOW,
-                      connection->fd, connection->reqlen,
-                      &connection->reqbuf, CHUNK_SIZE,
-                      httpClientDiscardHandler, connection);
+        if(connection->h2stream)
+            h2DoStreamBuf(IO_READ | IO_NOTNOW,
+                          connection, connection->reqlen,
+                          &connection->reqbuf, CHUNK_SIZE,
+                          httpClientDiscardHandler, connection);
+        else
+            do_stream_buf(IO_READ | IO_NOTNOW,
+                          connection->fd, connection->reqlen,
+                          &connection->reqbuf, CHUNK_SIZE,
+                          httpClientDiscardHandler, connection);
         return 1;
     }
 
@@ -1013,7 +1118,10 @@ httpClientDiscardBody(HTTPConnectionPtr connection)
     connection->reqbegin = 0;
     connection->bodylen = 0;
     connection->reqte = TE_UNKNOWN;
-    shutdown(connection->fd, 2);
+    if(connection->h2stream)
+        h2Shutdown(connection);
+    else
+        shutdown(connection->fd, 2);
     handler = scheduleTimeEvent(-1, httpClientDelayed,
                                 sizeof(connection), &connection);
     if(handler == NULL) {
@@ -1038,16 +1146,28 @@ httpClientDelayed(TimeEventHandlerPtr event)
          /* Don't read new requests if buffer is big. */
          bufsize = (connection->flags & CONN_BIGREQBUF) ?
              connection->reqlen : CHUNK_SIZE;
-         do_stream(IO_READ | IO_IMMEDIATE | IO_NOTNOW,
-                   connection->fd, connection->reqlen,
-                   connection->reqbuf, bufsize,
-                   httpClientHandler, connection);
+         if(connection->h2stream)
+             h2DoStream(IO_READ | IO_IMMEDIATE | IO_NOTNOW,
+                        connection, connection->reqlen,
+                        connection->reqbuf, bufsize,
+                        httpClientHandler, connection);
+         else
+             do_stream(IO_READ | IO_IMMEDIATE | IO_NOTNOW,
+                       connection->fd, connection->reqlen,
+                       connection->reqbuf, bufsize,
+                       httpClientHandler, connection);
      } else {
          httpConnectionDestroyReqbuf(connection);
-         do_stream_buf(IO_READ | IO_NOTNOW,
-                       connection->fd, 0,
-                       &connection->reqbuf, CHUNK_SIZE,
-                       httpClientHandler, connection);
+         if(connection->h2stream)
+             h2DoStreamBuf(IO_READ | IO_NOTNOW,
+                           connection, 0,
+                           &connection->reqbuf, CHUNK_SIZE,
+                           httpClientHandler, connection);
+         else
+             do_stream_buf(IO_READ | IO_NOTNOW,
+                           connection->fd, 0,
+                           &connection->reqbuf, CHUNK_SIZE,
+                           httpClientHandler, connection);
      }
      return 1;
 }
@@ -1073,6 +1193,36 @@ httpClientDiscardHandler(int status,
     return 1;
 }
 
+static void httpClientRefreshAhead(HTTPRequestPtr request);
+
+typedef struct _DiskWait {
+    HTTPRequestPtr request;
+    int novalidate;
+} DiskWaitRec, *DiskWaitPtr;
+
+/* The start of the body is being read from disk; notice the request
+   again once it is in memory. */
+
+static int
+httpClientDiskHandler(int status, ConditionHandlerPtr chandler)
+{
+    DiskWaitPtr dwait = (DiskWaitPtr)chandler->data;
+    HTTPRequestPtr request = dwait->request;
+
+    if(status == 0 && request->object->disk_reads > 0)
+        return 0;
+
+    request->chandler = NULL;
+    if(status < 0) {
+        /* We're being aborted, don't recurse. */
+        if(delayedHttpClientNoticeRequest(request) < 0)
+            do_log(L_ERROR, "Couldn't schedule request.\n");
+        return 1;
+    }
+    httpClientNoticeRequest(request, dwait->novalidate);
+    return 1;
+}
+
 int
 httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
 {
@@ -1081,17 +1231,22 @@ httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
     int serveNow = (request == connection->request);
     int validate = 0;
     int conditional = 0;
+    int stale = 0;
     int local, haveData;
     int rc;
 
     assert(!request->chandler);
 
+    request->flags &= ~REQUEST_COALESCED;
+
     if(request->error_code) {
         if((request->flags & REQUEST_FORCE_ERROR) || REQUEST_SIDE(request) ||
            request->object == NULL ||
            (request->object->flags & OBJECT_LOCAL) ||
            (request->object->flags & OBJECT_ABORTED) ||
-           (relaxTransparency < 1 && !proxyOffline)) {
+           (relaxTransparency < 1 && !proxyOffline &&
+            !objectMayServeStale(request->object, &request->cache_control,
+                                 1))) {
             if(serveNow) {
                 connection->flags |= CONN_WRITER;
                 return httpClientRawErrorHeaders(connection,
@@ -1132,9 +1287,49 @@ httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
         return 1;
     }
 
+    if(request->request == NULL && !httpVaryMatch(object, request->headers)) {
+        ObjectPtr variant = httpVaryVariant(object, request->headers);
+        if(variant == NULL) {
+            do_log(L_ERROR, "Couldn't allocate variant.\n");
+            if(serveNow) {
+                connection->flags |= CONN_WRITER;
+                return httpClientRawError(connection, 503,
+                                          internAtom("Couldn't allocate "
+                                                     "variant"),
+                                          0);
+            }
+            return 1;
+        }
+        if(object->requestor == request)
+            object->requestor = NULL;
+        releaseObject(object);
+        request->object = object = variant;
+    }
+
     local = urlIsLocal(object->key, object->key_size);
-    objectFillFromDisk(object, request->from,
-                       request->method == METHOD_HEAD ? 0 : 1);
+    if(serveNow && request->method != METHOD_HEAD) {
+        objectFillFromDiskAsync(object, request->from, 1);
+        if(object->disk_reads > 0) {
+            DiskWaitRec dwait;
+            dwait.request = request;
+            dwait.novalidate = novalidate;
+            connection->flags |= CONN_WRITER;
+            request->chandler =
+                conditionWait(&object->condition, httpClientDiskHandler,
+                              sizeof(dwait), &dwait);
+            if(request->chandler == NULL) {
+                do_log(L_ERROR, "Couldn't register condition handler.\n");
+                return httpClientRawError(connection, 503,
+                                          internAtom("Couldn't register "
+                                                     "condition handler"),
+                                          0);
+            }
+            return 1;
+        }
+    } else {
+        objectFillFromDisk(object, request->from,
+                           request->method == METHOD_HEAD ? 0 : 1);
+    }
 
     /* The spec doesn't strictly forbid 206 for non-200 instances, but doing
        that breaks some client software. */
@@ -1176,7 +1371,7 @@ httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
     else if((request->object->flags & OBJECT_FAILED) &&
             !(object->flags & OBJECT_INPROGRESS) &&
             !relaxTransparency)
-        validate = 1;
+        validate = !objectMayServeStale(object, &request->cache_control, 1);
     else if(request->method != METHOD_HEAD &&
             !objectHasData(object, request->from, request->to) &&
             !(object->flags & OBJECT_INPROGRESS))
@@ -1188,6 +1383,18 @@ httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
     else
         validate = 0;
 
+    if(validate && !local && !(object->flags & OBJECT_FAILED) &&
+       (request->method == METHOD_HEAD ? haveData :
+        objectHasData(object, request->from, request->to)) &&
+       objectMayServeStale(object, &request->cache_control, 0)) {
+        /* RFC 5861 stale-while-revalidate: serve what we've got, and
+           revalidate in the background unless somebody already is. */
+        if(!(object->flags & (OBJECT_INPROGRESS | OBJECT_VALIDATING)))
+            httpBackgroundRevalidate(object, request->headers);
+        validate = 0;
+        stale = 1;
+    }
+
     if(request->cache_control.flags & CACHE_ONLY_IF_CACHED) {
         validate = 0;
         if(!haveData) {
@@ -1201,12 +1408,18 @@ httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
         }
     }
 
-    if(!(request->object->flags & OBJECT_VALIDATING) &&
+    if(!validate && !stale && !local && haveData &&
+       objectWantsRefresh(request->object))
+        httpClientRefreshAhead(request);
+
+    if((!(request->object->flags & OBJECT_VALIDATING) || stale ||
+        (!validate && (request->object->flags & OBJECT_BACKGROUND))) &&
        ((!validate && haveData) ||
         (request->object->flags & OBJECT_FAILED))) {
         if(serveNow) {
             connection->flags |= CONN_WRITER;
-            lockChunk(request->object, request->from / CHUNK_SIZE);
+            lockChunk(request->object,
+                      request->from / request->object->chunk_size);
             return httpServeObject(connection);
         } else {
             return 1;
@@ -1239,18 +1452,29 @@ httpClientNoticeRequest(HTTPRequestPtr request, int novalidate)
         }
     }
 
+    if(!(request->flags & REQUEST_REQUESTED) &&
+       (request->object->flags & (OBJECT_INPROGRESS | OBJECT_VALIDATING))) {
+        /* Somebody else is already fetching this object.  Whatever they
+           get will be good enough for us, see httpClientCoalesced. */
+        request->flags |= REQUEST_COALESCED;
+        coalescedRequests++;
+    }
+
     if(request->object->flags & OBJECT_VALIDATING)
         return 1;
 
     conditional = (haveData && request->method == METHOD_GET);
-    if(!mindlesslyCacheVary && (request->object->cache_control & CACHE_VARY))
+    if(!mindlesslyCacheVary &&
+       (request->object->cache_control & CACHE_VARY_ANY))
         conditional = conditional && (request->object->etag != NULL);
 
     conditional =
         conditional && !(request->object->cache_control & CACHE_MISMATCH);
 
-    if(!(request->object->flags & OBJECT_INPROGRESS))
+    if(!(request->object->flags & OBJECT_INPROGRESS)) {
         request->object->flags |= OBJECT_VALIDATING;
+        request->object->flags &= ~OBJECT_BACKGROUND;
+    }
     rc = request->object->request(request->object,
                                   conditional ? METHOD_CONDITIONAL_GET : 
                                   request->method,
@@ -1289,14 +1513,168 @@ delayedHttpClientNoticeRequest(HTTPRequestPtr request)
     return 1;
 }
 
+/* Revalidation on behalf of no client in particular.  The requestor
+   is a request with no connection, which goes away once the server side
+   is done with it. */
+
+static int httpBackgroundHandler(int, ConditionHandlerPtr);
+
+static int
+httpBackgroundWait(TimeEventHandlerPtr event)
+{
+    HTTPRequestPtr request = *(HTTPRequestPtr*)event->data;
+
+    if(request->request) {
+        request->chandler =
+            conditionWait(&request->object->condition, httpBackgroundHandler,
+                          sizeof(request), &request);
+        if(request->chandler)
+            return 1;
+        do_log(L_ERROR, "Couldn't register condition handler.\n");
+        request->request->request = NULL;
+        request->request = NULL;
+    }
+
+    if(request->object->requestor == request)
+        request->object->requestor = NULL;
+    httpDestroyRequest(request);
+    return 1;
+}
+
+static int
+httpBackgroundHandler(int status, ConditionHandlerPtr chandler)
+{
+    HTTPRequestPtr request = *(HTTPRequestPtr*)chandler->data;
+    ObjectPtr object = request->object;
+    TimeEventHandlerPtr event;
+
+    if(status >= 0) {
+        if(request->request == NULL) {
+            request->chandler = NULL;
+            if(object->requestor == request)
+                object->requestor = NULL;
+            httpDestroyRequest(request);
+            return 1;
+        }
+        if(!(object->flags & OBJECT_SUPERSEDED) ||
+           !request->request->can_mutate)
+            return 0;
+        /* Follow the server side to the new object, as in
+           httpClientGetHandler. */
+        request->object = retainObject(request->request->can_mutate);
+        request->request->object = request->object;
+        if(object->requestor == request) {
+            if(request->object->requestor == NULL)
+                request->object->requestor = request;
+            object->requestor = NULL;
+        }
+        releaseObject(object);
+    } else if(request->request) {
+        /* We may be called from httpClientError, which still needs the
+           request, so we cannot destroy it just now. */
+        request->request->request = NULL;
+        request->request = NULL;
+    }
+
+    request->chandler = NULL;
+    event = scheduleTimeEvent(-1, httpBackgroundWait,
+                              sizeof(request), &request);
+    if(event == NULL) {
+        do_log(L_ERROR, "Couldn't schedule background revalidation.\n");
+        if(request->request) {
+            request->request->request = NULL;
+            request->request = NULL;
+        }
+    }
+    return 1;
+}
+
+/* Start revalidating an object without making any client wait for it.
+   The headers are those of the request that the server should see,
+   which matters for objects carrying Vary. */
+int
+httpBackgroundRevalidate(ObjectPtr object, AtomPtr headers)
+{
+    HTTPRequestPtr request;
+    int method, rc;
+
+    if(object->flags &
+       (OBJECT_INPROGRESS | OBJECT_VALIDATING | OBJECT_LOCAL |
+        OBJECT_INITIAL | OBJECT_LINEAR))
+        return 0;
+
+    request = httpMakeRequest();
+    if(request == NULL)
+        return -1;
+
+    if(object->cache_control & CACHE_MISMATCH)
+        method = METHOD_GET;
+    else
+        method = METHOD_CONDITIONAL_GET;
+
+    request->object = retainObject(object);
+    request->method = method;
+    request->headers = headers ? retainAtom(headers) : NULL;
+
+    object->flags |= OBJECT_VALIDATING | OBJECT_BACKGROUND;
+    rc = object->request(object, method, 0, -1, request,
+                         object->request_closure);
+    if(rc < 0) {
+        object->flags &= ~OBJECT_VALIDATING;
+        notifyObject(object);
+    }
+
+    if(request->request) {
+        request->chandler =
+            conditionWait(&object->condition, httpBackgroundHandler,
+                          sizeof(request), &request);
+        if(request->chandler)
+            return 1;
+        do_log(L_ERROR, "Couldn't register condition handler.\n");
+        request->request->request = NULL;
+        request->request = NULL;
+    }
+
+    if(object->requestor == request)
+        object->requestor = NULL;
+    httpDestroyRequest(request);
+    return rc < 0 ? -1 : 0;
+}
+
+/* Revalidate a popular object before it becomes stale, so that its
+   clients never wait for the server.  This is limited to
+   refreshAheadBudget requests per second, so that objects that expire
+   together don't cause a burst of traffic. */
+static void
+httpClientRefreshAhead(HTTPRequestPtr request)
+{
+    static time_t second = 0;
+    static int count = 0;
+
+    if(second != current_time.tv_sec) {
+        second = current_time.tv_sec;
+        count = 0;
+    }
+    if(count >= refreshAheadBudget)
+        return;
+
+    count++;
+    refreshedAhead++;
+    httpBackgroundRevalidate(request->object, request->headers);
+}
+
 int
 httpClientContinueDelayed(TimeEventHandlerPtr event)
 {
     static char httpContinue[] = "HTTP/1.1 100 Continue\r\n\r\n";
     HTTPConnectionPtr connection = *(HTTPConnectionPtr*)event->data;
 
-    do_stream(IO_WRITE, connection->fd, 0, httpContinue, 25,
-              httpErrorNofinishStreamHandler, connection);
+    if(connection->h2stream)
+        h2DoStream(IO_WRITE, connection, 0, httpContinue, 25,
+                   httpErrorNofinishStreamHandler, connection);
+    else
+        do_stream(IO_WRITE, connection->fd, 0, httpContinue, 25,
+                  httpErrorNofinishStreamHandler, connection);
     return 1;
 }
 
@@ -1311,6 +1689,23 @@ delayedHttpClientContinue(HTTPConnectionPtr connection)
     return 1;
 }
 
+/* A request that joined a fetch in progress may be served its result
+   even if that is already stale by the request's standards: the reply
+   was obtained after the request was made.  Replies that cannot be
+   shared are still fetched again. */
+static int
+httpClientCoalesced(HTTPRequestPtr request, ObjectPtr object)
+{
+    if(!(request->flags & REQUEST_COALESCED))
+        return 0;
+    if(object->flags & (OBJECT_INITIAL | OBJECT_FAILED | OBJECT_ABORTED))
+        return 0;
+    if(!objectIsShareable(object))
+        return 0;
+    coalescedRevalidations++;
+    return 1;
+}
+
 int
 httpClientGetHandler(int status, ConditionHandlerPtr chandler)
 {
@@ -1331,11 +1726,11 @@ httpClientGetHandler(int status, ConditionHandlerPtr chandler)
         object->flags &= ~OBJECT_VALIDATING; /* for now */
         if(request->request && request->request->request == request)
             httpServerClientReset(request->request);
-        lockChunk(object, request->from / CHUNK_SIZE);
+        lockChunk(object, request->from / object->chunk_size);
         request->chandler = NULL;
         rc = delayedHttpServeObject(connection);
         if(rc < 0) {
-            unlockChunk(object, request->from / CHUNK_SIZE);
+            unlockChunk(object, request->from / object->chunk_size);
             do_log(L_ERROR, "Couldn't schedule serving.\n");
             abortObject(object, 503, internAtom("Couldn't schedule serving"));
         }
@@ -1346,11 +1741,11 @@ httpClientGetHandler(int status, ConditionHandlerPtr chandler)
         return 0;
 
     if(request->error_code) {
-        lockChunk(object, request->from / CHUNK_SIZE);
+        lockChunk(object, request->from / object->chunk_size);
         request->chandler = NULL;
         rc = delayedHttpServeObject(connection);
         if(rc < 0) {
-            unlockChunk(object, request->from / CHUNK_SIZE);
+            unlockChunk(object, request->from / object->chunk_size);
             do_log(L_ERROR, "Couldn't schedule serving.\n");
             abortObject(object, 503, internAtom("Couldn't schedule serving"));
         }
@@ -1393,7 +1788,10 @@ httpClientGetHandler(int status, ConditionHandlerPtr chandler)
                         internAtom("Couldn't schedule "
                                    "noticing of request"));
             /* We're probably out of memory.  What can we do? */
-            shutdown(connection->fd, 1);
+            if(connection->h2stream)
+                h2Shutdown(connection);
+            else
+                shutdown(connection->fd, 1);
         }
         return 1;
     }
@@ -1401,8 +1799,18 @@ httpClientGetHandler(int status, ConditionHandlerPtr chandler)
     if(object->requestor != request && !(object->flags & OBJECT_ABORTED)) {
         /* Make sure we don't serve an object that is stale for us
            unless we're the requestor. */
+        if(request->request == NULL &&
+           !httpVaryMatch(object, request->headers)) {
+            /* Somebody else's variant -- go and find ours. */
+            rc = delayedHttpClientNoticeRequest(request);
+            if(rc >= 0) {
+                request->chandler = NULL;
+                return 1;
+            }
+        }
         if((object->flags & (OBJECT_LINEAR | OBJECT_MUTATING)) ||
-           objectMustRevalidate(object, &request->cache_control)) {
+           (objectMustRevalidate(object, &request->cache_control) &&
+            !httpClientCoalesced(request, object))) {
            if(object->flags & OBJECT_INPROGRESS)
                return 0;
            rc = delayedHttpClientNoticeRequest(request);
@@ -1459,11 +1867,11 @@ httpClientGetHandler(int status, ConditionHandlerPtr chandler)
         }
     }
 
-    lockChunk(object, request->from / CHUNK_SIZE);
+    lockChunk(object, request->from / object->chunk_size);
     request->chandler = NULL;
     rc = delayedHttpServeObject(connection);
     if(rc < 0) {
-        unlockChunk(object, request->from / CHUNK_SIZE);
+        unlockChunk(object, request->from / object->chunk_size);
         do_log(L_ERROR, "Couldn't schedule serving.\n");
         abortObject(object, 503, internAtom("Couldn't schedule serving"));
     }
@@ -1564,8 +1972,14 @@ httpClientSideHandler(int status,
     request->error_headers = NULL;
 
     if(request->request) {
-        shutdown(request->request->connection->fd, 2);
-        pokeFdEvent(request->request->connection->fd, -ESHUTDOWN, POLLOUT);
+        HTTPConnectionPtr server = request->request->connection;
+        if(server->h2stream) {
+            h2Shutdown(server);
+            h2PokeStream(server, -ESHUTDOWN, POLLOUT);
+        } else {
+            shutdown(server->fd, 2);
+            pokeFdEvent(server->fd, -ESHUTDOWN, POLLOUT);
+        }
     }
     notifyObject(request->object);
     connection->flags &= ~CONN_SIDE_READER;
@@ -1573,23 +1987,47 @@ httpClientSideHandler(int status,
     return 1;
 }
 
+static int
+objectRangeInMemory(ObjectPtr object, int from, int to)
+{
+    int i;
+
+    if(object->length < 0)
+        return 0;
+    if(to < 0 || to > object->length)
+        to = object->length;
+    for(i = from / object->chunk_size; i * object->chunk_size < to; i++) {
+        if(i >= object->numchunks)
+            return 0;
+        if(object->chunks[i].size <
+           MIN(object->chunk_size, to - i * object->chunk_size))
+            return 0;
+    }
+    return 1;
+}
+
+static int httpServeObjectSendfileHeadersHandler(int status,
+                                                 FdEventHandlerPtr event,
+                                                 StreamRequestPtr srequest);
+
 int 
 httpServeObject(HTTPConnectionPtr connection)
 {
     HTTPRequestPtr request = connection->request;
     ObjectPtr object = request->object;
-    int i = request->from / CHUNK_SIZE;
-    int j = request->from % CHUNK_SIZE;
+    int i = request->from / object->chunk_size;
+    int j = request->from % object->chunk_size;
     int n, len, rc;
     int bufsize = CHUNK_SIZE;
     int condition_result;
 
-    object->atime = current_time.tv_sec;
+    objectAccessed(object);
     objectMetadataChanged(object, 0);
 
     httpSetTimeout(connection, -1);
 
-    if((request->error_code && relaxTransparency <= 0) ||
+    if((request->error_code && relaxTransparency <= 0 &&
+        !objectMayServeStale(object, &request->cache_control, 1)) ||
        object->flags & OBJECT_INITIAL) {
         object->flags &= ~OBJECT_FAILED;
         unlockChunk(object, i);
@@ -1617,6 +2055,22 @@ httpServeObject(HTTPConnectionPtr connection)
         }
     }
 
+    if(compressObjects) {
+        ObjectPtr variant = compressedVariant(object, request);
+        if(variant) {
+            /* We stay attached to the server-side request, which keeps
+               filling the original object for the compressor. */
+            if(object->requestor == request)
+                object->requestor = NULL;
+            unlockChunk(object, i);
+            releaseObject(object);
+            request->object = object = variant;
+            i = request->from / object->chunk_size;
+            j = request->from % object->chunk_size;
+            lockChunk(object, i);
+        }
+    }
+
     condition_result = httpCondition(object, request->condition);
 
     if(condition_result == CONDITION_FAILED) {
@@ -1629,9 +2083,27 @@ httpServeObject(HTTPConnectionPtr connection)
                                   internAtom("Not modified"), 0);
     }
 
-    objectFillFromDisk(object, request->from,
-                       (request->method == METHOD_HEAD ||
-                        condition_result != CONDITION_MATCH) ? 0 : 1);
+    /* If some of the data is not in memory but the whole body is on
+       disk, we send it straight from the disk entry. */
+    if(request->method != METHOD_HEAD &&
+       condition_result == CONDITION_MATCH && !connection->h2stream &&
+       !(object->flags & 
+         (OBJECT_LINEAR | OBJECT_SUPERSEDED | OBJECT_ABORTED)) &&
+       !objectRangeInMemory(object, request->from, request->to)) {
+        assert(connection->disk_fd < 0);
+        connection->disk_fd =
+            diskEntryBodyFd(object, &connection->disk_body_offset);
+    }
+
+    /* The headers don't need the body, so they can go out while it
+       is being read; httpServeChunk waits for the reads to complete. */
+    if(connection->disk_fd < 0) {
+        if(request->method == METHOD_HEAD ||
+           condition_result != CONDITION_MATCH)
+            objectFillFromDisk(object, request->from, 0);
+        else
+            objectFillFromDiskAsync(object, request->from, 1);
+    }
 
     if(((object->flags & OBJECT_LINEAR) &&
         (object->requestor != connection->request)) ||
@@ -1706,6 +2178,10 @@ httpServeObject(HTTPConnectionPtr connection)
         if((object->length >= 0 && request->from >= object->length) ||
            (request->to >= 0 && request->from >= request->to)) {
             unlockChunk(object, i);
+            if(connection->disk_fd >= 0) {
+                CLOSE(connection->disk_fd);
+                connection->disk_fd = -1;
+            }
             return httpClientRawError(connection, 416,
                                       internAtom("Requested range "
                                                  "not satisfiable"),
@@ -1797,15 +2273,37 @@ httpServeObject(HTTPConnectionPtr connection)
 
     connection->offset = request->from;
     httpSetTimeout(connection, clientTimeout);
+
+    if(connection->disk_fd >= 0) {
+        do_log(D_CLIENT_DATA, "Serving on 0x%lx for 0x%lx: offset %d "
+               "from disk\n",
+               (unsigned long)connection, (unsigned long)object,
+               connection->offset);
+        unlockChunk(object, i);
+        do_stream(IO_WRITE, connection->fd, 0, connection->buf, n,
+                  httpServeObjectSendfileHeadersHandler, connection);
+        return 1;
+    }
+
     do_log(D_CLIENT_DATA, "Serving on 0x%lx for 0x%lx: offset %d len %d\n",
            (unsigned long)connection, (unsigned long)object,
            connection->offset, len);
-    do_stream_h(IO_WRITE |
-                (connection->te == TE_CHUNKED && len > 0 ? IO_CHUNKED : 0),
-                connection->fd, 0, 
-                connection->buf, n,
-                object->chunks[i].data + j, len,
-                httpServeObjectStreamHandler, connection);
+    if(connection->h2stream)
+        h2DoStreamH(IO_WRITE |
+                    (connection->te == TE_CHUNKED && len > 0 ?
+                     IO_CHUNKED : 0),
+                    connection, 0,
+                    connection->buf, n,
+                    object->chunks[i].data + j, len,
+                    httpServeObjectStreamHandler, connection);
+    else
+        do_stream_h(IO_WRITE |
+                    (connection->te == TE_CHUNKED && len > 0 ?
+                     IO_CHUNKED : 0),
+                    connection->fd, 0, 
+                    connection->buf, n,
+                    object->chunks[i].data + j, len,
+                    httpServeObjectStreamHandler, connection);
     return 1;
 
  fail:
@@ -1818,12 +2316,97 @@ httpServeObject(HTTPConnectionPtr connection)
         goto again;
     }
     unlockChunk(object, i);
+    if(connection->disk_fd >= 0) {
+        CLOSE(connection->disk_fd);
+        connection->disk_fd = -1;
+    }
     return httpClientRawError(connection, 500,
                               rc == 0 ?
                               internAtom("No space for headers") :
                               internAtom("Couldn't allocate big buffer"), 0);
 }
 
+static int
+httpServeObjectSendfileHandler(int status, FdEventHandlerPtr event)
+{
+    HTTPConnectionPtr connection = *(HTTPConnectionPtr*)event->data;
+    HTTPRequestPtr request = connection->request;
+    ObjectPtr object = request->object;
+    int to;
+
+    to = object->length;
+    if(request->to >= 0)
+        to = MIN(to, request->to);
+
+    if(status == 0 && connection->offset < to) {
+#ifdef HAVE_SENDFILE
+        off_t offset = connection->disk_body_offset + connection->offset;
+        ssize_t rc;
+        rc = sendfile(connection->fd, connection->disk_fd, &offset,
+                      MIN(to - connection->offset, 16 * CHUNK_SIZE));
+        if(rc < 0) {
+            if(errno == EAGAIN || errno == EINTR)
+                return 0;
+            status = -errno;
+        } else if(rc == 0) {
+            /* The disk entry was truncated behind our back. */
+            status = -EIO;
+        } else {
+            connection->offset += rc;
+            if(connection->offset < to) {
+                httpSetTimeout(connection, clientTimeout);
+                return 0;
+            }
+        }
+#else
+        abort();
+#endif
+    }
+
+    httpSetTimeout(connection, -1);
+
+    if(status < 0) {
+        do_log_error(status == -ECONNRESET ? D_IO : L_ERROR,
+                     -status, "Couldn't send disk entry to client");
+        httpClientFinish(connection, 1);
+    } else {
+        httpClientFinish(connection, 0);
+    }
+    return 1;
+}
+
+static int
+httpServeObjectSendfileHeadersHandler(int status,
+                                      FdEventHandlerPtr event,
+                                      StreamRequestPtr srequest)
+{
+    HTTPConnectionPtr connection = srequest->data;
+    FdEventHandlerPtr handler;
+
+    if(status == 0 && !streamRequestDone(srequest)) {
+        httpSetTimeout(connection, clientTimeout);
+        return 0;
+    }
+
+    if(status) {
+        if(status < 0)
+            do_log_error(status == -ECONNRESET ? D_IO : L_ERROR,
+                         -status, "Couldn't write to client");
+        httpClientFinish(connection, 1);
+        return 1;
+    }
+
+    httpConnectionDestroyBuf(connection);
+    handler = registerFdEvent(connection->fd, POLLOUT,
+                              httpServeObjectSendfileHandler,
+                              sizeof(connection), &connection);
+    if(handler == NULL) {
+        do_log(L_ERROR, "Couldn't register sendfile handler.\n");
+        httpClientFinish(connection, 1);
+    }
+    return 1;
+}
+
 static int
 httpServeObjectDelayed(TimeEventHandlerPtr event)
 {
@@ -1837,8 +2420,9 @@ delayedHttpServeObject(HTTPConnectionPtr connection)
 {
     TimeEventHandlerPtr event;
 
-    assert(connection->request->object->chunks[connection->request->from / 
-                                               CHUNK_SIZE].locked > 0);
+    assert(connection->request->object->chunks
+           [connection->request->from /
+            connection->request->object->chunk_size].locked > 0);
 
     event = scheduleTimeEvent(-1, httpServeObjectDelayed,
                               sizeof(connection), &connection);
@@ -1876,8 +2460,8 @@ httpServeChunk(HTTPConnectionPtr connection)
 {
     HTTPRequestPtr request = connection->request;
     ObjectPtr object = request->object;
-    int i = connection->offset / CHUNK_SIZE;
-    int j = connection->offset - (i * CHUNK_SIZE);
+    int i = connection->offset / object->chunk_size;
+    int j = connection->offset - (i * object->chunk_size);
     int to, len, len2, end;
     int rc;
 
@@ -1901,8 +2485,8 @@ httpServeChunk(HTTPConnectionPtr connection)
         len = object->chunks[i].size - j;
 
     if(request->method != METHOD_HEAD && 
-       len < CHUNK_SIZE && connection->offset + len < to) {
-        objectFillFromDisk(object, connection->offset + len, 2);
+       len < object->chunk_size && connection->offset + len < to) {
+        objectFillFromDiskAsync(object, connection->offset + len, 2);
         len = object->chunks[i].size - j;
     }
 
@@ -1918,9 +2502,14 @@ httpServeChunk(HTTPConnectionPtr connection)
             unlockChunk(object, i);
             if(connection->te == TE_CHUNKED) {
                 httpSetTimeout(connection, clientTimeout);
-                do_stream(IO_WRITE | IO_CHUNKED | IO_END,
-                          connection->fd, 0, NULL, 0,
-                          httpServeObjectFinishHandler, connection);
+                if(connection->h2stream)
+                    h2DoStream(IO_WRITE | IO_CHUNKED | IO_END,
+                               connection, 0, NULL, 0,
+                               httpServeObjectFinishHandler, connection);
+                else
+                    do_stream(IO_WRITE | IO_CHUNKED | IO_END,
+                              connection->fd, 0, NULL, 0,
+                              httpServeObjectFinishHandler, connection);
             } else {
                 httpClientFinish(connection,
                                  !(object->length >= 0 &&
@@ -1938,6 +2527,9 @@ httpServeChunk(HTTPConnectionPtr connection)
                     goto fail;
                 }
             }
+            /* We'll be woken up when the disk reads complete. */
+            if(object->disk_reads > 0)
+                return 1;
             if(!(object->flags & OBJECT_INPROGRESS)) {
                 if(object->flags & OBJECT_SUPERSEDED) {
                     goto fail;
@@ -1953,16 +2545,16 @@ httpServeChunk(HTTPConnectionPtr connection)
     } else {
         /* len > 0 */
         if(request->method != METHOD_HEAD)
-            objectFillFromDisk(object, (i + 1) * CHUNK_SIZE, 1);
+            objectFillFromDiskAsync(object, (i + 1) * object->chunk_size, 1);
         if(request->chandler) {
             unregisterConditionHandler(request->chandler);
             request->chandler = NULL;
         }
         len2 = 0;
-        if(j + len == CHUNK_SIZE && object->numchunks > i + 1) {
+        if(j + len == object->chunk_size && object->numchunks > i + 1) {
             len2 = object->chunks[i + 1].size;
             if(to >= 0)
-                len2 = MIN(len2, to - (i + 1) * CHUNK_SIZE);
+                len2 = MIN(len2, to - (i + 1) * object->chunk_size);
         }
         /* Lock early -- httpServerRequest may get_chunk */
         if(len2 > 0)
@@ -1974,16 +2566,16 @@ httpServeChunk(HTTPConnectionPtr connection)
             end = 0;
         /* Prefetch */
         if(!(object->flags & OBJECT_INPROGRESS) && !REQUEST_SIDE(request)) {
-            if(object->chunks[i].size < CHUNK_SIZE &&
+            if(object->chunks[i].size < object->chunk_size &&
                to >= 0 && connection->offset + len + 1 < to)
                 object->request(object, request->method,
                                 connection->offset + len, -1, request,
                                 object->request_closure);
             else if(i + 1 < object->numchunks &&
                     object->chunks[i + 1].size == 0 &&
-                    to >= 0 && (i + 1) * CHUNK_SIZE + 1 < to)
+                    to >= 0 && (i + 1) * object->chunk_size + 1 < to)
                 object->request(object, request->method,
-                                (i + 1) * CHUNK_SIZE, -1, request,
+                                (i + 1) * object->chunk_size, -1, request,
                                 object->request_closure);
         }
         if(len2 == 0) {
@@ -1993,25 +2585,42 @@ httpServeChunk(HTTPConnectionPtr connection)
                    (unsigned long)connection, (unsigned long)object,
                    connection->offset, len);
             /* IO_NOTNOW in order to give other clients a chance to run. */
-            do_stream(IO_WRITE | IO_NOTNOW |
-                      (connection->te == TE_CHUNKED ? IO_CHUNKED : 0) |
-                      (end ? IO_END : 0),
-                      connection->fd, 0, 
-                      object->chunks[i].data + j, len,
-                      httpServeObjectStreamHandler, connection);
+            if(connection->h2stream)
+                h2DoStream(IO_WRITE | IO_NOTNOW |
+                           (connection->te == TE_CHUNKED ? IO_CHUNKED : 0) |
+                           (end ? IO_END : 0),
+                           connection, 0,
+                           object->chunks[i].data + j, len,
+                           httpServeObjectStreamHandler, connection);
+            else
+                do_stream(IO_WRITE | IO_NOTNOW |
+                          (connection->te == TE_CHUNKED ? IO_CHUNKED : 0) |
+                          (end ? IO_END : 0),
+                          connection->fd, 0, 
+                          object->chunks[i].data + j, len,
+                          httpServeObjectStreamHandler, connection);
         } else {
             httpSetTimeout(connection, clientTimeout);
             do_log(D_CLIENT_DATA, 
                    "Serving on 0x%lx for 0x%lx: offset %d len %d + %d\n",
                    (unsigned long)connection, (unsigned long)object,
                    connection->offset, len, len2);
-            do_stream_2(IO_WRITE | IO_NOTNOW |
-                        (connection->te == TE_CHUNKED ? IO_CHUNKED : 0) |
-                        (end ? IO_END : 0),
-                        connection->fd, 0, 
-                        object->chunks[i].data + j, len,
-                        object->chunks[i + 1].data, len2,
-                        httpServeObjectStreamHandler2, connection);
+            if(connection->h2stream)
+                h2DoStream2(IO_WRITE | IO_NOTNOW |
+                            (connection->te == TE_CHUNKED ? IO_CHUNKED : 0) |
+                            (end ? IO_END : 0),
+                            connection, 0,
+                            object->chunks[i].data + j, len,
+                            object->chunks[i + 1].data, len2,
+                            httpServeObjectStreamHandler2, connection);
+            else
+                do_stream_2(IO_WRITE | IO_NOTNOW |
+                            (connection->te == TE_CHUNKED ? IO_CHUNKED : 0) |
+                            (end ? IO_END : 0),
+                            connection->fd, 0, 
+                            object->chunks[i].data + j, len,
+                            object->chunks[i + 1].data, len2,
+                            httpServeObjectStreamHandler2, connection);
         }            
         return 1;
     }
@@ -2053,7 +2662,10 @@ httpServeObjectHandler(int status, ConditionHandlerPtr chandler)
     int rc;
 
     if((request->object->flags & OBJECT_ABORTED) || status < 0) {
-        shutdown(connection->fd, 1);
+        if(connection->h2stream)
+            h2Shutdown(connection);
+        else
+            shutdown(connection->fd, 1);
         httpSetTimeout(connection, 10);
         /* httpServeChunk will take care of the error. */
     }
@@ -2078,7 +2690,7 @@ httpServeObjectStreamHandlerCommon(int kind, int status,
     HTTPConnectionPtr connection = srequest->data;
     HTTPRequestPtr request = connection->request;
     int condition_result = httpCondition(request->object, request->condition);
-    int i = connection->offset / CHUNK_SIZE;
+    int i = connection->offset / request->object->chunk_size;
 
     assert(!request->chandler);
 
@@ -2132,7 +2744,8 @@ httpServeObjectStreamHandlerCommon(int kind, int status,
     else {
         httpConnectionDestroyBuf(connection);
         lockChunk(connection->request->object,
-                  connection->offset / CHUNK_SIZE);
+                  connection->offset /
+                  connection->request->object->chunk_size);
         httpServeChunk(connection);
     }
     return 1;
@@ -20,7 +20,11 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+extern int coalescedRequests, coalescedRevalidations;
+extern int refreshedAhead;
+
 int httpAccept(int, FdEventHandlerPtr, AcceptRequestPtr);
+HTTPConnectionPtr httpAcceptConnection(int fd, struct _H2Stream *stream);
 void httpClientFinish(HTTPConnectionPtr connection, int s);
 int httpClientHandler(int, FdEventHandlerPtr, StreamRequestPtr);
 int httpClientNoticeError(HTTPRequestPtr, int code, struct _Atom *message);
@@ -49,6 +53,8 @@ int httpClientHandlerHeaders(FdEventHandlerPtr event,
                                 StreamRequestPtr request,
                                 HTTPConnectionPtr connection);
 int httpClientNoticeRequest(HTTPRequestPtr request, int);
+int delayedHttpClientNoticeRequest(HTTPRequestPtr request);
+int httpBackgroundRevalidate(ObjectPtr object, AtomPtr headers);
 int httpServeObject(HTTPConnectionPtr);
 int delayedHttpServeObject(HTTPConnectionPtr connection);
 int httpServeObjectStreamHandler(int status, 
@@ -0,0 +1,580 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "polipo.h"
+
+int compressObjects = 0;
+int compressionLevel = 6;
+AtomListPtr compressibleTypes = NULL;
+
+#ifdef NO_COMPRESSION
+
+void
+preinitCompress(void)
+{
+    return;
+}
+
+ObjectPtr
+compressedVariant(ObjectPtr object, HTTPRequestPtr request)
+{
+    return NULL;
+}
+
+void
+supersedeCompressedVariant(ObjectPtr object)
+{
+    return;
+}
+
+#else
+
+#include <zlib.h>
+
+#define VARIANT_SUFFIX " gzip"
+#define VARIANT_SUFFIX_LENGTH 5
+
+/* Objects known to be smaller than this are not worth compressing. */
+#define COMPRESS_MIN_SIZE 256
+
+/* The number of chunks compressed before yielding to the event loop. */
+#define COMPRESS_BURST 4
+
+typedef struct _Compressor {
+    ObjectPtr source;
+    ObjectPtr object;
+    int offset;
+    int length;
+    int pending;
+    ConditionHandlerPtr chandler;
+    z_stream stream;
+} CompressorRec, *CompressorPtr;
+
+static AtomPtr atomAcceptEncoding;
+
+static void compressPump(CompressorPtr compressor);
+
+void
+preinitCompress(void)
+{
+    static const char *types[] = {
+        "text/html", "text/css", "text/plain", "text/xml",
+        "text/javascript", "application/javascript",
+        "application/x-javascript", "application/json",
+        "application/xml", "application/xhtml+xml",
+        "application/rss+xml", "image/svg+xml", NULL
+    };
+    int i;
+
+    atomAcceptEncoding = internAtom("accept-encoding");
+    compressibleTypes = makeAtomList(NULL, 0);
+    if(atomAcceptEncoding == NULL || compressibleTypes == NULL) {
+        do_log(L_ERROR, "Couldn't allocate compressible types.\n");
+        exit(1);
+    }
+    for(i = 0; types[i]; i++)
+        atomListCons(internAtom(types[i]), compressibleTypes);
+
+    CONFIG_VARIABLE(compressObjects, CONFIG_BOOLEAN,
+                    "Compress text objects for clients that accept gzip.");
+    CONFIG_VARIABLE(compressionLevel, CONFIG_INT,
+                    "Compression level, from 1 to 9.");
+    CONFIG_VARIABLE(compressibleTypes, CONFIG_ATOM_LIST_LOWER,
+                    "Media types that may be compressed.");
+}
+
+static int
+isVariantKey(const char *key, int key_size)
+{
+    return key_size > VARIANT_SUFFIX_LENGTH &&
+        memcmp(key + key_size - VARIANT_SUFFIX_LENGTH,
+               VARIANT_SUFFIX, VARIANT_SUFFIX_LENGTH) == 0;
+}
+
+static char *
+variantKey(ObjectPtr object, int *key_size_return)
+{
+    char *key;
+
+    if(object->key_size + VARIANT_SUFFIX_LENGTH >= 50000)
+        return NULL;
+    key = malloc(object->key_size + VARIANT_SUFFIX_LENGTH);
+    if(key == NULL)
+        return NULL;
+    memcpy(key, object->key, object->key_size);
+    memcpy(key + object->key_size, VARIANT_SUFFIX, VARIANT_SUFFIX_LENGTH);
+    *key_size_return = object->key_size + VARIANT_SUFFIX_LENGTH;
+    return key;
+}
+
+/* Whether an Accept-Encoding value allows gzip. */
+static int
+acceptsGzip(const char *buf, int i, int end)
+{
+    int x, y, zero;
+
+    while(i < end) {
+        while(i < end && (buf[i] == ' ' || buf[i] == '\t' || buf[i] == ','))
+            i++;
+        x = i;
+        while(i < end && buf[i] != ',' && buf[i] != ';' &&
+              buf[i] != ' ' && buf[i] != '\t')
+            i++;
+        y = i;
+        zero = 0;
+        while(i < end && buf[i] != ',') {
+            if((buf[i] == 'q' || buf[i] == 'Q') &&
+               i + 1 < end && buf[i + 1] == '=') {
+                i += 2;
+                zero = 1;
+                while(i < end && (buf[i] == '0' || buf[i] == '.'))
+                    i++;
+                if(i < end && buf[i] >= '1' && buf[i] <= '9')
+                    zero = 0;
+                continue;
+            }
+            i++;
+        }
+        if((y - x == 4 && lwrcmp(buf + x, "gzip", 4) == 0) ||
+           (y - x == 6 && lwrcmp(buf + x, "x-gzip", 6) == 0))
+            return !zero;
+    }
+    return 0;
+}
+
+static int
+compressible(ObjectPtr object, HTTPRequestPtr request)
+{
+    int rc, start, end, i;
+    AtomPtr type;
+
+    if(request->method != METHOD_GET ||
+       request->from > 0 || request->to >= 0 ||
+       (request->cache_control.flags & CACHE_NO_TRANSFORM))
+        return 0;
+
+    if(object->type != OBJECT_HTTP || object->code != 200 ||
+       !(object->flags & OBJECT_PUBLIC) ||
+       (object->flags & (OBJECT_INITIAL | OBJECT_LOCAL | OBJECT_LINEAR |
+                         OBJECT_SUPERSEDED | OBJECT_ABORTED)) ||
+       (object->cache_control & (CACHE_NO_TRANSFORM | CACHE_NO_STORE |
+                                 CACHE_VARY | CACHE_MISMATCH)) ||
+       (object->length >= 0 && object->length < COMPRESS_MIN_SIZE) ||
+       isVariantKey(object->key, object->key_size))
+        return 0;
+
+    if(object->headers == NULL || request->headers == NULL)
+        return 0;
+
+    if(httpFindHeader(atomContentEncoding,
+                      object->headers->string, object->headers->length,
+                      &start, &end))
+        return 0;
+
+    rc = httpFindHeader(atomContentType,
+                        object->headers->string, object->headers->length,
+                        &start, &end);
+    if(!rc)
+        return 0;
+    for(i = start; i < end; i++)
+        if(object->headers->string[i] == ';' ||
+           object->headers->string[i] == ' ')
+            break;
+    type = internAtomLowerN(object->headers->string + start, i - start);
+    if(type == NULL)
+        return 0;
+    rc = atomListMember(type, compressibleTypes);
+    releaseAtom(type);
+    if(!rc)
+        return 0;
+
+    rc = httpFindHeader(atomAcceptEncoding,
+                        request->headers->string, request->headers->length,
+                        &start, &end);
+    if(!rc)
+        return 0;
+    return acceptsGzip(request->headers->string, start, end);
+}
+
+/* Whether a variant found in the cache was produced from the current
+   instance of object, and can still be served in full. */
+static int
+variantCurrent(ObjectPtr object, ObjectPtr variant)
+{
+    int n;
+
+    if((variant->flags & OBJECT_ABORTED) || variant->code != object->code ||
+       variant->last_modified != object->last_modified)
+        return 0;
+
+    if(object->etag) {
+        n = strlen(object->etag);
+        if(variant->etag == NULL ||
+           strlen(variant->etag) != n + VARIANT_SUFFIX_LENGTH ||
+           memcmp(variant->etag, object->etag, n) != 0 ||
+           strcmp(variant->etag + n, "-gzip") != 0)
+            return 0;
+    } else {
+        if(variant->etag)
+            return 0;
+        /* Without validators, a revalidation may have changed the body. */
+        if(object->last_modified < 0 && variant->age < object->age)
+            return 0;
+    }
+
+    if(variant->flags & OBJECT_INPROGRESS)
+        return 1;
+    return objectHasData(variant, 0, -1) > 0;
+}
+
+static int
+compressRequest(ObjectPtr object, int method, int from, int to,
+                HTTPRequestPtr requestor, void *closure)
+{
+    /* A deflate stream cannot be resumed: the variant is either being
+       produced, or complete in memory or on disk. */
+    return -1;
+}
+
+static void
+compressDestroy(CompressorPtr compressor)
+{
+    deflateEnd(&compressor->stream);
+    releaseObject(compressor->source);
+    releaseObject(compressor->object);
+    free(compressor);
+}
+
+static void
+compressAbort(CompressorPtr compressor, const char *message)
+{
+    ObjectPtr object = compressor->object;
+
+    do_log(L_WARN, "Couldn't compress %s: %s.\n",
+           scrub(compressor->source->key), message);
+    object->flags &= ~OBJECT_INPROGRESS;
+    abortObject(object, 500, internAtom(message));
+    retainObject(object);
+    compressDestroy(compressor);
+    releaseNotifyObject(object);
+}
+
+static int
+compressData(CompressorPtr compressor, const char *data, int len, int flush)
+{
+    z_stream *stream = &compressor->stream;
+    char *buf;
+    int rc, n, produced = 0;
+
+    buf = get_chunk();
+    if(buf == NULL)
+        return -1;
+
+    stream->next_in = (Bytef*)data;
+    stream->avail_in = len;
+    do {
+        stream->next_out = (Bytef*)buf;
+        stream->avail_out = CHUNK_SIZE;
+        rc = deflate(stream, flush);
+        if(rc == Z_STREAM_ERROR)
+            goto fail;
+        n = CHUNK_SIZE - stream->avail_out;
+        if(n > 0) {
+            rc = objectAddData(compressor->object, buf,
+                               compressor->length, n);
+            if(rc < 0)
+                goto fail;
+            compressor->length += n;
+            produced = 1;
+        }
+    } while(stream->avail_out == 0);
+
+    dispose_chunk(buf);
+    compressor->pending = (flush == Z_NO_FLUSH);
+    if(produced)
+        notifyObject(compressor->object);
+    return 1;
+
+ fail:
+    dispose_chunk(buf);
+    return -1;
+}
+
+static void
+compressFinish(CompressorPtr compressor)
+{
+    ObjectPtr object = compressor->object;
+    int rc;
+
+    rc = compressData(compressor, NULL, 0, Z_FINISH);
+    if(rc < 0) {
+        compressAbort(compressor, "Couldn't finish compressed object");
+        return;
+    }
+    object->length = compressor->length;
+    object->flags &= ~OBJECT_INPROGRESS;
+    objectMetadataChanged(object, 0);
+    retainObject(object);
+    compressDestroy(compressor);
+    releaseNotifyObject(object);
+}
+
+static int
+compressPumpHandler(TimeEventHandlerPtr event)
+{
+    CompressorPtr compressor = *(CompressorPtr*)event->data;
+    compressPump(compressor);
+    return 1;
+}
+
+/* Notifying the compressed object from within a condition handler
+   would nest signalCondition, so the pump always runs from the event
+   loop. */
+static int
+compressSchedule(CompressorPtr compressor)
+{
+    TimeEventHandlerPtr event;
+    event = scheduleTimeEvent(-1, compressPumpHandler,
+                              sizeof(compressor), &compressor);
+    return event ? 1 : -1;
+}
+
+static int
+compressSourceHandler(int status, ConditionHandlerPtr chandler)
+{
+    CompressorPtr compressor = *(CompressorPtr*)chandler->data;
+    int rc;
+
+    compressor->chandler = NULL;
+    if(status < 0) {
+        compressAbort(compressor, "Source object vanished");
+        return 1;
+    }
+    rc = compressSchedule(compressor);
+    if(rc < 0)
+        compressAbort(compressor, "Couldn't schedule compression");
+    return 1;
+}
+
+/* Compress whatever source data is available, a few chunks at a time,
+   then wait for the source to make progress. */
+static void
+compressPump(CompressorPtr compressor)
+{
+    ObjectPtr source = compressor->source;
+    int i, j, len, rc, n = 0;
+
+    while(1) {
+        if(source->flags & OBJECT_ABORTED) {
+            compressAbort(compressor, "Source object aborted");
+            return;
+        }
+        if(source->length >= 0 && compressor->offset >= source->length) {
+            compressFinish(compressor);
+            return;
+        }
+        if(n >= COMPRESS_BURST) {
+            rc = compressSchedule(compressor);
+            if(rc < 0)
+                compressAbort(compressor, "Couldn't schedule compression");
+            return;
+        }
+
+        i = compressor->offset / source->chunk_size;
+        j = compressor->offset % source->chunk_size;
+        len = i < source->numchunks ? source->chunks[i].size - j : 0;
+        if(len <= 0) {
+            objectFillFromDisk(source, compressor->offset, 1);
+            len = i < source->numchunks ? source->chunks[i].size - j : 0;
+        }
+        if(len <= 0)
+            break;
+
+        lockChunk(source, i);
+        rc = compressData(compressor, source->chunks[i].data + j, len,
+                          Z_NO_FLUSH);
+        unlockChunk(source, i);
+        if(rc < 0) {
+            compressAbort(compressor, "Couldn't compress data");
+            return;
+        }
+        compressor->offset += len;
+        n++;
+    }
+
+    if(!(source->flags & OBJECT_INPROGRESS)) {
+        compressAbort(compressor, "Source object is incomplete");
+        return;
+    }
+
+    /* Let the client have what we've got while the server is slow. */
+    if(compressor->pending) {
+        rc = compressData(compressor, NULL, 0, Z_SYNC_FLUSH);
+        if(rc < 0) {
+            compressAbort(compressor, "Couldn't compress data");
+            return;
+        }
+    }
+
+    compressor->chandler =
+        conditionWait(&source->condition, compressSourceHandler,
+                      sizeof(compressor), &compressor);
+    if(compressor->chandler == NULL)
+        compressAbort(compressor, "Couldn't register condition handler");
+}
+
+static int
+compressStart(ObjectPtr source, ObjectPtr object)
+{
+    CompressorPtr compressor;
+    AtomPtr headers;
+    char *etag = NULL;
+    int rc, n;
+
+    compressor = calloc(1, sizeof(CompressorRec));
+    if(compressor == NULL)
+        return -1;
+
+    rc = deflateInit2(&compressor->stream,
+                      MAX(1, MIN(9, compressionLevel)), Z_DEFLATED,
+                      15 + 16, 8, Z_DEFAULT_STRATEGY);
+    if(rc != Z_OK) {
+        free(compressor);
+        return -1;
+    }
+
+    headers = atomCat(source->headers,
+                      "\r\nContent-Encoding: gzip\r\nVary: Accept-Encoding");
+    if(source->etag) {
+        n = strlen(source->etag);
+        etag = malloc(n + VARIANT_SUFFIX_LENGTH + 1);
+        if(etag) {
+            memcpy(etag, source->etag, n);
+            strcpy(etag + n, "-gzip");
+        }
+    }
+    if(headers == NULL || (source->etag && etag == NULL)) {
+        if(headers)
+            releaseAtom(headers);
+        free(etag);
+        deflateEnd(&compressor->stream);
+        free(compressor);
+        return -1;
+    }
+
+    object->code = source->code;
+    if(source->message)
+        object->message = retainAtom(source->message);
+    object->headers = headers;
+    object->etag = etag;
+    if(source->via)
+        object->via = retainAtom(source->via);
+    object->date = source->date;
+    object->age = source->age;
+    object->expires = source->expires;
+    object->last_modified = source->last_modified;
+    object->cache_control = source->cache_control;
+    object->max_age = source->max_age;
+    object->s_maxage = source->s_maxage;
+    object->stale_while_revalidate = source->stale_while_revalidate;
+    object->stale_if_error = source->stale_if_error;
+    object->atime = current_time.tv_sec;
+    object->flags &= ~OBJECT_INITIAL;
+    object->flags |= OBJECT_INPROGRESS;
+
+    compressor->source = retainObject(source);
+    compressor->object = retainObject(object);
+    objectMetadataChanged(object, 0);
+
+    rc = compressSchedule(compressor);
+    if(rc < 0) {
+        object->flags &= ~OBJECT_INPROGRESS;
+        compressDestroy(compressor);
+        return -1;
+    }
+    return 1;
+}
+
+/* Returns the gzipped variant of object if it should be served to the
+   client that made request, starting to produce it if necessary. */
+ObjectPtr
+compressedVariant(ObjectPtr object, HTTPRequestPtr request)
+{
+    ObjectPtr variant;
+    char *key;
+    int key_size, rc;
+
+    if(!compressObjects || !compressible(object, request))
+        return NULL;
+
+    key = variantKey(object, &key_size);
+    if(key == NULL)
+        return NULL;
+
+    variant = makeObject(OBJECT_HTTP, key, key_size, 1, 1,
+                         compressRequest, NULL);
+    if(variant && !(variant->flags & OBJECT_INITIAL) &&
+       !variantCurrent(object, variant)) {
+        supersedeObject(variant);
+        releaseObject(variant);
+        variant = makeObject(OBJECT_HTTP, key, key_size, 1, 0,
+                             compressRequest, NULL);
+    }
+    free(key);
+    if(variant == NULL)
+        return NULL;
+
+    if(variant->flags & OBJECT_INITIAL) {
+        rc = compressStart(object, variant);
+        if(rc < 0) {
+            privatiseObject(variant, 0);
+            releaseObject(variant);
+            return NULL;
+        }
+    }
+    return variant;
+}
+
+void
+supersedeCompressedVariant(ObjectPtr object)
+{
+    ObjectPtr variant;
+    char *key;
+    int key_size;
+
+    if(object->type != OBJECT_HTTP ||
+       isVariantKey(object->key, object->key_size))
+        return;
+
+    key = variantKey(object, &key_size);
+    if(key == NULL)
+        return;
+    variant = findObject(OBJECT_HTTP, key, key_size);
+    free(key);
+    if(variant) {
+        supersedeObject(variant);
+        releaseObject(variant);
+    }
+}
+
+#endif
@@ -46,10 +46,12 @@ int diskCacheUnlinkTime = 32 * 24 * 60 * 60;
 int diskCacheTruncateTime = 4 * 24 * 60 * 60 + 12 * 60 * 60;
 int diskCacheTruncateSize =  1024 * 1024;
 int preciseExpiry = 0;
+int diskCacheSendfile = 1;
+int diskCacheAsync = 1;
 
 static DiskCacheEntryRec negativeEntry = {
     NULL, NULL,
-    -1, -1, -1, -1, 0, 0, NULL, NULL
+    -1, -1, -1, -1, 0, 0, NULL, NULL, 0, 0
 };
 
 #ifndef LOCAL_ROOT
@@ -96,6 +98,14 @@ preinitDiskcache()
     CONFIG_VARIABLE_SETTABLE(maxDiskCacheEntrySize, CONFIG_INT,
                              configIntSetter,
                              "Maximum size of objects cached on disk.");
+    CONFIG_VARIABLE_SETTABLE(diskCacheSendfile, CONFIG_BOOLEAN,
+                             configIntSetter,
+                             "Serve complete on-disk objects with sendfile.");
+    CONFIG_VARIABLE_SETTABLE(diskCacheAsync, CONFIG_BOOLEAN,
+                             configIntSetter,
+                             "Read from the on-disk cache asynchronously.");
+    preinitSegments();
+    preinitDiskIndex();
 }
 
 static int
@@ -184,6 +194,8 @@ initDiskcache()
         diskCacheRoot = NULL;
     }
 
+    initSegments();
+
     localDocumentRoot = expandTilde(maybeAddSlash(localDocumentRoot));
     rc = checkRoot(localDocumentRoot);
     if(rc <= 0) {
@@ -216,9 +228,9 @@ check_entry(DiskCacheEntryPtr entry)
         if(entry->offset >= 0) {
             off_t offset;
             offset = lseek(entry->fd, 0, SEEK_CUR);
-            assert(offset == entry->offset);
+            assert(offset == entry->base + entry->offset);
         }
-        if(entry->size >= 0) {
+        if(entry->size >= 0 && !entry->segment) {
             int rc;
             struct stat ss;
             rc = fstat(entry->fd, &ss);
@@ -244,6 +256,10 @@ diskEntrySize(ObjectPtr object)
     if(entry->size >= 0)
         return entry->size;
 
+    /* The file is shared with other entries. */
+    if(entry->segment)
+        return -1;
+
     rc = fstat(entry->fd, &buf);
     if(rc < 0) {
         do_log_error(L_ERROR, errno, "Couldn't stat");
@@ -278,7 +294,7 @@ entrySeek(DiskCacheEntryPtr entry, off_t offset)
         if(entry->size + entry->body_offset < offset)
             return -1;
     }
-    rc = lseek(entry->fd, offset, SEEK_SET);
+    rc = lseek(entry->fd, entry->base + offset, SEEK_SET);
     if(rc < 0) {
         do_log_error(L_ERROR, errno, "Couldn't seek");
         entry->offset = -1;
@@ -457,7 +473,8 @@ dirnameUrl(char *url, int n, char *name, int len)
     return NULL;
 }
 
-/* Create a file and all intermediate directories. */
+/* Create a file and all intermediate directories.  Fails silently with
+   EEXIST if the file already exists. */
 static int
 createFile(const char *name, int path_start)
 {
@@ -478,6 +495,8 @@ createFile(const char *name, int path_start)
 	      diskCacheFilePermissions);
     if(fd >= 0)
         return fd;
+    if(errno == EEXIST)
+        return -1;
     if(errno != ENOENT) {
         do_log_error(L_ERROR, errno, "Couldn't create disk file %s", name);
         return -1;
@@ -501,7 +520,8 @@ createFile(const char *name, int path_start)
     fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_BINARY,
 	      diskCacheFilePermissions);
     if(fd < 0) {
-        do_log_error(L_ERROR, errno, "Couldn't create file %s", name);
+        if(errno != EEXIST)
+            do_log_error(L_ERROR, errno, "Couldn't create file %s", name);
         return -1;
     }
 
@@ -812,6 +832,7 @@ validateLocalEntry(ObjectPtr object, int fd,
        
     if(object->flags & OBJECT_INITIAL) {
         object->length = ss.st_size;
+        objectSetChunkSize(object, object->length, 0);
         object->last_modified = ss.st_mtime;
         object->date = current_time.tv_sec;
         object->age = current_time.tv_sec;
@@ -1044,6 +1065,8 @@ validateEntry(ObjectPtr object, int fd,
     object->cache_control |= cache_control.flags;
     object->max_age = cache_control.max_age;
     object->s_maxage = cache_control.s_maxage;
+    object->stale_while_revalidate = cache_control.stale_while_revalidate;
+    object->stale_if_error = cache_control.stale_if_error;
 
     if(object->age < 0) object->age = object->date;
     if(object->age < 0) object->age = 0; /* a long time ago */
@@ -1056,17 +1079,24 @@ validateEntry(ObjectPtr object, int fd,
     }
     releaseAtom(message);
 
-    if(object->flags & OBJECT_INITIAL) object->via = via;
+    if(object->flags & OBJECT_INITIAL) {
+        object->via = via;
+        objectSetChunkSize(object, object->length, 0);
+    }
     object->flags &= ~OBJECT_INITIAL;
     if(offset > body_offset) {
+        /* A segment entry is followed by unrelated data. */
+        int n = MIN(offset - body_offset, CHUNK_SIZE);
+        if(length >= 0)
+            n = MIN(n, length);
         /* We need to make sure we don't invoke object expiry recursively */
         objectSetChunks(object, 1);
         if(object->numchunks >= 1) {
             if(object->chunks[0].data == NULL)
-                object->chunks[0].data = maybe_get_chunk();
+                object->chunks[0].data =
+                    maybe_get_chunks(CHUNKS(object->chunk_size));
             if(object->chunks[0].data)
-                objectAddData(object, buf + body_offset,
-                              0, MIN(offset - body_offset, CHUNK_SIZE));
+                objectAddData(object, buf + body_offset, 0, n);
         }
     }
 
@@ -1133,6 +1163,76 @@ revalidateDiskEntry(ObjectPtr object)
     return 1;
 }
 
+/* Small objects that are complete in memory go to the segment store. */
+static int
+segmentEligible(ObjectPtr object)
+{
+    int i;
+
+    if(!segmentStoreActive())
+        return 0;
+    if(object->length < 0 || object->length > diskCacheSegmentObjectSize)
+        return 0;
+    if(object->flags & (OBJECT_INPROGRESS | OBJECT_LINEAR))
+        return 0;
+    if(object->numchunks * object->chunk_size < object->length)
+        return 0;
+    for(i = 0; i * object->chunk_size < object->length; i++) {
+        if(object->chunks[i].size <
+           MIN(object->chunk_size, object->length - i * object->chunk_size))
+            return 0;
+    }
+    return 1;
+}
+
+static int
+writeSegmentEntry(ObjectPtr object, int *body_offset_return)
+{
+    int fd, rc, i, j, body_offset = -1;
+    int offset;
+    off_t base;
+    char *data = NULL;
+    int dsize = 0;
+
+    fd = segmentAppendBegin(object->key, object->key_size, &base);
+    if(fd < 0)
+        return -1;
+
+    if(object->length > 0) {
+        data = object->chunks[0].data;
+        dsize = MIN(object->chunks[0].size, object->length);
+    }
+    rc = writeHeaders(fd, &body_offset, object, data, dsize);
+    if(rc < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't write headers");
+        segmentAppendAbort();
+        return -1;
+    }
+
+    offset = rc - body_offset;
+    while(offset < object->length) {
+        i = offset / object->chunk_size;
+        j = offset % object->chunk_size;
+        rc = write(fd, object->chunks[i].data + j,
+                   MIN(object->chunk_size,
+                       object->length - i * object->chunk_size) - j);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0) {
+            do_log_error(L_ERROR, errno, "Couldn't write segment entry");
+            segmentAppendAbort();
+            return -1;
+        }
+        offset += rc;
+    }
+
+    rc = segmentAppendEnd(body_offset + object->length);
+    if(rc < 0)
+        return -1;
+    *body_offset_return = body_offset;
+    return 1;
+}
+
 static DiskCacheEntryPtr
 makeDiskEntry(ObjectPtr object, int create)
 {
@@ -1141,11 +1241,11 @@ makeDiskEntry(ObjectPtr object, int create)
     int fd = -1;
     int negative = 0, size = -1, name_len = -1;
     char *name = NULL;
-    off_t offset = -1;
+    off_t offset = -1, base = 0;
     int body_offset = -1;
     int rc;
     int local = (object->flags & OBJECT_LOCAL) != 0;
-    int dirty = 0;
+    int dirty = 0, segment = 0, length = 0, indexed;
 
    if(local && create)
        return NULL;
@@ -1199,15 +1299,37 @@ makeDiskEntry(ObjectPtr object, int create)
             return NULL;
         name_len = urlFilename(buf, 1024, object->key, object->key_size);
         if(name_len < 0) return NULL;
-        if(!negative)
-            fd = open(buf, O_RDWR | O_BINARY);
-        if(fd >= 0) {
+        if(!negative) {
+            fd = segmentLookup(object->key, object->key_size, &base, &length);
+            if(fd >= 0) {
+                rc = validateEntry(object, fd, &body_offset, &offset);
+                if(rc >= 0 && body_offset <= length) {
+                    dirty = rc;
+                    segment = 1;
+                    size = length - body_offset;
+                } else {
+                    close(fd);
+                    fd = -1;
+                    segmentRemove(object->key, object->key_size);
+                }
+            }
+        }
+        if(!negative && !segment) {
+            indexed = diskIndexLookup(buf);
+            if(indexed != 0) {
+                fd = open(buf, O_RDWR | O_BINARY);
+                if(fd < 0 && indexed > 0 && errno == ENOENT)
+                    diskIndexRemove(buf);
+            }
+        }
+        if(fd >= 0 && !segment) {
             rc = validateEntry(object, fd, &body_offset, &offset);
             if(rc >= 0) {
                 dirty = rc;
             } else {
                 close(fd);
                 fd = -1;
+                diskIndexRemove(buf);
                 rc = unlink(buf);
                 if(rc < 0 && errno != ENOENT) {
                     do_log_error(L_WARN,  errno,
@@ -1218,15 +1340,56 @@ makeDiskEntry(ObjectPtr object, int create)
             }
         }
 
+        if(fd < 0 && create && name_len > 0 && 
+           !(object->flags & OBJECT_INITIAL) && segmentEligible(object)) {
+            rc = writeSegmentEntry(object, &body_offset);
+            if(rc >= 0)
+                fd = segmentLookup(object->key, object->key_size,
+                                   &base, &length);
+            if(fd >= 0) {
+                segment = 1;
+                size = object->length;
+                offset = 0;
+                dirty = 0;
+                object->flags |= OBJECT_DISK_ENTRY_COMPLETE;
+            } else {
+                body_offset = -1;
+            }
+        }
+
         if(fd < 0 && create && name_len > 0 && 
            !(object->flags & OBJECT_INITIAL)) {
             fd = createFile(buf, diskCacheRoot->length);
-            if(fd < 0)
-                return NULL;
-
-            if(fd >= 0) {
+            if(fd < 0 && errno == EEXIST) {
+                /* Somebody else, typically another worker, created the
+                   entry since we looked.  Use it if its headers have
+                   been written, otherwise try again later. */
+                struct stat ss;
+                fd = open(buf, O_RDWR | O_BINARY);
+                if(fd >= 0) {
+                    rc = fstat(fd, &ss);
+                    if(rc >= 0 && ss.st_size > 0)
+                        rc = validateEntry(object, fd, &body_offset, &offset);
+                    else
+                        rc = -1;
+                    if(rc < 0) {
+                        close(fd);
+                        fd = -1;
+                    }
+                }
+                diskIndexAdd(buf, 0);
+                if(fd < 0)
+                    return NULL;
+                dirty = rc;
+            } else {
                 char *data = NULL;
                 int dsize = 0;
+                /* If creation failed, the index may have been wrong;
+                   make sure we try to open the file next time. */
+                diskIndexAdd(buf, 0);
+                if(fd < 0)
+                    return NULL;
+
                 if(object->numchunks > 0) {
                     data = object->chunks[0].data;
                     dsize = object->chunks[0].size;
@@ -1234,6 +1397,7 @@ makeDiskEntry(ObjectPtr object, int create)
                 rc = writeHeaders(fd, &body_offset, object, data, dsize);
                 if(rc < 0) {
                     do_log_error(L_ERROR, errno, "Couldn't write headers");
+                    diskIndexRemove(buf);
                     rc = unlink(buf);
                     if(rc < 0 && errno != ENOENT)
                         do_log_error(L_ERROR, errno,
@@ -1273,12 +1437,14 @@ makeDiskEntry(ObjectPtr object, int create)
     }
     assert(body_offset >= 0);
 
-    name = strdup_n(buf, name_len);
-    if(name == NULL) {
-        do_log(L_ERROR, "Couldn't allocate name.\n");
-        close(fd);
-        fd = -1;
-        return NULL;
+    if(!segment) {
+        name = strdup_n(buf, name_len);
+        if(name == NULL) {
+            do_log(L_ERROR, "Couldn't allocate name.\n");
+            close(fd);
+            fd = -1;
+            return NULL;
+        }
     }
 
     entry = malloc(sizeof(DiskCacheEntryRec));
@@ -1297,6 +1463,8 @@ makeDiskEntry(ObjectPtr object, int create)
     entry->offset = offset;
     entry->size = size;
     entry->metadataDirty = dirty;
+    entry->base = base;
+    entry->segment = segment;
 
     entry->next = diskEntries;
     if(diskEntries)
@@ -1318,6 +1486,10 @@ static int
 rewriteEntry(ObjectPtr object)
 {
     int old_body_offset = object->disk_entry->body_offset;
+    off_t old_base = object->disk_entry->base;
+    /* A segment entry is followed by unrelated data. */
+    off_t old_size =
+        object->disk_entry->segment ? object->disk_entry->size : -1;
     int fd, rc, n;
     DiskCacheEntryPtr entry;
     char* buf;
@@ -1361,13 +1533,19 @@ rewriteEntry(ObjectPtr object)
         }
     }
 
-    rc = lseek(fd, old_body_offset + offset, SEEK_SET);
+    rc = lseek(fd, old_base + old_body_offset + offset, SEEK_SET);
     if(rc < 0)
         goto done;
 
     while(1) {
         CHECK_ENTRY(entry);
-        n = read(fd, buf, bufsize);
+        n = bufsize;
+        if(old_size >= 0) {
+            if(offset >= old_size)
+                goto done;
+            n = MIN(n, old_size - offset);
+        }
+        n = read(fd, buf, n);
         if(n < 0 && errno == EINTR)
             continue;
         if(n <= 0)
@@ -1380,6 +1558,7 @@ rewriteEntry(ObjectPtr object)
         if(rc >= 0) {
             entry->offset += rc;
             entry->size += rc;
+            offset += rc;
         } else if(errno == EINTR) {
             goto write_again;
         }
@@ -1426,10 +1605,13 @@ destroyDiskEntry(ObjectPtr object, int d)
     if(d) {
         entry->object->flags &= ~OBJECT_DISK_ENTRY_COMPLETE;
         if(entry->filename) {
+            diskIndexRemove(entry->filename);
             urc = unlink(entry->filename);
             if(urc < 0)
                 do_log_error(L_WARN, errno, 
                              "Couldn't unlink %s", scrub(entry->filename));
+        } else if(entry->segment) {
+            segmentRemove(object->key, object->key_size);
         }
     } else {
         if(entry && entry->metadataDirty)
@@ -1445,6 +1627,8 @@ destroyDiskEntry(ObjectPtr object, int d)
             if(entry == NULL || entry == &negativeEntry)
                 return 0;
         }
+        if(entry->filename && !entry->local && entry->size >= 0)
+            diskIndexAdd(entry->filename, entry->body_offset + entry->size);
     }
  again:
     rc = close(entry->fd);
@@ -1486,13 +1670,36 @@ objectGetFromDisk(ObjectPtr object)
 }
 
 
+/* Whether the given chunks are already in memory. */
+
+static int
+objectChunksInMemory(ObjectPtr object, int offset, int chunks)
+{
+    int i, k, s;
+
+    if(object->flags & OBJECT_INITIAL)
+        return 0;
+
+    if((object->length < 0 || object->size < object->length) &&
+       object->size <
+       (offset / object->chunk_size + chunks) * object->chunk_size)
+        return 0;
+
+    for(k = 0; k < chunks; k++) {
+        i = offset / object->chunk_size + k;
+        s = MIN(object->chunk_size, object->size - i * object->chunk_size);
+        if(object->chunks[i].size < s)
+            return 0;
+    }
+    return 1;
+}
+
 int 
 objectFillFromDisk(ObjectPtr object, int offset, int chunks)
 {
     DiskCacheEntryPtr entry;
     int rc, result;
     int i, j, k;
-    int complete;
 
     if(object->type != OBJECT_HTTP)
         return 0;
@@ -1502,32 +1709,15 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
 
     if(object->length >= 0) {
         chunks = MIN(chunks, 
-                     (object->length - offset + CHUNK_SIZE - 1) / CHUNK_SIZE);
+                     (object->length - offset + object->chunk_size - 1) /
+                     object->chunk_size);
     }
 
-    rc = objectSetChunks(object, offset / CHUNK_SIZE + chunks);
+    rc = objectSetChunks(object, offset / object->chunk_size + chunks);
     if(rc < 0)
         return 0;
 
-    complete = 1;
-    if(object->flags & OBJECT_INITIAL) {
-        complete = 0;
-    } else if((object->length < 0 || object->size < object->length) &&
-              object->size < (offset / CHUNK_SIZE + chunks) * CHUNK_SIZE) {
-        complete = 0;
-    } else {
-        for(k = 0; k < chunks; k++) {
-            int s;
-            i = offset / CHUNK_SIZE + k;
-            s = MIN(CHUNK_SIZE, object->size - i * CHUNK_SIZE);
-            if(object->chunks[i].size < s) {
-                complete = 0;
-                break;
-            }
-        }
-    }
-
-    if(complete)
+    if(objectChunksInMemory(object, offset, chunks))
         return 1;
 
     /* This has the side-effect of revalidating the entry, which is
@@ -1537,9 +1727,9 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
         return 0;
                 
     for(k = 0; k < chunks; k++) {
-        i = offset / CHUNK_SIZE + k;
+        i = offset / object->chunk_size + k;
         if(!object->chunks[i].data)
-            object->chunks[i].data = get_chunk();
+            object->chunks[i].data = get_chunks(CHUNKS(object->chunk_size));
         if(!object->chunks[i].data) {
             chunks = k;
             break;
@@ -1550,12 +1740,12 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
     result = 0;
 
     for(k = 0; k < chunks; k++) {
-        int o;
-        i = offset / CHUNK_SIZE + k;
+        int o, n;
+        i = offset / object->chunk_size + k;
         j = object->chunks[i].size;
-        o = i * CHUNK_SIZE + j;
+        o = i * object->chunk_size + j;
 
-        if(object->chunks[i].size == CHUNK_SIZE)
+        if(object->chunks[i].size == object->chunk_size)
             continue;
 
         if(entry->size >= 0 && entry->size <= o)
@@ -1569,9 +1759,13 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
             }
         }
 
+        n = object->chunk_size - j;
+        if(entry->segment)
+            n = MIN(n, entry->size - o);
+
         CHECK_ENTRY(entry);
         again:
-        rc = read(entry->fd, object->chunks[i].data + j, CHUNK_SIZE - j);
+        rc = read(entry->fd, object->chunks[i].data + j, n);
         if(rc < 0) {
             if(errno == EINTR)
                 goto again;
@@ -1589,7 +1783,7 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
            entry->offset - entry->body_offset == entry->object->length)
             entry->size = entry->object->length;
             
-        if(rc < CHUNK_SIZE - j) {
+        if(rc < object->chunk_size - j) {
             /* Paranoia: the read may have been interrupted half-way. */
             if(entry->size < 0) {
                 if(rc == 0 ||
@@ -1619,7 +1813,7 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
 
     CHECK_ENTRY(object->disk_entry);
     for(k = 0; k < chunks; k++) {
-        i = offset / CHUNK_SIZE + k;
+        i = offset / object->chunk_size + k;
         unlockChunk(object, i);
     }
 
@@ -1631,6 +1825,395 @@ objectFillFromDisk(ObjectPtr object, int offset, int chunks)
     }
 }
 
+#ifdef HAVE_IO_URING
+
+/* Reads from the on-disk cache may be submitted to an io_uring, so
+   that a cold disk doesn't stall the event loop.  Completions are
+   signalled through an eventfd watched by the event loop; the chunk
+   being read into stays locked until then, and waiters are woken up
+   through the object's condition. */
+
+#define DISK_RING_ENTRIES 64
+
+typedef struct _DiskRing {
+    int fd;
+    int eventfd;
+    unsigned entries;
+    int queued;
+    int inflight;
+    void *ring;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} DiskRingRec, *DiskRingPtr;
+
+typedef struct _DiskRead {
+    ObjectPtr object;
+    int fd;
+    int chunk;
+    int offset;
+    int len;
+} DiskReadRec, *DiskReadPtr;
+
+static DiskRingPtr diskRing = NULL;
+static int diskRingBroken = 0;
+
+static int diskRingHandler(int status, FdEventHandlerPtr event);
+
+static void
+destroyDiskRing(DiskRingPtr ring)
+{
+    if(ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if(ring->ring)
+        munmap(ring->ring, ring->ring_size);
+    if(ring->eventfd >= 0)
+        close(ring->eventfd);
+    if(ring->fd >= 0)
+        close(ring->fd);
+    free(ring);
+}
+
+static int
+diskRingSetup()
+{
+    struct io_uring_params params;
+    DiskRingPtr ring;
+    FdEventHandlerPtr event;
+    char *base;
+    unsigned i;
+    int rc;
+
+    ring = calloc(1, sizeof(DiskRingRec));
+    if(ring == NULL)
+        goto fail;
+    ring->fd = -1;
+    ring->eventfd = -1;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, DISK_RING_ENTRIES, &params);
+    if(ring->fd < 0)
+        goto fail;
+
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    ring->ring_size =
+        MAX(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+            params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe));
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQ_RING);
+    if(ring->ring == MAP_FAILED) {
+        ring->ring = NULL;
+        goto fail;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    base = ring->ring;
+    ring->sq_tail = (unsigned*)(base + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(base + params.sq_off.array);
+    ring->cq_head = (unsigned*)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(base + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+
+    /* Submission slots are used in order, so the indirection array
+       is the identity. */
+    for(i = 0; i < params.sq_entries; i++)
+        ring->sq_array[i] = i;
+
+    ring->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(ring->eventfd < 0)
+        goto fail;
+
+    rc = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD,
+                 &ring->eventfd, 1);
+    if(rc < 0)
+        goto fail;
+
+    event = registerFdEvent(ring->eventfd, POLLIN, diskRingHandler, 0, NULL);
+    if(event == NULL) {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    diskRing = ring;
+    return 1;
+
+ fail:
+    do_log_error(L_WARN, errno,
+                 "Couldn't set up io_uring, reading disk cache synchronously");
+    if(ring)
+        destroyDiskRing(ring);
+    diskRingBroken = 1;
+    return -1;
+}
+
+static void
+diskRingQueue(DiskReadPtr r, char *buf, off_t offset)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail = *diskRing->sq_tail;
+
+    sqe = &diskRing->sqes[tail & *diskRing->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = r->len;
+    sqe->off = offset;
+    sqe->user_data = (unsigned long)r;
+    __atomic_store_n(diskRing->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    diskRing->queued++;
+    diskRing->inflight++;
+}
+
+static void
+diskRingSubmit()
+{
+    int rc;
+
+    while(diskRing->queued > 0) {
+        rc = syscall(__NR_io_uring_enter, diskRing->fd, diskRing->queued,
+                     0, 0, NULL, 0);
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+            /* The entries stay in the ring and will be picked up by
+               the next submission. */
+            do_log_error(L_ERROR, errno, "Couldn't submit disk reads");
+            return;
+        }
+        if(rc == 0)
+            return;
+        diskRing->queued -= rc;
+    }
+}
+
+static void
+diskReadDone(DiskReadPtr r, int rc)
+{
+    ObjectPtr object = r->object;
+    int i = r->chunk;
+
+    close(r->fd);
+    object->disk_reads--;
+
+    if(rc > 0) {
+        if(object->chunks[i].size < r->offset + rc)
+            object->chunks[i].size = r->offset + rc;
+        if(object->size < i * object->chunk_size + r->offset + rc)
+            object->size = i * object->chunk_size + r->offset + rc;
+    }
+    unlockChunk(object, i);
+
+    if(rc < r->len) {
+        if(rc < 0) {
+            do_log_error(L_ERROR, -rc, "Couldn't read from disk");
+            if(rc == -EINVAL || rc == -EOPNOTSUPP)
+                diskRingBroken = 1;
+        }
+        /* Let the synchronous code deal with short reads, it knows
+           how to notice that an entry changed behind our back. */
+        objectFillFromDisk(object, i * object->chunk_size, 1);
+    }
+
+    notifyObject(object);
+    releaseObject(object);
+    free(r);
+}
+
+static int
+diskRingHandler(int status, FdEventHandlerPtr event)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    unsigned long long value;
+    DiskReadPtr r;
+    int rc;
+
+    rc = read(diskRing->eventfd, &value, sizeof(value));
+    if(rc < 0 && errno != EAGAIN && errno != EINTR)
+        do_log_error(L_ERROR, errno, "Couldn't read eventfd");
+
+    while(1) {
+        head = *diskRing->cq_head;
+        tail = __atomic_load_n(diskRing->cq_tail, __ATOMIC_ACQUIRE);
+        if(head == tail)
+            break;
+        cqe = &diskRing->cqes[head & *diskRing->cq_mask];
+        r = (DiskReadPtr)(unsigned long)cqe->user_data;
+        rc = cqe->res;
+        __atomic_store_n(diskRing->cq_head, head + 1, __ATOMIC_RELEASE);
+        diskRing->inflight--;
+        diskReadDone(r, rc);
+    }
+    return 0;
+}
+
+#endif
+
+/* Like objectFillFromDisk, but doesn't wait for the data when the
+   disk can be read asynchronously.  Returns 0 if reads are in flight,
+   in which case the object's condition will be signalled when they
+   complete. */
+
+int
+objectFillFromDiskAsync(ObjectPtr object, int offset, int chunks)
+{
+#ifdef HAVE_IO_URING
+    DiskCacheEntryPtr entry;
+    DiskReadPtr r;
+    int i, j, k, n, o, rc, size;
+
+    if(!diskCacheAsync || diskRingBroken)
+        goto sync;
+
+    if(object->type != OBJECT_HTTP || (object->flags & OBJECT_LINEAR))
+        return 0;
+
+    /* Data may be arriving from the server into the same chunks. */
+    if(object->flags & OBJECT_INPROGRESS)
+        goto sync;
+
+    /* One batch at a time per object. */
+    if(object->disk_reads > 0)
+        return 0;
+
+    /* Opening the entry and reading its headers remain synchronous:
+       whoever is asking needs the headers straight away.  Only the
+       body goes through the ring. */
+    if(object->flags & OBJECT_INITIAL) {
+        if(!makeDiskEntry(object, 0) || (object->flags & OBJECT_INITIAL))
+            return 0;
+    }
+
+    if(object->length >= 0)
+        chunks = MIN(chunks,
+                     (object->length - offset + object->chunk_size - 1) /
+                     object->chunk_size);
+    if(chunks <= 0)
+        return 1;
+
+    rc = objectSetChunks(object, offset / object->chunk_size + chunks);
+    if(rc < 0)
+        return 0;
+
+    if(objectChunksInMemory(object, offset, chunks))
+        return 1;
+
+    entry = makeDiskEntry(object, 0);
+    if(!entry || entry->fd < 0)
+        return 0;
+
+    size = diskEntrySize(object);
+    if(size < 0)
+        goto sync;
+
+    if(!diskRing && diskRingSetup() < 0)
+        goto sync;
+
+    n = 0;
+    for(k = 0; k < chunks; k++) {
+        i = offset / object->chunk_size + k;
+        j = object->chunks[i].size;
+        o = i * object->chunk_size + j;
+        if(j >= object->chunk_size)
+            continue;
+        if(o >= size)
+            break;
+        if(diskRing->inflight >= diskRing->entries)
+            break;
+        if(!object->chunks[i].data)
+            object->chunks[i].data = get_chunks(CHUNKS(object->chunk_size));
+        if(!object->chunks[i].data)
+            break;
+        r = malloc(sizeof(DiskReadRec));
+        if(r == NULL)
+            break;
+        r->fd = dup(entry->fd);
+        if(r->fd < 0) {
+            free(r);
+            break;
+        }
+        r->object = retainObject(object);
+        r->chunk = i;
+        r->offset = j;
+        r->len = MIN(object->chunk_size - j, size - o);
+        lockChunk(object, i);
+        object->disk_reads++;
+        diskRingQueue(r, object->chunks[i].data + j,
+                      entry->base + entry->body_offset + o);
+        n++;
+    }
+
+    if(n == 0)
+        goto sync;
+
+    diskRingSubmit();
+    return 0;
+
+ sync:
+#endif
+    return objectFillFromDisk(object, offset, chunks);
+}
+
+/* If the whole body of an object is on disk, return a fresh file
+   descriptor for it, so that it can be sent to the client without
+   going through the chunk array. */
+
+int
+diskEntryBodyFd(ObjectPtr object, off_t *body_offset_return)
+{
+    DiskCacheEntryPtr entry;
+    int fd;
+
+#ifndef HAVE_SENDFILE
+    return -1;
+#endif
+
+    if(!diskCacheSendfile)
+        return -1;
+
+    if(object->type != OBJECT_HTTP || object->length < 0 ||
+       (object->flags & (OBJECT_INITIAL | OBJECT_LINEAR)))
+        return -1;
+
+    entry = makeDiskEntry(object, 0);
+    if(!entry || entry == &negativeEntry)
+        return -1;
+
+    if(diskEntrySize(object) != object->length)
+        return -1;
+
+    /* The caller uses explicit offsets, so sharing the file position
+       with the entry is harmless. */
+    fd = dup(entry->fd);
+    if(fd < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't duplicate disk entry");
+        return -1;
+    }
+    *body_offset_return = entry->base + entry->body_offset;
+    return fd;
+}
+
 int 
 writeoutToDisk(ObjectPtr object, int upto, int max)
 {
@@ -1702,8 +2285,8 @@ reallyWriteoutToDisk(ObjectPtr object, int upto, int max)
             break;
         CHECK_ENTRY(entry);
         assert(entry->offset == offset + entry->body_offset);
-        i = offset / CHUNK_SIZE;
-        j = offset % CHUNK_SIZE;
+        i = offset / object->chunk_size;
+        j = offset % object->chunk_size;
         if(i >= object->numchunks)
             break;
         if(object->chunks[i].size <= j)
@@ -1722,7 +2305,7 @@ reallyWriteoutToDisk(ObjectPtr object, int upto, int max)
         bytes += rc;
         if(entry->size < offset)
             entry->size = offset;
-    } while(j + rc >= CHUNK_SIZE);
+    } while(j + rc >= object->chunk_size);
 
  done:
     CHECK_ENTRY(entry);
@@ -2429,7 +3012,7 @@ expireDiskObjects()
     FTS *fts;
     FTSENT *fe;
     int files = 0, considered = 0, unlinked = 0, truncated = 0;
-    int dirs = 0, rmdirs = 0;
+    int dirs = 0, rmdirs = 0, expired;
     long left = 0, total = 0;
 
     if(diskCacheRoot == NULL || 
@@ -2481,6 +3064,13 @@ expireDiskObjects()
                 continue;
             }
 
+            /* Skip the segment store, which is expired below, and the
+               disk index snapshot. */
+            if(strncmp(fe->fts_path, diskCacheRoot->string,
+                       diskCacheRoot->length) == 0 &&
+               fe->fts_path[diskCacheRoot->length] == '.')
+                continue;
+
             files++;
             left += expireFile(fe->fts_accpath, fe->fts_statp,
                                &considered, &unlinked, &truncated);
@@ -2494,6 +3084,10 @@ expireDiskObjects()
            "(%ldkB -> %ldkB).\n",
            files, considered, unlinked, truncated, total/1024, left/1024);
     printf("%d directories, %d removed.\n", dirs, rmdirs);
+
+    expired = segmentExpire(current_time.tv_sec - diskCacheUnlinkTime);
+    if(expired >= 0)
+        printf("%d segment entries removed.\n", expired);
     return;
 }
 
@@ -2558,4 +3152,16 @@ diskEntrySize(ObjectPtr object)
 {
     return -1;
 }
+
+int
+objectFillFromDiskAsync(ObjectPtr object, int offset, int chunks)
+{
+    return 0;
+}
+
+int
+diskEntryBodyFd(ObjectPtr object, off_t *body_offset_return)
+{
+    return -1;
+}
 #endif
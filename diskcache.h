@@ -36,6 +36,8 @@ typedef struct _DiskCacheEntry {
     short metadataDirty;
     struct _DiskCacheEntry *next;
     struct _DiskCacheEntry *previous;
+    off_t base;                 /* start of the entry within its file */
+    short segment;
 } *DiskCacheEntryPtr, DiskCacheEntryRec;
 
 typedef struct _DiskObject {
@@ -55,6 +57,9 @@ typedef struct _DiskObject {
 struct stat;
 
 extern int maxDiskCacheEntrySize;
+extern int diskCacheDirectoryPermissions;
+extern int diskCacheFilePermissions;
+extern int diskCacheUnlinkTime;
 
 void preinitDiskcache(void);
 void initDiskcache(void);
@@ -62,6 +67,8 @@ int destroyDiskEntry(ObjectPtr object, int);
 int diskEntrySize(ObjectPtr object);
 ObjectPtr objectGetFromDisk(ObjectPtr);
 int objectFillFromDisk(ObjectPtr object, int offset, int chunks);
+int objectFillFromDiskAsync(ObjectPtr object, int offset, int chunks);
+int diskEntryBodyFd(ObjectPtr object, off_t *body_offset_return);
 int writeoutMetadata(ObjectPtr object);
 int writeoutToDisk(ObjectPtr object, int upto, int max);
 void dirtyDiskEntry(ObjectPtr object);
@@ -0,0 +1,412 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "polipo.h"
+
+#ifndef NO_DISK_CACHE
+
+#include "md5import.h"
+
+int diskCacheIndex = 0;
+
+/* The index maps a hash of the name of a file, relative to
+   diskCacheRoot, to the size and modification time of the file.  It
+   only becomes authoritative once it's complete, either because it was
+   loaded from a snapshot or because the initial scan has finished.
+   The snapshot is only valid after a clean shutdown, and is removed
+   when loaded. */
+
+#define DISK_INDEX_MAGIC 0x31494450     /* "PDI1" */
+#define DISK_INDEX_SCAN_STEP 256
+
+typedef struct _DiskIndexEntry {
+    unsigned long long hash;
+    unsigned int size;
+    unsigned int time;
+} DiskIndexEntryRec, *DiskIndexEntryPtr;
+
+typedef struct _DiskIndexHeader {
+    unsigned int magic;
+    unsigned int count;
+} DiskIndexHeaderRec;
+
+static DiskIndexEntryPtr diskIndex = NULL;
+static int diskIndexSize = 0;
+static int diskIndexCount = 0;
+static int diskIndexComplete = 0;
+static FTS *diskIndexFts = NULL;
+
+static int diskIndexScanHandler(TimeEventHandlerPtr);
+
+void
+preinitDiskIndex()
+{
+    CONFIG_VARIABLE(diskCacheIndex, CONFIG_BOOLEAN,
+                    "Keep an index of the on-disk cache in memory.");
+}
+
+/* Zero marks an empty slot. */
+static unsigned long long
+diskIndexHash(const char *name, int len)
+{
+    MD5_CTX ctx;
+    unsigned long long hash;
+
+    MD5Init(&ctx);
+    MD5Update(&ctx, (unsigned char*)name, len);
+    MD5Final(&ctx);
+    memcpy(&hash, ctx.digest, sizeof(hash));
+    return hash ? hash : 1;
+}
+
+static DiskIndexEntryPtr
+diskIndexFind(unsigned long long hash)
+{
+    int i = hash & (diskIndexSize - 1);
+
+    while(diskIndex[i].hash != 0) {
+        if(diskIndex[i].hash == hash)
+            return &diskIndex[i];
+        i = (i + 1) & (diskIndexSize - 1);
+    }
+    return &diskIndex[i];
+}
+
+static int
+diskIndexResize(int size)
+{
+    DiskIndexEntryPtr old = diskIndex, entry;
+    int i, old_size = diskIndexSize;
+
+    diskIndex = calloc(size, sizeof(DiskIndexEntryRec));
+    if(diskIndex == NULL) {
+        do_log(L_ERROR, "Couldn't allocate disk index.\n");
+        diskIndex = old;
+        return -1;
+    }
+    diskIndexSize = size;
+    for(i = 0; i < old_size; i++) {
+        if(old[i].hash != 0) {
+            entry = diskIndexFind(old[i].hash);
+            *entry = old[i];
+        }
+    }
+    free(old);
+    return 1;
+}
+
+static void
+diskIndexInsert(unsigned long long hash, unsigned int size, unsigned int time)
+{
+    DiskIndexEntryPtr entry;
+
+    /* Keep the load factor below one half. */
+    if(2 * (diskIndexCount + 1) > diskIndexSize) {
+        if(diskIndexResize(MAX(2 * diskIndexSize, 4096)) < 0) {
+            /* We can no longer answer negative lookups. */
+            diskIndexComplete = 0;
+            return;
+        }
+    }
+
+    entry = diskIndexFind(hash);
+    if(entry->hash == 0) {
+        entry->hash = hash;
+        diskIndexCount++;
+    }
+    entry->size = size;
+    entry->time = time;
+}
+
+/* Linear probing with backward-shift deletion, so that we never need
+   tombstones. */
+static void
+diskIndexDelete(unsigned long long hash)
+{
+    int i, j, k;
+
+    if(diskIndexSize == 0)
+        return;
+
+    i = diskIndexFind(hash) - diskIndex;
+    if(diskIndex[i].hash == 0)
+        return;
+
+    j = i;
+    while(1) {
+        j = (j + 1) & (diskIndexSize - 1);
+        if(diskIndex[j].hash == 0)
+            break;
+        k = diskIndex[j].hash & (diskIndexSize - 1);
+        if((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            diskIndex[i] = diskIndex[j];
+            i = j;
+        }
+    }
+    diskIndex[i].hash = 0;
+    diskIndexCount--;
+}
+
+/* Filenames are hashed relative to diskCacheRoot. */
+static int
+diskIndexName(const char *filename, const char **name_return)
+{
+    if(diskCacheRoot == NULL ||
+       strncmp(filename, diskCacheRoot->string, diskCacheRoot->length) != 0)
+        return -1;
+    *name_return = filename + diskCacheRoot->length;
+    return strlen(*name_return);
+}
+
+static int
+diskIndexFilename(char *buf, int n)
+{
+    int rc;
+    rc = snprintf(buf, n, "%s%s", diskCacheRoot->string, DISK_INDEX_FILE);
+    if(rc < 0 || rc >= n)
+        return -1;
+    return rc;
+}
+
+static int
+diskIndexLoad()
+{
+    char buf[1024];
+    FILE *f;
+    DiskIndexHeaderRec h;
+    DiskIndexEntryRec e;
+    unsigned int i;
+    int rc;
+
+    if(diskIndexFilename(buf, 1024) < 0)
+        return -1;
+    f = fopen(buf, "rb");
+    if(f == NULL)
+        return -1;
+
+    /* A crash after this point must cause a rescan. */
+    unlink(buf);
+
+    rc = fread(&h, sizeof(h), 1, f);
+    if(rc != 1 || h.magic != DISK_INDEX_MAGIC)
+        goto fail;
+
+    for(i = 0; i < h.count; i++) {
+        rc = fread(&e, sizeof(e), 1, f);
+        if(rc != 1 || e.hash == 0)
+            goto fail;
+        diskIndexInsert(e.hash, e.size, e.time);
+    }
+    fclose(f);
+    return 1;
+
+ fail:
+    do_log(L_WARN, "Couldn't read disk index %s.\n", buf);
+    fclose(f);
+    return -1;
+}
+
+void
+diskIndexSave()
+{
+    char buf[1024], tmp[1024];
+    FILE *f;
+    DiskIndexHeaderRec h;
+    int i, rc, fd;
+
+    if(!diskIndexComplete)
+        return;
+
+    if(diskIndexFilename(buf, 1024) < 0)
+        return;
+    rc = snprintf(tmp, 1024, "%s.tmp", buf);
+    if(rc < 0 || rc >= 1024)
+        return;
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+              diskCacheFilePermissions);
+    if(fd < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't create %s", tmp);
+        return;
+    }
+    f = fdopen(fd, "wb");
+    if(f == NULL) {
+        do_log_error(L_ERROR, errno, "Couldn't create %s", tmp);
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+
+    h.magic = DISK_INDEX_MAGIC;
+    h.count = diskIndexCount;
+    fwrite(&h, sizeof(h), 1, f);
+    for(i = 0; i < diskIndexSize; i++) {
+        if(diskIndex[i].hash != 0)
+            fwrite(&diskIndex[i], sizeof(DiskIndexEntryRec), 1, f);
+    }
+
+    rc = ferror(f);
+    if(fclose(f) != 0 || rc) {
+        do_log(L_ERROR, "Couldn't write disk index.\n");
+        unlink(tmp);
+        return;
+    }
+    rc = rename(tmp, buf);
+    if(rc < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't rename %s", tmp);
+        unlink(tmp);
+    }
+}
+
+void
+initDiskIndex()
+{
+    char *fts_argv[2];
+
+    if(!diskCacheIndex || diskCacheRoot == NULL || diskCacheRoot->length <= 0)
+        return;
+
+    if(numWorkers > 1) {
+        do_log(L_WARN, "Disabling disk index: "
+               "it cannot be shared between workers.\n");
+        return;
+    }
+
+    if(diskIndexResize(4096) < 0)
+        return;
+
+    if(diskIndexLoad() >= 0) {
+        diskIndexComplete = 1;
+        return;
+    }
+
+    /* Entries found so far are kept, since the scan only adds. */
+    fts_argv[0] = diskCacheRoot->string;
+    fts_argv[1] = NULL;
+    diskIndexFts = fts_open(fts_argv, FTS_LOGICAL, NULL);
+    if(diskIndexFts == NULL) {
+        do_log_error(L_ERROR, errno, "Couldn't fts_open disk cache");
+        return;
+    }
+    scheduleTimeEvent(0, diskIndexScanHandler, 0, NULL);
+}
+
+/* Scan the disk cache a little at a time, so as not to delay clients. */
+static int
+diskIndexScanHandler(TimeEventHandlerPtr event)
+{
+    FTSENT *fe;
+    const char *name;
+    int i, len;
+
+    for(i = 0; i < DISK_INDEX_SCAN_STEP; i++) {
+        fe = fts_read(diskIndexFts);
+        if(fe == NULL)
+            break;
+        if(fe->fts_info != FTS_F)
+            continue;
+        len = diskIndexName(fe->fts_path, &name);
+        /* Skip the segment store and the snapshot itself. */
+        if(len <= 0 || name[0] == '.')
+            continue;
+        diskIndexInsert(diskIndexHash(name, len),
+                        fe->fts_statp->st_size, fe->fts_statp->st_mtime);
+    }
+
+    if(i < DISK_INDEX_SCAN_STEP) {
+        fts_close(diskIndexFts);
+        diskIndexFts = NULL;
+        diskIndexComplete = 1;
+        do_log(L_INFO, "Disk index complete, %d entries.\n", diskIndexCount);
+        return 1;
+    }
+
+    scheduleTimeEvent(0, diskIndexScanHandler, 0, NULL);
+    return 1;
+}
+
+/* Returns 1 if the file might exist, 0 if it certainly doesn't, -1 if
+   we don't know. */
+int
+diskIndexLookup(const char *filename)
+{
+    const char *name;
+    int len;
+
+    if(!diskIndexComplete)
+        return -1;
+    len = diskIndexName(filename, &name);
+    if(len < 0)
+        return -1;
+    return diskIndexFind(diskIndexHash(name, len))->hash != 0;
+}
+
+void
+diskIndexAdd(const char *filename, off_t size)
+{
+    const char *name;
+    int len;
+
+    if(diskIndexSize == 0)
+        return;
+    len = diskIndexName(filename, &name);
+    if(len < 0)
+        return;
+    diskIndexInsert(diskIndexHash(name, len), size, current_time.tv_sec);
+}
+
+void
+diskIndexRemove(const char *filename)
+{
+    const char *name;
+    int len;
+
+    if(diskIndexSize == 0)
+        return;
+    len = diskIndexName(filename, &name);
+    if(len < 0)
+        return;
+    diskIndexDelete(diskIndexHash(name, len));
+}
+
+#else
+
+void
+preinitDiskIndex()
+{
+    return;
+}
+
+void
+initDiskIndex()
+{
+    return;
+}
+
+void
+diskIndexSave()
+{
+    return;
+}
+
+#endif
@@ -29,8 +29,10 @@ static int exitFlag = 0;
 #endif
 static int in_signalCondition = 0;
 
-static TimeEventHandlerPtr timeEventQueue;
-static TimeEventHandlerPtr timeEventQueueLast;
+static TimeEventHandlerPtr *timeEventHeap = NULL;
+static int timeEventHeapSize = 0;
+static int timeEventNum = 0;
+static unsigned int timeEventSerial = 0;
 
 struct timeval current_time;
 struct timeval null_time = {0,0};
@@ -39,6 +41,14 @@ static int fdEventSize = 0;
 static int fdEventNum = 0;
 static struct pollfd *poll_fds = NULL;
 static FdEventHandlerPtr *fdEvents = NULL, *fdEventsLast = NULL;
+/* Maps a file descriptor to its slot in poll_fds, or -1. */
+static int *fdIndex = NULL;
+static int fdIndexSize = 0;
+#ifdef HAVE_EPOLL
+/* If epoll_fd is negative, we fall back to poll. */
+static int epoll_fd = -1;
+static struct epoll_event *epoll_events = NULL;
+#endif
 int diskIsClean = 1;
 
 static int fds_invalid = 0;
@@ -134,13 +144,24 @@ initEvents()
     sigaction(SIGUSR2, &sa, NULL);
 #endif
 
-    timeEventQueue = NULL;
-    timeEventQueueLast = NULL;
+    timeEventHeap = NULL;
+    timeEventHeapSize = 0;
+    timeEventNum = 0;
     fdEventSize = 0;
     fdEventNum = 0;
     poll_fds = NULL;
     fdEvents = NULL;
     fdEventsLast = NULL;
+    fdIndex = NULL;
+    fdIndexSize = 0;
+
+#ifdef HAVE_EPOLL
+    epoll_events = NULL;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd < 0)
+        do_log_error(L_WARN, errno,
+                     "Couldn't create epoll instance, using poll instead");
+#endif
 }
 
 void
@@ -198,54 +219,113 @@ interestingSignals(sigset_t *ss)
 void
 timeToSleep(struct timeval *time)
 {
-    if(!timeEventQueue) {
+    if(timeEventNum == 0) {
         time->tv_sec = ~0L;
         time->tv_usec = ~0L;
     } else {
-        *time = timeEventQueue->time;
+        *time = timeEventHeap[0]->time;
+    }
+}
+
+/* The time event queue is a 4-ary heap ordered by expiry time, which
+   makes both scheduling and cancelling logarithmic. */
+
+static inline int
+timeEventBefore(TimeEventHandlerPtr e1, TimeEventHandlerPtr e2)
+{
+    int c = timeval_cmp(&e1->time, &e2->time);
+    if(c != 0)
+        return c < 0;
+    /* Events scheduled for the same time run in the order in which
+       they were scheduled. */
+    return (int)(e1->serial - e2->serial) < 0;
+}
+
+static inline void
+timeEventHeapSet(int i, TimeEventHandlerPtr event)
+{
+    timeEventHeap[i] = event;
+    event->index = i;
+}
+
+static void
+timeEventSiftUp(int i)
+{
+    TimeEventHandlerPtr event = timeEventHeap[i];
+    int parent;
+
+    while(i > 0) {
+        parent = (i - 1) / 4;
+        if(!timeEventBefore(event, timeEventHeap[parent]))
+            break;
+        timeEventHeapSet(i, timeEventHeap[parent]);
+        i = parent;
+    }
+    timeEventHeapSet(i, event);
+}
+
+static void
+timeEventSiftDown(int i)
+{
+    TimeEventHandlerPtr event = timeEventHeap[i];
+    TimeEventHandlerPtr min;
+    int j, child;
+
+    while(1) {
+        child = -1;
+        min = event;
+        for(j = 4 * i + 1; j <= 4 * i + 4 && j < timeEventNum; j++) {
+            if(timeEventBefore(timeEventHeap[j], min)) {
+                child = j;
+                min = timeEventHeap[j];
+            }
+        }
+        if(child < 0)
+            break;
+        timeEventHeapSet(i, min);
+        i = child;
     }
+    timeEventHeapSet(i, event);
+}
+
+static void
+timeEventHeapRemove(int i)
+{
+    TimeEventHandlerPtr last;
+
+    assert(i >= 0 && i < timeEventNum);
+    timeEventHeap[i]->index = -1;
+    timeEventNum--;
+    if(i == timeEventNum)
+        return;
+    last = timeEventHeap[timeEventNum];
+    timeEventHeapSet(i, last);
+    if(i > 0 && timeEventBefore(last, timeEventHeap[(i - 1) / 4]))
+        timeEventSiftUp(i);
+    else
+        timeEventSiftDown(i);
 }
 
 static TimeEventHandlerPtr
 enqueueTimeEvent(TimeEventHandlerPtr event)
 {
-    TimeEventHandlerPtr otherevent;
-
-    /* We try to optimise two cases -- the event happens very soon, or
-       it happens after most of the other events. */
-    if(timeEventQueue == NULL ||
-       timeval_cmp(&event->time, &timeEventQueue->time) < 0) {
-        /* It's the first event */
-        event->next = timeEventQueue;
-        event->previous = NULL;
-        if(timeEventQueue) {
-            timeEventQueue->previous = event;
-        } else {
-            timeEventQueueLast = event;
+    if(timeEventNum >= timeEventHeapSize) {
+        TimeEventHandlerPtr *new_heap;
+        int new_size = 2 * timeEventHeapSize + 16;
+        new_heap = realloc(timeEventHeap,
+                           new_size * sizeof(TimeEventHandlerPtr));
+        if(new_heap == NULL) {
+            free(event);
+            return NULL;
         }
-        timeEventQueue = event;
-    } else if(timeval_cmp(&event->time, &timeEventQueueLast->time) >= 0) {
-        /* It's the last one */
-        event->next = NULL;
-        event->previous = timeEventQueueLast;
-        timeEventQueueLast->next = event;
-        timeEventQueueLast = event;
-    } else {
-        /* Walk from the end */
-        otherevent = timeEventQueueLast;
-        while(otherevent->previous &&
-              timeval_cmp(&event->time, &otherevent->previous->time) < 0) {
-            otherevent = otherevent->previous;
-        }
-        event->next = otherevent;
-        event->previous = otherevent->previous;
-        if(otherevent->previous) {
-            otherevent->previous->next = event;
-        } else {
-            timeEventQueue = event;
-        }
-        otherevent->previous = event;
+        timeEventHeap = new_heap;
+        timeEventHeapSize = new_size;
     }
+
+    event->serial = timeEventSerial++;
+    timeEventHeap[timeEventNum] = event;
+    timeEventNum++;
+    timeEventSiftUp(timeEventNum - 1);
     return event;
 }
 
@@ -280,31 +360,111 @@ scheduleTimeEvent(int seconds,
     else if(dsize > 0)
         memcpy(event->data, data, dsize);
 
-    return enqueueTimeEvent(event);
+    event = enqueueTimeEvent(event);
+    if(event == NULL) {
+        do_log(L_ERROR, "Couldn't grow time event queue -- "
+               "discarding all objects.\n");
+        exitFlag = 2;
+    }
+    return event;
 }
 
 void
 cancelTimeEvent(TimeEventHandlerPtr event)
 {
-    if(event == timeEventQueue)
-        timeEventQueue = event->next;
-    if(event == timeEventQueueLast)
-        timeEventQueueLast = event->previous;
-    if(event->next)
-        event->next->previous = event->previous;
-    if(event->previous)
-        event->previous->next = event->next;
+    assert(timeEventHeap[event->index] == event);
+    timeEventHeapRemove(event->index);
     free(event);
 }
 
+static int
+fdEventIndex(int fd)
+{
+    if(fd < 0 || fd >= fdIndexSize)
+        return -1;
+    return fdIndex[fd];
+}
+
+static int
+setFdEventIndex(int fd, int i)
+{
+    if(fd >= fdIndexSize) {
+        int *new_fdIndex;
+        int new_size = MAX(fd + 1, 2 * fdIndexSize);
+        int j;
+
+        new_fdIndex = realloc(fdIndex, new_size * sizeof(int));
+        if(!new_fdIndex)
+            return -1;
+        for(j = fdIndexSize; j < new_size; j++)
+            new_fdIndex[j] = -1;
+        fdIndex = new_fdIndex;
+        fdIndexSize = new_size;
+    }
+    fdIndex[fd] = i;
+    return 1;
+}
+
+#ifdef HAVE_EPOLL
+static int
+epollToPoll(unsigned int events)
+{
+    return
+        ((events & EPOLLIN) ? POLLIN : 0) |
+        ((events & EPOLLOUT) ? POLLOUT : 0) |
+        ((events & EPOLLERR) ? POLLERR : 0) |
+        ((events & EPOLLHUP) ? POLLHUP : 0);
+}
+
+static int
+epollControl(int op, int fd, int poll_events)
+{
+    struct epoll_event ev;
+    int rc;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events =
+        ((poll_events & POLLIN) ? EPOLLIN : 0) |
+        ((poll_events & POLLOUT) ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+    rc = epoll_ctl(epoll_fd, op, fd, &ev);
+    /* Closing an fd silently removes it from the epoll set, so if it
+       was closed and reused while stale handlers were still registered,
+       our idea of what is in the set is wrong.  Poll would have
+       returned POLLNVAL; say so, and repair the set. */
+    if(rc < 0 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+        do_log(L_ERROR, "File descriptor %d was closed while registered.\n",
+               fd);
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    } else if(rc < 0 && op == EPOLL_CTL_ADD && errno == EEXIST) {
+        do_log(L_ERROR, "File descriptor %d was already in the epoll set.\n",
+               fd);
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    }
+    return rc;
+}
+#endif
+
+static void
+setPollEvents(int i, int events)
+{
+#ifdef HAVE_EPOLL
+    if(epoll_fd >= 0 &&
+       ((poll_fds[i].events ^ events) & (POLLIN | POLLOUT))) {
+        int rc;
+        rc = epollControl(EPOLL_CTL_MOD, poll_fds[i].fd, events);
+        if(rc < 0)
+            do_log_error(L_ERROR, errno, "Couldn't modify epoll event");
+    }
+#endif
+    poll_fds[i].events = events;
+}
+
 int
 allocateFdEventNum(int fd)
 {
     int i;
-    if(fdEventNum < fdEventSize) {
-        i = fdEventNum;
-        fdEventNum++;
-    } else {
+    if(fdEventNum >= fdEventSize) {
         struct pollfd *new_poll_fds;
         FdEventHandlerPtr *new_fdEvents, *new_fdEventsLast;
         int new_size = 3 * fdEventSize / 2 + 1;
@@ -312,22 +472,46 @@ allocateFdEventNum(int fd)
         new_poll_fds = realloc(poll_fds, new_size * sizeof(struct pollfd));
         if(!new_poll_fds)
             return -1;
+        poll_fds = new_poll_fds;
         new_fdEvents = realloc(fdEvents, new_size * sizeof(FdEventHandlerPtr));
         if(!new_fdEvents)
             return -1;
+        fdEvents = new_fdEvents;
         new_fdEventsLast = realloc(fdEventsLast, 
                                    new_size * sizeof(FdEventHandlerPtr));
         if(!new_fdEventsLast)
             return -1;
-
-        poll_fds = new_poll_fds;
-        fdEvents = new_fdEvents;
         fdEventsLast = new_fdEventsLast;
+#ifdef HAVE_EPOLL
+        if(epoll_fd >= 0) {
+            struct epoll_event *new_epoll_events;
+            new_epoll_events = realloc(epoll_events,
+                                       new_size * sizeof(struct epoll_event));
+            if(!new_epoll_events)
+                return -1;
+            epoll_events = new_epoll_events;
+        }
+#endif
         fdEventSize = new_size;
-        i = fdEventNum;
-        fdEventNum++;
     }
 
+    i = fdEventNum;
+    if(setFdEventIndex(fd, i) < 0)
+        return -1;
+
+#ifdef HAVE_EPOLL
+    if(epoll_fd >= 0) {
+        int rc;
+        rc = epollControl(EPOLL_CTL_ADD, fd, 0);
+        if(rc < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't add fd to epoll set");
+            fdIndex[fd] = -1;
+            return -1;
+        }
+    }
+#endif
+
+    fdEventNum++;
     poll_fds[i].fd = fd;
     poll_fds[i].events = POLLERR | POLLHUP | POLLNVAL;
     poll_fds[i].revents = 0;
@@ -337,16 +521,33 @@ allocateFdEventNum(int fd)
     return i;
 }
 
+/* Slots are not ordered, so we fill the hole with the last slot rather
+   than shifting the whole array. */
+
 void
 deallocateFdEventNum(int i)
 {
-    if(i < fdEventNum - 1) {
-        memmove(&poll_fds[i], &poll_fds[i + 1], 
-                (fdEventNum - i - 1) * sizeof(struct pollfd));
-        memmove(&fdEvents[i], &fdEvents[i + 1],
-                (fdEventNum - i - 1) * sizeof(FdEventHandlerPtr));
-        memmove(&fdEventsLast[i], &fdEventsLast[i + 1],
-                (fdEventNum - i - 1) * sizeof(FdEventHandlerPtr));
+    int fd = poll_fds[i].fd;
+    int last = fdEventNum - 1;
+
+#ifdef HAVE_EPOLL
+    if(epoll_fd >= 0) {
+        struct epoll_event ev;
+        int rc;
+        /* The fd may already have been closed, which removes it
+           from the epoll set. */
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+        if(rc < 0 && errno != EBADF && errno != ENOENT)
+            do_log_error(L_ERROR, errno, "Couldn't remove fd from epoll set");
+    }
+#endif
+
+    fdIndex[fd] = -1;
+    if(i < last) {
+        poll_fds[i] = poll_fds[last];
+        fdEvents[i] = fdEvents[last];
+        fdEventsLast[i] = fdEventsLast[last];
+        fdIndex[poll_fds[i].fd] = i;
     }
     fdEventNum--;
     fds_invalid = 1;
@@ -384,11 +585,8 @@ registerFdEventHelper(FdEventHandlerPtr event)
     int i;
     int fd = event->fd;
 
-    for(i = 0; i < fdEventNum; i++)
-        if(poll_fds[i].fd == fd)
-            break;
-
-    if(i >= fdEventNum)
+    i = fdEventIndex(fd);
+    if(i < 0)
         i = allocateFdEventNum(fd);
     if(i < 0) {
         free(event);
@@ -403,7 +601,7 @@ registerFdEventHelper(FdEventHandlerPtr event)
         fdEventsLast[i]->next = event;
     }
     fdEventsLast[i] = event;
-    poll_fds[i].events |= event->poll_events;
+    setPollEvents(i, poll_fds[i].events | event->poll_events);
 
     return event;
 }
@@ -456,8 +654,8 @@ unregisterFdEventI(FdEventHandlerPtr event, int i)
     if(fdEvents[i] == NULL) {
         deallocateFdEventNum(i);
     } else {
-        poll_fds[i].events = recomputePollEvents(fdEvents[i]) | 
-            POLLERR | POLLHUP | POLLNVAL;
+        setPollEvents(i, recomputePollEvents(fdEvents[i]) |
+                      POLLERR | POLLHUP | POLLNVAL);
     }
 }
 
@@ -466,13 +664,10 @@ unregisterFdEvent(FdEventHandlerPtr event)
 {
     int i;
 
-    for(i = 0; i < fdEventNum; i++) {
-        if(poll_fds[i].fd == event->fd) {
-            unregisterFdEventI(event, i);
-            return;
-        }
-    }
-    abort();
+    i = fdEventIndex(event->fd);
+    if(i < 0)
+        abort();
+    unregisterFdEventI(event, i);
 }
 
 void
@@ -481,14 +676,10 @@ runTimeEventQueue()
     TimeEventHandlerPtr event;
     int done;
 
-    while(timeEventQueue && 
-          timeval_cmp(&timeEventQueue->time, &current_time) <= 0) {
-        event = timeEventQueue;
-        timeEventQueue = event->next;
-        if(timeEventQueue)
-            timeEventQueue->previous = NULL;
-        else
-            timeEventQueueLast = NULL;
+    while(timeEventNum > 0 &&
+          timeval_cmp(&timeEventHeap[0]->time, &current_time) <= 0) {
+        event = timeEventHeap[0];
+        timeEventHeapRemove(0);
         done = event->handler(event);
         assert(done);
         free(event);
@@ -554,12 +745,8 @@ pokeFdEventHandler(TimeEventHandlerPtr tevent)
     FdEventHandlerPtr event, next;
     int i;
 
-    for(i = 0; i < fdEventNum; i++) {
-        if(poll_fds[i].fd == fd)
-            break;
-    }
-
-    if(i >= fdEventNum)
+    i = fdEventIndex(fd);
+    if(i < 0)
         return 1;
 
     event = fdEvents[i];
@@ -598,6 +785,68 @@ pokeFdEvent(int fd, int status, int what)
     }
 }
 
+static int
+pollFdEvents(int timeout)
+{
+#ifdef HAVE_EPOLL
+    if(epoll_fd >= 0) {
+        struct epoll_event dummy;
+        if(fdEventNum == 0)
+            return epoll_wait(epoll_fd, &dummy, 1, timeout);
+        return epoll_wait(epoll_fd, epoll_events, fdEventNum, timeout);
+    }
+#endif
+    return poll(poll_fds, fdEventNum, timeout);
+}
+
+/* Returns 1 if the set of file descriptors has changed. */
+
+static int
+dispatchFdEvent(int i, int revents)
+{
+    FdEventHandlerPtr event;
+    int done;
+
+    event = findEvent(revents, fdEvents[i]);
+    if(!event)
+        return 0;
+    done = event->handler(0, event);
+    if(done) {
+        if(fds_invalid)
+            unregisterFdEvent(event);
+        else
+            unregisterFdEventI(event, i);
+    }
+    return fds_invalid;
+}
+
+#ifdef HAVE_EPOLL
+/* A closed fd that is still registered is never reported by epoll,
+   so its handlers would wait forever.  When idle, look for such fds
+   at most once a minute, and wake their handlers with an error as
+   poll would with POLLNVAL. */
+
+static void
+epollCheckStale(void)
+{
+    static time_t last = 0;
+    int i;
+
+    if(current_time.tv_sec - last < 60)
+        return;
+    last = current_time.tv_sec;
+
+    for(i = 0; i < fdEventNum; i++) {
+        if(fcntl(poll_fds[i].fd, F_GETFD) >= 0 || errno != EBADF)
+            continue;
+        do_log(L_ERROR, "File descriptor %d was closed while registered.\n",
+               poll_fds[i].fd);
+        if(dispatchFdEvent(i, POLLERR | POLLHUP))
+            return;
+    }
+}
+#endif
+
 int
 workToDo()
 {
@@ -611,7 +860,7 @@ workToDo()
     gettimeofday(&current_time, NULL);
     if(timeval_cmp(&sleep_time, &current_time) <= 0)
         return 1;
-    rc = poll(poll_fds, fdEventNum, 0);
+    rc = pollFdEvents(0);
     if(rc < 0) {
         do_log_error(L_ERROR, errno, "Couldn't poll");
         return 1;
@@ -623,8 +872,7 @@ void
 eventLoop()
 {
     struct timeval sleep_time, timeout;
-    int rc, i, done, n;
-    FdEventHandlerPtr event;
+    int rc, i, n;
     int fd0;
 
     gettimeofday(&current_time, NULL);
@@ -636,11 +884,15 @@ eventLoop()
                 reopenLog();
             if(exitFlag >= 2) {
                 discardObjects(1, 0);
-                if(exitFlag >= 3)
+                segmentCheckpoint();
+                if(exitFlag >= 3) {
+                    diskIndexSave();
                     return;
+                }
                 free_chunk_arenas();
             } else {
                 writeoutObjects(1);
+                segmentCheckpoint();
             }
             initForbidden();
             exitFlag = 0;
@@ -648,8 +900,7 @@ eventLoop()
 
         timeToSleep(&sleep_time);
         if(sleep_time.tv_sec == -1) {
-            rc = poll(poll_fds, fdEventNum, 
-                      diskIsClean ? -1 : idleTime * 1000);
+            rc = pollFdEvents(diskIsClean ? -1 : idleTime * 1000);
         } else if(timeval_cmp(&sleep_time, &current_time) <= 0) {
             runTimeEventQueue();
             continue;
@@ -662,8 +913,8 @@ eventLoop()
                 int t;
                 timeval_minus(&timeout, &sleep_time, &current_time);
                 t = timeout.tv_sec * 1000 + (timeout.tv_usec + 999) / 1000;
-                rc = poll(poll_fds, fdEventNum,
-                          diskIsClean ? t : MIN(idleTime * 1000, t));
+                rc = pollFdEvents(diskIsClean ?
+                                  t : MIN(idleTime * 1000, t));
             }
         }
 
@@ -686,6 +937,10 @@ eventLoop()
         }
 
         if(rc == 0) {
+#ifdef HAVE_EPOLL
+            if(epoll_fd >= 0)
+                epollCheckStale();
+#endif
             if(!diskIsClean) {
                 timeToSleep(&sleep_time);
                 if(timeval_cmp(&sleep_time, &current_time) > 0)
@@ -698,6 +953,25 @@ eventLoop()
            assume that something changed whenever we see any activity. */
         diskIsClean = 0;
 
+#ifdef HAVE_EPOLL
+        if(epoll_fd >= 0) {
+            /* epoll only returns the ready fds, so this is linear in
+               the number of active connections. */
+            fd0 = (current_time.tv_usec ^ (current_time.tv_usec >> 16)) % rc;
+            for(i = 0; i < rc; i++) {
+                struct epoll_event *ev = &epoll_events[(i + fd0) % rc];
+                int j = fdEventIndex(ev->data.fd);
+                if(j < 0)
+                    continue;
+                if(dispatchFdEvent(j, epollToPoll(ev->events))) {
+                    fds_invalid = 0;
+                    goto again;
+                }
+            }
+            continue;
+        }
+#endif
+
         fd0 = 
             (current_time.tv_usec ^ (current_time.tv_usec >> 16)) % fdEventNum;
         n = rc;
@@ -707,17 +981,7 @@ eventLoop()
                 break;
             if(poll_fds[j].revents) {
                 n--;
-                event = findEvent(poll_fds[j].revents, fdEvents[j]);
-                if(!event)
-                    continue;
-                done = event->handler(0, event);
-                if(done) {
-                    if(fds_invalid)
-                        unregisterFdEvent(event);
-                    else
-                        unregisterFdEventI(event, j);
-                }
-                if(fds_invalid) {
+                if(dispatchFdEvent(j, poll_fds[j].revents)) {
                     fds_invalid = 0;
                     goto again;
                 } 
@@ -832,3 +1096,91 @@ polipoExit()
 {
     exitFlag = 3;
 }
+
+#ifdef HAVE_FORK
+/* Fork n worker processes, each of which will run its own event loop.
+   Returns the worker's index in the workers; in the parent, supervises
+   the workers, forwarding any signals it receives, and returns -1 once
+   they have all exited. */
+
+int
+forkWorkers(int n)
+{
+    pid_t *pids;
+    pid_t pid;
+    int i, live, status;
+
+    assert(fdEventNum == 0);
+
+    pids = malloc(n * sizeof(pid_t));
+    if(pids == NULL) {
+        do_log(L_ERROR, "Couldn't allocate workers.\n");
+        exit(1);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    for(i = 0; i < n; i++) {
+        pid = fork();
+        if(pid < 0) {
+            do_log_error(L_ERROR, errno, "Couldn't fork worker");
+            if(i == 0)
+                exit(1);
+            n = i;
+            break;
+        }
+        if(pid == 0) {
+            free(pids);
+#ifdef HAVE_EPOLL
+            /* An epoll instance is shared across fork. */
+            if(epoll_fd >= 0) {
+                close(epoll_fd);
+                epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+                if(epoll_fd < 0)
+                    do_log_error(L_WARN, errno,
+                                 "Couldn't create epoll instance, "
+                                 "using poll instead");
+            }
+#endif
+            return i;
+        }
+        pids[i] = pid;
+    }
+
+    do_log(L_INFO, "Started %d workers.\n", n);
+
+    live = n;
+    while(live > 0) {
+        pid = wait(&status);
+        if(pid < 0) {
+            if(errno == EINTR) {
+                int sig;
+                if(!exitFlag)
+                    continue;
+                sig = exitFlag == 1 ? SIGUSR1 :
+                    exitFlag == 2 ? SIGUSR2 : SIGTERM;
+                exitFlag = 0;
+                for(i = 0; i < n; i++)
+                    if(pids[i] > 0)
+                        kill(pids[i], sig);
+                continue;
+            }
+            do_log_error(L_ERROR, errno, "Couldn't wait for workers");
+            break;
+        }
+        for(i = 0; i < n; i++) {
+            if(pids[i] == pid) {
+                pids[i] = -1;
+                live--;
+                if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                    do_log(L_ERROR, "Worker %d (pid %d) died.\n",
+                           i, (int)pid);
+                break;
+            }
+        }
+    }
+    free(pids);
+    return -1;
+}
+#endif
@@ -26,13 +26,14 @@ extern int diskIsClean;
 
 typedef struct _TimeEventHandler {
     struct timeval time;
-    struct _TimeEventHandler *previous, *next;
+    int index;
+    unsigned int serial;
     int (*handler)(struct _TimeEventHandler*);
     char data[1];
 } TimeEventHandlerRec, *TimeEventHandlerPtr;
 
 typedef struct _FdEventHandler {
-    short fd;
+    int fd;
     short poll_events;
     struct _FdEventHandler *previous, *next;
     int (*handler)(int, struct _FdEventHandler*);
@@ -88,3 +89,6 @@ conditionWait(ConditionPtr condition,
 void unregisterConditionHandler(ConditionHandlerPtr);
 void abortConditionHandler(ConditionHandlerPtr);
 void polipoExit(void);
+#ifdef HAVE_FORK
+int forkWorkers(int n);
+#endif
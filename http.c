@@ -277,14 +277,16 @@ httpTimeoutHandler(TimeEventHandlerPtr event)
 {
     HTTPConnectionPtr connection = *(HTTPConnectionPtr*)event->data;
 
+    connection->timeout = NULL;
     if(connection->fd >= 0) {
         int rc;
         rc = shutdown(connection->fd, 2);
         if(rc < 0 && errno != ENOTCONN)
                 do_log_error(L_ERROR, errno, "Timeout: shutdown failed");
         pokeFdEvent(connection->fd, -EDOTIMEOUT, POLLIN | POLLOUT);
+    } else if(connection->h2stream) {
+        h2Timeout(connection);
     }
-    connection->timeout = NULL;
     return 1;
 }
 
@@ -300,6 +302,8 @@ httpWriteObjectHeaders(char *buf, int offset, int len,
     cache_control.s_maxage = object->s_maxage;
     cache_control.max_stale = -1;
     cache_control.min_fresh = -1;
+    cache_control.stale_while_revalidate = object->stale_while_revalidate;
+    cache_control.stale_if_error = object->stale_if_error;
 
     if(from <= 0 && to < 0) {
         if(object->length >= 0) {
@@ -466,6 +470,16 @@ httpPrintCacheControl(char *buf, int offset, int len,
             n = snnprintf(buf, n, len, "max-stale=%d",
                           cache_control->min_fresh);
         }
+        if(cache_control->stale_while_revalidate >= 0) {
+            PRINT_SEP();
+            n = snnprintf(buf, n, len, "stale-while-revalidate=%d",
+                          cache_control->stale_while_revalidate);
+        }
+        if(cache_control->stale_if_error >= 0) {
+            PRINT_SEP();
+            n = snnprintf(buf, n, len, "stale-if-error=%d",
+                          cache_control->stale_if_error);
+        }
     }
     return n;
 #undef PRINT_SEP
@@ -586,7 +600,11 @@ httpMakeConnection()
     connection->server = NULL;
     connection->pipelined = 0;
     connection->connecting = 0;
+    connection->slot = -1;
     connection->server = NULL;
+    connection->disk_fd = -1;
+    connection->disk_body_offset = 0;
+    connection->h2stream = NULL;
     return connection;
 }
 
@@ -1021,6 +1039,7 @@ void
 httpTweakCachability(ObjectPtr object)
 {
     int code = object->code;
+    int url_length, uncachable;
 
     if((object->cache_control & CACHE_AUTHORIZATION) &&
        !(object->cache_control & CACHE_PUBLIC)) {
@@ -1049,7 +1068,16 @@ httpTweakCachability(ObjectPtr object)
         object->cache_control |= CACHE_NO_HIDDEN;
     }
 
-    if(urlIsUncachable(object->key, object->key_size)) {
+    url_length = objectUrlLength(object);
+    if(url_length == object->key_size) {
+        uncachable = urlIsUncachable(object->key, object->key_size);
+    } else {
+        /* A secondary key; urlIsUncachable wants a NUL-terminated URL. */
+        char *url = strdup_n(object->key, url_length);
+        uncachable = url && urlIsUncachable(url, url_length);
+        free(url);
+    }
+    if(uncachable) {
         object->cache_control |= CACHE_NO_HIDDEN;
     }
 
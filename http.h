@@ -62,6 +62,8 @@ typedef struct _HTTPRequest {
 #define REQUEST_PIPELINED 16
 /* This client-side request has already switched objects once. */
 #define REQUEST_SUPERSEDED 32
+/* This client-side request is waiting for a fetch started by another. */
+#define REQUEST_COALESCED 64
 
 typedef struct _HTTPConnection {
     int flags;
@@ -87,6 +89,12 @@ typedef struct _HTTPConnection {
     struct _HTTPServer *server;
     int pipelined;
     int connecting;
+    int slot;
+    /* For client connections serving straight from the disk cache */
+    int disk_fd;
+    off_t disk_body_offset;
+    /* The HTTP/2 stream carrying this connection, which then has no fd */
+    struct _H2Stream *h2stream;
 } HTTPConnectionRec, *HTTPConnectionPtr;
 
 /* connection->flags */
@@ -0,0 +1,3332 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "polipo.h"
+
+int parentProxyH2 = 0;
+AtomListPtr h2Servers = NULL;
+int h2MaxStreams = 100;
+int h2Clients = 1;
+
+#ifdef NO_HTTP2
+
+void
+preinitHttp2(void)
+{
+    return;
+}
+
+int
+h2ServerEnabled(char *name, int port, int proxy)
+{
+    return 0;
+}
+
+int
+h2Connect(HTTPConnectionPtr connection)
+{
+    abort();
+}
+
+void
+h2ServerDiscard(HTTPServerPtr server)
+{
+    return;
+}
+
+int
+h2ClientAccept(int fd, const char *buf, int len)
+{
+    return 0;
+}
+
+void
+h2DoStream(int operation, HTTPConnectionPtr connection, int offset,
+           char *buf, int len,
+           int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+           void *data)
+{
+    abort();
+}
+
+void
+h2DoStreamH(int operation, HTTPConnectionPtr connection, int offset,
+            char *header, int hlen, char *buf, int len,
+            int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+            void *data)
+{
+    abort();
+}
+
+void
+h2DoStream2(int operation, HTTPConnectionPtr connection, int offset,
+            char *buf, int len, char *buf2, int len2,
+            int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+            void *data)
+{
+    abort();
+}
+
+void
+h2DoStream3(int operation, HTTPConnectionPtr connection, int offset,
+            char *buf, int len, char *buf2, int len2, char *buf3, int len3,
+            int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+            void *data)
+{
+    abort();
+}
+
+void
+h2DoStreamBuf(int operation, HTTPConnectionPtr connection, int offset,
+              char **buf_location, int len,
+              int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+              void *data)
+{
+    abort();
+}
+
+void
+h2PokeStream(HTTPConnectionPtr connection, int status, int what)
+{
+    abort();
+}
+
+void
+h2Shutdown(HTTPConnectionPtr connection)
+{
+    abort();
+}
+
+void
+h2Timeout(HTTPConnectionPtr connection)
+{
+    abort();
+}
+
+void
+h2StreamFinish(HTTPConnectionPtr connection, int s)
+{
+    abort();
+}
+
+#else
+
+#define H2_DATA 0
+#define H2_HEADERS 1
+#define H2_PRIORITY 2
+#define H2_RST_STREAM 3
+#define H2_SETTINGS 4
+#define H2_PUSH_PROMISE 5
+#define H2_PING 6
+#define H2_GOAWAY 7
+#define H2_WINDOW_UPDATE 8
+#define H2_CONTINUATION 9
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+#define H2_SETTINGS_HEADER_TABLE_SIZE 1
+#define H2_SETTINGS_ENABLE_PUSH 2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 4
+#define H2_SETTINGS_MAX_FRAME_SIZE 5
+#define H2_SETTINGS_MAX_HEADER_LIST_SIZE 6
+
+#define H2_NO_ERROR 0
+#define H2_PROTOCOL_ERROR 1
+#define H2_INTERNAL_ERROR 2
+#define H2_FLOW_CONTROL_ERROR 3
+#define H2_FRAME_SIZE_ERROR 6
+#define H2_REFUSED_STREAM 7
+#define H2_CANCEL 8
+#define H2_COMPRESSION_ERROR 9
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+/* We never raise SETTINGS_MAX_FRAME_SIZE, so this is also the largest
+   frame we accept. */
+#define H2_FRAME_SIZE 16384
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7FFFFFFF
+/* Receive windows.  The stream window bounds how much of a reply we
+   buffer on behalf of a slow reader. */
+#define H2_STREAM_WINDOW (256 * 1024)
+#define H2_SESSION_WINDOW (16 * 1024 * 1024)
+#define H2_SESSION_BUFFER (256 * 1024)
+#define H2_MAX_HEAD (64 * 1024)
+/* Largest decoded header list, counted as for
+   SETTINGS_MAX_HEADER_LIST_SIZE.  A small block can expand to a huge
+   list by referencing the dynamic table repeatedly. */
+#define H2_MAX_HEADER_LIST (64 * 1024)
+/* Largest request body without a Content-Length that we buffer */
+#define H2_MAX_BODY (1024 * 1024)
+#define H2_TABLE_SIZE 4096
+#define H2_TABLE_ENTRIES (H2_TABLE_SIZE / 32)
+#define H2_STATIC_ENTRIES 61
+#define H2_STREAM_HASH 64
+
+#define H2_SESSION_CONNECTING 1
+#define H2_SESSION_GOAWAY 2
+#define H2_SESSION_FULL 4
+#define H2_SESSION_WAKE 8
+/* We are the server; the peer is a client. */
+#define H2_SESSION_SERVER 16
+/* Waiting for the client's connection preface */
+#define H2_SESSION_PREFACE 32
+
+/* The peer has finished its reply, or its request */
+#define H2_STREAM_REMOTE_DONE 1
+/* We have sent all of the request */
+#define H2_STREAM_LOCAL_DONE 2
+/* The final (non-1xx) reply headers have been received, or we are the
+   server */
+#define H2_STREAM_FINAL 4
+/* The request headers have been sent */
+#define H2_STREAM_HEADERS 8
+#define H2_STREAM_HEAD 16
+/* The request body is buffered until its length is known. */
+#define H2_STREAM_HOLD 32
+/* The stream is lost, I/O on its connection fails with status */
+#define H2_STREAM_SHUT 64
+/* A read or a write is pending on the connection */
+#define H2_STREAM_READING 128
+#define H2_STREAM_WRITING 256
+/* The connection is waiting for the session to be set up */
+#define H2_STREAM_ATTACH 512
+/* Handlers are being called, don't free the stream just yet */
+#define H2_STREAM_RUNNING 1024
+/* The stream was finished by a handler */
+#define H2_STREAM_DEAD 2048
+/* We are the server; the connection belongs to client.c */
+#define H2_STREAM_SERVER 4096
+/* The reply is chunked, and ends with a write marked IO_END */
+#define H2_STREAM_CHUNKED 8192
+
+/* Request pseudo-header fields */
+#define H2_PSEUDO_METHOD 0
+#define H2_PSEUDO_SCHEME 1
+#define H2_PSEUDO_AUTHORITY 2
+#define H2_PSEUDO_PATH 3
+
+typedef struct _H2Buffer {
+    char *buf;
+    int len;
+    int size;
+} H2BufferRec, *H2BufferPtr;
+
+typedef struct _H2Field {
+    char *name;
+    int name_len;
+    char *value;
+    int value_len;
+} H2FieldRec, *H2FieldPtr;
+
+/* An HPACK dynamic table, newest entry first. */
+typedef struct _H2Table {
+    H2FieldRec entries[H2_TABLE_ENTRIES];
+    int first;
+    int count;
+    int size;
+    int max_size;
+} H2TableRec, *H2TablePtr;
+
+/* A stream standing in for the socket of an HTTPConnection.  On the
+   client side, it carries the successive requests of one of server.c's
+   connections to the server, each on a new stream id; id is 0 between
+   requests.  On the server side, it carries the single request of one
+   of client.c's connections.  Whatever the peer sends is kept in in,
+   as HTTP/1.1 for the connection to read; the first text bytes of in
+   are header, or have already been credited, and don't count against
+   the window. */
+typedef struct _H2Stream {
+    struct _H2Session *session;
+    HTTPConnectionPtr connection;
+    unsigned int id;
+    int flags;
+    int status;
+    int remaining;
+    int send_window;
+    int credit;
+    H2BufferRec in;
+    int text;
+    /* Pending I/O on connection, see h2ScheduleStream */
+    StreamRequestRec reading, writing;
+    int written;
+    int poke, poke_status;
+    TimeEventHandlerPtr wake;
+    struct _H2Stream *next, *hnext;
+} H2StreamRec, *H2StreamPtr;
+
+typedef struct _H2Session {
+    HTTPServerPtr server;
+    int fd;
+    int flags;
+    FdEventHandlerPtr reader, writer;
+    TimeEventHandlerPtr timeout;
+    H2BufferRec in, out;
+    unsigned int next_id, last_id;
+    int numactive;
+    int peer_max_streams;
+    int peer_window;
+    int peer_frame_size;
+    int send_window;
+    int credit;
+    H2StreamPtr streams;
+    H2StreamPtr hash[H2_STREAM_HASH];
+    /* Header block being reassembled from CONTINUATION frames */
+    H2BufferRec block;
+    unsigned int block_id;
+    int block_flags;
+    /* The HTTP/1.1 header lines decoded from the last block */
+    H2BufferRec head;
+    int head_status;
+    int head_length;
+    int head_host;
+    int head_bad;
+    int head_size;
+    /* Request pseudo-header fields and cookies, on the server side */
+    H2BufferRec pseudo;
+    int pseudo_offset[4], pseudo_len[4];
+    H2BufferRec cookie;
+    H2BufferRec scratch;
+    H2BufferRec encoded;
+    H2TableRec decoder, encoder;
+    int encoder_update;
+} H2SessionRec, *H2SessionPtr;
+
+static const struct {
+    const char *name;
+    const char *value;
+} h2StaticTable[H2_STATIC_ENTRIES] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/* The HPACK Huffman code (RFC 7541, Appendix B); entry 256 is EOS. */
+static const unsigned int h2HuffmanCodes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff
+};
+
+static const unsigned char h2HuffmanLengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+static unsigned int h2HuffmanFirst[31];
+static int h2HuffmanCount[31], h2HuffmanOffset[31];
+static short h2HuffmanSymbols[257];
+static int h2HuffmanReady = 0;
+
+static void h2SessionDispatch(H2SessionPtr session);
+static void h2SessionDie(H2SessionPtr session, int status);
+static int h2SessionReadHandler(int status, FdEventHandlerPtr event);
+static int h2SessionWriteHandler(int status, FdEventHandlerPtr event);
+
+void
+preinitHttp2(void)
+{
+    CONFIG_VARIABLE(parentProxyH2, CONFIG_BOOLEAN,
+                    "Speak HTTP/2 (h2c) to the parent proxy.");
+    CONFIG_VARIABLE(h2Servers, CONFIG_ATOM_LIST_LOWER,
+                    "Servers that speak HTTP/2 (h2c) with prior knowledge.");
+    CONFIG_VARIABLE(h2MaxStreams, CONFIG_INT,
+                    "Maximum number of concurrent HTTP/2 streams "
+                    "per server or client.");
+    CONFIG_VARIABLE(h2Clients, CONFIG_BOOLEAN,
+                    "Accept HTTP/2 (h2c) from clients.");
+}
+
+int
+h2ServerEnabled(char *name, int port, int proxy)
+{
+    int i, n;
+    AtomPtr atom;
+
+    if(proxy)
+        return parentProxyH2;
+    if(h2Servers == NULL)
+        return 0;
+
+    n = strlen(name);
+    for(i = 0; i < h2Servers->length; i++) {
+        atom = h2Servers->list[i];
+        if(atom->length < n || memcmp(atom->string, name, n) != 0)
+            continue;
+        if(atom->length == n) {
+            if(port == 80)
+                return 1;
+        } else if(atom->string[n] == ':') {
+            if(atoi(atom->string + n + 1) == port)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+h2Reserve(H2BufferPtr b, int n)
+{
+    char *buf;
+    int size;
+
+    if(b->len + n <= b->size)
+        return 1;
+    size = MAX(2 * b->size, b->len + n);
+    size = MAX(size, 1024);
+    buf = realloc(b->buf, size);
+    if(buf == NULL) {
+        do_log(L_ERROR, "Couldn't allocate HTTP/2 buffer.\n");
+        return -1;
+    }
+    b->buf = buf;
+    b->size = size;
+    return 1;
+}
+
+static int
+h2Append(H2BufferPtr b, const char *data, int n)
+{
+    if(h2Reserve(b, n) < 0)
+        return -1;
+    if(n > 0)
+        memcpy(b->buf + b->len, data, n);
+    b->len += n;
+    return 1;
+}
+
+static void
+h2Consume(H2BufferPtr b, int n)
+{
+    assert(n <= b->len);
+    if(n < b->len)
+        memmove(b->buf, b->buf + n, b->len - n);
+    b->len -= n;
+}
+
+static void
+h2BufferFree(H2BufferPtr b)
+{
+    if(b->buf)
+        free(b->buf);
+    b->buf = NULL;
+    b->len = b->size = 0;
+}
+
+/* Return the length of the header of an HTTP/1.1 message, including
+   the final empty line, or -1 if it is incomplete. */
+static int
+h2HeadLength(const char *buf, int len)
+{
+    int i;
+    for(i = 0; i + 3 < len; i++) {
+        if(buf[i] == '\r' && buf[i + 1] == '\n' &&
+           buf[i + 2] == '\r' && buf[i + 3] == '\n')
+            return i + 4;
+    }
+    return -1;
+}
+
+static int
+h2LineLength(const char *buf, int len)
+{
+    int i;
+    for(i = 0; i + 1 < len; i++) {
+        if(buf[i] == '\r' && buf[i + 1] == '\n')
+            return i;
+    }
+    return -1;
+}
+
+static int
+h2NameIs(const char *name, int name_len, const char *s)
+{
+    int n = strlen(s);
+    return name_len == n && lwrcmp(name, s, n) == 0;
+}
+
+/* Headers that are specific to an HTTP/1.x connection. */
+static int
+h2HopByHop(const char *name, int name_len)
+{
+    return h2NameIs(name, name_len, "connection") ||
+        h2NameIs(name, name_len, "keep-alive") ||
+        h2NameIs(name, name_len, "proxy-connection") ||
+        h2NameIs(name, name_len, "transfer-encoding") ||
+        h2NameIs(name, name_len, "upgrade");
+}
+
+/* HPACK (RFC 7541) */
+
+static void
+h2HuffmanInit(void)
+{
+    int i, l, k;
+    unsigned int code;
+
+    memset(h2HuffmanCount, 0, sizeof(h2HuffmanCount));
+    for(i = 0; i < 257; i++)
+        h2HuffmanCount[h2HuffmanLengths[i]]++;
+
+    /* The code is canonical, so each length is a run of consecutive
+       codes assigned in symbol order. */
+    code = 0;
+    k = 0;
+    for(l = 1; l <= 30; l++) {
+        code = (code + h2HuffmanCount[l - 1]) << 1;
+        h2HuffmanFirst[l] = code;
+        h2HuffmanOffset[l] = k;
+        for(i = 0; i < 257; i++)
+            if(h2HuffmanLengths[i] == l)
+                h2HuffmanSymbols[k++] = i;
+    }
+    h2HuffmanReady = 1;
+}
+
+static int
+h2HuffmanDecode(H2BufferPtr out, const unsigned char *data, int len)
+{
+    unsigned int code = 0;
+    int clen = 0, i, j, sym;
+
+    if(!h2HuffmanReady)
+        h2HuffmanInit();
+
+    /* The shortest code is 5 bits long. */
+    if(h2Reserve(out, len * 8 / 5 + 1) < 0)
+        return -1;
+
+    for(i = 0; i < len; i++) {
+        for(j = 7; j >= 0; j--) {
+            code = (code << 1) | ((data[i] >> j) & 1);
+            clen++;
+            if(code - h2HuffmanFirst[clen] <
+               (unsigned)h2HuffmanCount[clen]) {
+                sym = h2HuffmanSymbols[h2HuffmanOffset[clen] +
+                                       code - h2HuffmanFirst[clen]];
+                if(sym == 256)
+                    return -1;
+                out->buf[out->len++] = sym;
+                code = 0;
+                clen = 0;
+            } else if(clen >= 30) {
+                return -1;
+            }
+        }
+    }
+
+    /* Padding is a prefix of EOS, that is all ones, shorter than 8 bits. */
+    if(clen > 7 || code != (1U << clen) - 1)
+        return -1;
+    return 1;
+}
+
+static int
+h2HuffmanLength(const char *s, int len)
+{
+    int i, bits = 0;
+    for(i = 0; i < len; i++)
+        bits += h2HuffmanLengths[(unsigned char)s[i]];
+    return (bits + 7) / 8;
+}
+
+static int
+h2HuffmanEncode(H2BufferPtr out, const char *s, int len)
+{
+    unsigned long long bits = 0;
+    int nbits = 0, i, c;
+
+    if(h2Reserve(out, h2HuffmanLength(s, len)) < 0)
+        return -1;
+
+    for(i = 0; i < len; i++) {
+        c = (unsigned char)s[i];
+        bits = (bits << h2HuffmanLengths[c]) | h2HuffmanCodes[c];
+        nbits += h2HuffmanLengths[c];
+        while(nbits >= 8) {
+            out->buf[out->len++] = (bits >> (nbits - 8)) & 0xFF;
+            nbits -= 8;
+        }
+        bits &= (1ULL << nbits) - 1;
+    }
+    if(nbits > 0)
+        out->buf[out->len++] =
+            ((bits << (8 - nbits)) | ((1 << (8 - nbits)) - 1)) & 0xFF;
+    return 1;
+}
+
+static int
+h2EncodeInteger(H2BufferPtr out, int prefix, int first, unsigned int value)
+{
+    unsigned int max = (1 << prefix) - 1;
+
+    if(h2Reserve(out, 6) < 0)
+        return -1;
+    if(value < max) {
+        out->buf[out->len++] = first | value;
+        return 1;
+    }
+    out->buf[out->len++] = first | max;
+    value -= max;
+    while(value >= 128) {
+        out->buf[out->len++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out->buf[out->len++] = value;
+    return 1;
+}
+
+static int
+h2DecodeInteger(const unsigned char *buf, int len, int *i,
+                int prefix, unsigned int *value_return)
+{
+    unsigned int max = (1 << prefix) - 1, value;
+    int shift = 0, b;
+
+    if(*i >= len)
+        return -1;
+    value = buf[(*i)++] & max;
+    if(value == max) {
+        do {
+            if(*i >= len || shift > 21)
+                return -1;
+            b = buf[(*i)++];
+            value += (b & 0x7F) << shift;
+            shift += 7;
+        } while(b & 0x80);
+    }
+    *value_return = value;
+    return 1;
+}
+
+static int
+h2EncodeString(H2BufferPtr out, const char *s, int len)
+{
+    int hlen = h2HuffmanLength(s, len);
+
+    if(hlen < len) {
+        if(h2EncodeInteger(out, 7, 0x80, hlen) < 0)
+            return -1;
+        return h2HuffmanEncode(out, s, len);
+    }
+    if(h2EncodeInteger(out, 7, 0, len) < 0)
+        return -1;
+    return h2Append(out, s, len);
+}
+
+static int
+h2DecodeString(const unsigned char *buf, int len, int *i, H2BufferPtr out)
+{
+    unsigned int n;
+    int huffman, rc;
+
+    if(*i >= len)
+        return -1;
+    huffman = buf[*i] & 0x80;
+    rc = h2DecodeInteger(buf, len, i, 7, &n);
+    if(rc < 0 || n > len - *i)
+        return -1;
+    if(huffman)
+        rc = h2HuffmanDecode(out, buf + *i, n);
+    else
+        rc = h2Append(out, (const char*)buf + *i, n);
+    *i += n;
+    return rc;
+}
+
+static H2FieldPtr
+h2TableEntry(H2TablePtr table, int i)
+{
+    return &table->entries[(table->first + i) % H2_TABLE_ENTRIES];
+}
+
+static void
+h2TableEvict(H2TablePtr table, int size)
+{
+    H2FieldPtr field;
+
+    while(table->count > 0 && table->size > size) {
+        field = h2TableEntry(table, table->count - 1);
+        table->size -= field->name_len + field->value_len + 32;
+        free(field->name);
+        field->name = field->value = NULL;
+        table->count--;
+    }
+}
+
+static int
+h2TableAdd(H2TablePtr table, const char *name, int name_len,
+           const char *value, int value_len)
+{
+    int size = name_len + value_len + 32;
+    H2FieldPtr field;
+    char *p;
+
+    if(size > table->max_size) {
+        h2TableEvict(table, 0);
+        return 0;
+    }
+
+    /* Copy first, name or value may live in an entry that is about to
+       be evicted. */
+    p = malloc(name_len + value_len + 1);
+    if(p == NULL)
+        return -1;
+    memcpy(p, name, name_len);
+    memcpy(p + name_len, value, value_len);
+
+    h2TableEvict(table, table->max_size - size);
+    assert(table->count < H2_TABLE_ENTRIES);
+    table->first = (table->first + H2_TABLE_ENTRIES - 1) % H2_TABLE_ENTRIES;
+    field = &table->entries[table->first];
+    field->name = p;
+    field->name_len = name_len;
+    field->value = p + name_len;
+    field->value_len = value_len;
+    table->count++;
+    table->size += size;
+    return 1;
+}
+
+static int
+h2TableLookup(H2TablePtr table, unsigned int index,
+              const char **name, int *name_len,
+              const char **value, int *value_len)
+{
+    H2FieldPtr field;
+
+    if(index == 0)
+        return -1;
+    if(index <= H2_STATIC_ENTRIES) {
+        *name = h2StaticTable[index - 1].name;
+        *name_len = strlen(*name);
+        *value = h2StaticTable[index - 1].value;
+        *value_len = strlen(*value);
+        return 1;
+    }
+    index -= H2_STATIC_ENTRIES + 1;
+    if(index >= table->count)
+        return -1;
+    field = h2TableEntry(table, index);
+    *name = field->name;
+    *name_len = field->name_len;
+    *value = field->value;
+    *value_len = field->value_len;
+    return 1;
+}
+
+static void
+h2TableInit(H2TablePtr table)
+{
+    memset(table, 0, sizeof(H2TableRec));
+    table->max_size = H2_TABLE_SIZE;
+}
+
+static void
+h2TableFree(H2TablePtr table)
+{
+    h2TableEvict(table, 0);
+}
+
+static int
+h2Sensitive(const char *name, int name_len)
+{
+    return h2NameIs(name, name_len, "authorization") ||
+        h2NameIs(name, name_len, "proxy-authorization") ||
+        h2NameIs(name, name_len, "cookie") ||
+        h2NameIs(name, name_len, "set-cookie");
+}
+
+/* Encode one header field; name must be lowercase. */
+static int
+h2EncodeHeader(H2SessionPtr session, const char *name, int name_len,
+               const char *value, int value_len)
+{
+    H2BufferPtr out = &session->encoded;
+    H2TablePtr table = &session->encoder;
+    H2FieldPtr field;
+    int i, index = 0, incremental, rc;
+
+    for(i = 0; i < H2_STATIC_ENTRIES; i++) {
+        if(!h2NameIs(name, name_len, h2StaticTable[i].name))
+            continue;
+        if(index == 0)
+            index = i + 1;
+        if(value_len == strlen(h2StaticTable[i].value) &&
+           memcmp(value, h2StaticTable[i].value, value_len) == 0)
+            return h2EncodeInteger(out, 7, 0x80, i + 1);
+    }
+    for(i = 0; i < table->count; i++) {
+        field = h2TableEntry(table, i);
+        if(field->name_len != name_len ||
+           memcmp(field->name, name, name_len) != 0)
+            continue;
+        if(index == 0)
+            index = H2_STATIC_ENTRIES + 1 + i;
+        if(field->value_len == value_len &&
+           memcmp(field->value, value, value_len) == 0)
+            return h2EncodeInteger(out, 7, 0x80, H2_STATIC_ENTRIES + 1 + i);
+    }
+
+    incremental = 0;
+    if(h2Sensitive(name, name_len)) {
+        rc = h2EncodeInteger(out, 4, 0x10, index);
+    } else if(name_len + value_len + 32 <= table->max_size / 2) {
+        incremental = 1;
+        rc = h2EncodeInteger(out, 6, 0x40, index);
+    } else {
+        rc = h2EncodeInteger(out, 4, 0, index);
+    }
+    if(rc < 0)
+        return -1;
+    if(index == 0 && h2EncodeString(out, name, name_len) < 0)
+        return -1;
+    if(h2EncodeString(out, value, value_len) < 0)
+        return -1;
+    if(incremental)
+        return h2TableAdd(table, name, name_len, value, value_len);
+    return 1;
+}
+
+static void
+h2Put32(char *p, unsigned int v)
+{
+    p[0] = (v >> 24) & 0xFF;
+    p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;
+    p[3] = v & 0xFF;
+}
+
+static unsigned int
+h2Get32(const unsigned char *p)
+{
+    return ((unsigned)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static int
+h2WriteFrame(H2SessionPtr session, int type, int flags, unsigned int id,
+             const char *payload, int len)
+{
+    unsigned char *p;
+
+    if(h2Reserve(&session->out, 9 + len) < 0)
+        return -1;
+    p = (unsigned char*)session->out.buf + session->out.len;
+    p[0] = (len >> 16) & 0xFF;
+    p[1] = (len >> 8) & 0xFF;
+    p[2] = len & 0xFF;
+    p[3] = type;
+    p[4] = flags;
+    h2Put32((char*)p + 5, id & 0x7FFFFFFF);
+    if(len > 0)
+        memcpy(p + 9, payload, len);
+    session->out.len += 9 + len;
+    return 1;
+}
+
+static int
+h2WriteWindowUpdate(H2SessionPtr session, unsigned int id, int increment)
+{
+    char buf[4];
+    h2Put32(buf, increment);
+    return h2WriteFrame(session, H2_WINDOW_UPDATE, 0, id, buf, 4);
+}
+
+static int
+h2WriteRstStream(H2SessionPtr session, unsigned int id, int code)
+{
+    char buf[4];
+    h2Put32(buf, code);
+    return h2WriteFrame(session, H2_RST_STREAM, 0, id, buf, 4);
+}
+
+static int
+h2WriteGoaway(H2SessionPtr session, int code)
+{
+    char buf[8];
+    /* We never accept streams from a server, so last_id is 0 unless we
+       are the server. */
+    h2Put32(buf, session->last_id);
+    h2Put32(buf + 4, code);
+    return h2WriteFrame(session, H2_GOAWAY, 0, 0, buf, 8);
+}
+
+/* Write a header block, splitting it into CONTINUATION frames if
+   necessary. */
+static int
+h2WriteHeaders(H2SessionPtr session, unsigned int id, int end,
+               H2BufferPtr block)
+{
+    int offset = 0, n, type = H2_HEADERS, flags;
+
+    do {
+        n = MIN(block->len - offset, session->peer_frame_size);
+        flags = 0;
+        if(offset + n == block->len)
+            flags |= H2_FLAG_END_HEADERS;
+        if(type == H2_HEADERS && end)
+            flags |= H2_FLAG_END_STREAM;
+        if(h2WriteFrame(session, type, flags, id,
+                        block->buf + offset, n) < 0)
+            return -1;
+        offset += n;
+        type = H2_CONTINUATION;
+    } while(offset < block->len);
+    return 1;
+}
+
+static const char *
+h2ReasonPhrase(int status)
+{
+    switch(status) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 407: return "Proxy Authentication Required";
+    case 412: return "Precondition Failed";
+    case 416: return "Range Not Satisfiable";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "Unknown";
+    }
+}
+
+/* Streams */
+
+static void h2StreamWake(H2StreamPtr stream);
+
+static H2StreamPtr
+h2FindStream(H2SessionPtr session, unsigned int id)
+{
+    H2StreamPtr stream = session->hash[id % H2_STREAM_HASH];
+    while(stream && stream->id != id)
+        stream = stream->hnext;
+    return stream;
+}
+
+static void
+h2StreamOpen(H2StreamPtr stream, unsigned int id)
+{
+    H2SessionPtr session = stream->session;
+    int h;
+
+    stream->id = id;
+    h = stream->id % H2_STREAM_HASH;
+    stream->hnext = session->hash[h];
+    session->hash[h] = stream;
+    session->numactive++;
+    stream->send_window = session->peer_window;
+    stream->credit = 0;
+}
+
+/* Forget the stream id once both sides are done with it, or the
+   stream has been reset.  Anything the peer sends on it afterwards is
+   discarded. */
+static void
+h2StreamRelease(H2StreamPtr stream)
+{
+    H2SessionPtr session = stream->session;
+    H2StreamPtr *p;
+
+    if(stream->id == 0)
+        return;
+
+    p = &session->hash[stream->id % H2_STREAM_HASH];
+    while(*p != stream)
+        p = &(*p)->hnext;
+    *p = stream->hnext;
+    stream->hnext = NULL;
+    stream->id = 0;
+    session->numactive--;
+
+    /* A slot is free, let any waiting requests go. */
+    session->flags |= H2_SESSION_WAKE;
+}
+
+static void
+h2StreamReset(H2StreamPtr stream, int code)
+{
+    if(stream->id != 0) {
+        h2WriteRstStream(stream->session, stream->id, code);
+        h2StreamRelease(stream);
+    }
+}
+
+/* The stream is lost: pending and future I/O on its connection fails
+   with status, or reads an end of file if status is 0. */
+static void
+h2StreamShut(H2StreamPtr stream, int status)
+{
+    h2StreamRelease(stream);
+    if(!(stream->flags & H2_STREAM_SHUT)) {
+        stream->flags |= H2_STREAM_SHUT;
+        stream->status = status;
+    }
+    h2StreamWake(stream);
+}
+
+/* The server didn't process the request, or won't take any more; make
+   sure that server.c resends it on a fresh session. */
+static void
+h2StreamRefuse(H2StreamPtr stream)
+{
+    if(stream->connection->serviced == 0)
+        stream->connection->serviced = 1;
+    h2StreamShut(stream, -ECONNRESET);
+}
+
+static void
+h2StreamLocalDone(H2StreamPtr stream)
+{
+    stream->flags |= H2_STREAM_LOCAL_DONE;
+    if(stream->flags & H2_STREAM_REMOTE_DONE) {
+        h2StreamRelease(stream);
+    } else if(stream->flags & H2_STREAM_SERVER) {
+        /* We replied before the end of the request, tell the client to
+           stop sending it. */
+        h2StreamReset(stream, H2_NO_ERROR);
+    }
+}
+
+static int h2StreamUnhold(H2StreamPtr stream);
+
+static void
+h2StreamRemoteDone(H2StreamPtr stream)
+{
+    if((stream->flags & H2_STREAM_HOLD) && h2StreamUnhold(stream) < 0) {
+        h2StreamReset(stream, H2_INTERNAL_ERROR);
+        h2StreamShut(stream, -ENOMEM);
+        return;
+    }
+
+    stream->flags |= H2_STREAM_REMOTE_DONE;
+    if(!(stream->flags & (H2_STREAM_LOCAL_DONE | H2_STREAM_SERVER))) {
+        /* The server replied before reading all of the request, the
+           rest of which is discarded. */
+        h2WriteRstStream(stream->session, stream->id, H2_CANCEL);
+        stream->flags |= H2_STREAM_LOCAL_DONE;
+    }
+    if(stream->flags & H2_STREAM_LOCAL_DONE)
+        h2StreamRelease(stream);
+    if(stream->flags & H2_STREAM_READING)
+        h2StreamWake(stream);
+}
+
+static int
+h2HeaderLine(const char *buf, int len, int i,
+             int *name_return, int *name_len_return,
+             int *value_return, int *value_len_return)
+{
+    int end, colon, value, value_end;
+
+    end = h2LineLength(buf + i, len - i);
+    if(end < 0)
+        return -1;
+    end += i;
+    colon = i;
+    while(colon < end && buf[colon] != ':')
+        colon++;
+    if(colon >= end || colon == i) {
+        *name_len_return = 0;
+        return end + 2;
+    }
+    value = colon + 1;
+    while(value < end && (buf[value] == ' ' || buf[value] == '\t'))
+        value++;
+    value_end = end;
+    while(value_end > value &&
+          (buf[value_end - 1] == ' ' || buf[value_end - 1] == '\t'))
+        value_end--;
+    *name_return = i;
+    *name_len_return = colon - i;
+    *value_return = value;
+    *value_len_return = value_end - value;
+    return end + 2;
+}
+
+/* Send the HTTP/1.1 request header of length len written by server.c
+   as a HEADERS frame on a new stream.  Returns 0 if no new stream may
+   be opened yet. */
+static int
+h2StreamRequest(H2StreamPtr stream, const char *buf, int len)
+{
+    H2SessionPtr session = stream->session;
+    int eol, i, j, next, rc;
+    int method_len, target, target_len, path, path_len;
+    int authority = -1, authority_len = 0;
+    int name, name_len, value, value_len;
+    int length = -1;
+
+    if(session->flags & H2_SESSION_GOAWAY) {
+        h2StreamRefuse(stream);
+        return 0;
+    }
+    if(session->numactive >= session->peer_max_streams)
+        return 0;
+
+    eol = h2LineLength(buf, len);
+    if(eol < 0)
+        return -1;
+    i = 0;
+    while(i < eol && buf[i] != ' ')
+        i++;
+    if(i == 0 || i >= eol)
+        return -1;
+    method_len = i;
+    target = i + 1;
+    j = target;
+    while(j < eol && buf[j] != ' ')
+        j++;
+    if(j == target || j >= eol)
+        return -1;
+    target_len = j - target;
+
+    path = target;
+    path_len = target_len;
+    if(target_len >= 7 && lwrcmp(buf + target, "http://", 7) == 0) {
+        /* Absolute URL, as sent to a proxy */
+        authority = target + 7;
+        j = authority;
+        while(j < target + target_len && buf[j] != '/')
+            j++;
+        authority_len = j - authority;
+        path = j;
+        path_len = target + target_len - j;
+    }
+
+    for(i = eol + 2; i < len - 2; i = next) {
+        next = h2HeaderLine(buf, len, i, &name, &name_len,
+                            &value, &value_len);
+        if(next < 0)
+            return -1;
+        if(name_len == 0)
+            continue;
+        if(h2NameIs(buf + name, name_len, "host")) {
+            if(authority < 0) {
+                authority = value;
+                authority_len = value_len;
+            }
+        } else if(h2NameIs(buf + name, name_len, "content-length")) {
+            length = 0;
+            for(j = value; j < value + value_len; j++) {
+                if(!digit(buf[j]) || length > (INT_MAX - 9) / 10)
+                    return -1;
+                length = length * 10 + (buf[j] - '0');
+            }
+        } else if(h2NameIs(buf + name, name_len, "transfer-encoding")) {
+            /* httpWriteRequest always sends a Content-Length. */
+            return -1;
+        }
+    }
+    if(authority < 0)
+        return -1;
+
+    session->encoded.len = 0;
+    if(session->encoder_update) {
+        if(h2EncodeInteger(&session->encoded, 5, 0x20,
+                           session->encoder.max_size) < 0)
+            return -1;
+        session->encoder_update = 0;
+    }
+
+    rc = h2EncodeHeader(session, ":method", 7, buf, method_len);
+    if(rc >= 0)
+        rc = h2EncodeHeader(session, ":scheme", 7, "http", 4);
+    if(rc >= 0)
+        rc = h2EncodeHeader(session, ":authority", 10,
+                            buf + authority, authority_len);
+    if(rc >= 0) {
+        if(path_len == 0)
+            rc = h2EncodeHeader(session, ":path", 5, "/", 1);
+        else
+            rc = h2EncodeHeader(session, ":path", 5, buf + path, path_len);
+    }
+
+    for(i = eol + 2; i < len - 2 && rc >= 0; i = next) {
+        next = h2HeaderLine(buf, len, i, &name, &name_len,
+                            &value, &value_len);
+        if(name_len == 0 || h2HopByHop(buf + name, name_len) ||
+           h2NameIs(buf + name, name_len, "host") ||
+           h2NameIs(buf + name, name_len, "te"))
+            continue;
+        session->scratch.len = 0;
+        rc = h2Reserve(&session->scratch, name_len);
+        if(rc < 0)
+            break;
+        for(j = 0; j < name_len; j++)
+            session->scratch.buf[j] = lwr(buf[name + j]);
+        session->scratch.len = name_len;
+        rc = h2EncodeHeader(session, session->scratch.buf, name_len,
+                            buf + value, value_len);
+    }
+
+    if(rc < 0) {
+        /* The encoder's table may no longer match the server's. */
+        do_log(L_ERROR, "Couldn't encode HTTP/2 request.\n");
+        shutdown(session->fd, 2);
+        return -1;
+    }
+
+    stream->flags |= H2_STREAM_HEADERS;
+    if(method_len == 4 && memcmp(buf, "HEAD", 4) == 0)
+        stream->flags |= H2_STREAM_HEAD;
+    stream->remaining = MAX(length, 0);
+
+    h2StreamOpen(stream, session->next_id);
+    session->next_id += 2;
+    do_log(D_SERVER_REQ, "HTTP/2 stream %u: ", stream->id);
+    do_log_n(D_SERVER_REQ, buf, eol);
+    do_log(D_SERVER_REQ, "\n");
+    rc = h2WriteHeaders(session, stream->id, length <= 0, &session->encoded);
+    if(rc < 0)
+        return -1;
+    if(length <= 0)
+        h2StreamLocalDone(stream);
+    return 1;
+}
+
+/* Send the HTTP/1.1 reply header of length len written by client.c as
+   a HEADERS frame, on the server side. */
+static int
+h2StreamResponse(H2StreamPtr stream, const char *buf, int len)
+{
+    H2SessionPtr session = stream->session;
+    int eol, i, j, next, rc, status, body, end;
+    int name, name_len, value, value_len;
+    int length = -1, chunked = 0;
+
+    eol = h2LineLength(buf, len);
+    if(eol < 12 || memcmp(buf, "HTTP/1.", 7) != 0 || buf[8] != ' ' ||
+       !digit(buf[9]) || !digit(buf[10]) || !digit(buf[11]))
+        return -1;
+    status = atoi(buf + 9);
+    if(status < 100)
+        return -1;
+
+    session->encoded.len = 0;
+    if(session->encoder_update) {
+        if(h2EncodeInteger(&session->encoded, 5, 0x20,
+                           session->encoder.max_size) < 0)
+            return -1;
+        session->encoder_update = 0;
+    }
+    rc = h2EncodeHeader(session, ":status", 7, buf + 9, 3);
+
+    for(i = eol + 2; i < len - 2 && rc >= 0; i = next) {
+        next = h2HeaderLine(buf, len, i, &name, &name_len,
+                            &value, &value_len);
+        if(next < 0)
+            return -1;
+        if(name_len == 0)
+            continue;
+        if(h2NameIs(buf + name, name_len, "content-length")) {
+            length = 0;
+            for(j = value; j < value + value_len; j++) {
+                if(!digit(buf[j]) || length > (INT_MAX - 9) / 10)
+                    return -1;
+                length = length * 10 + (buf[j] - '0');
+            }
+        } else if(h2NameIs(buf + name, name_len, "transfer-encoding")) {
+            if(value_len == 7 && lwrcmp(buf + value, "chunked", 7) == 0)
+                chunked = 1;
+            else
+                return -1;
+        }
+        if(h2HopByHop(buf + name, name_len))
+            continue;
+        session->scratch.len = 0;
+        rc = h2Reserve(&session->scratch, name_len);
+        if(rc < 0)
+            break;
+        for(j = 0; j < name_len; j++)
+            session->scratch.buf[j] = lwr(buf[name + j]);
+        session->scratch.len = name_len;
+        rc = h2EncodeHeader(session, session->scratch.buf, name_len,
+                            buf + value, value_len);
+    }
+
+    if(rc < 0) {
+        do_log(L_ERROR, "Couldn't encode HTTP/2 reply.\n");
+        shutdown(session->fd, 2);
+        return -1;
+    }
+
+    if(status < 200) {
+        if(h2WriteHeaders(session, stream->id, 0, &session->encoded) < 0)
+            return -1;
+        return 1;
+    }
+
+    /* The body is as long as the Content-Length, ends with the last
+       chunk, or else with the stream; remaining is -1 in the latter
+       two cases. */
+    body = !(stream->flags & H2_STREAM_HEAD) && status != 204 && status != 304;
+    end = !body || length == 0;
+    stream->flags |= H2_STREAM_HEADERS;
+    if(!end && chunked)
+        stream->flags |= H2_STREAM_CHUNKED;
+    stream->remaining = end ? 0 : chunked ? -1 : length;
+
+    if(h2WriteHeaders(session, stream->id, end, &session->encoded) < 0)
+        return -1;
+    if(end)
+        h2StreamLocalDone(stream);
+    return 1;
+}
+
+/* Append the reply header just decoded to the stream's input, as
+   HTTP/1.1 for server.c to read.  A reply without a Content-Length is
+   delimited by the end of the stream. */
+static int
+h2StreamReply(H2StreamPtr stream, int end)
+{
+    H2SessionPtr session = stream->session;
+    H2BufferPtr in = &stream->in;
+    int status = session->head_status, body, len = in->len;
+    char buf[80];
+    int n;
+
+    if(status < 100 || status > 999)
+        return -1;
+
+    if(stream->flags & H2_STREAM_FINAL) {
+        /* Trailers, which we drop. */
+        return end ? 1 : -1;
+    }
+
+    if(status < 200) {
+        if(end)
+            return -1;
+        if(status == 100) {
+            if(h2Append(in, "HTTP/1.1 100 Continue\r\n\r\n", 25) < 0)
+                return -1;
+            stream->text += 25;
+        }
+        return 1;
+    }
+
+    stream->flags |= H2_STREAM_FINAL;
+    body = !(stream->flags & H2_STREAM_HEAD) && status != 204 && status != 304;
+
+    n = snprintf(buf, 80, "HTTP/1.1 %d %s\r\n", status, h2ReasonPhrase(status));
+    if(h2Append(in, buf, n) < 0 ||
+       h2Append(in, session->head.buf, session->head.len) < 0)
+        return -1;
+    if(body && !session->head_length && end) {
+        if(h2Append(in, "Content-Length: 0\r\n", 19) < 0)
+            return -1;
+    }
+    if(h2Append(in, "\r\n", 2) < 0)
+        return -1;
+    stream->text += in->len - len;
+    return 1;
+}
+
+static int
+h2StreamData(H2StreamPtr stream, const char *data, int len, int end)
+{
+    if(!(stream->flags & H2_STREAM_FINAL))
+        return -1;
+    /* A peer that ignores the window */
+    if(stream->in.len - stream->text + len > H2_STREAM_WINDOW)
+        return -1;
+    if(h2Append(&stream->in, data, len) < 0)
+        return -1;
+    if(stream->flags & H2_STREAM_HOLD) {
+        /* Nothing is read until the end of the body, so the window
+           must be opened straight away. */
+        if(stream->in.len > H2_MAX_BODY)
+            return -1;
+        stream->text += len;
+        if(len > 0)
+            h2WriteWindowUpdate(stream->session, stream->id, len);
+    }
+    /* Otherwise, the window is opened as the connection reads the
+       data, see h2StreamConsume. */
+    if(end)
+        h2StreamRemoteDone(stream);
+    else if(len > 0 && (stream->flags & H2_STREAM_READING))
+        h2StreamWake(stream);
+    return 1;
+}
+
+/* The whole request body has been received, insert its length into
+   the header. */
+static int
+h2StreamUnhold(H2StreamPtr stream)
+{
+    H2BufferPtr in = &stream->in;
+    char buf[40];
+    int n, head, at;
+
+    head = h2HeadLength(in->buf, in->len);
+    if(head < 0)
+        return -1;
+    at = head - 2;
+    n = snprintf(buf, 40, "Content-Length: %d\r\n", in->len - head);
+    if(h2Reserve(in, n) < 0)
+        return -1;
+    memmove(in->buf + at + n, in->buf + at, in->len - at);
+    memcpy(in->buf + at, buf, n);
+    in->len += n;
+    stream->text += n;
+    stream->flags &= ~H2_STREAM_HOLD;
+    return 1;
+}
+
+static void
+h2SessionIdle(H2SessionPtr session);
+
+static void
+h2StreamFree(H2StreamPtr stream)
+{
+    H2SessionPtr session = stream->session;
+    H2StreamPtr *p;
+
+    if(session) {
+        h2StreamRelease(stream);
+        p = &session->streams;
+        while(*p != stream)
+            p = &(*p)->next;
+        *p = stream->next;
+        if(session->streams == NULL)
+            h2SessionIdle(session);
+    }
+
+    if(stream->wake)
+        cancelTimeEvent(stream->wake);
+    h2BufferFree(&stream->in);
+    free(stream);
+}
+
+/* Emulated stream I/O.  A connection carried by a stream has no file
+   descriptor: server.c schedules its reads and writes with the
+   h2DoStream functions below, which have the semantics of their io.c
+   counterparts.  A write's handler is only called once the peer's
+   windows have admitted all of its data, and the window of a reply is
+   only opened as server.c reads it.  Handlers are called from the
+   stream's wake event, never from within a session handler. */
+
+static int h2StreamWakeHandler(TimeEventHandlerPtr event);
+
+static void
+h2StreamWake(H2StreamPtr stream)
+{
+    if(stream->wake)
+        return;
+    stream->wake = scheduleTimeEvent(0, h2StreamWakeHandler,
+                                     sizeof(stream), &stream);
+    if(stream->wake == NULL)
+        do_log(L_ERROR, "Couldn't schedule HTTP/2 stream.\n");
+}
+
+/* Call the handler of the pending read or write.  Returns 0 if the
+   handler finished the stream. */
+static int
+h2StreamCall(H2StreamPtr stream, int flag, int status)
+{
+    StreamRequestPtr pending =
+        flag == H2_STREAM_READING ? &stream->reading : &stream->writing;
+    StreamRequestRec request = *pending;
+    int done;
+
+    stream->flags &= ~flag;
+    done = request.handler(status, NULL, &request);
+    if(stream->flags & H2_STREAM_DEAD)
+        return 0;
+    if(!done) {
+        assert(!(stream->flags & flag));
+        *pending = request;
+        stream->flags |= flag;
+    }
+    return 1;
+}
+
+/* The buffers of a request, in order. */
+static int
+h2Segments(StreamRequestPtr request, char **bufs, int *lens)
+{
+    int n = 0;
+
+    if(!(request->operation & (IO_BUF3 | IO_BUF_LOCATION)) &&
+       request->u.h.hlen > 0) {
+        bufs[n] = request->u.h.header;
+        lens[n++] = request->u.h.hlen;
+    }
+    if(request->operation & IO_BUF_LOCATION)
+        request->buf = *request->u.l.buf_location;
+    bufs[n] = request->buf;
+    lens[n++] = request->len;
+    bufs[n] = request->buf2;
+    lens[n++] = request->len2;
+    if(request->operation & IO_BUF3) {
+        bufs[n] = request->u.b.buf3;
+        lens[n++] = request->u.b.len3;
+    }
+    return n;
+}
+
+static int
+h2StreamWrite(H2StreamPtr stream)
+{
+    StreamRequestPtr request = &stream->writing;
+    H2SessionPtr session = stream->session;
+    char *bufs[4];
+    int lens[4], n, i, k, m, total, pos, hlen, end, rc;
+
+    if(!(stream->flags & H2_STREAM_WRITING))
+        return 1;
+    if(stream->flags & H2_STREAM_SHUT)
+        return h2StreamCall(stream, H2_STREAM_WRITING,
+                            stream->status < 0 ? stream->status : -EPIPE);
+
+    n = h2Segments(request, bufs, lens);
+    total = 0;
+    for(i = 0; i < n; i++)
+        total += lens[i];
+
+    pos = stream->written;
+    while(pos < total) {
+        i = 0;
+        k = pos;
+        while(k >= lens[i]) {
+            k -= lens[i];
+            i++;
+        }
+        if(!(stream->flags & H2_STREAM_HEADERS)) {
+            /* The header is always written in a single buffer. */
+            m = h2HeadLength(bufs[i] + k, lens[i] - k);
+            if(m < 0) {
+                do_log(L_ERROR, "Couldn't find end of HTTP/2 header.\n");
+                return h2StreamCall(stream, H2_STREAM_WRITING, -EINVAL);
+            }
+            if(stream->flags & H2_STREAM_SERVER)
+                rc = h2StreamResponse(stream, bufs[i] + k, m);
+            else
+                rc = h2StreamRequest(stream, bufs[i] + k, m);
+            if(rc < 0) {
+                do_log(L_ERROR, "Couldn't send HTTP/2 header.\n");
+                return h2StreamCall(stream, H2_STREAM_WRITING, -EINVAL);
+            }
+            if(rc == 0)
+                break;
+            pos += m;
+            continue;
+        }
+        if(stream->flags & H2_STREAM_LOCAL_DONE) {
+            /* The peer doesn't want any more. */
+            pos = total;
+            break;
+        }
+        if(session->out.len >= H2_SESSION_BUFFER) {
+            session->flags |= H2_SESSION_FULL;
+            break;
+        }
+        m = lens[i] - k;
+        if(stream->remaining >= 0)
+            m = MIN(m, stream->remaining);
+        m = MIN(m, stream->send_window);
+        m = MIN(m, session->send_window);
+        m = MIN(m, session->peer_frame_size);
+        if(m <= 0)
+            break;
+        if(stream->remaining >= 0)
+            end = m == stream->remaining;
+        else
+            end = (stream->flags & H2_STREAM_CHUNKED) &&
+                (request->operation & IO_END) && pos + m == total;
+        if(h2WriteFrame(session, H2_DATA, end ? H2_FLAG_END_STREAM : 0,
+                        stream->id, bufs[i] + k, m) < 0)
+            return h2StreamCall(stream, H2_STREAM_WRITING, -ENOMEM);
+        stream->send_window -= m;
+        session->send_window -= m;
+        if(stream->remaining >= 0)
+            stream->remaining -= m;
+        pos += m;
+        if(end)
+            h2StreamLocalDone(stream);
+    }
+
+    stream->written = pos;
+    if(pos < total)
+        return 1;
+
+    if((stream->flags & H2_STREAM_CHUNKED) && (request->operation & IO_END) &&
+       !(stream->flags & H2_STREAM_LOCAL_DONE)) {
+        /* The last chunk came without any data. */
+        if(h2WriteFrame(session, H2_DATA, H2_FLAG_END_STREAM,
+                        stream->id, NULL, 0) < 0)
+            return h2StreamCall(stream, H2_STREAM_WRITING, -ENOMEM);
+        h2StreamLocalDone(stream);
+    }
+
+    /* Report progress as io.c would. */
+    stream->written = 0;
+    hlen = (request->operation & (IO_BUF3 | IO_BUF_LOCATION)) ?
+        0 : request->u.h.hlen;
+    request->offset = total - hlen;
+    if(request->operation & IO_CHUNKED) {
+        if(request->operation & IO_END)
+            request->offset += total > hlen ? 7 : 5;
+        else
+            request->offset += 2;
+    }
+    return h2StreamCall(stream, H2_STREAM_WRITING, 0);
+}
+
+/* The HTTP layer has read n bytes of the stream's input.  The peer may
+   send as much more. */
+static void
+h2StreamConsume(H2StreamPtr stream, int n)
+{
+    int text = MIN(n, stream->text);
+
+    h2Consume(&stream->in, n);
+    stream->text -= text;
+    if(stream->id == 0 || (stream->flags & H2_STREAM_REMOTE_DONE))
+        return;
+    stream->credit += n - text;
+    if(stream->credit > 0 &&
+       (stream->in.len == 0 || stream->credit >= H2_STREAM_WINDOW / 4)) {
+        h2WriteWindowUpdate(stream->session, stream->id, stream->credit);
+        stream->credit = 0;
+    }
+}
+
+static int
+h2StreamRead(H2StreamPtr stream)
+{
+    StreamRequestPtr request = &stream->reading;
+    char *bufs[4];
+    int lens[4], n, i, k, m, total, copied;
+
+    while(stream->flags & H2_STREAM_READING) {
+        if(stream->in.len == 0 || (stream->flags & H2_STREAM_HOLD)) {
+            if(stream->flags & H2_STREAM_SHUT)
+                return h2StreamCall(stream, H2_STREAM_READING,
+                                    stream->status < 0 ? stream->status : 1);
+            /* client.c takes an end of file while it replies for an
+               abort, so the end of a request reads as nothing. */
+            if((stream->flags & H2_STREAM_REMOTE_DONE) &&
+               !(stream->flags & H2_STREAM_SERVER))
+                return h2StreamCall(stream, H2_STREAM_READING, 1);
+            return 1;
+        }
+
+        if((request->operation & IO_BUF_LOCATION) &&
+           *request->u.l.buf_location == NULL) {
+            *request->u.l.buf_location = get_chunk();
+            if(*request->u.l.buf_location == NULL)
+                return h2StreamCall(stream, H2_STREAM_READING, -ENOMEM);
+        }
+        n = h2Segments(request, bufs, lens);
+        total = 0;
+        for(i = 0; i < n; i++)
+            total += lens[i];
+
+        copied = 0;
+        while(request->offset < total && copied < stream->in.len) {
+            i = 0;
+            k = request->offset;
+            while(k >= lens[i]) {
+                k -= lens[i];
+                i++;
+            }
+            m = MIN(lens[i] - k, stream->in.len - copied);
+            memcpy(bufs[i] + k, stream->in.buf + copied, m);
+            copied += m;
+            request->offset += m;
+        }
+        if(copied == 0)
+            return 1;
+        h2StreamConsume(stream, copied);
+        if(!h2StreamCall(stream, H2_STREAM_READING, 0))
+            return 0;
+    }
+    return 1;
+}
+
+/* An idle connection to the server whose stream is lost goes away, as
+   httpServerIdleHandler does for a connection with a socket. */
+static int
+h2StreamIdleLost(H2StreamPtr stream)
+{
+    HTTPConnectionPtr connection = stream->connection;
+
+    if(connection->request || connection->connecting ||
+       (stream->flags & (H2_STREAM_READING | H2_STREAM_WRITING)))
+        return 0;
+    do_log(D_SERVER_CONN, "Idle connection to %s:%d died.\n",
+           scrub(connection->server->name), connection->server->port);
+    httpServerAbort(connection, 1, 504, internAtom("Timeout"));
+    return 1;
+}
+
+static int
+h2StreamWakeHandler(TimeEventHandlerPtr event)
+{
+    H2StreamPtr stream = *(H2StreamPtr*)event->data;
+    H2SessionPtr session;
+    int status, what;
+
+    stream->wake = NULL;
+    stream->flags |= H2_STREAM_RUNNING;
+
+    if(stream->flags & H2_STREAM_ATTACH) {
+        if(!(stream->flags & H2_STREAM_SHUT) &&
+           (stream->session->flags & H2_SESSION_CONNECTING))
+            goto done;
+        stream->flags &= ~H2_STREAM_ATTACH;
+        if(stream->flags & H2_STREAM_SHUT)
+            status = stream->status < 0 ? stream->status : -ECONNRESET;
+        else
+            status = 0;
+        httpServerConnectionHandlerCommon(status, stream->connection);
+        if(stream->flags & H2_STREAM_DEAD)
+            goto done;
+    }
+
+    if(stream->poke) {
+        status = stream->poke_status;
+        what = stream->poke;
+        stream->poke = 0;
+        if((what & POLLOUT) && (stream->flags & H2_STREAM_WRITING) &&
+           !h2StreamCall(stream, H2_STREAM_WRITING, status))
+            goto done;
+        if((what & POLLIN) && (stream->flags & H2_STREAM_READING) &&
+           !h2StreamCall(stream, H2_STREAM_READING, status))
+            goto done;
+    }
+
+    if(!h2StreamWrite(stream) || !h2StreamRead(stream))
+        goto done;
+
+    if((stream->flags & H2_STREAM_SHUT) && !(stream->flags & H2_STREAM_SERVER))
+        h2StreamIdleLost(stream);
+
+ done:
+    stream->flags &= ~H2_STREAM_RUNNING;
+    session = stream->session;
+    if(stream->flags & H2_STREAM_DEAD)
+        h2StreamFree(stream);
+    if(session)
+        h2SessionDispatch(session);
+    return 1;
+}
+
+static void
+h2ScheduleStream(int operation, HTTPConnectionPtr connection, int offset,
+                 char *header, int hlen,
+                 char *buf, int len, char *buf2, int len2,
+                 char *buf3, int len3, char **buf_location,
+                 int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+                 void *data)
+{
+    H2StreamPtr stream = connection->h2stream;
+    StreamRequestRec request;
+    int flag;
+
+    request.operation = operation;
+    request.fd = -1;
+    if(len3) {
+        request.u.b.len3 = len3;
+        request.u.b.buf3 = buf3;
+        request.operation |= IO_BUF3;
+    } else if(buf_location) {
+        request.u.l.buf_location = buf_location;
+        request.operation |= IO_BUF_LOCATION;
+    } else {
+        request.u.h.hlen = hlen;
+        request.u.h.header = header;
+    }
+    request.offset = offset;
+    request.buf = buf;
+    request.len = len;
+    request.buf2 = buf2;
+    request.len2 = len2;
+    request.handler = handler;
+    request.data = data;
+
+    if((operation & IO_MASK) == IO_WRITE) {
+        /* Writes always start at the beginning of their buffers. */
+        assert(offset == 0);
+        flag = H2_STREAM_WRITING;
+        stream->writing = request;
+        stream->written = 0;
+    } else {
+        if((operation & IO_IMMEDIATE) && handler(0, NULL, &request))
+            return;
+        flag = H2_STREAM_READING;
+        stream->reading = request;
+    }
+    assert(!(stream->flags & flag));
+    stream->flags |= flag;
+    h2StreamWake(stream);
+}
+
+void
+h2DoStream(int operation, HTTPConnectionPtr connection, int offset,
+           char *buf, int len,
+           int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+           void *data)
+{
+    h2ScheduleStream(operation, connection, offset, NULL, 0,
+                     buf, len, NULL, 0, NULL, 0, NULL, handler, data);
+}
+
+void
+h2DoStreamH(int operation, HTTPConnectionPtr connection, int offset,
+            char *header, int hlen, char *buf, int len,
+            int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+            void *data)
+{
+    h2ScheduleStream(operation, connection, offset, header, hlen,
+                     buf, len, NULL, 0, NULL, 0, NULL, handler, data);
+}
+
+void
+h2DoStream2(int operation, HTTPConnectionPtr connection, int offset,
+            char *buf, int len, char *buf2, int len2,
+            int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+            void *data)
+{
+    h2ScheduleStream(operation, connection, offset, NULL, 0,
+                     buf, len, buf2, len2, NULL, 0, NULL, handler, data);
+}
+
+void
+h2DoStream3(int operation, HTTPConnectionPtr connection, int offset,
+            char *buf, int len, char *buf2, int len2, char *buf3, int len3,
+            int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+            void *data)
+{
+    h2ScheduleStream(operation, connection, offset, NULL, 0,
+                     buf, len, buf2, len2, buf3, len3, NULL, handler, data);
+}
+
+void
+h2DoStreamBuf(int operation, HTTPConnectionPtr connection, int offset,
+              char **buf_location, int len,
+              int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+              void *data)
+{
+    h2ScheduleStream(operation, connection, offset, NULL, 0,
+                     *buf_location, len, NULL, 0, NULL, 0, buf_location,
+                     handler, data);
+}
+
+/* Like pokeFdEvent */
+void
+h2PokeStream(HTTPConnectionPtr connection, int status, int what)
+{
+    H2StreamPtr stream = connection->h2stream;
+
+    stream->poke_status = status;
+    stream->poke |= what;
+    h2StreamWake(stream);
+}
+
+/* Like shutdown(fd, 2): the stream is reset, further writes fail and
+   reads return an end of file. */
+void
+h2Shutdown(HTTPConnectionPtr connection)
+{
+    H2StreamPtr stream = connection->h2stream;
+
+    h2StreamReset(stream, H2_CANCEL);
+    h2StreamShut(stream, 0);
+    if(stream->session)
+        h2SessionDispatch(stream->session);
+}
+
+void
+h2Timeout(HTTPConnectionPtr connection)
+{
+    H2StreamPtr stream = connection->h2stream;
+
+    h2StreamReset(stream, H2_CANCEL);
+    h2StreamShut(stream, -EDOTIMEOUT);
+    if(stream->session)
+        h2SessionDispatch(stream->session);
+}
+
+/* Called by server.c or client.c when it is done with an exchange.
+   Unless both sides have finished, the stream is reset.  If s is not
+   0, the connection is going away, and so does the stream. */
+void
+h2StreamFinish(HTTPConnectionPtr connection, int s)
+{
+    H2StreamPtr stream = connection->h2stream;
+    H2SessionPtr session = stream->session;
+
+    if(stream->flags & H2_STREAM_SERVER) {
+        /* A reply without a length ends with the connection. */
+        if(stream->id != 0 && (stream->flags & H2_STREAM_HEADERS) &&
+           !(stream->flags & (H2_STREAM_LOCAL_DONE | H2_STREAM_CHUNKED)) &&
+           stream->remaining < 0 &&
+           h2WriteFrame(session, H2_DATA, H2_FLAG_END_STREAM,
+                        stream->id, NULL, 0) >= 0)
+            h2StreamLocalDone(stream);
+        if(stream->id != 0)
+            do_log(L_ERROR, "Truncated reply on HTTP/2 stream %u.\n",
+                   stream->id);
+        h2StreamReset(stream, H2_INTERNAL_ERROR);
+    } else {
+        h2StreamReset(stream, H2_CANCEL);
+        stream->flags &= ~(H2_STREAM_REMOTE_DONE | H2_STREAM_LOCAL_DONE |
+                           H2_STREAM_FINAL | H2_STREAM_HEADERS |
+                           H2_STREAM_HEAD);
+        stream->in.len = 0;
+        stream->text = 0;
+    }
+
+    if(s) {
+        stream->flags &= ~(H2_STREAM_READING | H2_STREAM_WRITING);
+        stream->connection = NULL;
+        connection->h2stream = NULL;
+        if(stream->flags & H2_STREAM_RUNNING)
+            stream->flags |= H2_STREAM_DEAD;
+        else
+            h2StreamFree(stream);
+    }
+    if(session)
+        h2SessionDispatch(session);
+}
+
+/* Sessions */
+
+static const char *h2PseudoNames[4] =
+    { ":method", ":scheme", ":authority", ":path" };
+
+/* Accumulate a decoded header field into the session's HTTP/1.1
+   header lines. */
+static void
+h2HeaderField(H2SessionPtr session, const char *name, int name_len,
+              const char *value, int value_len)
+{
+    int i;
+
+    if(session->head_bad)
+        return;
+    session->head_size += name_len + value_len + 32;
+    if(session->head_size > H2_MAX_HEADER_LIST) {
+        session->head_bad = 1;
+        return;
+    }
+
+    if(name_len == 0) {
+        session->head_bad = 1;
+        return;
+    }
+    for(i = 0; i < name_len; i++) {
+        if(name[i] == '\r' || name[i] == '\n' || name[i] == '\0' ||
+           name[i] == ' ' || (i > 0 && name[i] == ':')) {
+            session->head_bad = 1;
+            return;
+        }
+    }
+    for(i = 0; i < value_len; i++) {
+        if(value[i] == '\r' || value[i] == '\n' || value[i] == '\0') {
+            session->head_bad = 1;
+            return;
+        }
+    }
+
+    if(name[0] == ':') {
+        if(session->flags & H2_SESSION_SERVER) {
+            for(i = 0; i < 4; i++)
+                if(h2NameIs(name, name_len, h2PseudoNames[i]))
+                    break;
+            if(i >= 4 || session->pseudo_len[i] >= 0 ||
+               session->head.len > 0 || session->cookie.len > 0) {
+                session->head_bad = 1;
+                return;
+            }
+            session->pseudo_offset[i] = session->pseudo.len;
+            session->pseudo_len[i] = value_len;
+            if(h2Append(&session->pseudo, value, value_len) < 0)
+                session->head_bad = 1;
+        } else if(h2NameIs(name, name_len, ":status") && value_len == 3 &&
+                  digit(value[0]) && digit(value[1]) && digit(value[2])) {
+            session->head_status = atoi(value);
+        } else {
+            session->head_bad = 1;
+        }
+        return;
+    }
+
+    if(h2HopByHop(name, name_len))
+        return;
+    if(h2NameIs(name, name_len, "content-length"))
+        session->head_length = 1;
+
+    if(session->flags & H2_SESSION_SERVER) {
+        if(h2NameIs(name, name_len, "te"))
+            return;
+        if(h2NameIs(name, name_len, "host"))
+            session->head_host = 1;
+        if(h2NameIs(name, name_len, "cookie")) {
+            /* Cookies may be split into multiple fields. */
+            if((session->cookie.len > 0 &&
+                h2Append(&session->cookie, "; ", 2) < 0) ||
+               h2Append(&session->cookie, value, value_len) < 0)
+                session->head_bad = 1;
+            return;
+        }
+    }
+
+    if(h2Append(&session->head, name, name_len) < 0 ||
+       h2Append(&session->head, ": ", 2) < 0 ||
+       h2Append(&session->head, value, value_len) < 0 ||
+       h2Append(&session->head, "\r\n", 2) < 0)
+        session->head_bad = 1;
+}
+
+static int
+h2DecodeBlock(H2SessionPtr session, const unsigned char *buf, int len)
+{
+    H2TablePtr table = &session->decoder;
+    const char *name, *value;
+    int name_len, value_len, value_offset, literal, incremental;
+    int i = 0;
+    unsigned int index;
+
+    if(h2Reserve(&session->scratch, 1) < 0)
+        return -1;
+
+    while(i < len) {
+        session->scratch.len = 0;
+        if(buf[i] & 0x80) {
+            if(h2DecodeInteger(buf, len, &i, 7, &index) < 0 ||
+               h2TableLookup(table, index, &name, &name_len,
+                             &value, &value_len) < 0)
+                return -1;
+            h2HeaderField(session, name, name_len, value, value_len);
+            continue;
+        }
+
+        if((buf[i] & 0xE0) == 0x20) {
+            if(h2DecodeInteger(buf, len, &i, 5, &index) < 0 ||
+               index > H2_TABLE_SIZE)
+                return -1;
+            table->max_size = index;
+            h2TableEvict(table, index);
+            continue;
+        }
+
+        incremental = (buf[i] & 0x40) != 0;
+        if(h2DecodeInteger(buf, len, &i, incremental ? 6 : 4, &index) < 0)
+            return -1;
+        literal = (index == 0);
+        if(literal) {
+            if(h2DecodeString(buf, len, &i, &session->scratch) < 0)
+                return -1;
+            name_len = session->scratch.len;
+        } else {
+            if(h2TableLookup(table, index, &name, &name_len,
+                             &value, &value_len) < 0)
+                return -1;
+        }
+        value_offset = session->scratch.len;
+        if(h2DecodeString(buf, len, &i, &session->scratch) < 0)
+            return -1;
+        /* The scratch buffer may have moved. */
+        if(literal)
+            name = session->scratch.buf;
+        value = session->scratch.buf + value_offset;
+        value_len = session->scratch.len - value_offset;
+
+        /* An indexed name points into the dynamic table, and adding
+           the new entry may evict the one it lives in, so use the
+           field before adding it. */
+        h2HeaderField(session, name, name_len, value, value_len);
+        if(incremental &&
+           h2TableAdd(table, name, name_len, value, value_len) < 0)
+            return -1;
+    }
+    return 1;
+}
+
+/* Append the HTTP/1.1 request for the header block just decoded to the
+   stream's input, for client.c to read.  A request with a body but no
+   Content-Length is held back until the body is complete. */
+static int
+h2StreamRequestHead(H2StreamPtr stream, int end)
+{
+    H2SessionPtr session = stream->session;
+    H2BufferPtr in = &stream->in;
+    const char *pseudo[4];
+    int i, len[4], connect = 0;
+
+    for(i = 0; i < 4; i++) {
+        pseudo[i] = session->pseudo.buf + session->pseudo_offset[i];
+        len[i] = session->pseudo_len[i];
+    }
+    if(len[H2_PSEUDO_METHOD] <= 0)
+        return -1;
+
+    if(len[H2_PSEUDO_METHOD] == 7 &&
+       memcmp(pseudo[H2_PSEUDO_METHOD], "CONNECT", 7) == 0) {
+        if(len[H2_PSEUDO_AUTHORITY] <= 0)
+            return -1;
+        /* client.c refuses tunnels on a stream. */
+        connect = 1;
+        if(h2Append(in, "CONNECT ", 8) < 0 ||
+           h2Append(in, pseudo[H2_PSEUDO_AUTHORITY],
+                    len[H2_PSEUDO_AUTHORITY]) < 0)
+            return -1;
+    } else {
+        if(len[H2_PSEUDO_SCHEME] <= 0 || len[H2_PSEUDO_PATH] <= 0)
+            return -1;
+        if(len[H2_PSEUDO_METHOD] == 4 &&
+           memcmp(pseudo[H2_PSEUDO_METHOD], "HEAD", 4) == 0)
+            stream->flags |= H2_STREAM_HEAD;
+        if(h2Append(in, pseudo[H2_PSEUDO_METHOD],
+                    len[H2_PSEUDO_METHOD]) < 0 ||
+           h2Append(in, " ", 1) < 0)
+            return -1;
+        /* Requests to a proxy carry an absolute URL. */
+        if(len[H2_PSEUDO_AUTHORITY] > 0) {
+            if(h2Append(in, pseudo[H2_PSEUDO_SCHEME],
+                        len[H2_PSEUDO_SCHEME]) < 0 ||
+               h2Append(in, "://", 3) < 0 ||
+               h2Append(in, pseudo[H2_PSEUDO_AUTHORITY],
+                        len[H2_PSEUDO_AUTHORITY]) < 0)
+                return -1;
+        }
+        if(h2Append(in, pseudo[H2_PSEUDO_PATH], len[H2_PSEUDO_PATH]) < 0)
+            return -1;
+    }
+    if(h2Append(in, " HTTP/1.1\r\n", 11) < 0)
+        return -1;
+
+    if(!session->head_host && len[H2_PSEUDO_AUTHORITY] > 0) {
+        if(h2Append(in, "Host: ", 6) < 0 ||
+           h2Append(in, pseudo[H2_PSEUDO_AUTHORITY],
+                    len[H2_PSEUDO_AUTHORITY]) < 0 ||
+           h2Append(in, "\r\n", 2) < 0)
+            return -1;
+    }
+    if(h2Append(in, session->head.buf, session->head.len) < 0)
+        return -1;
+    if(session->cookie.len > 0) {
+        if(h2Append(in, "Cookie: ", 8) < 0 ||
+           h2Append(in, session->cookie.buf, session->cookie.len) < 0 ||
+           h2Append(in, "\r\n", 2) < 0)
+            return -1;
+    }
+    if(h2Append(in, "Connection: close\r\n\r\n", 21) < 0)
+        return -1;
+    stream->text = in->len;
+
+    /* Polipo wants to know the length of a request body up front. */
+    if(!end && !session->head_length && !connect)
+        stream->flags |= H2_STREAM_HOLD;
+    return 1;
+}
+
+/* Hand the stream over to client.c, as if it were a freshly accepted
+   connection, and open it as stream id. */
+static int
+h2StreamAccept(H2StreamPtr stream, unsigned int id)
+{
+    H2SessionPtr session = stream->session;
+    HTTPConnectionPtr connection;
+
+    connection = httpAcceptConnection(-1, stream);
+    if(connection == NULL)
+        return -1;
+
+    stream->connection = connection;
+    stream->next = session->streams;
+    session->streams = stream;
+    h2StreamOpen(stream, id);
+    if(session->timeout) {
+        cancelTimeEvent(session->timeout);
+        session->timeout = NULL;
+    }
+
+    do_log(D_CLIENT_REQ, "HTTP/2 stream %u: ", id);
+    do_log_n(D_CLIENT_REQ, stream->in.buf,
+             h2LineLength(stream->in.buf, stream->in.len));
+    do_log(D_CLIENT_REQ, "\n");
+    return 1;
+}
+
+/* A client opened a new stream. */
+static int
+h2StreamIncoming(H2SessionPtr session, unsigned int id, int end)
+{
+    H2StreamPtr stream;
+    int rc;
+
+    if(id % 2 != 1 || id <= session->last_id)
+        return -H2_PROTOCOL_ERROR;
+    session->last_id = id;
+    if(session->flags & H2_SESSION_GOAWAY)
+        return 1;
+    if(session->numactive >= h2MaxStreams) {
+        h2WriteRstStream(session, id, H2_REFUSED_STREAM);
+        return 1;
+    }
+
+    stream = calloc(1, sizeof(H2StreamRec));
+    if(stream == NULL) {
+        h2WriteRstStream(session, id, H2_REFUSED_STREAM);
+        return 1;
+    }
+    stream->session = session;
+    stream->flags = H2_STREAM_SERVER | H2_STREAM_FINAL;
+
+    if(session->head_bad || h2StreamRequestHead(stream, end) < 0) {
+        do_log(L_ERROR, "Malformed HTTP/2 request on stream %u.\n", id);
+        rc = -EINVAL;
+        goto fail;
+    }
+
+    rc = h2StreamAccept(stream, id);
+    if(rc < 0)
+        goto fail;
+
+    if(end)
+        h2StreamRemoteDone(stream);
+    return 1;
+
+ fail:
+    h2BufferFree(&stream->in);
+    free(stream);
+    h2WriteRstStream(session, id,
+                     rc == -EINVAL ? H2_PROTOCOL_ERROR : H2_REFUSED_STREAM);
+    return 1;
+}
+
+static int
+h2HeaderBlock(H2SessionPtr session)
+{
+    H2StreamPtr stream;
+    unsigned int id = session->block_id;
+    int end = (session->block_flags & H2_FLAG_END_STREAM) != 0;
+    int i, rc;
+
+    session->block_id = 0;
+    session->head.len = 0;
+    session->head_status = -1;
+    session->head_length = 0;
+    session->head_host = 0;
+    session->head_bad = 0;
+    session->head_size = 0;
+    session->pseudo.len = 0;
+    session->cookie.len = 0;
+    for(i = 0; i < 4; i++)
+        session->pseudo_len[i] = -1;
+
+    /* Always decode, the table is shared by all streams. */
+    rc = h2DecodeBlock(session, (unsigned char*)session->block.buf,
+                       session->block.len);
+    session->block.len = 0;
+    if(rc < 0)
+        return -H2_COMPRESSION_ERROR;
+
+    stream = h2FindStream(session, id);
+    if(stream == NULL && (session->flags & H2_SESSION_SERVER))
+        return h2StreamIncoming(session, id, end);
+    if(stream == NULL || (stream->flags & H2_STREAM_REMOTE_DONE))
+        return 1;
+
+    if(session->flags & H2_SESSION_SERVER) {
+        /* Trailers, which we drop. */
+        if(!end)
+            return -H2_PROTOCOL_ERROR;
+        h2StreamRemoteDone(stream);
+        return 1;
+    }
+
+    if(session->head_bad || h2StreamReply(stream, end) < 0) {
+        do_log(L_ERROR, "Malformed HTTP/2 reply on stream %u.\n", id);
+        h2StreamReset(stream, H2_PROTOCOL_ERROR);
+        h2StreamShut(stream, -ECONNRESET);
+    } else if(end) {
+        h2StreamRemoteDone(stream);
+    } else if(stream->flags & H2_STREAM_READING) {
+        h2StreamWake(stream);
+    }
+    return 1;
+}
+
+static int
+h2Settings(H2SessionPtr session, const unsigned char *p, int len)
+{
+    H2StreamPtr stream;
+    unsigned int value;
+    int i, id, delta;
+
+    for(i = 0; i < len; i += 6) {
+        id = (p[i] << 8) | p[i + 1];
+        value = h2Get32(p + i + 2);
+        switch(id) {
+        case H2_SETTINGS_HEADER_TABLE_SIZE:
+            value = MIN(value, H2_TABLE_SIZE);
+            if(value != session->encoder.max_size) {
+                session->encoder.max_size = value;
+                h2TableEvict(&session->encoder, value);
+                session->encoder_update = 1;
+            }
+            break;
+        case H2_SETTINGS_MAX_CONCURRENT_STREAMS:
+            session->peer_max_streams = MIN(value, H2_MAX_WINDOW);
+            break;
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+            if(value > H2_MAX_WINDOW)
+                return -H2_FLOW_CONTROL_ERROR;
+            delta = value - session->peer_window;
+            for(stream = session->streams; stream; stream = stream->next)
+                if(stream->id != 0)
+                    stream->send_window += delta;
+            session->peer_window = value;
+            break;
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if(value < 16384 || value > 16777215)
+                return -H2_PROTOCOL_ERROR;
+            session->peer_frame_size = value;
+            break;
+        default:
+            break;
+        }
+    }
+    session->flags |= H2_SESSION_WAKE;
+    return 1;
+}
+
+/* The server won't accept any more streams on this session.  Requests
+   that it didn't process, and those not sent yet, are resent by
+   server.c on a fresh session.  A client going away lets its streams
+   finish. */
+static void
+h2Goaway(H2SessionPtr session, unsigned int last)
+{
+    H2StreamPtr stream;
+
+    if(session->flags & H2_SESSION_SERVER) {
+        session->flags |= H2_SESSION_GOAWAY;
+        if(session->streams == NULL)
+            h2SessionIdle(session);
+        return;
+    }
+
+    if(session->server) {
+        do_log(D_SERVER_CONN, "HTTP/2 session to %s:%d going away.\n",
+               scrub(session->server->name), session->server->port);
+        if(session->server->h2session == session)
+            session->server->h2session = NULL;
+        session->server = NULL;
+    }
+    session->flags |= H2_SESSION_GOAWAY | H2_SESSION_WAKE;
+
+    for(stream = session->streams; stream; stream = stream->next) {
+        /* A connection still being attached will notice when it
+           sends its first request. */
+        if(stream->id > last ||
+           (stream->id == 0 &&
+            !(stream->flags & (H2_STREAM_HEADERS | H2_STREAM_ATTACH))))
+            h2StreamRefuse(stream);
+    }
+}
+
+static int
+h2Frame(H2SessionPtr session, int type, int flags, unsigned int id,
+        const unsigned char *p, int len)
+{
+    H2StreamPtr stream;
+    unsigned int increment;
+    int pad = 0, skip = 0, rc;
+
+    switch(type) {
+    case H2_DATA:
+        if(id == 0)
+            return -H2_PROTOCOL_ERROR;
+        if(flags & H2_FLAG_PADDED) {
+            if(len < 1 || p[0] >= len)
+                return -H2_PROTOCOL_ERROR;
+            pad = p[0];
+            skip = 1;
+        }
+        session->credit += len;
+        if(session->credit >= H2_SESSION_WINDOW / 2) {
+            h2WriteWindowUpdate(session, 0, session->credit);
+            session->credit = 0;
+        }
+        stream = h2FindStream(session, id);
+        if(stream == NULL || (stream->flags & H2_STREAM_REMOTE_DONE))
+            return 1;
+        /* Padding is flow-controlled too, give it back straight away. */
+        stream->credit += skip + pad;
+        rc = h2StreamData(stream, (const char*)p + skip, len - skip - pad,
+                          flags & H2_FLAG_END_STREAM);
+        if(rc < 0) {
+            h2StreamReset(stream, H2_PROTOCOL_ERROR);
+            h2StreamShut(stream, -ECONNRESET);
+        }
+        return 1;
+
+    case H2_HEADERS:
+        if(id == 0 || session->block_id != 0)
+            return -H2_PROTOCOL_ERROR;
+        if(flags & H2_FLAG_PADDED) {
+            if(len < 1)
+                return -H2_PROTOCOL_ERROR;
+            pad = p[0];
+            skip = 1;
+        }
+        if(flags & H2_FLAG_PRIORITY)
+            skip += 5;
+        if(skip + pad > len)
+            return -H2_PROTOCOL_ERROR;
+        session->block.len = 0;
+        if(h2Append(&session->block, (const char*)p + skip,
+                    len - skip - pad) < 0)
+            return -H2_INTERNAL_ERROR;
+        session->block_id = id;
+        session->block_flags = flags;
+        if(flags & H2_FLAG_END_HEADERS)
+            return h2HeaderBlock(session);
+        return 1;
+
+    case H2_CONTINUATION:
+        if(id == 0 || id != session->block_id)
+            return -H2_PROTOCOL_ERROR;
+        if(session->block.len + len > H2_MAX_HEAD)
+            return -H2_PROTOCOL_ERROR;
+        if(h2Append(&session->block, (const char*)p, len) < 0)
+            return -H2_INTERNAL_ERROR;
+        if(flags & H2_FLAG_END_HEADERS)
+            return h2HeaderBlock(session);
+        return 1;
+
+    case H2_RST_STREAM:
+        if(id == 0)
+            return -H2_PROTOCOL_ERROR;
+        if(len != 4)
+            return -H2_FRAME_SIZE_ERROR;
+        stream = h2FindStream(session, id);
+        if(stream == NULL)
+            return 1;
+        do_log(D_SERVER_CONN, "HTTP/2 stream %u reset (%u).\n",
+               id, h2Get32(p));
+        if(!(session->flags & H2_SESSION_SERVER) &&
+           (stream->flags & H2_STREAM_REMOTE_DONE)) {
+            /* The reply is complete, the server just doesn't want the
+               rest of the request. */
+            stream->flags |= H2_STREAM_LOCAL_DONE;
+            h2StreamRelease(stream);
+            h2StreamWake(stream);
+        } else if(!(session->flags & H2_SESSION_SERVER) &&
+                  h2Get32(p) == H2_REFUSED_STREAM) {
+            h2StreamRefuse(stream);
+        } else {
+            h2StreamShut(stream, -ECONNRESET);
+        }
+        return 1;
+
+    case H2_SETTINGS:
+        if(id != 0)
+            return -H2_PROTOCOL_ERROR;
+        if(flags & H2_FLAG_ACK)
+            return 1;
+        if(len % 6 != 0)
+            return -H2_FRAME_SIZE_ERROR;
+        rc = h2Settings(session, p, len);
+        if(rc < 0)
+            return rc;
+        return h2WriteFrame(session, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+
+    case H2_PUSH_PROMISE:
+        /* We disabled push. */
+        return -H2_PROTOCOL_ERROR;
+
+    case H2_PING:
+        if(len != 8)
+            return -H2_FRAME_SIZE_ERROR;
+        if(flags & H2_FLAG_ACK)
+            return 1;
+        return h2WriteFrame(session, H2_PING, H2_FLAG_ACK, 0,
+                            (const char*)p, 8);
+
+    case H2_GOAWAY:
+        if(len < 8)
+            return -H2_FRAME_SIZE_ERROR;
+        h2Goaway(session, h2Get32(p) & 0x7FFFFFFF);
+        return 1;
+
+    case H2_WINDOW_UPDATE:
+        if(len != 4)
+            return -H2_FRAME_SIZE_ERROR;
+        increment = h2Get32(p) & 0x7FFFFFFF;
+        if(id == 0) {
+            if(increment == 0 ||
+               increment > H2_MAX_WINDOW - session->send_window)
+                return -H2_FLOW_CONTROL_ERROR;
+            session->send_window += increment;
+        } else {
+            stream = h2FindStream(session, id);
+            if(stream == NULL)
+                return 1;
+            if(increment == 0 ||
+               increment > H2_MAX_WINDOW - stream->send_window) {
+                h2StreamReset(stream, H2_FLOW_CONTROL_ERROR);
+                h2StreamShut(stream, -ECONNRESET);
+                return 1;
+            }
+            stream->send_window += increment;
+        }
+        session->flags |= H2_SESSION_WAKE;
+        return 1;
+
+    default:
+        /* PRIORITY and unknown frame types */
+        return 1;
+    }
+}
+
+static int
+h2SessionProcess(H2SessionPtr session)
+{
+    const unsigned char *p;
+    unsigned int id;
+    int offset = 0, len, type, flags, rc;
+
+    if(session->flags & H2_SESSION_PREFACE) {
+        len = strlen(H2_PREFACE);
+        if(memcmp(session->in.buf, H2_PREFACE,
+                  MIN(session->in.len, len)) != 0)
+            return -H2_PROTOCOL_ERROR;
+        if(session->in.len < len)
+            return 1;
+        session->flags &= ~H2_SESSION_PREFACE;
+        offset = len;
+    }
+
+    while(session->in.len - offset >= 9) {
+        p = (const unsigned char*)session->in.buf + offset;
+        len = (p[0] << 16) | (p[1] << 8) | p[2];
+        type = p[3];
+        flags = p[4];
+        id = h2Get32(p + 5) & 0x7FFFFFFF;
+        if(len > H2_FRAME_SIZE)
+            return -H2_FRAME_SIZE_ERROR;
+        if(session->in.len - offset < 9 + len)
+            break;
+        if(session->block_id != 0 && type != H2_CONTINUATION)
+            return -H2_PROTOCOL_ERROR;
+        rc = h2Frame(session, type, flags, id, p + 9, len);
+        if(rc < 0)
+            return rc;
+        offset += 9 + len;
+    }
+    h2Consume(&session->in, offset);
+    return 1;
+}
+
+/* Tear down the session and everything relayed over it.  The current
+   handler, if any, must already have cleared its own pointer.  The
+   connections carried by its streams notice on their next I/O. */
+static void
+h2SessionDie(H2SessionPtr session, int status)
+{
+    H2StreamPtr stream;
+
+    if(session->server && session->server->h2session == session)
+        session->server->h2session = NULL;
+
+    while(session->streams) {
+        stream = session->streams;
+        session->streams = stream->next;
+        stream->session = NULL;
+        stream->id = 0;
+        stream->next = stream->hnext = NULL;
+        h2StreamShut(stream, status);
+    }
+
+    if(session->timeout)
+        cancelTimeEvent(session->timeout);
+    if(session->reader)
+        unregisterFdEvent(session->reader);
+    if(session->writer)
+        unregisterFdEvent(session->writer);
+    if(session->fd >= 0)
+        CLOSE(session->fd);
+
+    h2BufferFree(&session->in);
+    h2BufferFree(&session->out);
+    h2BufferFree(&session->block);
+    h2BufferFree(&session->head);
+    h2BufferFree(&session->scratch);
+    h2BufferFree(&session->pseudo);
+    h2BufferFree(&session->cookie);
+    h2BufferFree(&session->encoded);
+    h2TableFree(&session->decoder);
+    h2TableFree(&session->encoder);
+    free(session);
+}
+
+/* Send a GOAWAY, if possible, before dying. */
+static void
+h2SessionError(H2SessionPtr session, int code)
+{
+    int rc;
+
+    if(code == H2_NO_ERROR)
+        do_log(D_SERVER_CONN, "Closing idle HTTP/2 session.\n");
+    else if(session->server)
+        do_log(L_ERROR, "HTTP/2 error %d on session to %s:%d.\n",
+               code, scrub(session->server->name), session->server->port);
+    else
+        do_log(L_ERROR, "HTTP/2 error %d.\n", code);
+
+    if(session->fd >= 0 && h2WriteGoaway(session, code) >= 0) {
+        rc = write(session->fd, session->out.buf, session->out.len);
+        if(rc < 0 && errno != EAGAIN)
+            do_log_error(D_SERVER_CONN, errno, "Couldn't send GOAWAY");
+    }
+    h2SessionDie(session, -ECONNRESET);
+}
+
+static int
+h2SessionTimeoutHandler(TimeEventHandlerPtr event)
+{
+    H2SessionPtr session = *(H2SessionPtr*)event->data;
+
+    session->timeout = NULL;
+    if(session->streams)
+        return 1;
+    if(!(session->flags & H2_SESSION_GOAWAY))
+        h2SessionError(session, H2_NO_ERROR);
+    else
+        h2SessionDie(session, -ECONNRESET);
+    return 1;
+}
+
+/* Close a session that has been left without streams, straight away if
+   it is going away. */
+static void
+h2SessionIdle(H2SessionPtr session)
+{
+    if(session->timeout) {
+        if(!(session->flags & H2_SESSION_GOAWAY))
+            return;
+        cancelTimeEvent(session->timeout);
+    }
+    session->timeout =
+        scheduleTimeEvent((session->flags & H2_SESSION_GOAWAY) ? 0 :
+                          (session->flags & H2_SESSION_SERVER) ?
+                          clientTimeout : serverIdleTimeout,
+                          h2SessionTimeoutHandler,
+                          sizeof(session), &session);
+    if(session->timeout == NULL)
+        do_log(L_ERROR, "Couldn't schedule HTTP/2 session timeout.\n");
+}
+
+static void
+h2SessionDispatch(H2SessionPtr session)
+{
+    H2StreamPtr stream, next;
+
+    while(session->flags & H2_SESSION_WAKE) {
+        session->flags &= ~H2_SESSION_WAKE;
+        for(stream = session->streams; stream; stream = next) {
+            next = stream->next;
+            if(stream->flags & H2_STREAM_WRITING)
+                h2StreamWake(stream);
+        }
+    }
+
+    if(session->fd < 0 || (session->flags & H2_SESSION_CONNECTING))
+        return;
+
+    if(!session->writer && session->out.len > 0) {
+        session->writer = registerFdEvent(session->fd, POLLOUT,
+                                          h2SessionWriteHandler,
+                                          sizeof(session), &session);
+        if(session->writer == NULL)
+            goto fail;
+    }
+    if(!session->reader) {
+        session->reader = registerFdEvent(session->fd, POLLIN,
+                                          h2SessionReadHandler,
+                                          sizeof(session), &session);
+        if(session->reader == NULL)
+            goto fail;
+    }
+    return;
+
+ fail:
+    /* Let the remaining handler notice. */
+    do_log(L_ERROR, "Couldn't register HTTP/2 session handler.\n");
+    shutdown(session->fd, 2);
+}
+
+static int
+h2SessionReadHandler(int status, FdEventHandlerPtr event)
+{
+    H2SessionPtr session = *(H2SessionPtr*)event->data;
+    int rc;
+
+    session->reader = NULL;
+
+    if(status) {
+        h2SessionDie(session, status < 0 ? status : -ECONNRESET);
+        return 1;
+    }
+
+    if(h2Reserve(&session->in, H2_FRAME_SIZE) < 0) {
+        h2SessionError(session, H2_INTERNAL_ERROR);
+        return 1;
+    }
+    rc = read(session->fd, session->in.buf + session->in.len,
+              session->in.size - session->in.len);
+    if(rc < 0 && (errno == EAGAIN || errno == EINTR)) {
+        h2SessionDispatch(session);
+        return 1;
+    }
+    if(rc <= 0) {
+        if(rc < 0)
+            do_log_error(D_SERVER_CONN, errno, "HTTP/2 session read error");
+        h2SessionDie(session, rc < 0 ? -errno : -ECONNRESET);
+        return 1;
+    }
+
+    session->in.len += rc;
+    rc = h2SessionProcess(session);
+    if(rc < 0) {
+        h2SessionError(session, -rc);
+        return 1;
+    }
+    h2SessionDispatch(session);
+    return 1;
+}
+
+static int
+h2SessionWriteHandler(int status, FdEventHandlerPtr event)
+{
+    H2SessionPtr session = *(H2SessionPtr*)event->data;
+    int rc;
+
+    session->writer = NULL;
+
+    if(status) {
+        h2SessionDie(session, status < 0 ? status : -ECONNRESET);
+        return 1;
+    }
+
+    rc = write(session->fd, session->out.buf, session->out.len);
+    if(rc < 0) {
+        if(errno == EAGAIN || errno == EINTR) {
+            h2SessionDispatch(session);
+            return 1;
+        }
+        do_log_error(D_SERVER_CONN, errno, "HTTP/2 session write error");
+        h2SessionDie(session, -errno);
+        return 1;
+    }
+
+    h2Consume(&session->out, rc);
+    if((session->flags & H2_SESSION_FULL) &&
+       session->out.len < H2_SESSION_BUFFER) {
+        session->flags &= ~H2_SESSION_FULL;
+        session->flags |= H2_SESSION_WAKE;
+    }
+    h2SessionDispatch(session);
+    return 1;
+}
+
+/* Connecting */
+
+static int
+h2ConnectFailedHandler(TimeEventHandlerPtr event)
+{
+    HTTPConnectionPtr connection = *(HTTPConnectionPtr*)event->data;
+    httpServerConnectionHandlerCommon(-ENOMEM, connection);
+    return 1;
+}
+
+static H2SessionPtr
+h2MakeSession(HTTPServerPtr server)
+{
+    H2SessionPtr session;
+
+    session = calloc(1, sizeof(H2SessionRec));
+    if(session == NULL)
+        return NULL;
+    session->server = server;
+    session->fd = -1;
+    session->next_id = 1;
+    session->peer_max_streams = H2_MAX_WINDOW;
+    session->peer_window = H2_DEFAULT_WINDOW;
+    session->peer_frame_size = H2_FRAME_SIZE;
+    session->send_window = H2_DEFAULT_WINDOW;
+    h2TableInit(&session->decoder);
+    h2TableInit(&session->encoder);
+    return session;
+}
+
+static int
+h2SessionConnected(H2SessionPtr session, int fd)
+{
+    char settings[18];
+    H2StreamPtr stream;
+
+    session->fd = fd;
+    setNonblocking(fd, 1);
+    session->flags &= ~H2_SESSION_CONNECTING;
+
+    do_log(D_SERVER_CONN, "HTTP/2 session to %s:%d.\n",
+           scrub(session->server->name), session->server->port);
+
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_ENABLE_PUSH;
+    h2Put32(settings + 2, 0);
+    settings[6] = 0;
+    settings[7] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+    h2Put32(settings + 8, H2_STREAM_WINDOW);
+    settings[12] = 0;
+    settings[13] = H2_SETTINGS_MAX_HEADER_LIST_SIZE;
+    h2Put32(settings + 14, H2_MAX_HEADER_LIST);
+    if(h2Append(&session->out, H2_PREFACE, strlen(H2_PREFACE)) < 0 ||
+       h2WriteFrame(session, H2_SETTINGS, 0, 0, settings, 18) < 0 ||
+       h2WriteWindowUpdate(session, 0,
+                           H2_SESSION_WINDOW - H2_DEFAULT_WINDOW) < 0) {
+        h2SessionDie(session, -ENOMEM);
+        return 1;
+    }
+
+    for(stream = session->streams; stream; stream = stream->next) {
+        if(stream->flags & H2_STREAM_ATTACH)
+            h2StreamWake(stream);
+    }
+
+    h2SessionIdle(session);
+    h2SessionDispatch(session);
+    return 1;
+}
+
+static int
+h2ConnectionHandler(int status,
+                    FdEventHandlerPtr event,
+                    ConnectRequestPtr request)
+{
+    H2SessionPtr session = request->data;
+    int rc;
+
+    if(status < 0) {
+        if(request->fd >= 0)
+            CLOSE(request->fd);
+        do_log_error(L_ERROR, -status, "Connect to %s:%d failed",
+                     scrub(session->server->name), session->server->port);
+        h2SessionDie(session, status);
+        return 1;
+    }
+
+    session->server->addrindex = request->index;
+    rc = setNodelay(request->fd, 1);
+    if(rc < 0)
+        do_log_error(L_WARN, errno, "Couldn't disable Nagle's algorithm");
+    return h2SessionConnected(session, request->fd);
+}
+
+static int
+h2SocksHandler(int status, SocksRequestPtr request)
+{
+    H2SessionPtr session = request->data;
+
+    if(status < 0) {
+        h2SessionDie(session, status);
+        return 1;
+    }
+    return h2SessionConnected(session, request->fd);
+}
+
+static int
+h2DnsHandler(int status, GethostbynameRequestPtr request)
+{
+    H2SessionPtr session = request->data;
+
+    if(status <= 0) {
+        do_log(L_ERROR, "Host %s lookup failed.\n",
+               scrub(session->server->name));
+        h2SessionDie(session, status < 0 ? status : -EDNS_HOST_NOT_FOUND);
+        return 1;
+    }
+
+    if(request->addr->string[0] == DNS_CNAME) {
+        if(request->count > 10) {
+            h2SessionDie(session, -EDNS_CNAME_LOOP);
+            return 1;
+        }
+        do_gethostbyname(request->addr->string + 1, request->count + 1,
+                         h2DnsHandler, session);
+        return 1;
+    }
+
+    do_connect(retainAtom(request->addr), session->server->addrindex,
+               session->server->port, h2ConnectionHandler, session);
+    return 1;
+}
+
+/* Called by httpServerConnection for a server that speaks HTTP/2.  The
+   connection gets a stream of the server's session instead of a socket,
+   and is handed back to server.c once the session is open. */
+int
+h2Connect(HTTPConnectionPtr connection)
+{
+    HTTPServerPtr server = connection->server;
+    H2SessionPtr session = server->h2session;
+    H2StreamPtr stream;
+    int new = 0;
+
+    if(session == NULL) {
+        session = h2MakeSession(server);
+        if(session == NULL)
+            goto fail;
+        session->flags = H2_SESSION_CONNECTING;
+        server->h2session = session;
+        new = 1;
+    }
+
+    stream = calloc(1, sizeof(H2StreamRec));
+    if(stream == NULL) {
+        if(new) {
+            server->h2session = NULL;
+            h2SessionDie(session, -ENOMEM);
+        }
+        goto fail;
+    }
+    stream->session = session;
+    stream->connection = connection;
+    stream->flags = H2_STREAM_ATTACH;
+    stream->next = session->streams;
+    session->streams = stream;
+    if(session->timeout) {
+        cancelTimeEvent(session->timeout);
+        session->timeout = NULL;
+    }
+    connection->h2stream = stream;
+
+    if(!(session->flags & H2_SESSION_CONNECTING)) {
+        h2StreamWake(stream);
+    } else if(new) {
+        do_log(D_SERVER_CONN, "HTTP/2 C... %s:%d.\n",
+               scrub(server->name), server->port);
+        if(socksParentProxy)
+            do_socks_connect(server->name, server->port,
+                             h2SocksHandler, session);
+        else
+            do_gethostbyname(server->name, 0, h2DnsHandler, session);
+    }
+    return 1;
+
+ fail:
+    /* Never call back server.c from within httpServerConnection. */
+    if(scheduleTimeEvent(0, h2ConnectFailedHandler,
+                         sizeof(connection), &connection) == NULL)
+        do_log(L_ERROR, "Couldn't schedule HTTP/2 connection failure.\n");
+    return -1;
+}
+
+void
+h2ServerDiscard(HTTPServerPtr server)
+{
+    if(server->h2session &&
+       !(server->h2session->flags & H2_SESSION_CONNECTING))
+        h2SessionDie(server->h2session, -ECONNRESET);
+}
+
+/* Accepting HTTP/2 from clients */
+
+static int
+h2Base64Decode(const char *s, int len, H2BufferPtr out)
+{
+    unsigned int bits = 0;
+    int i, n = 0, v;
+
+    if(h2Reserve(out, len) < 0)
+        return -1;
+    for(i = 0; i < len; i++) {
+        if(s[i] >= 'A' && s[i] <= 'Z')
+            v = s[i] - 'A';
+        else if(s[i] >= 'a' && s[i] <= 'z')
+            v = s[i] - 'a' + 26;
+        else if(s[i] >= '0' && s[i] <= '9')
+            v = s[i] - '0' + 52;
+        else if(s[i] == '-' || s[i] == '+')
+            v = 62;
+        else if(s[i] == '_' || s[i] == '/')
+            v = 63;
+        else if(s[i] == '=')
+            break;
+        else
+            return -1;
+        bits = (bits << 6) | v;
+        n += 6;
+        if(n >= 8) {
+            n -= 8;
+            out->buf[out->len++] = (bits >> n) & 0xFF;
+        }
+    }
+    return 1;
+}
+
+static int
+h2HasToken(const char *value, int value_len, const char *token)
+{
+    int i = 0, j, n = strlen(token);
+
+    while(i < value_len) {
+        while(i < value_len && (value[i] == ' ' || value[i] == ','))
+            i++;
+        j = i;
+        while(j < value_len && value[j] != ',' && value[j] != ' ')
+            j++;
+        if(j - i == n && lwrcmp(value + i, token, n) == 0)
+            return 1;
+        i = j;
+    }
+    return 0;
+}
+
+/* Check whether buf holds a request without a body that asks to be
+   upgraded to h2c.  Returns the length of its header, or 0. */
+static int
+h2UpgradeRequest(const char *buf, int len,
+                 int *settings_return, int *settings_len_return)
+{
+    int head, eol, i, next, upgrade = 0, settings = -1, settings_len = 0;
+    int name, name_len, value, value_len;
+
+    head = h2HeadLength(buf, len);
+    if(head < 0)
+        return 0;
+    eol = h2LineLength(buf, head);
+    if(eol < 9 || memcmp(buf + eol - 9, " HTTP/1.1", 9) != 0)
+        return 0;
+
+    for(i = eol + 2; i < head - 2; i = next) {
+        next = h2HeaderLine(buf, head, i, &name, &name_len,
+                            &value, &value_len);
+        if(next < 0)
+            return 0;
+        if(name_len == 0)
+            continue;
+        if(h2NameIs(buf + name, name_len, "upgrade")) {
+            if(h2HasToken(buf + value, value_len, "h2c"))
+                upgrade = 1;
+        } else if(h2NameIs(buf + name, name_len, "http2-settings")) {
+            if(settings >= 0)
+                return 0;
+            settings = value;
+            settings_len = value_len;
+        } else if(h2NameIs(buf + name, name_len, "content-length")) {
+            if(value_len != 1 || buf[value] != '0')
+                return 0;
+        } else if(h2NameIs(buf + name, name_len, "transfer-encoding")) {
+            return 0;
+        }
+    }
+    if(!upgrade || settings < 0)
+        return 0;
+    *settings_return = settings;
+    *settings_len_return = settings_len;
+    return head;
+}
+
+/* The request that asked for the upgrade becomes stream 1. */
+static int
+h2StreamUpgraded(H2SessionPtr session, const char *buf, int head)
+{
+    H2StreamPtr stream;
+    int eol, i, next, rc;
+    int name, name_len, value, value_len;
+
+    stream = calloc(1, sizeof(H2StreamRec));
+    if(stream == NULL)
+        return -1;
+    stream->session = session;
+    stream->flags =
+        H2_STREAM_SERVER | H2_STREAM_FINAL | H2_STREAM_REMOTE_DONE;
+    if(head >= 5 && memcmp(buf, "HEAD ", 5) == 0)
+        stream->flags |= H2_STREAM_HEAD;
+
+    eol = h2LineLength(buf, head);
+    rc = h2Append(&stream->in, buf, eol + 2);
+    for(i = eol + 2; i < head - 2 && rc >= 0; i = next) {
+        next = h2HeaderLine(buf, head, i, &name, &name_len,
+                            &value, &value_len);
+        if(name_len == 0 || h2HopByHop(buf + name, name_len) ||
+           h2NameIs(buf + name, name_len, "http2-settings"))
+            continue;
+        rc = h2Append(&stream->in, buf + i, next - i);
+    }
+    if(rc >= 0)
+        rc = h2Append(&stream->in, "Connection: close\r\n\r\n", 21);
+    if(rc >= 0) {
+        stream->text = stream->in.len;
+        session->last_id = 1;
+        rc = h2StreamAccept(stream, 1);
+    }
+    if(rc < 0) {
+        h2BufferFree(&stream->in);
+        free(stream);
+        return -1;
+    }
+    return 1;
+}
+
+static int
+h2ClientStartHandler(TimeEventHandlerPtr event)
+{
+    H2SessionPtr session = *(H2SessionPtr*)event->data;
+    int rc;
+
+    rc = h2SessionProcess(session);
+    if(rc < 0) {
+        h2SessionError(session, -rc);
+        return 1;
+    }
+    if(session->streams == NULL)
+        h2SessionIdle(session);
+    h2SessionDispatch(session);
+    return 1;
+}
+
+/* Called by client.c with the first request header read from a client
+   connection.  If the client speaks HTTP/2, either with prior knowledge
+   or by asking for an upgrade, we take over fd and return 1. */
+int
+h2ClientAccept(int fd, const char *buf, int len)
+{
+    H2SessionPtr session;
+    TimeEventHandlerPtr event;
+    char settings[18];
+    int head = 0, value = 0, value_len = 0;
+
+    if(!h2Clients)
+        return 0;
+
+    if(len < 18 ||
+       memcmp(buf, H2_PREFACE, MIN(len, (int)strlen(H2_PREFACE))) != 0) {
+        head = h2UpgradeRequest(buf, len, &value, &value_len);
+        if(head <= 0)
+            return 0;
+    }
+
+    session = h2MakeSession(NULL);
+    if(session == NULL)
+        return 0;
+    session->flags = H2_SESSION_SERVER | H2_SESSION_PREFACE;
+
+    if(head > 0) {
+        /* The client's settings come in the HTTP2-Settings header. */
+        if(h2Base64Decode(buf + value, value_len, &session->scratch) < 0 ||
+           session->scratch.len % 6 != 0 ||
+           h2Settings(session, (unsigned char*)session->scratch.buf,
+                      session->scratch.len) < 0) {
+            h2SessionDie(session, -EINVAL);
+            return 0;
+        }
+        if(h2Append(&session->out,
+                    "HTTP/1.1 101 Switching Protocols\r\n"
+                    "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n",
+                    71) < 0) {
+            h2SessionDie(session, -ENOMEM);
+            return 0;
+        }
+    }
+
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    h2Put32(settings + 2, h2MaxStreams);
+    settings[6] = 0;
+    settings[7] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+    h2Put32(settings + 8, H2_STREAM_WINDOW);
+    settings[12] = 0;
+    settings[13] = H2_SETTINGS_MAX_HEADER_LIST_SIZE;
+    h2Put32(settings + 14, H2_MAX_HEADER_LIST);
+    if(h2WriteFrame(session, H2_SETTINGS, 0, 0, settings, 18) < 0 ||
+       h2WriteWindowUpdate(session, 0,
+                           H2_SESSION_WINDOW - H2_DEFAULT_WINDOW) < 0 ||
+       h2Append(&session->in, buf + head, len - head) < 0) {
+        h2SessionDie(session, -ENOMEM);
+        return 0;
+    }
+
+    /* From now on, the connection is ours. */
+    session->fd = fd;
+    do_log(D_CLIENT_CONN, "HTTP/2 client connection%s.\n",
+           head > 0 ? " (upgraded)" : "");
+
+    if(head > 0 && h2StreamUpgraded(session, buf, head) < 0) {
+        do_log(L_ERROR, "Couldn't start HTTP/2 stream.\n");
+        h2SessionError(session, H2_INTERNAL_ERROR);
+        return 1;
+    }
+
+    /* Our caller's reader is still registered on fd. */
+    event = scheduleTimeEvent(0, h2ClientStartHandler,
+                              sizeof(session), &session);
+    if(event == NULL) {
+        do_log(L_ERROR, "Couldn't schedule HTTP/2 session.\n");
+        h2SessionDie(session, -ENOMEM);
+    }
+    return 1;
+}
+
+#endif
@@ -0,0 +1,71 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* HTTP/2 over cleartext TCP (h2c).  An HTTP/2 connection, to a server
+   or from a client, is shared by many HTTPConnections that have no fd:
+   each one is carried by a stream, and server.c or client.c drives it
+   through the h2DoStream functions, which behave like their io.c
+   counterparts.  The rest of Polipo only ever speaks HTTP/1.1. */
+
+extern int parentProxyH2;
+extern AtomListPtr h2Servers;
+extern int h2MaxStreams;
+extern int h2Clients;
+
+struct _H2Session;
+struct _H2Stream;
+
+void preinitHttp2(void);
+int h2ServerEnabled(char *name, int port, int proxy);
+int h2Connect(HTTPConnectionPtr connection);
+void h2ServerDiscard(struct _HTTPServer *server);
+int h2ClientAccept(int fd, const char *buf, int len);
+
+void
+h2DoStream(int operation, HTTPConnectionPtr connection, int offset,
+           char *buf, int len,
+           int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+           void *data);
+void
+h2DoStreamH(int operation, HTTPConnectionPtr connection, int offset,
+            char *header, int hlen, char *buf, int len,
+            int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+            void *data);
+void
+h2DoStream2(int operation, HTTPConnectionPtr connection, int offset,
+            char *buf, int len, char *buf2, int len2,
+            int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+            void *data);
+void
+h2DoStream3(int operation, HTTPConnectionPtr connection, int offset,
+            char *buf, int len, char *buf2, int len2, char *buf3, int len3,
+            int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+            void *data);
+void
+h2DoStreamBuf(int operation, HTTPConnectionPtr connection, int offset,
+              char **buf_location, int len,
+              int (*handler)(int, FdEventHandlerPtr, StreamRequestPtr),
+              void *data);
+void h2PokeStream(HTTPConnectionPtr connection, int status, int what);
+void h2Shutdown(HTTPConnectionPtr connection);
+void h2Timeout(HTTPConnectionPtr connection);
+void h2StreamFinish(HTTPConnectionPtr connection, int s);
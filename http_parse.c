@@ -22,6 +22,28 @@ THE SOFTWARE.
 
 #include "polipo.h"
 
+#if !defined(NO_SIMD) && defined(__GNUC__)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH 32
+typedef __m256i simd_vector;
+#define simd_load(p) _mm256_load_si256((const simd_vector*)(p))
+#define simd_set1(c) _mm256_set1_epi8(c)
+#define simd_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define simd_or(a, b) _mm256_or_si256(a, b)
+#define simd_mask(a) ((unsigned)_mm256_movemask_epi8(a))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_WIDTH 16
+typedef __m128i simd_vector;
+#define simd_load(p) _mm_load_si128((const simd_vector*)(p))
+#define simd_set1(c) _mm_set1_epi8(c)
+#define simd_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define simd_or(a, b) _mm_or_si128(a, b)
+#define simd_mask(a) ((unsigned)_mm_movemask_epi8(a))
+#endif
+#endif
+
 static int getNextWord(const char *buf, int i, int *x_return, int *y_return);
 static int getNextToken(const char *buf, int i, int *x_return, int *y_return);
 static int getNextTokenInList(const char *buf, int i, 
@@ -36,18 +58,21 @@ static AtomPtr atomConnection, atomProxyConnection, atomContentLength,
     atomIfModifiedSince, atomIfUnmodifiedSince, atomIfRange, atomLastModified,
     atomIfMatch, atomIfNoneMatch, atomAge, atomTransferEncoding, 
     atomETag, atomCacheControl, atomPragma, atomContentRange, atomRange,
-    atomVia, atomVary, atomExpect, atomAuthorization,
+    atomVia, atomExpect, atomAuthorization,
     atomSetCookie, atomCookie, atomCookie2,
     atomXPolipoDate, atomXPolipoAccess, atomXPolipoLocation, 
     atomXPolipoBodyOffset;
 
-AtomPtr atomContentType, atomContentEncoding;
+AtomPtr atomContentType, atomContentEncoding, atomVary;
 
 int censorReferer = 0;
 int laxHttpParser = 1;
 
 static AtomListPtr censoredHeaders;
 
+/* Characters that getNextToken accepts within a token. */
+static char tokenChar[256];
+
 void
 preinitHttpParser()
 {
@@ -67,6 +92,8 @@ preinitHttpParser()
 void
 initHttpParser()
 {
+    int i;
+
 #define A(name, value) name = internAtom(value); if(!name) goto fail;
     /* These must be in lower-case */
     A(atomConnection, "connection");
@@ -109,6 +136,9 @@ initHttpParser()
     A(atomXPolipoLocation, "x-polipo-location");
     A(atomXPolipoBodyOffset, "x-polipo-body-offset");
 #undef A
+
+    for(i = 33; i < 127; i++)
+        tokenChar[i] = strchr("()<>@,;:\\/[]?={}", i) == NULL;
     return;
 
  fail:
@@ -116,6 +146,44 @@ initHttpParser()
     exit(1);
 }
 
+/* Returns the index of the first CR or LF in buf between i and to, or
+   to if there is none.  The vector version only performs aligned loads,
+   which never cross a page boundary, so it never faults even when the
+   line ends just before the end of the buffer; bytes outside of the
+   range are masked out. */
+static inline int
+findEol(const char *restrict buf, int i, int to)
+{
+#ifdef SIMD_WIDTH
+    const simd_vector cr = simd_set1('\r'), lf = simd_set1('\n');
+    const char *p;
+    simd_vector v;
+    unsigned mask;
+    int j;
+
+    if(i >= to)
+        return to;
+
+    p = buf + i - ((size_t)(buf + i) & (SIMD_WIDTH - 1));
+    v = simd_load(p);
+    mask = simd_mask(simd_or(simd_eq(v, cr), simd_eq(v, lf)));
+    mask &= ~0U << (buf + i - p);
+    while(mask == 0) {
+        p += SIMD_WIDTH;
+        if(p - buf >= to)
+            return to;
+        v = simd_load(p);
+        mask = simd_mask(simd_or(simd_eq(v, cr), simd_eq(v, lf)));
+    }
+    j = p - buf + __builtin_ctz(mask);
+    return j < to ? j : to;
+#else
+    while(i < to && buf[i] != '\n' && buf[i] != '\r')
+        i++;
+    return i;
+#endif
+}
+
 static int
 getNextWord(const char *restrict buf, int i, int *x_return, int *y_return)
 {
@@ -220,18 +288,8 @@ getNextToken(const char *restrict buf, int i, int *x_return, int *y_return)
         }
     }
     x = i;
-    while(buf[i] > 32 && buf[i] < 127) {
-        switch(buf[i]) {
-        case '(': case ')': case '<': case '>': case '@':
-        case ',': case ';': case ':': case '\\': case '/':
-        case '[': case ']': case '?': case '=':
-        case '{': case '}': case ' ': case '\t':
-            goto out;
-        default:
-            i++;
-        }
-    }
- out:
+    while(tokenChar[(unsigned char)buf[i]])
+        i++;
     y = i;
 
     *x_return = x;
@@ -352,8 +410,7 @@ skipEol(const char *restrict buf, int i)
 static int
 skipToEol(const char *restrict buf, int i, int *start_return)
 {
-    while(buf[i] != '\n' && buf[i] != '\r')
-        i++;
+    i = findEol(buf, i, INT_MAX);
     if(buf[i] == '\n') {
         *start_return = i;
         return i + 1;
@@ -552,6 +609,7 @@ parseHeaderLine(const char *restrict buf, int start,
  syntax:
     i = start;
     while(1) {
+        i = findEol(buf, i, INT_MAX);
         if(buf[i] == '\n') {
             i++;
             break;
@@ -593,7 +651,7 @@ findEndOfHeaders(const char *restrict buf, int from, int to, int *body_return)
             }
         } else {
             eol = 0;
-            i++;
+            i = findEol(buf, i + 1, to);
         }
     }
     return -1;
@@ -800,6 +858,8 @@ httpParseHeaders(int client, AtomPtr url,
     cache_control.s_maxage = -1;
     cache_control.min_fresh = -1;
     cache_control.max_stale = -1;
+    cache_control.stale_while_revalidate = -1;
+    cache_control.stale_if_error = -1;
     
     i = start;
 
@@ -817,9 +877,9 @@ httpParseHeaders(int client, AtomPtr url,
         if(name_start < 0)
             continue;
 
-        name = internAtomLowerN(buf + name_start, name_end - name_start);
-
-        if(name == atomConnection) {
+        /* Only two headers are of interest here, so don't bother
+           interning the name. */
+        if(token_compare(buf, name_start, name_end, "connection")) {
             j = getNextTokenInList(buf, value_start, 
                                    &token_start, &token_end, NULL, NULL,
                                    &end);
@@ -853,11 +913,8 @@ httpParseHeaders(int client, AtomPtr url,
                                        &token_start, &token_end, NULL, NULL,
                                        &end);
             }
-        } else if(name == atomCacheControl)
+        } else if(token_compare(buf, name_start, name_end, "cache-control"))
             haveCacheControl = 1;
-
-        releaseAtom(name);
-        name = NULL;
     }
     
     i = start;
@@ -1116,6 +1173,16 @@ httpParseHeaders(int client, AtomPtr url,
                     parseCacheControl(buf, token_start, token_end,
                                       v_start, v_end,
                                       &cache_control.max_stale);
+                } else if(token_compare(buf, token_start, token_end,
+                                        "stale-while-revalidate")) {
+                    parseCacheControl(buf, token_start, token_end,
+                                      v_start, v_end,
+                                      &cache_control.stale_while_revalidate);
+                } else if(token_compare(buf, token_start, token_end,
+                                        "stale-if-error")) {
+                    parseCacheControl(buf, token_start, token_end,
+                                      v_start, v_end,
+                                      &cache_control.stale_if_error);
                 } else {
                     do_log(L_WARN, "Unsupported Cache-Control directive ");
                     do_log_n(L_WARN, buf + token_start, 
@@ -1215,6 +1282,8 @@ httpParseHeaders(int client, AtomPtr url,
                              buf + value_start, value_end - value_start);
                     do_log(L_VARY, ").\n");
                 }
+                if(token_compare(buf, value_start, value_end, "*"))
+                    cache_control.flags |= CACHE_VARY_ANY;
                 cache_control.flags |= CACHE_VARY;
             } else if(name == atomAuthorization) {
                 cache_control.flags |= CACHE_AUTHORIZATION;
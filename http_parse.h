@@ -27,7 +27,7 @@ typedef struct HTTPRange {
 } HTTPRangeRec, *HTTPRangePtr;
 
 extern int censorReferer;
-extern AtomPtr atomContentType, atomContentEncoding;
+extern AtomPtr atomContentType, atomContentEncoding, atomVary;
 
 void preinitHttpParser(void);
 void initHttpParser(void);
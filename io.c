@@ -756,6 +756,26 @@ create_listener(char *address, int port,
     if(rc < 0) do_log_error(L_WARN, errno, "Couldn't set SO_REUSEADDR");
 #endif
 
+    if(numWorkers > 1) {
+#ifdef SO_REUSEPORT
+        /* Every worker binds its own socket, and the kernel balances
+           incoming connections between them. */
+        rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+                        (char *)&one, sizeof(one));
+        if(rc < 0) do_log_error(L_ERROR, errno, "Couldn't set SO_REUSEPORT");
+#else
+        do_log(L_ERROR, "Multiple workers are not supported "
+               "on this platform.\n");
+        rc = -1;
+#endif
+        if(rc < 0) {
+            CLOSE(fd);
+            done = (*handler)(-ENOSYS, NULL, NULL);
+            assert(done);
+            return NULL;
+        }
+    }
+
     if(inet6) {
 #ifdef HAVE_IPv6
         rc = setV6only(fd, 0);
@@ -123,9 +123,9 @@ plainIndexDiskObjects(FILE *out, char *root)
 #endif
 
 static void
-serversList(FILE *out, char *dummy)
+serversList(FILE *out, char *which)
 {
-    listServers(out);
+    listServers(out, which);
 }
 
 static int
@@ -200,7 +200,11 @@ httpSpecialRequest(ObjectPtr object, int method, int from, int to,
                      "<p>There are %d public and %d private objects "
                      "currently in memory using %d KB in %d chunks "
                      "(%d KB allocated).</p>\n"
-                     "<p>There are %d atoms.</p>"
+                     "<p>There are %d atoms using %d KB "
+                     "(%d KB of atom slabs allocated).</p>\n"
+                     "<p>The object hash table has %d entries "
+                     "in %d buckets; lookups take %.2f probes "
+                     "on average.</p>\n"
                      "<p><form method=POST action=\"/polipo/status?\">"
                      "<input type=submit name=\"init-forbidden\" "
                      "value=\"Read forbidden file\"></form>\n"
@@ -228,7 +232,11 @@ httpSpecialRequest(ObjectPtr object, int method, int from, int to,
                      publicObjectCount, privateObjectCount,
                      used_chunks * CHUNK_SIZE / 1024, used_chunks,
                      totalChunkArenaSize() / 1024,
-                     used_atoms);
+                     used_atoms, used_atom_bytes / 1024,
+                     atomSlabBytes / 1024,
+                     objectHashCount, objectHashTableSize,
+                     objectHashLookups > 0 ?
+                     (double)objectHashProbes / objectHashLookups : 0.0);
         object->expires = current_time.tv_sec;
         object->length = object->size;
     } else if(matchUrl("/polipo/config", object)) {
@@ -275,12 +283,22 @@ httpSpecialRequest(ObjectPtr object, int method, int from, int to,
         object->expires = current_time.tv_sec + 20;
 #endif
     } else if(matchUrl("/polipo/servers", object)) {
+        int len;
+        char *which;
         if(disableServersList) {
             abortObject(object, 403, internAtom("Action not allowed"));
             notifyObject(object);
             return 1;
         }
-        fillSpecialObject(object, serversList, NULL);
+        len = MAX(0, object->key_size - 16);
+        which = strdup_n((char*)object->key + 16, len);
+        if(which == NULL) {
+            abortObject(object, 503, internAtom("Couldn't allocate server"));
+            notifyObject(object);
+            return 1;
+        }
+        fillSpecialObject(object, serversList, which);
+        free(which);
         object->expires = current_time.tv_sec + 2;
     } else {
         abortObject(object, 404, internAtom("Not found"));
@@ -347,9 +365,14 @@ httpSpecialDoSide(HTTPRequestPtr requestor)
     client->reqlen -= client->reqbegin;
     client->reqbegin = 0;
 
-    do_stream(IO_READ | IO_NOTNOW, client->fd,
-              client->reqlen, client->reqbuf, CHUNK_SIZE,
-              httpSpecialClientSideHandler, client);
+    if(client->h2stream)
+        h2DoStream(IO_READ | IO_NOTNOW, client,
+                   client->reqlen, client->reqbuf, CHUNK_SIZE,
+                   httpSpecialClientSideHandler, client);
+    else
+        do_stream(IO_READ | IO_NOTNOW, client->fd,
+                  client->reqlen, client->reqbuf, CHUNK_SIZE,
+                  httpSpecialClientSideHandler, client);
     return 1;
 }
 
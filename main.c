@@ -25,6 +25,7 @@ THE SOFTWARE.
 AtomPtr configFile = NULL;
 AtomPtr pidFile = NULL;
 int daemonise = 0;
+int numWorkers = 1;
 
 static void
 usage(char *argv0)
@@ -46,9 +47,12 @@ main(int argc, char **argv)
     int rc;
     int expire = 0, printConfig = 0;
 
+    initHash();
     initAtoms();
     CONFIG_VARIABLE(daemonise, CONFIG_BOOLEAN, "Run as a daemon");
     CONFIG_VARIABLE(pidFile, CONFIG_ATOM, "File with pid of running daemon.");
+    CONFIG_VARIABLE(numWorkers, CONFIG_INT,
+                    "Number of worker processes.");
 
     preinitChunks();
     preinitLog();
@@ -56,6 +60,8 @@ main(int argc, char **argv)
     preinitIo();
     preinitDns();
     preinitServer();
+    preinitHttp2();
+    preinitCompress();
     preinitHttp();
     preinitDiskcache();
     preinitLocal();
@@ -157,15 +163,30 @@ main(int argc, char **argv)
         writePid(pidFile->string);
     }
 
+#ifdef HAVE_FORK
+    if(numWorkers > 1) {
+        rc = forkWorkers(numWorkers);
+        if(rc < 0) {
+            if(pidFile) unlink(pidFile->string);
+            return 0;
+        }
+    }
+#else
+    numWorkers = 1;
+#endif
+
     listener = create_listener(proxyAddress->string, 
                                proxyPort, httpAccept, NULL);
     if(!listener) {
-        if(pidFile) unlink(pidFile->string);
+        if(pidFile && numWorkers <= 1) unlink(pidFile->string);
         exit(1);
     }
 
+    initDiskIndex();
+    prefaultChunks();
+
     eventLoop();
 
-    if(pidFile) unlink(pidFile->string);
+    if(pidFile && numWorkers <= 1) unlink(pidFile->string);
     return 0;
 }
@@ -37,6 +37,14 @@ int cacheIsShared = 1;
 int publicObjectLowMark = 0, objectHighMark = 2048;
 
 static ObjectPtr *objectHashTable;
+/* While the hash table is being resized, objects are moved from the old
+   table a few buckets at a time.  An object lives in the old table if
+   and only if its old bucket hasn't been migrated yet. */
+static ObjectPtr *oldObjectHashTable = NULL;
+static int log2OldObjectHashTableSize;
+static int objectHashMigrated;
+int objectHashCount = 0;
+unsigned long objectHashLookups = 0, objectHashProbes = 0;
 int maxExpiresAge = (30 * 24 + 1) * 3600;
 int maxAge = (14 * 24 + 1) * 3600;
 float maxAgeFraction = 0.1;
@@ -45,6 +53,24 @@ int maxWriteoutWhenIdle = 64 * 1024;
 int maxObjectsWhenIdle = 32;
 int idleTime = 20;
 int dontCacheCookies = 0;
+int staleWhileRevalidate = 0;
+int staleIfError = 0;
+int refreshAhead = 0;
+int refreshAheadBudget = 8;
+int largeObjectThreshold = 0;
+int largeObjectChunkSize = MAX_CHUNK_SIZE;
+AtomPtr objectEvictionPolicy = NULL;
+
+/* With the gdsf eviction policy, objects are discarded in order of
+   frequency divided by size (Greedy-Dual-Size-Frequency).  Frequencies
+   are estimated with a count-min sketch of 4-bit counters, which also
+   remembers objects that are no longer in memory.  The counters are
+   halved every so often, which stands in for GDSF's inflation value. */
+#define SKETCH_DEPTH 4
+static int evictGDSF = 0;
+static unsigned char *sketch = NULL;
+static int log2SketchWidth;
+static int sketchAdditions;
 
 void
 preinitObject()
@@ -77,6 +103,23 @@ preinitObject()
                              "Max age for objects without Last-modified.");
     CONFIG_VARIABLE_SETTABLE(dontCacheCookies, CONFIG_BOOLEAN, configIntSetter,
                              "Work around cachable cookies.");
+    CONFIG_VARIABLE_SETTABLE(staleWhileRevalidate, CONFIG_TIME,
+                             configIntSetter,
+                             "Default stale-while-revalidate (-1 = never).");
+    CONFIG_VARIABLE_SETTABLE(staleIfError, CONFIG_TIME, configIntSetter,
+                             "Default stale-if-error (-1 = never).");
+    CONFIG_VARIABLE_SETTABLE(refreshAhead, CONFIG_TIME, configIntSetter,
+                             "Revalidate popular objects this long "
+                             "before they become stale.");
+    CONFIG_VARIABLE_SETTABLE(refreshAheadBudget, CONFIG_INT, configIntSetter,
+                             "Max refresh-ahead requests per second.");
+    CONFIG_VARIABLE(objectEvictionPolicy, CONFIG_ATOM_LOWER,
+                    "Memory cache eviction policy (lru or gdsf).");
+    CONFIG_VARIABLE_SETTABLE(largeObjectThreshold, CONFIG_INT, configIntSetter,
+                             "Objects larger than this use larger chunks "
+                             "(0 = never).");
+    CONFIG_VARIABLE(largeObjectChunkSize, CONFIG_INT,
+                    "Max chunk size for large objects.");
 }
 
 void
@@ -98,11 +141,12 @@ initObject()
                    "setting to %d.\n", publicObjectLowMark);
     }
 
+    /* The table grows as needed, so this is just the initial size. */
     q = 1;
-    if(objectHashTableSize <= objectHighMark / 2 ||
+    if(objectHashTableSize < 16 ||
        objectHashTableSize > objectHighMark * 1024) {
         if(objectHashTableSize != 0) q = 0;
-        objectHashTableSize = objectHighMark * 16;
+        objectHashTableSize = MAX(objectHighMark / 4, 16);
     }
     log2ObjectHashTableSize = log2_ceil(objectHashTableSize);
     objectHashTableSize = 1 << log2ObjectHashTableSize;
@@ -120,25 +164,184 @@ initObject()
         do_log(L_ERROR, "Couldn't allocate object hash table.\n");
         exit(1);
     }
+    oldObjectHashTable = NULL;
+    objectHashCount = 0;
+
+    if(objectEvictionPolicy == NULL ||
+       strcmp(objectEvictionPolicy->string, "lru") == 0) {
+        evictGDSF = 0;
+    } else if(strcmp(objectEvictionPolicy->string, "gdsf") == 0) {
+        /* Large enough to remember a few times more objects than we
+           keep in memory. */
+        log2SketchWidth = log2_ceil(objectHighMark * 8);
+        sketch = calloc(SKETCH_DEPTH, (1 << log2SketchWidth) / 2);
+        if(sketch == NULL) {
+            do_log(L_ERROR, "Couldn't allocate frequency sketch.\n");
+            evictGDSF = 0;
+        } else {
+            sketchAdditions = 0;
+            evictGDSF = 1;
+        }
+    } else {
+        do_log(L_WARN, "Unknown objectEvictionPolicy %s -- using lru.\n",
+               objectEvictionPolicy->string);
+        evictGDSF = 0;
+    }
+
+    if(largeObjectChunkSize < CHUNK_SIZE ||
+       largeObjectChunkSize > MAX_CHUNK_SIZE ||
+       (largeObjectChunkSize & (largeObjectChunkSize - 1)) != 0) {
+        q = CHUNK_SIZE;
+        while(q < MAX_CHUNK_SIZE && q * 2 <= largeObjectChunkSize)
+            q *= 2;
+        largeObjectChunkSize = q;
+        do_log(L_WARN, "Impossible largeObjectChunkSize value -- "
+               "setting to %d.\n", largeObjectChunkSize);
+    }
+}
+
+/* The position of the counter for h in the given row, counted in
+   nibbles from the start of the sketch. */
+static unsigned int
+sketchIndex(unsigned int h, int row)
+{
+    static const unsigned int multipliers[SKETCH_DEPTH] =
+        {0x9E3779B1, 0x85EBCA77, 0xC2B2AE3D, 0x27D4EB2F};
+    return (row << log2SketchWidth) +
+        (((h * multipliers[row]) & 0xFFFFFFFF) >> (32 - log2SketchWidth));
+}
+
+static int
+sketchCounter(unsigned int i)
+{
+    return (sketch[i / 2] >> (i % 2 * 4)) & 0x0F;
+}
+
+static int
+sketchCount(unsigned int h)
+{
+    int row, count = 15;
+
+    for(row = 0; row < SKETCH_DEPTH; row++)
+        count = MIN(count, sketchCounter(sketchIndex(h, row)));
+    return count;
+}
+
+static void
+sketchIncrement(unsigned int h)
+{
+    int row, i, min;
+    unsigned int j;
+
+    /* Conservative update: only the smallest counters are bumped. */
+    min = sketchCount(h);
+    if(min < 15) {
+        for(row = 0; row < SKETCH_DEPTH; row++) {
+            j = sketchIndex(h, row);
+            if(sketchCounter(j) == min)
+                sketch[j / 2] += 1 << (j % 2 * 4);
+        }
+    }
+
+    sketchAdditions++;
+    if(sketchAdditions >= (10 << log2SketchWidth)) {
+        for(i = 0; i < SKETCH_DEPTH * (1 << log2SketchWidth) / 2; i++)
+            sketch[i] = (sketch[i] >> 1) & 0x77;
+        sketchAdditions /= 2;
+    }
+}
+
+static void
+objectHashMigrate(int n)
+{
+    ObjectPtr object, next;
+    int h, size;
+
+    if(!oldObjectHashTable)
+        return;
+
+    size = 1 << log2OldObjectHashTableSize;
+    while(n > 0 && objectHashMigrated < size) {
+        object = oldObjectHashTable[objectHashMigrated];
+        while(object) {
+            next = object->hash_next;
+            h = object->hash & (objectHashTableSize - 1);
+            object->hash_next = objectHashTable[h];
+            objectHashTable[h] = object;
+            object = next;
+        }
+        oldObjectHashTable[objectHashMigrated] = NULL;
+        objectHashMigrated++;
+        n--;
+    }
+
+    if(objectHashMigrated >= size) {
+        free(oldObjectHashTable);
+        oldObjectHashTable = NULL;
+    }
+}
+
+static void
+objectHashGrow()
+{
+    ObjectPtr *new_table;
+
+    if(oldObjectHashTable)
+        objectHashMigrate(1 << log2OldObjectHashTableSize);
+
+    if(log2ObjectHashTableSize >= 28)
+        return;
+
+    new_table = calloc(1 << (log2ObjectHashTableSize + 1), sizeof(ObjectPtr));
+    if(new_table == NULL) {
+        do_log(L_WARN, "Couldn't grow object hash table.\n");
+        return;
+    }
+
+    oldObjectHashTable = objectHashTable;
+    log2OldObjectHashTableSize = log2ObjectHashTableSize;
+    objectHashMigrated = 0;
+    objectHashTable = new_table;
+    log2ObjectHashTableSize++;
+    objectHashTableSize = 1 << log2ObjectHashTableSize;
+}
+
+static ObjectPtr *
+objectHashChain(unsigned int h)
+{
+    if(oldObjectHashTable) {
+        int i = h & ((1 << log2OldObjectHashTableSize) - 1);
+        if(i >= objectHashMigrated)
+            return &oldObjectHashTable[i];
+    }
+    return &objectHashTable[h & (objectHashTableSize - 1)];
 }
 
 ObjectPtr
 findObject(int type, const void *key, int key_size)
 {
-    int h;
+    unsigned int h;
     ObjectPtr object;
 
     if(key_size >= 50000)
         return NULL;
 
-    h = hash(type, key, key_size, log2ObjectHashTableSize);
-    object = objectHashTable[h];
+    objectHashMigrate(4);
+
+    h = hash(type, key, key_size, 32);
+    object = *objectHashChain(h);
+    objectHashLookups++;
+    while(object) {
+        objectHashProbes++;
+        /* Comparing the full hash value first avoids most memcmps. */
+        if(object->hash == h && object->type == type &&
+           object->key_size == key_size &&
+           memcmp(object->key, key, key_size) == 0)
+            break;
+        object = object->hash_next;
+    }
     if(!object)
         return NULL;
-    if(object->type != type || object->key_size != key_size ||
-       memcmp(object->key, key, key_size) != 0) {
-        return NULL;
-    }
     if(object->next)
         object->next->previous = object->previous;
     if(object->previous)
@@ -162,7 +365,7 @@ makeObject(int type, const void *key, int key_size, int public, int fromdisk,
            RequestFunction request, void* request_closure)
 {
     ObjectPtr object;
-    int h;
+    ObjectPtr *chain;
 
     object = findObject(type, key, key_size);
     if(object != NULL) {
@@ -208,15 +411,15 @@ makeObject(int type, const void *key, int key_size, int public, int fromdisk,
     object->key[key_size] = '\0';
     object->key_size = key_size;
     object->flags = (public?OBJECT_PUBLIC:0) | OBJECT_INITIAL;
+    object->hash = hash(object->type, object->key, object->key_size, 32);
+    object->hash_next = NULL;
     if(public) {
-        h = hash(object->type, object->key, object->key_size, 
-                 log2ObjectHashTableSize);
-        if(objectHashTable[h]) {
-            writeoutToDisk(objectHashTable[h], objectHashTable[h]->size, -1);
-            privatiseObject(objectHashTable[h], 0);
-            assert(!objectHashTable[h]);
-        }
-        objectHashTable[h] = object;
+        if(objectHashCount >= objectHashTableSize)
+            objectHashGrow();
+        chain = objectHashChain(object->hash);
+        object->hash_next = *chain;
+        *chain = object;
+        objectHashCount++;
         object->next = object_list;
         object->previous = NULL;
         if(object_list)
@@ -234,6 +437,8 @@ makeObject(int type, const void *key, int key_size, int public, int fromdisk,
     initCondition(&object->condition);
     object->headers = NULL;
     object->via = NULL;
+    object->vary_headers = NULL;
+    object->chunk_size = CHUNK_SIZE;
     object->numchunks = 0;
     object->chunks = NULL;
     object->length = -1;
@@ -242,13 +447,17 @@ makeObject(int type, const void *key, int key_size, int public, int fromdisk,
     object->expires = -1;
     object->last_modified = -1;
     object->atime = -1;
+    object->hits = 0;
     object->etag = NULL;
     object->cache_control = 0;
     object->max_age = -1;
     object->s_maxage = -1;
+    object->stale_while_revalidate = -1;
+    object->stale_if_error = -1;
     object->size = 0;
     object->requestor = NULL;
     object->disk_entry = NULL;
+    object->disk_reads = 0;
     if(object->flags & OBJECT_PUBLIC)
         publicObjectCount++;
     else
@@ -260,6 +469,16 @@ makeObject(int type, const void *key, int key_size, int public, int fromdisk,
     return object;
 }
 
+/* Called whenever an object is served to a client. */
+void
+objectAccessed(ObjectPtr object)
+{
+    object->atime = current_time.tv_sec;
+    object->hits++;
+    if(evictGDSF && (object->flags & OBJECT_PUBLIC))
+        sketchIncrement(object->hash);
+}
+
 void 
 objectMetadataChanged(ObjectPtr object, int revalidate)
 {
@@ -332,6 +551,32 @@ unlockChunk(ObjectPtr object, int i)
     do_log(D_LOCK, "%d\n", object->chunks[i].locked);
 }
 
+/* Large objects are stored in larger chunks, which means fewer
+   chunks to keep track of and fewer system calls.  The chunk size
+   can only change while no chunk holds data or is locked, and is
+   chosen so that the last chunk doesn't waste too much memory and that
+   offset, where the first data will be stored, is at a chunk
+   boundary. */
+void
+objectSetChunkSize(ObjectPtr object, int length, int offset)
+{
+    int i, size = CHUNK_SIZE;
+
+    for(i = 0; i < object->numchunks; i++) {
+        if(object->chunks[i].data || object->chunks[i].locked)
+            return;
+    }
+
+    /* Chunks that are large relative to chunkHighMark would fragment
+       memory too easily. */
+    if(largeObjectThreshold > 0 && length >= largeObjectThreshold) {
+        while(size < largeObjectChunkSize && size * 2 <= length / 16 &&
+              size * 2 <= chunkHighMark / 64 && offset % (size * 2) == 0)
+            size *= 2;
+    }
+    object->chunk_size = size;
+}
+
 int
 objectSetChunks(ObjectPtr object, int numchunks)
 {
@@ -341,7 +586,8 @@ objectSetChunks(ObjectPtr object, int numchunks)
         return 0;
 
     if(object->length >= 0)
-        n = MAX(numchunks, (object->length + (CHUNK_SIZE - 1)) / CHUNK_SIZE);
+        n = MAX(numchunks, (object->length + (object->chunk_size - 1)) /
+                object->chunk_size);
     else
         n = MAX(numchunks, 
                 MAX(object->numchunks + 2, object->numchunks * 5 / 4));
@@ -393,11 +639,11 @@ objectPartial(ObjectPtr object, int length, struct _Atom *headers)
 static int
 objectAddChunk(ObjectPtr object, const char *data, int offset, int plen)
 {
-    int i = offset / CHUNK_SIZE;
+    int i = offset / object->chunk_size;
     int rc;
 
-    assert(offset % CHUNK_SIZE == 0);
-    assert(plen <= CHUNK_SIZE);
+    assert(offset % object->chunk_size == 0);
+    assert(plen <= object->chunk_size);
 
     if(object->numchunks <= i) {
         rc = objectSetChunks(object, i + 1);
@@ -408,7 +654,7 @@ objectAddChunk(ObjectPtr object, const char *data, int offset, int plen)
     lockChunk(object, i);
 
     if(object->chunks[i].data == NULL) {
-        object->chunks[i].data = get_chunk();
+        object->chunks[i].data = get_chunks(CHUNKS(object->chunk_size));
         if(object->chunks[i].data == NULL)
             goto fail;
     }
@@ -433,11 +679,11 @@ objectAddChunk(ObjectPtr object, const char *data, int offset, int plen)
 static int
 objectAddChunkEnd(ObjectPtr object, const char *data, int offset, int plen)
 {
-    int i = offset / CHUNK_SIZE;
+    int i = offset / object->chunk_size;
     int rc;
 
-    assert(offset % CHUNK_SIZE != 0 && 
-           offset % CHUNK_SIZE + plen <= CHUNK_SIZE);
+    assert(offset % object->chunk_size != 0 && 
+           offset % object->chunk_size + plen <= object->chunk_size);
 
     if(object->numchunks <= i) {
         rc = objectSetChunks(object, i + 1);
@@ -448,7 +694,7 @@ objectAddChunkEnd(ObjectPtr object, const char *data, int offset, int plen)
     lockChunk(object, i);
 
     if(object->chunks[i].data == NULL)
-        object->chunks[i].data = get_chunk();
+        object->chunks[i].data = get_chunks(CHUNKS(object->chunk_size));
     if(object->chunks[i].data == NULL)
         goto fail;
 
@@ -456,14 +702,14 @@ objectAddChunkEnd(ObjectPtr object, const char *data, int offset, int plen)
         goto fail;
     }
 
-    if(object->chunks[i].size < offset % CHUNK_SIZE) {
+    if(object->chunks[i].size < offset % object->chunk_size) {
         goto fail;
     }
 
     if(object->size < offset + plen)
         object->size = offset + plen;
-    object->chunks[i].size = offset % CHUNK_SIZE + plen;
-    memcpy(object->chunks[i].data + (offset % CHUNK_SIZE),
+    object->chunks[i].size = offset % object->chunk_size + plen;
+    memcpy(object->chunks[i].data + (offset % object->chunk_size),
            data, plen);
 
     unlockChunk(object, i);
@@ -496,15 +742,16 @@ objectAddData(ObjectPtr object, const char *data, int offset, int len)
             
     object->flags &= ~OBJECT_FAILED;
 
-    if(offset + len >= object->numchunks * CHUNK_SIZE) {
-        rc = objectSetChunks(object, (offset + len - 1) / CHUNK_SIZE + 1);
+    if(offset + len >= object->numchunks * object->chunk_size) {
+        rc = objectSetChunks(object,
+                             (offset + len - 1) / object->chunk_size + 1);
         if(rc < 0) {
             return -1;
         }
     }
 
-    if(offset % CHUNK_SIZE != 0) {
-        int plen = CHUNK_SIZE - offset % CHUNK_SIZE;
+    if(offset % object->chunk_size != 0) {
+        int plen = object->chunk_size - offset % object->chunk_size;
         if(plen >= len)
             plen = len;
         rc = objectAddChunkEnd(object, data, offset, plen);
@@ -517,7 +764,7 @@ objectAddData(ObjectPtr object, const char *data, int offset, int len)
     }
 
     while(len > 0) {
-        int plen = (len >= CHUNK_SIZE) ? CHUNK_SIZE : len;
+        int plen = (len >= object->chunk_size) ? object->chunk_size : len;
         rc = objectAddChunk(object, data, offset, plen);
         if(rc < 0) {
             return -1;
@@ -557,15 +804,16 @@ objectHoleSize(ObjectPtr object, int offset)
 {
     int size = 0, i;
 
-    if(offset < 0 || offset / CHUNK_SIZE >= object->numchunks)
+    if(offset < 0 || offset / object->chunk_size >= object->numchunks)
         return -1;
 
-    if(offset % CHUNK_SIZE != 0) {
-        if(object->chunks[offset / CHUNK_SIZE].size > offset % CHUNK_SIZE)
+    if(offset % object->chunk_size != 0) {
+        if(object->chunks[offset / object->chunk_size].size >
+           offset % object->chunk_size)
             return 0;
         else {
-            size += CHUNK_SIZE - offset % CHUNK_SIZE;
-            offset += CHUNK_SIZE - offset % CHUNK_SIZE;
+            size += object->chunk_size - offset % object->chunk_size;
+            offset += object->chunk_size - offset % object->chunk_size;
             if(offset < 0) {
                 /* Overflow */
                 return -1;
@@ -573,9 +821,9 @@ objectHoleSize(ObjectPtr object, int offset)
         }
     }
 
-    for(i = offset / CHUNK_SIZE; i < object->numchunks; i++) {
+    for(i = offset / object->chunk_size; i < object->numchunks; i++) {
         if(object->chunks[i].size == 0)
-            size += CHUNK_SIZE;
+            size += object->chunk_size;
         else
             break;
     }
@@ -600,8 +848,8 @@ objectHasData(ObjectPtr object, int from, int to)
             return 0;
     }
 
-    first = from / CHUNK_SIZE;
-    last = to / CHUNK_SIZE;
+    first = from / object->chunk_size;
+    last = to / object->chunk_size;
 
     if(from >= to)
         return 2;
@@ -611,15 +859,18 @@ objectHasData(ObjectPtr object, int from, int to)
         goto disk;
     }
 
-    if(last > object->numchunks ||
-       object->chunks[last].size > to % CHUNK_SIZE) {
+    /* When to is at a chunk boundary, chunk last is not needed and may
+       not exist. */
+    if(to % object->chunk_size != 0 &&
+       (last >= object->numchunks ||
+        object->chunks[last].size > to % object->chunk_size)) {
         upto = to;
         goto disk;
     }
 
     for(i = last - 1; i >= first; i--) {
-        if(object->chunks[i].size < CHUNK_SIZE) {
-            upto = (i + 1) * CHUNK_SIZE;
+        if(object->chunks[i].size < object->chunk_size) {
+            upto = (i + 1) * object->chunk_size;
             goto disk;
         }
     }
@@ -657,10 +908,12 @@ destroyObject(ObjectPtr object)
         if(object->headers) releaseAtom(object->headers);
         if(object->etag) free(object->etag);
         if(object->via) releaseAtom(object->via);
+        if(object->vary_headers) releaseAtom(object->vary_headers);
         for(i = 0; i < object->numchunks; i++) {
             assert(!object->chunks[i].locked);
             if(object->chunks[i].data)
-                dispose_chunk(object->chunks[i].data);
+                dispose_chunks(object->chunks[i].data,
+                               CHUNKS(object->chunk_size));
             object->chunks[i].data = NULL;
             object->chunks[i].size = 0;
         }
@@ -673,7 +926,8 @@ destroyObject(ObjectPtr object)
 void
 privatiseObject(ObjectPtr object, int linear) 
 {
-    int i, h;
+    int i;
+    ObjectPtr *link;
     if(!(object->flags & OBJECT_PUBLIC)) {
         if(linear)
             object->flags |= OBJECT_LINEAR;
@@ -689,15 +943,20 @@ privatiseObject(ObjectPtr object, int linear)
             break;
         if(object->chunks[i].data) {
             object->chunks[i].size = 0;
-            dispose_chunk(object->chunks[i].data);
+            dispose_chunks(object->chunks[i].data,
+                           CHUNKS(object->chunk_size));
             object->chunks[i].data = NULL;
         }
     }
 
-    h = hash(object->type, object->key, object->key_size, 
-             log2ObjectHashTableSize);
-    assert(objectHashTable[h] == object);
-    objectHashTable[h] = NULL;
+    link = objectHashChain(object->hash);
+    while(*link != object) {
+        assert(*link);
+        link = &(*link)->hash_next;
+    }
+    *link = object->hash_next;
+    object->hash_next = NULL;
+    objectHashCount--;
 
     if(object->previous)
         object->previous->next = object->next;
@@ -745,7 +1004,8 @@ abortObject(ObjectPtr object, int code, AtomPtr message)
     for(i = 0; i < object->numchunks; i++) {
         if(object->chunks[i].data) {
             if(!object->chunks[i].locked) {
-                dispose_chunk(object->chunks[i].data);
+                dispose_chunks(object->chunks[i].data,
+                               CHUNKS(object->chunk_size));
                 object->chunks[i].data = NULL;
                 object->chunks[i].size = 0;
             }
@@ -758,6 +1018,7 @@ void
 supersedeObject(ObjectPtr object)
 {
     object->flags |= OBJECT_SUPERSEDED;
+    supersedeCompressedVariant(object);
     destroyDiskEntry(object, 1);
     privatiseObject(object, 0);
     notifyObject(object);
@@ -808,11 +1069,101 @@ writeoutObjects(int all)
     diskIsClean = 1;
 }
 
+typedef struct _EvictionCandidate {
+    ObjectPtr object;
+    float priority;
+    int order;
+} EvictionCandidateRec, *EvictionCandidatePtr;
+
+static int
+compareEvictionCandidates(const void *a, const void *b)
+{
+    const EvictionCandidateRec *ca = a, *cb = b;
+    if(ca->priority != cb->priority)
+        return ca->priority < cb->priority ? -1 : 1;
+    return ca->order - cb->order;
+}
+
+/* The second pass of discardObjects for the gdsf policy.  The size of
+   an object only matters when we're short on chunks rather than on
+   objects; the least recently used objects go first among equals. */
+static int
+discardObjectsGDSF(void)
+{
+    EvictionCandidatePtr candidates;
+    ObjectPtr object;
+    int i, n, chunks;
+    int sized = used_chunks > CHUNKS(chunkLowMark);
+
+    candidates = malloc(MAX(publicObjectCount, 1) *
+                        sizeof(EvictionCandidateRec));
+    if(candidates == NULL)
+        return -1;
+
+    n = 0;
+    for(object = object_list_end; object; object = object->previous) {
+        if(object->refcount != 0 || n >= publicObjectCount)
+            continue;
+        chunks = sized ?
+            MAX((object->size + CHUNK_SIZE - 1) / CHUNK_SIZE, 1) : 1;
+        candidates[n].object = object;
+        candidates[n].priority = (float)sketchCount(object->hash) / chunks;
+        candidates[n].order = n;
+        n++;
+    }
+    qsort(candidates, n, sizeof(EvictionCandidateRec),
+          compareEvictionCandidates);
+
+    for(i = 0; i < n; i++) {
+        if(used_chunks <= CHUNKS(chunkLowMark) &&
+           publicObjectCount <= publicObjectLowMark)
+            break;
+        object = candidates[i].object;
+        writeoutToDisk(object, object->size, -1);
+        privatiseObject(object, 0);
+    }
+
+    free(candidates);
+    return 1;
+}
+
+/* Discard the least recently used object that is not in use, or
+   failing that the complete chunks of one that is.  Returns 0 if
+   there was nothing to discard. */
+int
+discardOldestObject()
+{
+    ObjectPtr object;
+    int j, done;
+
+    for(object = object_list_end; object; object = object->previous) {
+        if(object->refcount == 0) {
+            writeoutToDisk(object, object->size, -1);
+            privatiseObject(object, 0);
+            return 1;
+        }
+        done = 0;
+        for(j = 0; j < object->numchunks; j++) {
+            if(object->chunks[j].locked ||
+               object->chunks[j].size < object->chunk_size)
+                continue;
+            writeoutToDisk(object, (j + 1) * object->chunk_size, -1);
+            dispose_chunks(object->chunks[j].data,
+                           CHUNKS(object->chunk_size));
+            object->chunks[j].data = NULL;
+            object->chunks[j].size = 0;
+            done = 1;
+        }
+        if(done)
+            return 1;
+    }
+    return 0;
+}
+
 int
 discardObjects(int all, int force)
 {
     ObjectPtr object;
-    int i;
     static int in_discardObjects = 0;
     TimeEventHandlerPtr event;
 
@@ -828,17 +1179,19 @@ discardObjects(int all, int force)
         while(object && 
               (all || force || used_chunks >= CHUNKS(chunkLowMark))) {
             if(force || ((object->flags & OBJECT_PUBLIC) &&
-                         object->numchunks > CHUNKS(chunkLowMark) / 4)) {
+                         object->numchunks * CHUNKS(object->chunk_size) >
+                         CHUNKS(chunkLowMark) / 4)) {
                 int j;
                 for(j = 0; j < object->numchunks; j++) {
                     if(object->chunks[j].locked) {
                         break;
                     }
-                    if(object->chunks[j].size < CHUNK_SIZE) {
+                    if(object->chunks[j].size < object->chunk_size) {
                         continue;
                     }
-                    writeoutToDisk(object, (j + 1) * CHUNK_SIZE, -1);
-                    dispose_chunk(object->chunks[j].data);
+                    writeoutToDisk(object, (j + 1) * object->chunk_size, -1);
+                    dispose_chunks(object->chunks[j].data,
+                                   CHUNKS(object->chunk_size));
                     object->chunks[j].data = NULL;
                     object->chunks[j].size = 0;
                 }
@@ -846,16 +1199,17 @@ discardObjects(int all, int force)
             object = object->previous;
         }
         
-        i = 0;
         object = object_list_end;
+        if(evictGDSF && !all && !force && discardObjectsGDSF() >= 0)
+            object = NULL;
+        /* Discarding an object frees its chunks straight away, so
+           there's no need to count them. */
         while(object && 
               (all || force ||
-               used_chunks - i > CHUNKS(chunkLowMark) ||
-               used_chunks > CHUNKS(chunkCriticalMark) ||
+               used_chunks > CHUNKS(chunkLowMark) ||
                publicObjectCount > publicObjectLowMark)) {
             ObjectPtr next_object = object->previous;
             if(object->refcount == 0) {
-                i += object->numchunks;
                 writeoutToDisk(object, object->size, -1);
                 privatiseObject(object, 0);
             } else if(all || force) {
@@ -880,10 +1234,12 @@ discardObjects(int all, int force)
                     for(j = object->numchunks - 1; j >= 0; j--) {
                         if(object->chunks[j].locked)
                             continue;
-                        if(object->chunks[j].size < CHUNK_SIZE)
+                        if(object->chunks[j].size < object->chunk_size)
                             continue;
-                        writeoutToDisk(object, (j + 1) * CHUNK_SIZE, -1);
-                        dispose_chunk(object->chunks[j].data);
+                        writeoutToDisk(object,
+                                       (j + 1) * object->chunk_size, -1);
+                        dispose_chunks(object->chunks[j].data,
+                                       CHUNKS(object->chunk_size));
                         object->chunks[j].data = NULL;
                         object->chunks[j].size = 0;
                     }
@@ -922,19 +1278,17 @@ discardObjects(int all, int force)
     return 1;
 }
 
-CacheControlRec no_cache_control = {0, -1, -1, -1, -1};
+CacheControlRec no_cache_control = {0, -1, -1, -1, -1, -1, -1};
 
-int
-objectIsStale(ObjectPtr object, CacheControlPtr cache_control)
+/* The time at which an object becomes stale. */
+static int
+objectStaleTime(ObjectPtr object, CacheControlPtr cache_control)
 {
     int stale = 0x7FFFFFFF;
     int flags;
     int max_age, s_maxage;
     time_t date;
 
-    if(object->flags & OBJECT_INITIAL)
-        return 0;
-
     if(object->date >= 0)
         date = object->date;
     else if(object->age >= 0)
@@ -1005,7 +1359,16 @@ objectIsStale(ObjectPtr object, CacheControlPtr cache_control)
         }
     }
 
-    return current_time.tv_sec > stale;
+    return stale;
+}
+
+int
+objectIsStale(ObjectPtr object, CacheControlPtr cache_control)
+{
+    if(object->flags & OBJECT_INITIAL)
+        return 0;
+
+    return current_time.tv_sec > objectStaleTime(object, cache_control);
 }
 
 int
@@ -1026,7 +1389,7 @@ objectMustRevalidate(ObjectPtr object, CacheControlPtr cache_control)
     if(cacheIsShared && (flags & CACHE_PRIVATE))
         return 1;
 
-    if(!mindlesslyCacheVary && (flags & CACHE_VARY))
+    if(!mindlesslyCacheVary && (flags & CACHE_VARY_ANY))
         return 1;
 
     if(dontCacheCookies && (flags & CACHE_COOKIE))
@@ -1038,3 +1401,97 @@ objectMustRevalidate(ObjectPtr object, CacheControlPtr cache_control)
     return 0;
 }
 
+/* RFC 5861: whether a stale object may still be served, either while
+   it is being revalidated or, if error is true, because revalidation
+   failed.  Clients asking for end-to-end revalidation don't get any
+   stale data. */
+int
+objectMayServeStale(ObjectPtr object, CacheControlPtr cache_control,
+                    int error)
+{
+    CacheControlRec relaxed;
+    int window;
+
+    if(object->flags & (OBJECT_INITIAL | OBJECT_ABORTED | OBJECT_LINEAR))
+        return 0;
+
+    if(cache_control == NULL)
+        cache_control = &no_cache_control;
+
+    if((cache_control->flags & CACHE_NO) || cache_control->max_age == 0)
+        return 0;
+
+    if((object->cache_control & CACHE_NO) || !objectIsShareable(object))
+        return 0;
+
+    if(error) {
+        if(staleIfError < 0)
+            return 0;
+        window = object->stale_if_error >= 0 ?
+            object->stale_if_error : staleIfError;
+    } else {
+        if(staleWhileRevalidate < 0)
+            return 0;
+        window = object->stale_while_revalidate >= 0 ?
+            object->stale_while_revalidate : staleWhileRevalidate;
+    }
+    if(window <= 0)
+        return 0;
+
+    /* This is ignored by objectIsStale for must-revalidate objects. */
+    relaxed = *cache_control;
+    relaxed.max_stale = MAX(relaxed.max_stale, 0) + window;
+    return !objectIsStale(object, &relaxed);
+}
+
+/* Whether an object is about to become stale and is popular enough to
+   be worth revalidating before that happens.  An object is popular if,
+   since it was last validated, it has been requested on average at
+   least once every refreshAhead seconds. */
+int
+objectWantsRefresh(ObjectPtr object)
+{
+    int stale;
+
+    if(refreshAhead <= 0 || object->hits < 2 || object->age < 0)
+        return 0;
+
+    if(object->flags &
+       (OBJECT_INITIAL | OBJECT_INPROGRESS | OBJECT_VALIDATING |
+        OBJECT_ABORTED | OBJECT_FAILED | OBJECT_LOCAL | OBJECT_LINEAR |
+        OBJECT_DYNAMIC))
+        return 0;
+
+    if((object->cache_control & CACHE_NO) || !objectIsShareable(object))
+        return 0;
+
+    stale = objectStaleTime(object, NULL);
+    if(current_time.tv_sec > stale ||
+       current_time.tv_sec + refreshAhead < stale)
+        return 0;
+
+    return object->atime - object->age <= (time_t)object->hits * refreshAhead;
+}
+
+/* Whether an object may be served to clients other than its requestor
+   at all, irrespective of its freshness. */
+int
+objectIsShareable(ObjectPtr object)
+{
+    int flags = object->cache_control;
+
+    if(flags & (CACHE_NO_HIDDEN | CACHE_NO_STORE))
+        return 0;
+
+    if(cacheIsShared && (flags & CACHE_PRIVATE))
+        return 0;
+
+    if(!mindlesslyCacheVary && (flags & CACHE_VARY_ANY))
+        return 0;
+
+    if(dontCacheCookies && (flags & CACHE_COOKIE))
+        return 0;
+
+    return 1;
+}
+
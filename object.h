@@ -28,7 +28,7 @@ THE SOFTWARE.
 
 struct _HTTPRequest;
 
-#if defined(USHRT_MAX) && CHUNK_SIZE <= USHRT_MAX
+#if defined(USHRT_MAX) && MAX_CHUNK_SIZE <= USHRT_MAX
 typedef unsigned short chunk_size_t;
 #else
 typedef unsigned int chunk_size_t;
@@ -62,19 +62,27 @@ typedef struct _Object {
     time_t expires;
     time_t last_modified;
     time_t atime;
+    unsigned int hits;
     char *etag;
     unsigned short cache_control;
     int max_age;
     int s_maxage;
+    int stale_while_revalidate;
+    int stale_if_error;
     struct _Atom *headers;
     struct _Atom *via;
+    struct _Atom *vary_headers;
     int size;
+    int chunk_size;
     int numchunks;
     ChunkPtr chunks;
     void *requestor;
     struct _Condition condition;
     struct _DiskCacheEntry *disk_entry;
+    int disk_reads;
     struct _Object *next, *previous;
+    unsigned int hash;
+    struct _Object *hash_next;
 } ObjectRec, *ObjectPtr;
 
 typedef struct _CacheControl {
@@ -83,10 +91,15 @@ typedef struct _CacheControl {
     int s_maxage;
     int min_fresh;
     int max_stale;
+    int stale_while_revalidate;
+    int stale_if_error;
 } CacheControlRec, *CacheControlPtr;
 
 extern int cacheIsShared;
 extern int mindlesslyCacheVary;
+extern int staleWhileRevalidate, staleIfError;
+extern int refreshAhead, refreshAheadBudget;
+extern int largeObjectThreshold, largeObjectChunkSize;
 
 extern CacheControlRec no_cache_control;
 extern int objectExpiryScheduled;
@@ -98,7 +111,10 @@ extern const time_t time_t_max;
 
 extern int publicObjectLowMark, objectHighMark;
 
+extern int objectHashTableSize;
 extern int log2ObjectHashTableSize;
+extern int objectHashCount;
+extern unsigned long objectHashLookups, objectHashProbes;
 
 /* object->type */
 #define OBJECT_HTTP 1
@@ -129,6 +145,8 @@ extern int log2ObjectHashTableSize;
 #define OBJECT_DYNAMIC 1024
 /* Used for synchronisation between client and server. */
 #define OBJECT_MUTATING 2048
+/* the validation in progress was started by the proxy itself */
+#define OBJECT_BACKGROUND 4096
 
 /* object->cache_control and connection->cache_control */
 /* RFC 2616 14.9 */
@@ -150,7 +168,7 @@ extern int log2ObjectHashTableSize;
 #define CACHE_PROXY_REVALIDATE 128
 /* only-if-cached */
 #define CACHE_ONLY_IF_CACHED 256
-/* set if Vary header; treated as no-cache */
+/* set if Vary header; see vary.c */
 #define CACHE_VARY 512
 /* set if Authorization header; treated specially */
 #define CACHE_AUTHORIZATION 1024
@@ -158,6 +176,8 @@ extern int log2ObjectHashTableSize;
 #define CACHE_COOKIE 2048
 /* set if this object should never be combined with another resource */
 #define CACHE_MISMATCH 4096
+/* set if Vary: *; treated as no-cache */
+#define CACHE_VARY_ANY 8192
 
 struct _HTTPRequest;
 
@@ -168,9 +188,11 @@ ObjectPtr makeObject(int type, const void *key, int key_size,
                      int public, int fromdisk,
                      int (*request)(ObjectPtr, int, int, int, 
                                     struct _HTTPRequest*, void*), void*);
+void objectAccessed(ObjectPtr object);
 void objectMetadataChanged(ObjectPtr object, int dirty);
 ObjectPtr retainObject(ObjectPtr);
 void releaseObject(ObjectPtr);
+void objectSetChunkSize(ObjectPtr object, int length, int offset);
 int objectSetChunks(ObjectPtr object, int numchunks);
 void lockChunk(ObjectPtr, int);
 void unlockChunk(ObjectPtr, int);
@@ -191,7 +213,12 @@ void objectPrintf(ObjectPtr object, int offset, const char *format, ...)
 int discardObjectsHandler(TimeEventHandlerPtr);
 void writeoutObjects(int);
 int discardObjects(int all, int force);
+int discardOldestObject(void);
 int objectIsStale(ObjectPtr object, CacheControlPtr cache_control)
     ATTRIBUTE ((pure));
 int objectMustRevalidate(ObjectPtr object, CacheControlPtr cache_control)
     ATTRIBUTE ((pure));
+int objectMayServeStale(ObjectPtr object, CacheControlPtr cache_control,
+                        int error);
+int objectWantsRefresh(ObjectPtr object) ATTRIBUTE ((pure));
+int objectIsShareable(ObjectPtr object) ATTRIBUTE ((pure));
@@ -57,6 +57,7 @@ THE SOFTWARE.
 #include <poll.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <sys/file.h>
 #include <signal.h>
 #endif
 
@@ -99,6 +100,18 @@ THE SOFTWARE.
 #ifdef __GLIBC__
 #define HAVE_FTS
 #endif
+#ifndef NO_EPOLL
+#define HAVE_EPOLL
+#endif
+#ifndef NO_SENDFILE
+#define HAVE_SENDFILE
+#endif
+#ifndef NO_SPLICE
+#define HAVE_SPLICE
+#endif
+#ifndef NO_IO_URING
+#define HAVE_IO_URING
+#endif
 #ifndef __UCLIBC__
 #define HAVE_FFSL
 #define HAVE_FFSLL
@@ -189,6 +202,8 @@ THE SOFTWARE.
 #ifndef HAVE_REGEX
 #define NO_FORBIDDEN
 #endif
+/* No socketpair */
+#define NO_HTTP2
 #ifndef MINGW
 #define HAVE_MKGMTIME
 #endif
@@ -203,6 +218,20 @@ THE SOFTWARE.
 #define NO_REDIRECTOR
 #endif
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#endif
+
 #include "mingw.h"
 
 #include "ftsimport.h"
@@ -219,7 +248,12 @@ THE SOFTWARE.
 #include "client.h"
 #include "local.h"
 #include "diskcache.h"
+#include "segment.h"
+#include "diskindex.h"
 #include "server.h"
+#include "http2.h"
+#include "compress.h"
+#include "vary.h"
 #include "http_parse.h"
 #include "parse_time.h"
 #include "forbidden.h"
@@ -229,4 +263,5 @@ THE SOFTWARE.
 
 extern AtomPtr configFile;
 extern int daemonise;
+extern int numWorkers;
 extern AtomPtr pidFile;
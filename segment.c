@@ -0,0 +1,1208 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "polipo.h"
+
+#ifndef NO_DISK_CACHE
+
+#include "md5import.h"
+
+int diskCacheSegments = 0;
+int diskCacheSegmentSize = 64 * 1024 * 1024;
+int diskCacheSegmentObjectSize = 64 * 1024;
+
+/* A segment is a sequence of records.  Each record is a header,
+   followed by the key, followed by the entry itself in the same format
+   as a per-file entry.  A record is written as SEGMENT_PENDING and
+   only marked valid once complete, so a crash leaves at most one bad
+   record, at the end of the current segment.  A tombstone is a record
+   with no entry, and cancels any earlier record with the same key. */
+
+#define SEGMENT_MAGIC 0x31475350        /* "PSG1" */
+#define SEGMENT_TOMBSTONE 0x30475350    /* "PSG0" */
+#define SEGMENT_PENDING 0
+#define SEGMENT_INDEX_MAGIC 0x31495350  /* "PSI1" */
+
+#define SEGMENT_MAX_KEY 4096
+#define SEGMENT_CHECKPOINT_INTERVAL (10 * 60)
+#define SEGMENT_STAMP_SLACK (60 * 60)
+
+typedef struct _SegmentHeader {
+    unsigned int magic;
+    unsigned int key_len;
+    unsigned int length;
+    unsigned int stamp;
+} SegmentHeaderRec;
+
+typedef struct _SegmentEntry {
+    unsigned long long hash;
+    off_t base;
+    int segment;
+    int key_len;
+    int length;
+    unsigned int stamp;
+    struct _SegmentEntry *next;
+} SegmentEntryRec, *SegmentEntryPtr;
+
+typedef struct _Segment {
+    off_t size;                 /* -1 if the segment doesn't exist */
+    off_t dead;
+} SegmentRec, *SegmentPtr;
+
+/* The index checkpoint: a header, the segment table, then the entries. */
+
+typedef struct _SegmentIndexHeader {
+    unsigned int magic;
+    unsigned int numSegments;
+    unsigned int count;
+    unsigned int pad;
+} SegmentIndexHeaderRec;
+
+typedef struct _SegmentIndexSegment {
+    long long size;
+    long long dead;
+} SegmentIndexSegmentRec;
+
+typedef struct _SegmentIndexEntry {
+    unsigned long long hash;
+    long long base;
+    unsigned int segment;
+    unsigned int key_len;
+    unsigned int length;
+    unsigned int stamp;
+} SegmentIndexEntryRec;
+
+static char *segmentRoot = NULL;
+static int segmentLockFd = -1;
+
+static SegmentPtr segments = NULL;
+static int numSegments = 0;
+static int writeSegment = -1;
+static int writeFd = -1;
+
+static SegmentEntryPtr *segmentTable = NULL;
+static int segmentTableSize = 0;
+static int segmentCount = 0;
+static int segmentsDirty = 0;
+
+static off_t pendingRecord = -1;
+static unsigned long long pendingHash;
+static int pendingKeyLen;
+static unsigned int pendingStamp;
+
+static int segmentCheckpointHandler(TimeEventHandlerPtr);
+static int segmentCollect(int all);
+
+void
+preinitSegments()
+{
+    CONFIG_VARIABLE(diskCacheSegments, CONFIG_BOOLEAN,
+                    "Store small objects in log-structured segments.");
+    CONFIG_VARIABLE(diskCacheSegmentSize, CONFIG_INT,
+                    "Size of on-disk cache segments.");
+    CONFIG_VARIABLE_SETTABLE(diskCacheSegmentObjectSize, CONFIG_INT,
+                             configIntSetter,
+                             "Largest object stored in a segment.");
+}
+
+static unsigned long long
+segmentHash(const char *key, int key_len)
+{
+    MD5_CTX ctx;
+    unsigned long long hash;
+
+    MD5Init(&ctx);
+    MD5Update(&ctx, (unsigned char*)key, key_len);
+    MD5Final(&ctx);
+    memcpy(&hash, ctx.digest, sizeof(hash));
+    return hash;
+}
+
+static off_t
+recordSize(int key_len, int length)
+{
+    return sizeof(SegmentHeaderRec) + key_len + length;
+}
+
+static int
+segmentFilename(char *buf, int n, int s)
+{
+    int rc;
+    if(s >= 0)
+        rc = snprintf(buf, n, "%s%08x", segmentRoot, s);
+    else
+        rc = snprintf(buf, n, "%sindex", segmentRoot);
+    if(rc < 0 || rc >= n)
+        return -1;
+    return rc;
+}
+
+static int
+readAt(int fd, void *buf, int n, off_t offset)
+{
+    int rc, i = 0;
+
+    if(lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+    while(i < n) {
+        rc = read(fd, (char*)buf + i, n - i);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return -1;
+        i += rc;
+    }
+    return n;
+}
+
+static int
+writeAt(int fd, const void *buf, int n, off_t offset)
+{
+    int rc, i = 0;
+
+    if(lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+    while(i < n) {
+        rc = write(fd, (const char*)buf + i, n - i);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return -1;
+        i += rc;
+    }
+    return n;
+}
+
+static int
+ensureSegment(int s)
+{
+    SegmentPtr new;
+    int i, n;
+
+    if(s < numSegments)
+        return 1;
+    n = MAX(2 * numSegments, s + 16);
+    new = realloc(segments, n * sizeof(SegmentRec));
+    if(new == NULL) {
+        do_log(L_ERROR, "Couldn't allocate segment table.\n");
+        return -1;
+    }
+    for(i = numSegments; i < n; i++) {
+        new[i].size = -1;
+        new[i].dead = 0;
+    }
+    segments = new;
+    numSegments = n;
+    return 1;
+}
+
+static int
+resizeSegmentTable(int size)
+{
+    SegmentEntryPtr *new, entry, next;
+    int i, j;
+
+    new = calloc(size, sizeof(SegmentEntryPtr));
+    if(new == NULL) {
+        do_log(L_ERROR, "Couldn't allocate segment index.\n");
+        return -1;
+    }
+    for(i = 0; i < segmentTableSize; i++) {
+        entry = segmentTable[i];
+        while(entry) {
+            next = entry->next;
+            j = entry->hash & (size - 1);
+            entry->next = new[j];
+            new[j] = entry;
+            entry = next;
+        }
+    }
+    free(segmentTable);
+    segmentTable = new;
+    segmentTableSize = size;
+    return 1;
+}
+
+static SegmentEntryPtr
+findSegmentEntry(unsigned long long hash)
+{
+    SegmentEntryPtr entry;
+
+    if(segmentTableSize == 0)
+        return NULL;
+    entry = segmentTable[hash & (segmentTableSize - 1)];
+    while(entry) {
+        if(entry->hash == hash)
+            return entry;
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+/* Removes an entry from the index and accounts for the space it used. */
+static void
+dropSegmentEntry(unsigned long long hash)
+{
+    SegmentEntryPtr *p, entry;
+
+    if(segmentTableSize == 0)
+        return;
+    p = &segmentTable[hash & (segmentTableSize - 1)];
+    while(*p) {
+        entry = *p;
+        if(entry->hash == hash) {
+            *p = entry->next;
+            if(entry->segment < numSegments)
+                segments[entry->segment].dead +=
+                    recordSize(entry->key_len, entry->length);
+            free(entry);
+            segmentCount--;
+            segmentsDirty = 1;
+            return;
+        }
+        p = &entry->next;
+    }
+}
+
+static int
+addSegmentEntry(unsigned long long hash, int s, off_t base,
+                int key_len, int length, unsigned int stamp)
+{
+    SegmentEntryPtr entry;
+    int i;
+
+    entry = findSegmentEntry(hash);
+    if(entry) {
+        if(entry->segment < numSegments)
+            segments[entry->segment].dead +=
+                recordSize(entry->key_len, entry->length);
+    } else {
+        if(segmentCount >= segmentTableSize) {
+            if(resizeSegmentTable(MAX(2 * segmentTableSize, 1024)) < 0)
+                return -1;
+        }
+        entry = malloc(sizeof(SegmentEntryRec));
+        if(entry == NULL) {
+            do_log(L_ERROR, "Couldn't allocate segment entry.\n");
+            return -1;
+        }
+        entry->hash = hash;
+        i = hash & (segmentTableSize - 1);
+        entry->next = segmentTable[i];
+        segmentTable[i] = entry;
+        segmentCount++;
+    }
+    entry->segment = s;
+    entry->base = base;
+    entry->key_len = key_len;
+    entry->length = length;
+    entry->stamp = stamp;
+    segmentsDirty = 1;
+    return 1;
+}
+
+/* Drop all index entries that live in segment s. */
+static void
+dropSegment(int s)
+{
+    SegmentEntryPtr *p, entry;
+    int i;
+
+    for(i = 0; i < segmentTableSize; i++) {
+        p = &segmentTable[i];
+        while(*p) {
+            entry = *p;
+            if(entry->segment == s) {
+                *p = entry->next;
+                free(entry);
+                segmentCount--;
+            } else {
+                p = &entry->next;
+            }
+        }
+    }
+    segments[s].size = -1;
+    segments[s].dead = 0;
+    segmentsDirty = 1;
+}
+
+static void
+resetSegmentIndex()
+{
+    int i;
+    SegmentEntryPtr entry, next;
+
+    for(i = 0; i < segmentTableSize; i++) {
+        entry = segmentTable[i];
+        while(entry) {
+            next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(segmentTable);
+    segmentTable = NULL;
+    segmentTableSize = 0;
+    segmentCount = 0;
+    free(segments);
+    segments = NULL;
+    numSegments = 0;
+}
+
+static void
+closeSegments()
+{
+    if(writeFd >= 0)
+        close(writeFd);
+    writeFd = -1;
+    writeSegment = -1;
+    if(segmentLockFd >= 0)
+        close(segmentLockFd);
+    segmentLockFd = -1;
+    resetSegmentIndex();
+    free(segmentRoot);
+    segmentRoot = NULL;
+}
+
+static int
+openSegment(int s, int flags)
+{
+    char buf[1024];
+    int fd;
+
+    if(segmentFilename(buf, 1024, s) < 0)
+        return -1;
+    fd = open(buf, flags | O_BINARY, diskCacheFilePermissions);
+    if(fd < 0 && !(flags & O_CREAT) && errno == ENOENT)
+        return -1;
+    if(fd < 0)
+        do_log_error(L_ERROR, errno, "Couldn't open segment %s", buf);
+    return fd;
+}
+
+static int
+openWriteSegment(int s)
+{
+    int fd;
+
+    if(ensureSegment(s) < 0)
+        return -1;
+    fd = openSegment(s, O_RDWR | O_CREAT);
+    if(fd < 0)
+        return -1;
+    if(writeFd >= 0)
+        close(writeFd);
+    writeFd = fd;
+    writeSegment = s;
+    if(segments[s].size < 0) {
+        segments[s].size = 0;
+        segments[s].dead = 0;
+    }
+    return 1;
+}
+
+/* Make sure the current segment has room for another record. */
+static int
+reserveSegment()
+{
+    if(writeFd < 0)
+        return -1;
+    if(segments[writeSegment].size < diskCacheSegmentSize)
+        return 1;
+    return openWriteSegment(writeSegment + 1);
+}
+
+/* Read records from segment s starting at from, and update the index.
+   Returns the offset of the first record that is not valid. */
+static off_t
+scanSegment(int s, int fd, off_t from, off_t file_size)
+{
+    SegmentHeaderRec h;
+    char key[SEGMENT_MAX_KEY];
+    unsigned long long hash;
+    off_t offset = from, size;
+
+    while(offset + (off_t)sizeof(h) <= file_size) {
+        if(readAt(fd, &h, sizeof(h), offset) < 0)
+            break;
+        if(h.magic != SEGMENT_MAGIC && h.magic != SEGMENT_TOMBSTONE)
+            break;
+        if(h.key_len == 0 || h.key_len > SEGMENT_MAX_KEY)
+            break;
+        if(h.magic == SEGMENT_TOMBSTONE && h.length != 0)
+            break;
+        size = recordSize(h.key_len, h.length);
+        if(offset + size > file_size)
+            break;
+        if(readAt(fd, key, h.key_len, offset + sizeof(h)) < 0)
+            break;
+        hash = segmentHash(key, h.key_len);
+        if(h.magic == SEGMENT_MAGIC) {
+            addSegmentEntry(hash, s, offset + sizeof(h) + h.key_len,
+                            h.key_len, h.length, h.stamp);
+        } else {
+            dropSegmentEntry(hash);
+            segments[s].dead += size;
+        }
+        offset += size;
+    }
+    return offset;
+}
+
+
+/* Returns the number of segments described by the checkpoint. */
+static int
+loadSegmentIndex()
+{
+    char buf[1024];
+    FILE *f;
+    SegmentIndexHeaderRec h;
+    SegmentIndexSegmentRec seg;
+    SegmentIndexEntryRec e;
+    unsigned int i;
+    int rc;
+
+    if(segmentFilename(buf, 1024, -1) < 0)
+        return -1;
+    f = fopen(buf, "rb");
+    if(f == NULL)
+        return 0;
+
+    rc = fread(&h, sizeof(h), 1, f);
+    if(rc != 1 || h.magic != SEGMENT_INDEX_MAGIC ||
+       h.numSegments > 0x100000)
+        goto fail;
+
+    if(h.numSegments > 0 && ensureSegment(h.numSegments - 1) < 0)
+        goto fail;
+
+    for(i = 0; i < h.numSegments; i++) {
+        rc = fread(&seg, sizeof(seg), 1, f);
+        if(rc != 1)
+            goto fail;
+        segments[i].size = seg.size;
+        segments[i].dead = seg.dead;
+    }
+
+    for(i = 0; i < h.count; i++) {
+        rc = fread(&e, sizeof(e), 1, f);
+        if(rc != 1)
+            goto fail;
+        if(e.segment >= h.numSegments || segments[e.segment].size < 0 ||
+           e.base + e.length > segments[e.segment].size)
+            continue;
+        rc = addSegmentEntry(e.hash, e.segment, e.base,
+                             e.key_len, e.length, e.stamp);
+        if(rc < 0)
+            goto fail;
+    }
+
+    fclose(f);
+    return h.numSegments;
+
+ fail:
+    do_log(L_WARN, "Couldn't read segment index %s -- rebuilding.\n", buf);
+    fclose(f);
+    return -1;
+}
+
+static int
+writeSegmentIndex()
+{
+    char buf[1024], tmp[1024];
+    FILE *f;
+    SegmentIndexHeaderRec h;
+    SegmentIndexSegmentRec seg;
+    SegmentIndexEntryRec e;
+    SegmentEntryPtr entry;
+    int i, rc, fd;
+
+    if(segmentFilename(buf, 1024, -1) < 0)
+        return -1;
+    rc = snprintf(tmp, 1024, "%s.tmp", buf);
+    if(rc < 0 || rc >= 1024)
+        return -1;
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+              diskCacheFilePermissions);
+    if(fd < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't create %s", tmp);
+        return -1;
+    }
+    f = fdopen(fd, "wb");
+    if(f == NULL) {
+        do_log_error(L_ERROR, errno, "Couldn't create %s", tmp);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    memset(&h, 0, sizeof(h));
+    h.magic = SEGMENT_INDEX_MAGIC;
+    h.numSegments = numSegments;
+    h.count = segmentCount;
+    fwrite(&h, sizeof(h), 1, f);
+
+    for(i = 0; i < numSegments; i++) {
+        seg.size = segments[i].size;
+        seg.dead = segments[i].dead;
+        fwrite(&seg, sizeof(seg), 1, f);
+    }
+
+    memset(&e, 0, sizeof(e));
+    for(i = 0; i < segmentTableSize; i++) {
+        entry = segmentTable[i];
+        while(entry) {
+            e.hash = entry->hash;
+            e.base = entry->base;
+            e.segment = entry->segment;
+            e.key_len = entry->key_len;
+            e.length = entry->length;
+            e.stamp = entry->stamp;
+            fwrite(&e, sizeof(e), 1, f);
+            entry = entry->next;
+        }
+    }
+
+    rc = ferror(f);
+    if(fclose(f) != 0 || rc) {
+        do_log(L_ERROR, "Couldn't write segment index.\n");
+        unlink(tmp);
+        return -1;
+    }
+
+    rc = rename(tmp, buf);
+    if(rc < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't rename %s", tmp);
+        unlink(tmp);
+        return -1;
+    }
+    segmentsDirty = 0;
+    return 1;
+}
+
+static int
+compareInts(const void *a, const void *b)
+{
+    int i = *(const int*)a, j = *(const int*)b;
+    return i < j ? -1 : i > j ? 1 : 0;
+}
+
+/* Bring the index up to date with records written after the last
+   checkpoint, and forget about segments that have disappeared.
+   Returns the number of the last segment, or 0 if there are none. */
+static int
+recoverSegments(int indexed)
+{
+    char buf[1024];
+    DIR *dir;
+    struct dirent *dirent;
+    struct stat ss;
+    int *found = NULL;
+    int numFound = 0, maxFound = 0;
+    int i, s, fd, rc, last;
+    char *end;
+    off_t offset;
+
+    dir = opendir(segmentRoot);
+    if(dir == NULL) {
+        do_log_error(L_ERROR, errno, "Couldn't open %s", segmentRoot);
+        return -1;
+    }
+    while((dirent = readdir(dir)) != NULL) {
+        if(strlen(dirent->d_name) != 8)
+            continue;
+        s = strtol(dirent->d_name, &end, 16);
+        if(*end != '\0' || s <= 0)
+            continue;
+        if(numFound >= maxFound) {
+            int *new;
+            maxFound = MAX(2 * maxFound, 16);
+            new = realloc(found, maxFound * sizeof(int));
+            if(new == NULL) {
+                do_log(L_ERROR, "Couldn't allocate segment list.\n");
+                closedir(dir);
+                free(found);
+                return -1;
+            }
+            found = new;
+        }
+        found[numFound++] = s;
+    }
+    closedir(dir);
+
+    if(numFound > 0)
+        qsort(found, numFound, sizeof(int), compareInts);
+
+    for(s = 0; s < numSegments; s++) {
+        if(segments[s].size >= 0 &&
+           (numFound == 0 ||
+            !bsearch(&s, found, numFound, sizeof(int), compareInts)))
+            dropSegment(s);
+    }
+
+    last = numFound > 0 ? found[numFound - 1] : 0;
+
+    for(i = 0; i < numFound; i++) {
+        s = found[i];
+        if(ensureSegment(s) < 0)
+            goto fail;
+        if(s < indexed && segments[s].size < 0) {
+            /* Left over from an interrupted compaction. */
+            if(segmentFilename(buf, 1024, s) >= 0)
+                unlink(buf);
+            continue;
+        }
+        fd = openSegment(s, s == last ? O_RDWR : O_RDONLY);
+        if(fd < 0)
+            continue;
+        rc = fstat(fd, &ss);
+        if(rc < 0) {
+            close(fd);
+            continue;
+        }
+        if(segments[s].size < 0) {
+            segments[s].size = 0;
+            segments[s].dead = 0;
+        } else if(segments[s].size > ss.st_size) {
+            do_log(L_WARN, "Segment %08x is shorter than expected.\n", s);
+            dropSegment(s);
+            segments[s].size = 0;
+        }
+        offset = scanSegment(s, fd, segments[s].size, ss.st_size);
+        if(offset < ss.st_size) {
+            if(s == last) {
+                do_log(L_WARN, "Truncating segment %08x at %ld.\n",
+                       s, (long)offset);
+                rc = ftruncate(fd, offset);
+                if(rc < 0)
+                    do_log_error(L_ERROR, errno, "Couldn't truncate segment");
+                segments[s].size = offset;
+            } else {
+                segments[s].dead += ss.st_size - offset;
+                segments[s].size = ss.st_size;
+            }
+        } else {
+            segments[s].size = offset;
+        }
+        close(fd);
+    }
+    free(found);
+    return last;
+
+ fail:
+    free(found);
+    return -1;
+}
+
+void
+initSegments()
+{
+    char buf[1024];
+    int rc, indexed, last;
+
+    if(!diskCacheSegments || diskCacheRoot == NULL)
+        return;
+
+    if(numWorkers > 1) {
+        do_log(L_WARN, "Disabling segment store: "
+               "it cannot be shared between workers.\n");
+        return;
+    }
+
+    rc = snprintf(buf, 1024, "%s%s/", diskCacheRoot->string,
+                  SEGMENT_DIRECTORY);
+    if(rc < 0 || rc >= 1024)
+        return;
+    rc = mkdir(buf, diskCacheDirectoryPermissions);
+    if(rc < 0 && errno != EEXIST) {
+        do_log_error(L_ERROR, errno, "Couldn't create %s", buf);
+        return;
+    }
+    segmentRoot = strdup(buf);
+    if(segmentRoot == NULL)
+        return;
+
+    rc = snprintf(buf, 1024, "%slock", segmentRoot);
+    if(rc < 0 || rc >= 1024)
+        goto fail;
+    segmentLockFd = open(buf, O_RDWR | O_CREAT | O_BINARY,
+                         diskCacheFilePermissions);
+    if(segmentLockFd < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't open %s", buf);
+        goto fail;
+    }
+#ifndef WIN32
+    /* Protects against polipo -x running concurrently with us. */
+    rc = flock(segmentLockFd, LOCK_EX | LOCK_NB);
+    if(rc < 0) {
+        do_log(L_WARN, "Segment store %s is in use, not using it.\n",
+               segmentRoot);
+        goto fail;
+    }
+#endif
+
+    indexed = loadSegmentIndex();
+    if(indexed < 0) {
+        resetSegmentIndex();
+        indexed = 0;
+    }
+    last = recoverSegments(indexed);
+    if(last < 0)
+        goto fail;
+    rc = openWriteSegment(MAX(last, 1));
+    if(rc < 0)
+        goto fail;
+
+    scheduleTimeEvent(SEGMENT_CHECKPOINT_INTERVAL,
+                      segmentCheckpointHandler, 0, NULL);
+    return;
+
+ fail:
+    closeSegments();
+}
+
+int
+segmentStoreActive()
+{
+    return writeFd >= 0;
+}
+
+/* Returns a fresh file descriptor positioned at the start of the entry
+   stored under key, or -1 if there is no such entry. */
+int
+segmentLookup(const char *key, int key_len,
+              off_t *base_return, int *length_return)
+{
+    SegmentHeaderRec h;
+    char buf[SEGMENT_MAX_KEY];
+    SegmentEntryPtr entry;
+    off_t record;
+    int fd, rc;
+
+    if(writeFd < 0 || key_len <= 0 || key_len > SEGMENT_MAX_KEY)
+        return -1;
+
+    entry = findSegmentEntry(segmentHash(key, key_len));
+    if(entry == NULL || entry->key_len != key_len)
+        return -1;
+
+    fd = openSegment(entry->segment, O_RDWR);
+    if(fd < 0) {
+        dropSegmentEntry(entry->hash);
+        return -1;
+    }
+
+    record = entry->base - sizeof(h) - key_len;
+    rc = readAt(fd, &h, sizeof(h), record);
+    if(rc < 0 || h.magic != SEGMENT_MAGIC ||
+       h.key_len != key_len || h.length != entry->length) {
+        do_log(L_WARN, "Inconsistent segment record for %s.\n", scrub(key));
+        close(fd);
+        dropSegmentEntry(entry->hash);
+        return -1;
+    }
+
+    rc = readAt(fd, buf, key_len, record + sizeof(h));
+    if(rc < 0 || memcmp(buf, key, key_len) != 0) {
+        /* A hash collision, most probably. */
+        close(fd);
+        return -1;
+    }
+
+    if(entry->stamp + SEGMENT_STAMP_SLACK < current_time.tv_sec) {
+        h.stamp = current_time.tv_sec;
+        rc = writeAt(fd, &h, sizeof(h), record);
+        if(rc >= 0) {
+            entry->stamp = h.stamp;
+            segmentsDirty = 1;
+        }
+    }
+
+    if(lseek(fd, entry->base, SEEK_SET) < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't seek");
+        close(fd);
+        return -1;
+    }
+
+    *base_return = entry->base;
+    *length_return = entry->length;
+    return fd;
+}
+
+/* Starts writing a new record.  Returns a file descriptor positioned at
+   the start of the entry, which the caller writes sequentially before
+   calling segmentAppendEnd or segmentAppendAbort. */
+int
+segmentAppendBegin(const char *key, int key_len, off_t *base_return)
+{
+    SegmentHeaderRec h;
+    off_t record;
+
+    if(writeFd < 0 || pendingRecord >= 0)
+        return -1;
+    if(key_len <= 0 || key_len > SEGMENT_MAX_KEY)
+        return -1;
+    if(reserveSegment() < 0)
+        return -1;
+
+    record = segments[writeSegment].size;
+    h.magic = SEGMENT_PENDING;
+    h.key_len = key_len;
+    h.length = 0;
+    h.stamp = current_time.tv_sec;
+
+    pendingRecord = record;
+    if(writeAt(writeFd, &h, sizeof(h), record) < 0 ||
+       writeAt(writeFd, key, key_len, record + sizeof(h)) < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't write segment record");
+        segmentAppendAbort();
+        return -1;
+    }
+
+    pendingHash = segmentHash(key, key_len);
+    pendingKeyLen = key_len;
+    pendingStamp = h.stamp;
+    *base_return = record + sizeof(h) + key_len;
+    return writeFd;
+}
+
+int
+segmentAppendEnd(int length)
+{
+    SegmentHeaderRec h;
+    off_t base, end;
+    int rc;
+
+    assert(pendingRecord >= 0);
+
+    base = pendingRecord + sizeof(h) + pendingKeyLen;
+    end = lseek(writeFd, 0, SEEK_CUR);
+    if(end != base + length) {
+        do_log(L_ERROR, "Inconsistent segment record length.\n");
+        segmentAppendAbort();
+        return -1;
+    }
+
+    h.magic = SEGMENT_MAGIC;
+    h.key_len = pendingKeyLen;
+    h.length = length;
+    h.stamp = pendingStamp;
+    rc = writeAt(writeFd, &h, sizeof(h), pendingRecord);
+    if(rc < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't write segment record");
+        segmentAppendAbort();
+        return -1;
+    }
+
+    segments[writeSegment].size = end;
+    pendingRecord = -1;
+    rc = addSegmentEntry(pendingHash, writeSegment, base,
+                         pendingKeyLen, length, pendingStamp);
+    if(rc < 0) {
+        segments[writeSegment].dead += recordSize(pendingKeyLen, length);
+        return -1;
+    }
+    return 1;
+}
+
+void
+segmentAppendAbort()
+{
+    off_t end;
+    int rc;
+
+    if(pendingRecord < 0)
+        return;
+
+    rc = ftruncate(writeFd, pendingRecord);
+    if(rc < 0) {
+        /* Don't leave a bad record in the middle of a segment. */
+        do_log_error(L_ERROR, errno, "Couldn't truncate segment");
+        end = lseek(writeFd, 0, SEEK_END);
+        if(end > pendingRecord) {
+            segments[writeSegment].dead += end - pendingRecord;
+            segments[writeSegment].size = end;
+        }
+        openWriteSegment(writeSegment + 1);
+    }
+    pendingRecord = -1;
+}
+
+static int
+writeTombstone(const char *key, int key_len)
+{
+    SegmentHeaderRec h;
+    off_t record, size;
+
+    if(reserveSegment() < 0)
+        return -1;
+
+    record = segments[writeSegment].size;
+    h.magic = SEGMENT_TOMBSTONE;
+    h.key_len = key_len;
+    h.length = 0;
+    h.stamp = current_time.tv_sec;
+    if(writeAt(writeFd, &h, sizeof(h), record) < 0 ||
+       writeAt(writeFd, key, key_len, record + sizeof(h)) < 0) {
+        do_log_error(L_ERROR, errno, "Couldn't write segment tombstone");
+        if(ftruncate(writeFd, record) < 0)
+            openWriteSegment(writeSegment + 1);
+        return -1;
+    }
+    size = recordSize(key_len, 0);
+    segments[writeSegment].size += size;
+    segments[writeSegment].dead += size;
+    return 1;
+}
+
+void
+segmentRemove(const char *key, int key_len)
+{
+    unsigned long long hash;
+
+    if(writeFd < 0 || pendingRecord >= 0)
+        return;
+    if(key_len <= 0 || key_len > SEGMENT_MAX_KEY)
+        return;
+
+    hash = segmentHash(key, key_len);
+    if(findSegmentEntry(hash) == NULL)
+        return;
+    dropSegmentEntry(hash);
+    writeTombstone(key, key_len);
+}
+
+/* Copy the live records of segment s to the current segment. */
+static int
+compactSegment(int s)
+{
+    SegmentHeaderRec h;
+    char key[SEGMENT_MAX_KEY];
+    char *buf;
+    SegmentEntryPtr entry;
+    off_t offset, size, dst, o;
+    int fd, n, moved = 0;
+
+    assert(s != writeSegment && pendingRecord < 0);
+
+    fd = openSegment(s, O_RDONLY);
+    if(fd < 0) {
+        dropSegment(s);
+        return 0;
+    }
+
+    buf = malloc(CHUNK_SIZE);
+    if(buf == NULL) {
+        do_log(L_ERROR, "Couldn't allocate compaction buffer.\n");
+        close(fd);
+        return -1;
+    }
+
+    offset = 0;
+    while(offset < segments[s].size) {
+        if(readAt(fd, &h, sizeof(h), offset) < 0)
+            break;
+        if(h.magic != SEGMENT_MAGIC && h.magic != SEGMENT_TOMBSTONE)
+            break;
+        if(h.key_len == 0 || h.key_len > SEGMENT_MAX_KEY)
+            break;
+        size = recordSize(h.key_len, h.length);
+        if(h.magic == SEGMENT_MAGIC) {
+            if(readAt(fd, key, h.key_len, offset + sizeof(h)) < 0)
+                break;
+            entry = findSegmentEntry(segmentHash(key, h.key_len));
+            if(entry && entry->segment == s &&
+               entry->base == offset + sizeof(h) + h.key_len) {
+                if(reserveSegment() < 0)
+                    goto fail;
+                dst = segments[writeSegment].size;
+                for(o = 0; o < size; o += n) {
+                    n = MIN(size - o, CHUNK_SIZE);
+                    if(readAt(fd, buf, n, offset + o) < 0 ||
+                       writeAt(writeFd, buf, n, dst + o) < 0) {
+                        do_log_error(L_ERROR, errno,
+                                     "Couldn't compact segment");
+                        if(ftruncate(writeFd, dst) < 0)
+                            openWriteSegment(writeSegment + 1);
+                        goto fail;
+                    }
+                }
+                segments[writeSegment].size += size;
+                entry->segment = writeSegment;
+                entry->base = dst + sizeof(h) + h.key_len;
+                moved++;
+            }
+        }
+        offset += size;
+    }
+
+    close(fd);
+    free(buf);
+    dropSegment(s);
+    return moved;
+
+ fail:
+    close(fd);
+    free(buf);
+    return -1;
+}
+
+/* Compact segments that are mostly dead and write out the index.  Unless
+   all is true, we copy at most one segment, to avoid blocking for too
+   long. */
+static int
+segmentCollect(int all)
+{
+    char buf[1024];
+    int *victims;
+    int numVictims = 0;
+    int s, best = -1, rc;
+
+    if(writeFd < 0)
+        return -1;
+
+    victims = malloc(numSegments * sizeof(int));
+    if(victims == NULL)
+        return -1;
+
+    for(s = 1; s < numSegments; s++) {
+        if(s == writeSegment || segments[s].size < 0)
+            continue;
+        if(segments[s].dead >= segments[s].size) {
+            if(compactSegment(s) >= 0)
+                victims[numVictims++] = s;
+        } else if(2 * segments[s].dead > segments[s].size) {
+            if(all) {
+                if(compactSegment(s) >= 0)
+                    victims[numVictims++] = s;
+            } else if(best < 0 ||
+                      segments[s].dead * segments[best].size >
+                      segments[best].dead * segments[s].size) {
+                best = s;
+            }
+        }
+    }
+    if(best >= 0 && compactSegment(best) >= 0)
+        victims[numVictims++] = best;
+
+    if(segmentsDirty || numVictims > 0) {
+        rc = writeSegmentIndex();
+        if(rc < 0) {
+            /* The old index still refers to the old segments. */
+            free(victims);
+            return -1;
+        }
+    }
+
+    for(s = 0; s < numVictims; s++) {
+        if(segmentFilename(buf, 1024, victims[s]) >= 0) {
+            rc = unlink(buf);
+            if(rc < 0 && errno != ENOENT)
+                do_log_error(L_ERROR, errno, "Couldn't unlink %s", buf);
+        }
+    }
+    free(victims);
+    return 1;
+}
+
+/* Drop entries that haven't been touched since before.  We don't bother
+   with tombstones, since the index is written out right away. */
+static int
+expireSegmentEntries(time_t before)
+{
+    SegmentEntryPtr *p, entry;
+    int i, n = 0;
+
+    for(i = 0; i < segmentTableSize; i++) {
+        p = &segmentTable[i];
+        while(*p) {
+            entry = *p;
+            if((time_t)entry->stamp < before) {
+                *p = entry->next;
+                segments[entry->segment].dead +=
+                    recordSize(entry->key_len, entry->length);
+                free(entry);
+                segmentCount--;
+                n++;
+            } else {
+                p = &entry->next;
+            }
+        }
+    }
+    if(n > 0)
+        segmentsDirty = 1;
+    return n;
+}
+
+void
+segmentCheckpoint()
+{
+    if(writeFd < 0)
+        return;
+    expireSegmentEntries(current_time.tv_sec - diskCacheUnlinkTime);
+    segmentCollect(0);
+}
+
+static int
+segmentCheckpointHandler(TimeEventHandlerPtr event)
+{
+    segmentCheckpoint();
+    if(writeFd >= 0)
+        scheduleTimeEvent(SEGMENT_CHECKPOINT_INTERVAL,
+                          segmentCheckpointHandler, 0, NULL);
+    return 1;
+}
+
+int
+segmentExpire(time_t before)
+{
+    int n;
+
+    if(writeFd < 0)
+        return -1;
+    n = expireSegmentEntries(before);
+    segmentCollect(1);
+    return n;
+}
+
+#else
+
+void
+preinitSegments()
+{
+    return;
+}
+
+void
+initSegments()
+{
+    return;
+}
+
+void
+segmentCheckpoint()
+{
+    return;
+}
+
+#endif
@@ -0,0 +1,42 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* The segment store keeps small objects in a few large append-only
+   files under diskCacheRoot, rather than one file per object. */
+
+#define SEGMENT_DIRECTORY ".segments"
+
+extern int diskCacheSegments;
+extern int diskCacheSegmentSize;
+extern int diskCacheSegmentObjectSize;
+
+void preinitSegments(void);
+void initSegments(void);
+int segmentStoreActive(void);
+int segmentLookup(const char *key, int key_len,
+                  off_t *base_return, int *length_return);
+int segmentAppendBegin(const char *key, int key_len, off_t *base_return);
+int segmentAppendEnd(int length);
+void segmentAppendAbort(void);
+void segmentRemove(const char *key, int key_len);
+void segmentCheckpoint(void);
+int segmentExpire(time_t before);
@@ -40,8 +40,23 @@ int maxSideBuffering = 1500;
 int maxConnectionAge = 1260;
 int maxConnectionRequests = 400;
 int alwaysAddNoTransform = 0;
+int maxServerConnections = 0;
 
-static HTTPServerPtr servers = 0;
+/* Known servers are kept in a hash table keyed on name, port and
+   isProxy, and on a doubly-linked list in most-recently-used order,
+   so that expiry only needs to look at the tail. */
+static HTTPServerPtr servers = NULL, servers_last = NULL;
+static HTTPServerPtr *serverHashTable = NULL;
+static int serverHashSize = 0;
+static int numServers = 0;
+
+#define SERVER_HASH_INITIAL 256
+
+/* Connections to all servers, and the servers that hold at least one;
+   servers waiting for the global limit are kept in FIFO order. */
+static int numServerConnections = 0, numActiveServers = 0;
+static HTTPServerPtr waitingServers = NULL, waitingServersLast = NULL;
+static int serverConnectionsOpened = 0, serverRequestsSent = 0;
 
 static int httpServerContinueConditionHandler(int, ConditionHandlerPtr);
 static int initParentProxy(void);
@@ -79,6 +94,9 @@ preinitServer(void)
                     "Maximum number of connections per HTTP/1.0 server.");
     CONFIG_VARIABLE(serverMaxSlots, CONFIG_INT,
                     "Maximum number of connections per broken server.");
+    CONFIG_VARIABLE_SETTABLE(maxServerConnections, CONFIG_INT,
+                             configIntSetter,
+                             "Maximum number of connections to all servers.");
     CONFIG_VARIABLE(dontCacheRedirects, CONFIG_BOOLEAN,
                     "If true, don't cache redirects.");
     CONFIG_VARIABLE_SETTABLE(allowUnalignedRangeRequests,
@@ -105,25 +123,122 @@ parentProxySetter(ConfigVariablePtr var, void *value)
     return 1;
 }
 
+static unsigned int
+serverHash(char *name, int port, int proxy)
+{
+    return hash(port << 1 | (proxy ? 1 : 0), name, strlen(name), 32);
+}
+
+static HTTPServerPtr *
+serverBucket(unsigned int h)
+{
+    return &serverHashTable[h & (serverHashSize - 1)];
+}
+
+static void
+resizeServerHashTable(int size)
+{
+    HTTPServerPtr *old = serverHashTable;
+    HTTPServerPtr server;
+    int i, old_size = serverHashSize;
+
+    serverHashTable = calloc(size, sizeof(HTTPServerPtr));
+    if(serverHashTable == NULL) {
+        serverHashTable = old;
+        return;
+    }
+    serverHashSize = size;
+
+    for(i = 0; i < old_size; i++) {
+        while(old[i]) {
+            server = old[i];
+            old[i] = server->hnext;
+            server->hnext = *serverBucket(server->hash);
+            *serverBucket(server->hash) = server;
+        }
+    }
+    free(old);
+}
+
+static HTTPServerPtr
+findServer(char *name, int port, int proxy)
+{
+    HTTPServerPtr server;
+    unsigned int h;
+
+    if(serverHashTable == NULL)
+        return NULL;
+
+    h = serverHash(name, port, proxy);
+    server = *serverBucket(h);
+    while(server) {
+        if(server->hash == h && server->port == port &&
+           server->isProxy == proxy && strcmp(server->name, name) == 0)
+            return server;
+        server = server->hnext;
+    }
+    return NULL;
+}
+
+static void
+unlinkServer(HTTPServerPtr server)
+{
+    if(server->previous)
+        server->previous->next = server->next;
+    else
+        servers = server->next;
+    if(server->next)
+        server->next->previous = server->previous;
+    else
+        servers_last = server->previous;
+    server->next = server->previous = NULL;
+}
+
+static void
+linkServer(HTTPServerPtr server)
+{
+    server->previous = NULL;
+    server->next = servers;
+    if(servers)
+        servers->previous = server;
+    else
+        servers_last = server;
+    servers = server;
+}
+
 static void
 discardServer(HTTPServerPtr server)
 {
-    HTTPServerPtr previous;
+    HTTPServerPtr *p;
     assert(!server->request);
 
-    if(server == servers)
-        servers = server->next;
-    else {
-        previous = servers;
-        while(previous->next != server)
-            previous = previous->next;
-        previous->next = server->next;
+    unlinkServer(server);
+    h2ServerDiscard(server);
+
+    p = serverBucket(server->hash);
+    while(*p != server)
+        p = &(*p)->hnext;
+    *p = server->hnext;
+    numServers--;
+
+    if(server->waiting) {
+        HTTPServerPtr previous = NULL;
+        p = &waitingServers;
+        while(*p != server) {
+            previous = *p;
+            p = &(*p)->wnext;
+        }
+        *p = server->wnext;
+        if(waitingServersLast == server)
+            waitingServersLast = previous;
     }
 
     if(server->connection)
         free(server->connection);
     if(server->idleHandler)
         free(server->idleHandler);
+    if(server->idle)
+        free(server->idle);
     if(server->name)
         free(server->name);
 
@@ -145,15 +260,19 @@ httpServerIdle(HTTPServerPtr server)
 static int
 expireServersHandler(TimeEventHandlerPtr event)
 {
-    HTTPServerPtr server, next;
+    HTTPServerPtr server, previous;
     TimeEventHandlerPtr e;
-    server = servers;
+
+    /* The list is in LRU order, so we can stop at the first server
+       that has been used recently. */
+    server = servers_last;
     while(server) {
-        next = server->next;
-        if(httpServerIdle(server) &&
-           server->time + serverExpireTime < current_time.tv_sec)
+        if(server->time + serverExpireTime >= current_time.tv_sec)
+            break;
+        previous = server->previous;
+        if(httpServerIdle(server))
             discardServer(server);
-        server = next;
+        server = previous;
     }
     e = scheduleTimeEvent(serverExpireTime / 60 + 60, 
                           expireServersHandler, 0, NULL);
@@ -219,6 +338,15 @@ initServer(void)
 {
     TimeEventHandlerPtr event;
     servers = NULL;
+    servers_last = NULL;
+
+    serverHashTable = calloc(SERVER_HASH_INITIAL, sizeof(HTTPServerPtr));
+    if(serverHashTable == NULL) {
+        do_log(L_ERROR, "Couldn't allocate server hash table.\n");
+        exit(1);
+    }
+    serverHashSize = SERVER_HASH_INITIAL;
+    numServers = 0;
 
     if(pmmFirstSize || pmmSize) {
         if(pmmSize == 0) pmmSize = pmmFirstSize;
@@ -252,39 +380,41 @@ static HTTPServerPtr
 getServer(char *name, int port, int proxy)
 {
     HTTPServerPtr server;
-    int i;
+    int i, h2, maxslots;
 
-    server = servers;
-    while(server) {
-        if(strcmp(server->name, name) == 0 && server->port == port &&
-           server->isProxy == proxy) {
-            if(httpServerIdle(server) &&
-               server->time +  serverExpireTime < current_time.tv_sec) {
-                discardServer(server);
-                server = NULL;
-                break;
-            } else {
-                server->time = current_time.tv_sec;
-                return server;
+    server = findServer(name, port, proxy);
+    if(server) {
+        if(httpServerIdle(server) &&
+           server->time +  serverExpireTime < current_time.tv_sec) {
+            discardServer(server);
+        } else {
+            server->time = current_time.tv_sec;
+            if(server != servers) {
+                unlinkServer(server);
+                linkServer(server);
             }
+            return server;
         }
-        server = server->next;
     }
-    
+
+    /* An HTTP/2 server gets one slot per concurrent stream. */
+    h2 = h2ServerEnabled(name, port, proxy);
+    maxslots = h2 ? MAX(serverMaxSlots, h2MaxStreams) : serverMaxSlots;
+
     server = malloc(sizeof(HTTPServerRec));
     if(server == NULL) {
         do_log(L_ERROR, "Couldn't allocate server.\n");
         return NULL;
     }
 
-    server->connection = malloc(serverMaxSlots * sizeof(HTTPConnectionPtr));
+    server->connection = malloc(maxslots * sizeof(HTTPConnectionPtr));
     if(server->connection == NULL) {
         do_log(L_ERROR, "Couldn't allocate server.\n");
         free(server);
         return NULL;
     }
 
-    server->idleHandler = malloc(serverMaxSlots * sizeof(FdEventHandlerPtr));
+    server->idleHandler = malloc(maxslots * sizeof(FdEventHandlerPtr));
     if(server->connection == NULL) {
         do_log(L_ERROR, "Couldn't allocate server.\n");
         free(server->connection);
@@ -292,7 +422,16 @@ getServer(char *name, int port, int proxy)
         return NULL;
     }
 
-    server->maxslots = serverMaxSlots;
+    server->idle = malloc(maxslots * sizeof(int));
+    if(server->idle == NULL) {
+        do_log(L_ERROR, "Couldn't allocate server.\n");
+        free(server->idleHandler);
+        free(server->connection);
+        free(server);
+        return NULL;
+    }
+
+    server->maxslots = maxslots;
 
     server->name = strdup(name);
     if(server->name == NULL) {
@@ -304,23 +443,37 @@ getServer(char *name, int port, int proxy)
     server->port = port;
     server->addrindex = 0;
     server->isProxy = proxy;
+    server->hash = serverHash(name, port, proxy);
     server->version = HTTP_UNKNOWN;
     server->persistent = 0;
     server->pipeline = 0;
     server->time = current_time.tv_sec;
     server->rtt = -1;
     server->rate = -1;
-    server->numslots = MIN(serverSlots, server->maxslots);
+    server->numslots = h2 ? maxslots : MIN(serverSlots, server->maxslots);
     for(i = 0; i < server->maxslots; i++) {
         server->connection[i] = NULL;
         server->idleHandler[i] = NULL;
     }
+    server->numidle = 0;
+    server->numconnections = 0;
+    server->numconnecting = 0;
+    server->connections = 0;
+    server->requests = 0;
+    server->waiting = 0;
+    server->wnext = NULL;
+    server->h2 = h2;
+    server->h2session = NULL;
     server->request = NULL;
     server->request_last = NULL;
     server->lies = 0;
 
-    server->next = servers;
-    servers = server;
+    linkServer(server);
+    server->hnext = *serverBucket(server->hash);
+    *serverBucket(server->hash) = server;
+    numServers++;
+    if(numServers > 2 * serverHashSize)
+        resizeServerHashTable(2 * serverHashSize);
     return server;
 }
 
@@ -386,11 +539,17 @@ httpServerAbortRequest(HTTPRequestPtr request, int fail,
 void 
 httpServerClientReset(HTTPRequestPtr request)
 {
-    if(request->connection && 
-       request->connection->fd >= 0 &&
-       !request->connection->connecting &&
-       request->connection->request == request)
-        pokeFdEvent(request->connection->fd, -ECLIENTRESET, POLLIN | POLLOUT);
+    HTTPConnectionPtr connection = request->connection;
+
+    if(connection &&
+       (connection->fd >= 0 || connection->h2stream) &&
+       !connection->connecting &&
+       connection->request == request) {
+        if(connection->h2stream)
+            h2PokeStream(connection, -ECLIENTRESET, POLLIN | POLLOUT);
+        else
+            pokeFdEvent(connection->fd, -ECLIENTRESET, POLLIN | POLLOUT);
+    }
 }
 
 
@@ -422,13 +581,15 @@ httpMakeServerRequest(char *name, int port, ObjectPtr object,
 
     /* Because we allocate objects in chunks, we cannot have data that
        doesn't start at a chunk boundary. */
-    if(from % CHUNK_SIZE != 0) {
+    if(from % object->chunk_size != 0) {
         if(allowUnalignedRangeRequests) {
-            objectFillFromDisk(object, from / CHUNK_SIZE * CHUNK_SIZE, 1);
+            objectFillFromDisk(object,
+                               from / object->chunk_size * object->chunk_size,
+                               1);
             if(objectHoleSize(object, from - 1) != 0)
-                from = from / CHUNK_SIZE * CHUNK_SIZE;
+                from = from / object->chunk_size * object->chunk_size;
         } else {
-            from = from / CHUNK_SIZE * CHUNK_SIZE;
+            from = from / object->chunk_size * object->chunk_size;
         }
     }
 
@@ -488,6 +649,151 @@ httpMakeServerRequest(char *name, int port, ObjectPtr object,
     return 1;
 }
 
+static void
+httpServerIdlePush(HTTPConnectionPtr connection)
+{
+    HTTPServerPtr server = connection->server;
+    assert(server->numidle < server->maxslots);
+    server->idle[server->numidle++] = connection->slot;
+}
+
+static void
+httpServerIdleRemove(HTTPConnectionPtr connection)
+{
+    HTTPServerPtr server = connection->server;
+    int i;
+
+    for(i = 0; i < server->numidle; i++) {
+        if(server->idle[i] == connection->slot) {
+            memmove(server->idle + i, server->idle + i + 1,
+                    (server->numidle - i - 1) * sizeof(int));
+            server->numidle--;
+            break;
+        }
+    }
+    if(server->idleHandler[connection->slot]) {
+        unregisterFdEvent(server->idleHandler[connection->slot]);
+        server->idleHandler[connection->slot] = NULL;
+    }
+}
+
+static void
+httpServerConnected(HTTPConnectionPtr connection)
+{
+    if(connection->connecting) {
+        connection->connecting = 0;
+        connection->server->numconnecting--;
+    }
+}
+
+static int
+httpServerFreeSlot(HTTPServerPtr server)
+{
+    int i;
+    for(i = 0; i < server->numslots; i++)
+        if(!server->connection[i])
+            return i;
+    return -1;
+}
+
+static void
+httpServerWait(HTTPServerPtr server)
+{
+    if(server->waiting)
+        return;
+    server->waiting = 1;
+    server->wnext = NULL;
+    if(waitingServersLast)
+        waitingServersLast->wnext = server;
+    else
+        waitingServers = server;
+    waitingServersLast = server;
+}
+
+static void
+httpServerUnwait(HTTPServerPtr server)
+{
+    HTTPServerPtr *p = &waitingServers, previous = NULL;
+
+    if(!server->waiting)
+        return;
+    while(*p != server) {
+        previous = *p;
+        p = &(*p)->wnext;
+    }
+    *p = server->wnext;
+    if(waitingServersLast == server)
+        waitingServersLast = previous;
+    server->waiting = 0;
+    server->wnext = NULL;
+}
+
+static int
+serverConnectionsAvailable(void)
+{
+    return maxServerConnections <= 0 ||
+        numServerConnections < maxServerConnections;
+}
+
+/* Called whenever a connection to a server is closed, in order to
+   hand the free connection over to the servers waiting for one. */
+static void
+httpServerWakeWaiting(void)
+{
+    HTTPServerPtr server;
+
+    while(waitingServers && serverConnectionsAvailable()) {
+        server = waitingServers;
+        httpServerUnwait(server);
+        httpServerTrigger(server);
+    }
+}
+
+/* Decide whether server may open a new connection.  When the global
+   limit maxServerConnections is reached, a server holding less than
+   its fair share closes an idle connection belonging to a server
+   holding more, starting with the least recently used servers.
+   Servers that still cannot connect queue up until a connection is
+   closed. */
+static int
+httpServerMayConnect(HTTPServerPtr server)
+{
+    HTTPServerPtr other;
+    int share;
+
+    /* Streams of an HTTP/2 session don't use up sockets. */
+    if(server->h2 || serverConnectionsAvailable())
+        return 1;
+
+    share = maxServerConnections /
+        (numActiveServers + (server->numconnections == 0 ? 1 : 0));
+    if(share < 1)
+        share = 1;
+    if(server->numconnections >= share)
+        return 0;
+
+    /* Closing a connection triggers the servers that are waiting,
+       which must not include this one. */
+    httpServerUnwait(server);
+    other = servers_last;
+    while(other) {
+        if(other != server && !other->h2 &&
+           other->numconnections > share && other->numidle > 0) {
+            do_log(D_SERVER_CONN, "Reclaiming connection to %s:%d.\n",
+                   scrub(other->name), other->port);
+            httpServerFinish(other->connection[other->idle[0]], 1, 0);
+            break;
+        }
+        other = other->previous;
+    }
+
+    if(serverConnectionsAvailable())
+        return 1;
+
+    httpServerWait(server);
+    return 0;
+}
+
 int
 httpServerConnection(HTTPServerPtr server)
 {
@@ -501,21 +807,28 @@ httpServerConnection(HTTPServerPtr server)
     }
     connection->server = server;
 
-    for(i = 0; i < server->numslots; i++) {
-        if(!server->connection[i]) {
-            server->connection[i] = connection;
-            break;
-        }
-    }
-    assert(i < server->numslots);
-    
+    i = httpServerFreeSlot(server);
+    assert(i >= 0);
+    server->connection[i] = connection;
+    connection->slot = i;
+    if(server->numconnections++ == 0 && !server->h2)
+        numActiveServers++;
+    if(!server->h2)
+        numServerConnections++;
+    server->numconnecting++;
+    server->connections++;
+    serverConnectionsOpened++;
+
     connection->request = NULL;
     connection->request_last = NULL;
 
     do_log(D_SERVER_CONN, "C... %s:%d.\n",
            scrub(connection->server->name), connection->server->port);
     httpSetTimeout(connection, serverTimeout);
-    if(socksParentProxy) {
+    if(server->h2) {
+        connection->connecting = CONNECTING_CONNECT;
+        h2Connect(connection);
+    } else if(socksParentProxy) {
         connection->connecting = CONNECTING_SOCKS;
         do_socks_connect(server->name, connection->server->port,
                          httpServerSocksHandler, connection);
@@ -549,7 +862,7 @@ httpServerConnectionDnsHandler(int status, GethostbynameRequestPtr request)
                request->error_message ?
                request->error_message->string :
                pstrerror(-status), -status);
-        connection->connecting = 0;
+        httpServerConnected(connection);
         if(connection->server->request)
             httpServerAbortRequest(connection->server->request, 1, 504,
                                    retainAtom(message));
@@ -561,7 +874,7 @@ httpServerConnectionDnsHandler(int status, GethostbynameRequestPtr request)
         if(request->count > 10) {
             AtomPtr message = internAtom("DNS CNAME loop");
             do_log(L_ERROR, "DNS CNAME loop.\n");
-            connection->connecting = 0;
+            httpServerConnected(connection);
             if(connection->server->request)
                 httpServerAbortRequest(connection->server->request, 1, 504,
                                        retainAtom(message));
@@ -631,7 +944,7 @@ httpServerConnectionHandlerCommon(int status, HTTPConnectionPtr connection)
             do_log_error(L_ERROR, -status, "Connect to %s:%d failed",
                          scrub(connection->server->name),
                          connection->server->port);
-        connection->connecting = 0;
+        httpServerConnected(connection);
         if(connection->server->request)
             httpServerAbortRequest(connection->server->request,
                                    status != -ECLIENTRESET, 504, 
@@ -643,7 +956,8 @@ httpServerConnectionHandlerCommon(int status, HTTPConnectionPtr connection)
     do_log(D_SERVER_CONN, "C    %s:%d.\n",
            scrub(connection->server->name), connection->server->port);
 
-    connection->connecting = 0;
+    httpServerConnected(connection);
+    httpServerIdlePush(connection);
     /* serverTrigger will take care of inserting any timeouts */
     httpServerTrigger(connection->server);
     return 1;
@@ -654,20 +968,13 @@ httpServerIdleHandler(int a, FdEventHandlerPtr event)
 {
     HTTPConnectionPtr connection = *(HTTPConnectionPtr*)event->data;
     HTTPServerPtr server = connection->server;
-    int i;
 
     assert(!connection->request);
 
     do_log(D_SERVER_CONN, "Idle connection to %s:%d died.\n", 
            scrub(connection->server->name), connection->server->port);
 
-    for(i = 0; i < server->maxslots; i++) {
-        if(connection == server->connection[i]) {
-            server->idleHandler[i] = NULL;
-            break;
-        }
-    }
-    assert(i < server->maxslots);
+    server->idleHandler[connection->slot] = NULL;
 
     httpServerAbort(connection, 1, 504, internAtom("Timeout"));
     return 1;
@@ -730,40 +1037,36 @@ numRequests(HTTPServerPtr server)
 HTTPConnectionPtr
 httpServerGetConnection(HTTPServerPtr server, int *idle_return)
 {
-    int i, j;
-    int connecting = 0, empty = 0, idle = 0;
+    HTTPConnectionPtr connection;
+    int i, j, idle = 0;
 
+    /* Try to find an idle connection, preferring the one that was
+       used most recently. */
     j = -1;
-    /* Try to find an idle connection */
-    for(i = 0; i < server->numslots; i++) {
-        if(server->connection[i]) {
-            if(!server->connection[i]->connecting) {
-                if(!server->connection[i]->request) {
-                    if(server->idleHandler[i])
-                        unregisterFdEvent(server->idleHandler[i]);
-                    server->idleHandler[i] = NULL;
-                    if(j < 0) j = i;
-                    idle++;
-                }
-            } else
-                connecting++;
-        } else
-            empty++;
+    for(i = 0; i < server->numidle; i++) {
+        if(server->idle[i] < server->numslots) {
+            j = i;
+            idle++;
+        }
     }
 
     if(j >= 0) {
+        connection = server->connection[server->idle[j]];
+        httpServerIdleRemove(connection);
         *idle_return = idle;
-        return server->connection[j];
+        return connection;
     }
 
     /* If there's an empty slot, schedule connection creation */
-    if(empty) {
+    if(httpServerFreeSlot(server) >= 0) {
         /* Don't open a connection if there are already enough in
            progress, except if the server doesn't do persistent
            connections and there's only one in progress. */
-        if((connecting == 0 || (server->persistent <= 0 && connecting <= 1)) ||
-           connecting < numRequests(server)) {
-            httpServerConnection(server);
+        if((server->numconnecting == 0 ||
+            (server->persistent <= 0 && server->numconnecting <= 1)) ||
+           server->numconnecting < numRequests(server)) {
+            if(httpServerMayConnect(server))
+                httpServerConnection(server);
         }
     }
 
@@ -772,9 +1075,7 @@ httpServerGetConnection(HTTPServerPtr server, int *idle_return)
         for(i = 0; i < serverSlots; i++) {
             if(server->connection[i] && !server->connection[i]->connecting &&
                pipelineIsSmall(server->connection[i])) {
-                if(server->idleHandler[i])
-                    unregisterFdEvent(server->idleHandler[i]);
-                server->idleHandler[i] = NULL;
+                httpServerIdleRemove(server->connection[i]);
                 *idle_return = 0;
                 return server->connection[i];
             }
@@ -860,6 +1161,8 @@ httpServerTrigger(HTTPServerPtr server)
                 request->flags |= REQUEST_PIPELINED;
             request->time0 = current_time;
             i++;
+            server->requests++;
+            serverRequestsSent++;
             server->request = request->next;
             request->next = NULL;
             if(server->request == NULL)
@@ -875,31 +1178,35 @@ httpServerTrigger(HTTPServerPtr server)
         if(idle && connection->pipelined > 0)
             httpServerReply(connection, 0);
 
-        if(i == 0) break;
+        if(i == 0) {
+            if(!connection->pipelined)
+                httpServerIdlePush(connection);
+            break;
+        }
     }
 
-    for(i = 0; i < server->maxslots; i++) {
-        if(server->connection[i] &&
-           !server->connection[i]->connecting &&
-           !server->connection[i]->request) {
-            /* Artificially age any fresh connections that aren't used
-               straight away; this is necessary for the logic for POST and 
-               the logic that determines whether a given request should be 
-               restarted. */
-            if(server->connection[i]->serviced == 0)
-                server->connection[i]->serviced = 1;
-            if(!server->idleHandler[i])
-                server->idleHandler[i] = 
-                    registerFdEvent(server->connection[i]->fd, POLLIN,
-                                    httpServerIdleHandler,
-                                    sizeof(HTTPConnectionPtr),
-                                    &server->connection[i]);
-            if(!server->idleHandler[i]) {
-                do_log(L_ERROR, "Couldn't register idle handler.\n");
-                httpServerFinish(server->connection[i], 1, 0);
-            }
-            httpSetTimeout(server->connection[i], serverIdleTimeout);
+    for(i = server->numidle - 1; i >= 0; i--) {
+        int slot = server->idle[i];
+        connection = server->connection[slot];
+        /* Artificially age any fresh connections that aren't used
+           straight away; this is necessary for the logic for POST and 
+           the logic that determines whether a given request should be 
+           restarted. */
+        if(connection->serviced == 0)
+            connection->serviced = 1;
+        /* An idle stream notices by itself when it is lost. */
+        if(!server->idleHandler[slot] && !connection->h2stream)
+            server->idleHandler[slot] = 
+                registerFdEvent(connection->fd, POLLIN,
+                                httpServerIdleHandler,
+                                sizeof(HTTPConnectionPtr),
+                                &server->connection[slot]);
+        if(!server->idleHandler[slot] && !connection->h2stream) {
+            do_log(L_ERROR, "Couldn't register idle handler.\n");
+            httpServerFinish(connection, 1, 0);
+            break;
         }
+        httpSetTimeout(connection, serverIdleTimeout);
     }
 
     return 1;
@@ -912,41 +1219,33 @@ httpServerSideRequest(HTTPServerPtr server)
     HTTPConnectionPtr connection;
     HTTPRequestPtr requestor = request->request;
     HTTPConnectionPtr client = requestor->connection;
-    int rc, i, freeslots, idle, connecting;
+    int rc, i, idle;
 
     assert(REQUEST_SIDE(request));
 
     connection = NULL;
-    freeslots = 0;
     idle = -1;
-    connecting = 0;
 
-    /* Find a fresh connection */
-    for(i = 0; i < server->numslots; i++) {
-        if(!server->connection[i])
-            freeslots++;
-        else if(!server->connection[i]->connecting) {
-            if(!server->connection[i]->request) {
-                if(server->connection[i]->serviced == 0) {
-                    if(server->idleHandler[i])
-                        unregisterFdEvent(server->idleHandler[i]);
-                    server->idleHandler[i] = NULL;
-                    connection = server->connection[i];
-                    break;
-                } else {
-                    idle = i;
-                }
-            }
+    /* Find a fresh connection.  Every stream of an HTTP/2 session is
+       fresh, a request that the server didn't process is refused. */
+    for(i = server->numidle - 1; i >= 0; i--) {
+        int slot = server->idle[i];
+        if(slot >= server->numslots)
+            continue;
+        if(server->connection[slot]->serviced == 0 || server->h2) {
+            connection = server->connection[slot];
+            break;
         } else {
-            connecting++;
+            idle = slot;
         }
     }
 
     if(!connection) {
         /* Make sure that a fresh connection will be established at some
            point, then wait until httpServerTrigger calls us again. */
-        if(freeslots) {
-            httpServerConnection(server);
+        if(httpServerFreeSlot(server) >= 0) {
+            if(httpServerMayConnect(server))
+                httpServerConnection(server);
         } else {
             if(idle >= 0) {
                 /* Shutdown a random idle connection */
@@ -964,6 +1263,9 @@ httpServerSideRequest(HTTPServerPtr server)
                                internAtom("Couldn't write request"));
         return 0;
     }
+    httpServerIdleRemove(connection);
+    server->requests++;
+    serverRequestsSent++;
     server->request = request->next;
     request->next = NULL;
     if(server->request == NULL)
@@ -1000,24 +1302,39 @@ httpServerDoSide(HTTPConnectionPtr connection)
     if(connection->reqlen > 0) {
         /* Send the headers, but don't send any part of the body if
            we're in wait_continue. */
-        do_stream_2(IO_WRITE,
-                    connection->fd, 0,
-                    connection->reqbuf, connection->reqlen,
-                    client->reqbuf + client->reqbegin, 
-                    (request->flags & REQUEST_WAIT_CONTINUE) ? 0 : len,
-                    httpServerSideHandler2, connection);
+        if(connection->h2stream)
+            h2DoStream2(IO_WRITE, connection, 0,
+                        connection->reqbuf, connection->reqlen,
+                        client->reqbuf + client->reqbegin,
+                        (request->flags & REQUEST_WAIT_CONTINUE) ? 0 : len,
+                        httpServerSideHandler2, connection);
+        else
+            do_stream_2(IO_WRITE,
+                        connection->fd, 0,
+                        connection->reqbuf, connection->reqlen,
+                        client->reqbuf + client->reqbegin, 
+                        (request->flags & REQUEST_WAIT_CONTINUE) ? 0 : len,
+                        httpServerSideHandler2, connection);
         httpServerReply(connection, 0);
     } else if(request->object->flags & OBJECT_ABORTED) {
         if(connection->reqbuf)
             dispose_chunk(connection->reqbuf);
         connection->reqbuf = NULL;
         connection->reqlen = 0;
-        pokeFdEvent(connection->fd, -ESHUTDOWN, POLLIN);
+        if(connection->h2stream)
+            h2PokeStream(connection, -ESHUTDOWN, POLLIN);
+        else
+            pokeFdEvent(connection->fd, -ESHUTDOWN, POLLIN);
         if(client->flags & CONN_READER) {
             client->flags |= CONN_SIDE_READER;
-            do_stream(IO_READ | IO_IMMEDIATE | IO_NOTNOW,
-                      client->fd, 0, NULL, 0,
-                      httpClientSideHandler, client);
+            if(client->h2stream)
+                h2DoStream(IO_READ | IO_IMMEDIATE | IO_NOTNOW,
+                           client, 0, NULL, 0,
+                           httpClientSideHandler, client);
+            else
+                do_stream(IO_READ | IO_IMMEDIATE | IO_NOTNOW,
+                          client->fd, 0, NULL, 0,
+                          httpClientSideHandler, client);
         }
     } else if(!(request->flags & REQUEST_WAIT_CONTINUE) && doflush) {
         /* Make sure there's a reqbuf, as httpServerFinish uses
@@ -1025,10 +1342,15 @@ httpServerDoSide(HTTPConnectionPtr connection)
         if(connection->reqbuf == NULL)
             connection->reqbuf = get_chunk();
         assert(connection->reqbuf != NULL);
-        do_stream(IO_WRITE,
-                  connection->fd, 0,
-                  client->reqbuf + client->reqbegin, len,
-                  httpServerSideHandler, connection);
+        if(connection->h2stream)
+            h2DoStream(IO_WRITE, connection, 0,
+                       client->reqbuf + client->reqbegin, len,
+                       httpServerSideHandler, connection);
+        else
+            do_stream(IO_WRITE,
+                      connection->fd, 0,
+                      client->reqbuf + client->reqbegin, len,
+                      httpServerSideHandler, connection);
     } else {
         if(connection->reqbuf) {
             httpConnectionDestroyReqbuf(connection);
@@ -1049,10 +1371,16 @@ httpServerDoSide(HTTPConnectionPtr connection)
             /* Fall through -- the client side will clean up. */
         }
         client->flags |= CONN_SIDE_READER;
-        do_stream(IO_READ | (done ? IO_IMMEDIATE : 0 ) | IO_NOTNOW,
-                  client->fd, client->reqlen,
-                  client->reqbuf, CHUNK_SIZE,
-                  httpClientSideHandler, client);
+        if(client->h2stream)
+            h2DoStream(IO_READ | (done ? IO_IMMEDIATE : 0 ) | IO_NOTNOW,
+                       client, client->reqlen,
+                       client->reqbuf, CHUNK_SIZE,
+                       httpClientSideHandler, client);
+        else
+            do_stream(IO_READ | (done ? IO_IMMEDIATE : 0 ) | IO_NOTNOW,
+                      client->fd, client->reqlen,
+                      client->reqbuf, CHUNK_SIZE,
+                      httpClientSideHandler, client);
     }
     return 1;
 }
@@ -1100,8 +1428,12 @@ httpServerSideHandlerCommon(int kind, int status,
     if(status) {
         do_log_error(L_ERROR, -status, "Couldn't write to server");
         httpConnectionDestroyReqbuf(connection);
-        if(status != -ECLIENTRESET)
-            shutdown(connection->fd, 2);
+        if(status != -ECLIENTRESET) {
+            if(connection->h2stream)
+                h2Shutdown(connection);
+            else
+                shutdown(connection->fd, 2);
+        }
         abortObject(request->object, 502,
                     internAtom("Couldn't write to server"));
         /* Let the read side handle the error */
@@ -1189,9 +1521,13 @@ httpServerFinish(HTTPConnectionPtr connection, int s, int offset)
            extremely unlikely to happen.  As for POST/PUT requests,
            they are not pipelined, so this can only happen if the
            server sent an error reply early. */
-        assert(connection->fd >= 0);
-        shutdown(connection->fd, 1);
-        pokeFdEvent(connection->fd, -EDOSHUTDOWN, POLLOUT);
+        if(connection->h2stream) {
+            h2PokeStream(connection, -EDOSHUTDOWN, POLLOUT);
+        } else {
+            assert(connection->fd >= 0);
+            shutdown(connection->fd, 1);
+            pokeFdEvent(connection->fd, -EDOSHUTDOWN, POLLOUT);
+        }
         httpServerDelayedFinish(connection);
         goto done;
     }
@@ -1265,6 +1601,9 @@ httpServerFinish(HTTPConnectionPtr connection, int s, int offset)
         }
     }
 
+    if(connection->h2stream)
+        h2StreamFinish(connection, s);
+
     connection->server->time = current_time.tv_sec;
     connection->serviced++;
 
@@ -1277,7 +1616,7 @@ httpServerFinish(HTTPConnectionPtr connection, int s, int offset)
             CLOSE(connection->fd);
         connection->fd = -1;
         server->persistent -= 1;
-        if(server->persistent < -5)
+        if(server->persistent < -5 && !server->h2)
             server->numslots = MIN(server->maxslots, serverMaxSlots);
         if(connection->request) {
             HTTPRequestPtr req;
@@ -1304,37 +1643,43 @@ httpServerFinish(HTTPConnectionPtr connection, int s, int offset)
            is in progress. */
         if(server->pipeline == 2 || server->pipeline == 3)
             server->pipeline = 1;
-        for(i = 0; i < server->maxslots; i++)
-            if(connection == server->connection[i])
-                break;
-        assert(i < server->maxslots);
-        if(server->idleHandler[i])
-            unregisterFdEvent(server->idleHandler[i]);
-        server->idleHandler[i] = NULL;
+        i = connection->slot;
+        assert(i >= 0 && i < server->maxslots &&
+               server->connection[i] == connection);
+        httpServerIdleRemove(connection);
         server->connection[i] = NULL;
+        if(connection->connecting)
+            server->numconnecting--;
+        if(--server->numconnections == 0 && !server->h2)
+            numActiveServers--;
+        if(!server->h2)
+            numServerConnections--;
         free(connection);
     } else {
         server->persistent += 1;
-        if(server->persistent > 0)
+        if(server->persistent > 0 && !server->h2)
             server->numslots = MIN(server->maxslots,
                                    server->version == HTTP_10 ?
                                    serverSlots1 : serverSlots);
         httpSetTimeout(connection, serverTimeout);
         /* See httpServerTrigger */
-        if(connection->pipelined ||
-           (server->version == HTTP_11 && server->pipeline <= 0) ||
-           (server->pipeline == 3)) {
+        if(!server->h2 &&
+           (connection->pipelined ||
+            (server->version == HTTP_11 && server->pipeline <= 0) ||
+            (server->pipeline == 3))) {
             server->pipeline++;
         }
         if(connection->pipelined) {
             httpServerReply(connection, 1);
         } else {
             httpConnectionDestroyBuf(connection);
+            httpServerIdlePush(connection);
         }
     }
 
  done:
     httpServerTrigger(server);
+    httpServerWakeWaiting();
 }
 
 static int
@@ -1386,10 +1731,16 @@ httpServerReply(HTTPConnectionPtr connection, int immediate)
         httpConnectionDestroyBuf(connection);
 
     httpSetTimeout(connection, serverTimeout);
-    do_stream_buf(IO_READ | (immediate ? IO_IMMEDIATE : 0) | IO_NOTNOW,
-                  connection->fd, connection->len,
-                  &connection->buf, CHUNK_SIZE,
-                  httpServerReplyHandler, connection);
+    if(connection->h2stream)
+        h2DoStreamBuf(IO_READ | (immediate ? IO_IMMEDIATE : 0) | IO_NOTNOW,
+                      connection, connection->len,
+                      &connection->buf, CHUNK_SIZE,
+                      httpServerReplyHandler, connection);
+    else
+        do_stream_buf(IO_READ | (immediate ? IO_IMMEDIATE : 0) | IO_NOTNOW,
+                      connection->fd, connection->len,
+                      &connection->buf, CHUNK_SIZE,
+                      httpServerReplyHandler, connection);
 }
 
 int
@@ -1486,7 +1837,7 @@ httpServerRequest(ObjectPtr object, int method, int from, int to,
     if(proxyOffline)
         return -1;
 
-    rc = parseUrl(object->key, object->key_size, &x, &y, &port, &z);
+    rc = parseUrl(object->key, objectUrlLength(object), &x, &y, &port, &z);
     
     if(rc < 0 || x < 0 || y < 0 || y - x > 131) {
         do_log(L_ERROR, "Couldn't parse URL %s\n", scrub(object->key));
@@ -1526,7 +1877,7 @@ httpWriteRequest(HTTPConnectionPtr connection, HTTPRequestPtr request,
     ObjectPtr object = request->object;
     int from = request->from, to = request->to, method = request->method;
     char *url = object->key, *m;
-    int url_size = object->key_size;
+    int url_size = objectUrlLength(object);
     int x, y, port, z, location_size;
     char *location;
     int l, n, rc, bufsize;
@@ -1547,7 +1898,9 @@ httpWriteRequest(HTTPConnectionPtr connection, HTTPRequestPtr request,
             from = 0;
             to = -1;
         } else {
-            objectFillFromDisk(object, from / CHUNK_SIZE * CHUNK_SIZE, 1);
+            objectFillFromDisk(object,
+                               from / object->chunk_size * object->chunk_size,
+                               1);
             l = objectHoleSize(request->object, from);
             if(l > 0) {
                 if(to <= 0 || to > from + l)
@@ -1561,9 +1914,9 @@ httpWriteRequest(HTTPConnectionPtr connection, HTTPRequestPtr request,
                     to = to < 0 ? from + pmmSize : MIN(to, from + pmmSize);
             }
 
-            if(from % CHUNK_SIZE != 0)
+            if(from % object->chunk_size != 0)
                 if(objectHoleSize(object, from - 1) != 0)
-                    from = from / CHUNK_SIZE * CHUNK_SIZE;
+                    from = from / object->chunk_size * object->chunk_size;
         }
     }
 
@@ -1753,8 +2106,13 @@ httpServerHandler(int status,
 
  fail:
     httpConnectionDestroyReqbuf(connection);
-    shutdown(connection->fd, 2);
-    pokeFdEvent(connection->fd, -EDOSHUTDOWN, POLLIN);
+    if(connection->h2stream) {
+        h2Shutdown(connection);
+        h2PokeStream(connection, -EDOSHUTDOWN, POLLIN);
+    } else {
+        shutdown(connection->fd, 2);
+        pokeFdEvent(connection->fd, -EDOSHUTDOWN, POLLIN);
+    }
     httpSetTimeout(connection, 60);
     return 1;
 }
@@ -1768,15 +2126,25 @@ httpServerSendRequest(HTTPConnectionPtr connection)
         do_log(D_SERVER_REQ, 
                "Writing aborted on 0x%lx\n", (unsigned long)connection);
         httpConnectionDestroyReqbuf(connection);
-        shutdown(connection->fd, 2);
-        pokeFdEvent(connection->fd, -EDOSHUTDOWN, POLLIN | POLLOUT);
+        if(connection->h2stream) {
+            h2Shutdown(connection);
+            h2PokeStream(connection, -EDOSHUTDOWN, POLLIN | POLLOUT);
+        } else {
+            shutdown(connection->fd, 2);
+            pokeFdEvent(connection->fd, -EDOSHUTDOWN, POLLIN | POLLOUT);
+        }
         return -1;
     }
 
     httpSetTimeout(connection, serverTimeout);
-    do_stream(IO_WRITE, connection->fd, 0,
-              connection->reqbuf, connection->reqlen,
-              httpServerHandler, connection);
+    if(connection->h2stream)
+        h2DoStream(IO_WRITE, connection, 0,
+                   connection->reqbuf, connection->reqlen,
+                   httpServerHandler, connection);
+    else
+        do_stream(IO_WRITE, connection->fd, 0,
+                  connection->reqbuf, connection->reqlen,
+                  httpServerHandler, connection);
     return 1;
 }
 
@@ -1846,10 +2214,15 @@ httpServerReplyHandler(int status,
             return 1;
         }
         /* Can't just return 0 -- buf has moved. */
-        do_stream(IO_READ,
-                  connection->fd, connection->len,
-                  connection->buf, bigBufferSize,
-                  httpServerReplyHandler, connection);
+        if(connection->h2stream)
+            h2DoStream(IO_READ, connection, connection->len,
+                       connection->buf, bigBufferSize,
+                       httpServerReplyHandler, connection);
+        else
+            do_stream(IO_READ,
+                      connection->fd, connection->len,
+                      connection->buf, bigBufferSize,
+                      httpServerReplyHandler, connection);
         return 1;
     }
 
@@ -1921,7 +2294,7 @@ httpServerHandlerHeaders(int eof,
     connection->server->version = version;
     request->flags |= REQUEST_PERSISTENT;
 
-    url = internAtomN(object->key, object->key_size);    
+    url = internAtomN(object->key, objectUrlLength(object));
     rc = httpParseHeaders(0, url, connection->buf, rc, request,
                           &headers, &len, &cache_control, NULL, &te,
                           &date, &last_modified, &expires, NULL, NULL, NULL,
@@ -2022,6 +2395,17 @@ httpServerHandlerHeaders(int eof,
         }
     }
 
+    /* RFC 5861: a server error during revalidation doesn't replace an
+       instance that may still be served stale-if-error. */
+    if((code == 500 || code == 502 || code == 503 || code == 504) &&
+       !(object->flags & OBJECT_INITIAL) &&
+       objectMayServeStale(object, NULL, 1)) {
+        do_log(L_WARN, "Server error %d on revalidation of %s, "
+               "keeping stale instance.\n", code, scrub(object->key));
+        httpServerAbort(connection, 1, code, retainAtom(message));
+        goto fail;
+    }
+
     releaseAtom(url);
 
     /* Okay, we're going to accept this reply. */
@@ -2173,9 +2557,12 @@ httpServerHandlerHeaders(int eof,
         new_object->flags |= OBJECT_DYNAMIC;
 
     new_object->age = age;
+    new_object->hits = 0;
     new_object->cache_control |= cache_control.flags;
     new_object->max_age = cache_control.max_age;
     new_object->s_maxage = cache_control.s_maxage;
+    new_object->stale_while_revalidate = cache_control.stale_while_revalidate;
+    new_object->stale_if_error = cache_control.stale_if_error;
     new_object->flags &= ~OBJECT_FAILED;
 
     if(date >= 0)
@@ -2214,6 +2601,12 @@ httpServerHandlerHeaders(int eof,
 
     httpTweakCachability(new_object);
 
+    if(request->request)
+        httpVaryRecord(new_object,
+                       (new_object->flags & OBJECT_INITIAL) ?
+                       headers : new_object->headers,
+                       request->request->headers);
+
     if(!via)
         new_via = internAtomF("%s %s",
                               version == HTTP_11 ? "1.1" : "1.0",
@@ -2230,6 +2623,8 @@ httpServerHandlerHeaders(int eof,
     }
 
     if(new_object->flags & OBJECT_INITIAL) {
+        /* objectPartial wakes up clients, which lock chunks. */
+        objectSetChunkSize(new_object, full_len, MAX(content_range.from, 0));
         objectPartial(new_object, full_len, headers);
     } else {
         if(new_object->length < 0)
@@ -2300,7 +2695,9 @@ httpServerHandlerHeaders(int eof,
     }
 
 
-    if(request->flags & REQUEST_PERSISTENT) {
+    /* An HTTP/2 stream carries a single reply, which may well be
+       delimited by its end. */
+    if((request->flags & REQUEST_PERSISTENT) && !connection->h2stream) {
         if(request->method != METHOD_HEAD && 
            connection->te == TE_IDENTITY && len < 0) {
             do_log(L_ERROR, "Persistent reply with no Content-Length\n");
@@ -2373,7 +2770,7 @@ httpServerHandlerHeaders(int eof,
                 object->length = object->size;
                 objectMetadataChanged(object, 0);
             }
-            httpServerFinish(connection, 1, 0);
+            httpServerFinish(connection, connection->h2stream ? 0 : 1, 0);
             return 1;
         }
     } else {
@@ -2450,7 +2847,7 @@ httpServerIndirectHandlerCommon(HTTPConnectionPtr connection, int eof)
                 request->object->length = request->object->size;
                 objectMetadataChanged(request->object, 0);
             }
-            httpServerFinish(connection, 1, 0);
+            httpServerFinish(connection, connection->h2stream ? 0 : 1, 0);
             return 1;
         }
     } else {
@@ -2508,8 +2905,9 @@ httpServerReadData(HTTPConnectionPtr connection, int immediate)
        ((connection->te == TE_IDENTITY && to > connection->offset) ||
         (connection->te == TE_CHUNKED && connection->chunk_remaining > 0))) {
         /* Read directly into the object */
-        int i = connection->offset / CHUNK_SIZE;
-        int j = connection->offset % CHUNK_SIZE;
+        int cs = object->chunk_size;
+        int i = connection->offset / cs;
+        int j = connection->offset % cs;
         int end, len, more;
         /* See httpServerDirectHandlerCommon if you change this */
         if(connection->te == TE_CHUNKED) {
@@ -2536,39 +2934,55 @@ httpServerReadData(HTTPConnectionPtr connection, int immediate)
            memory. */
         lockChunk(object, i);
         if(object->chunks[i].data == NULL)
-            object->chunks[i].data = get_chunk();
+            object->chunks[i].data = get_chunks(CHUNKS(cs));
         if(object->chunks[i].data && object->chunks[i].size >= j) {
-            if(len + j > CHUNK_SIZE) {
+            if(len + j > cs) {
                 lockChunk(object, i + 1);
                 if(object->chunks[i + 1].data == NULL)
-                    object->chunks[i + 1].data = get_chunk();
+                    object->chunks[i + 1].data = get_chunks(CHUNKS(cs));
                 /* Unless we're grabbing all len of data, we do not
                    want to do an indirect read immediately afterwards. */
-                if(more && len + j <= 2 * CHUNK_SIZE) {
+                if(more && len + j <= 2 * cs) {
                     if(!connection->buf)
                         connection->buf = get_chunk(); /* checked below */
                 }
                 if(object->chunks[i + 1].data) {
-                    do_stream_3(IO_READ | IO_NOTNOW, connection->fd, j,
-                                object->chunks[i].data, CHUNK_SIZE,
-                                object->chunks[i + 1].data,
-                                MIN(CHUNK_SIZE,
-                                    end - (i + 1) * CHUNK_SIZE),
-                                connection->buf, connection->buf ? more : 0,
-                                httpServerDirectHandler2, connection);
+                    if(connection->h2stream)
+                        h2DoStream3(IO_READ | IO_NOTNOW, connection, j,
+                                    object->chunks[i].data, cs,
+                                    object->chunks[i + 1].data,
+                                    MIN(cs, end - (i + 1) * cs),
+                                    connection->buf,
+                                    connection->buf ? more : 0,
+                                    httpServerDirectHandler2, connection);
+                    else
+                        do_stream_3(IO_READ | IO_NOTNOW, connection->fd, j,
+                                    object->chunks[i].data, cs,
+                                    object->chunks[i + 1].data,
+                                    MIN(cs, end - (i + 1) * cs),
+                                    connection->buf,
+                                    connection->buf ? more : 0,
+                                    httpServerDirectHandler2, connection);
                     return 1;
                 }
                 unlockChunk(object, i + 1);
             }
-            if(more && len + j <= CHUNK_SIZE) {
+            if(more && len + j <= cs) {
                 if(!connection->buf)
                     connection->buf = get_chunk();
             }
-            do_stream_2(IO_READ | IO_NOTNOW, connection->fd, j,
-                        object->chunks[i].data,
-                        MIN(CHUNK_SIZE, end - i * CHUNK_SIZE),
-                        connection->buf, connection->buf ? more : 0,
-                        httpServerDirectHandler, connection);
+            if(connection->h2stream)
+                h2DoStream2(IO_READ | IO_NOTNOW, connection, j,
+                            object->chunks[i].data,
+                            MIN(cs, end - i * cs),
+                            connection->buf, connection->buf ? more : 0,
+                            httpServerDirectHandler, connection);
+            else
+                do_stream_2(IO_READ | IO_NOTNOW, connection->fd, j,
+                            object->chunks[i].data,
+                            MIN(cs, end - i * cs),
+                            connection->buf, connection->buf ? more : 0,
+                            httpServerDirectHandler, connection);
             return 1;
         } else {
             unlockChunk(object, i);
@@ -2579,13 +2993,22 @@ httpServerReadData(HTTPConnectionPtr connection, int immediate)
         httpConnectionDestroyBuf(connection);
 
     httpSetTimeout(connection, serverTimeout);
-    do_stream_buf(IO_READ | IO_NOTNOW |
-                  ((immediate && connection->len) ? IO_IMMEDIATE : 0),
-                  connection->fd, connection->len,
-                  &connection->buf,
-                  (connection->te == TE_CHUNKED ? 
-                   MIN(2048, CHUNK_SIZE) : CHUNK_SIZE),
-                  httpServerIndirectHandler, connection);
+    if(connection->h2stream)
+        h2DoStreamBuf(IO_READ | IO_NOTNOW |
+                      ((immediate && connection->len) ? IO_IMMEDIATE : 0),
+                      connection, connection->len,
+                      &connection->buf,
+                      (connection->te == TE_CHUNKED ?
+                       MIN(2048, CHUNK_SIZE) : CHUNK_SIZE),
+                      httpServerIndirectHandler, connection);
+    else
+        do_stream_buf(IO_READ | IO_NOTNOW |
+                      ((immediate && connection->len) ? IO_IMMEDIATE : 0),
+                      connection->fd, connection->len,
+                      &connection->buf,
+                      (connection->te == TE_CHUNKED ? 
+                       MIN(2048, CHUNK_SIZE) : CHUNK_SIZE),
+                      httpServerIndirectHandler, connection);
     return 1;
 }
 
@@ -2597,7 +3020,8 @@ httpServerDirectHandlerCommon(int kind, int status,
     HTTPConnectionPtr connection = srequest->data;
     HTTPRequestPtr request = connection->request;
     ObjectPtr object = request->object;
-    int i = connection->offset / CHUNK_SIZE;
+    int cs = object->chunk_size;
+    int i = connection->offset / cs;
     int to, end, end1;
 
     assert(request->object->flags & OBJECT_INPROGRESS);
@@ -2625,17 +3049,17 @@ httpServerDirectHandlerCommon(int kind, int status,
     else
         end = to;
     /* The amount of data actually read into the object */
-    end1 = MIN(end, i * CHUNK_SIZE + MIN(kind * CHUNK_SIZE, srequest->offset));
+    end1 = MIN(end, i * cs + MIN(kind * cs, srequest->offset));
 
     assert(end >= 0);
-    assert(end1 >= i * CHUNK_SIZE);
-    assert(end1 - 2 * CHUNK_SIZE <= i * CHUNK_SIZE);
+    assert(end1 >= i * cs);
+    assert(end1 - 2 * cs <= i * cs);
 
     object->chunks[i].size = 
-        MAX(object->chunks[i].size, MIN(end1 - i * CHUNK_SIZE, CHUNK_SIZE));
-    if(kind == 2 && end1 > (i + 1) * CHUNK_SIZE) {
+        MAX(object->chunks[i].size, MIN(end1 - i * cs, cs));
+    if(kind == 2 && end1 > (i + 1) * cs) {
         object->chunks[i + 1].size =
-            MAX(object->chunks[i + 1].size, end1 - (i + 1) * CHUNK_SIZE);
+            MAX(object->chunks[i + 1].size, end1 - (i + 1) * cs);
     }
     if(connection->te == TE_CHUNKED) {
         connection->chunk_remaining -= (end1 - connection->offset);
@@ -2646,8 +3070,8 @@ httpServerDirectHandlerCommon(int kind, int status,
     unlockChunk(object, i);
     if(kind == 2) unlockChunk(object, i + 1);
 
-    if(i * CHUNK_SIZE + srequest->offset > end1) {
-        connection->len = i * CHUNK_SIZE + srequest->offset - end1;
+    if(i * cs + srequest->offset > end1) {
+        connection->len = i * cs + srequest->offset - end1;
         return httpServerIndirectHandlerCommon(connection, status);
     } else {
         notifyObject(object);
@@ -2795,11 +3219,90 @@ connectionAddData(HTTPConnectionPtr connection, int skip)
     }
 }
 
+static void
+printServer(FILE *out, HTTPServerPtr server, int entry)
+{
+    int i, n, m;
+
+    fprintf(out, "<tr class=\"%s\">", entry % 2 == 0 ? "even" : "odd");
+    if(server->port == 80)
+        fprintf(out, "<td>%s</td>", server->name);
+    else
+        fprintf(out, "<td>%s:%d</td>", server->name, server->port);
+
+    if(server->version == HTTP_11)
+        fprintf(out, "<td>1.1</td>");
+    else if(server->version == HTTP_10)
+        fprintf(out, "<td>1.0</td>");
+    else
+        fprintf(out, "<td>unknown</td>");
+
+    if(server->persistent < 0)
+        fprintf(out, "<td>no</td>");
+    else if(server->persistent > 0)
+        fprintf(out, "<td>yes</td>");
+    else
+        fprintf(out, "<td>unknown</td>");
+
+    if(server->h2)
+        fprintf(out, "<td>h2</td>");
+    else if(server->version != HTTP_11 || server->persistent <= 0)
+        fprintf(out, "<td></td>");
+    else if(server->pipeline < 0)
+        fprintf(out, "<td>no</td>");
+    else if(server->pipeline >= 0 && server->pipeline <= 1)
+        fprintf(out, "<td>unknown</td>");
+    else if(server->pipeline == 2 || server->pipeline == 3)
+        fprintf(out, "<td>probing</td>");
+    else 
+        fprintf(out, "<td>yes</td>");
+
+    n = 0; m = 0;
+    for(i = 0; i < server->maxslots; i++)
+        if(server->connection[i] && !server->connection[i]->connecting) {
+            if(i < server->numslots)
+                n++;
+            else
+                m++;
+        }
+        
+    fprintf(out, "<td>%d/%d", n, server->numslots);
+    if(m)
+        fprintf(out, " + %d</td>", m);
+    else
+        fprintf(out, "</td>");
+
+    if(server->lies > 0)
+        fprintf(out, "<td>(%d lies)</td>", (server->lies + 9) / 10);
+    else
+        fprintf(out, "<td></td>");
+
+    if(server->rtt > 0)
+        fprintf(out, "<td>%.3f</td>", (double)server->rtt / 1000000.0);
+    else
+        fprintf(out, "<td></td>");
+    if(server->rate > 0)
+        fprintf(out, "<td>%d</td>", server->rate);
+    else
+        fprintf(out, "<td></td>");
+    if(server->requests > 0)
+        fprintf(out, "<td>%d%%</td>",
+                100 * MAX(server->requests - server->connections, 0) /
+                server->requests);
+    else
+        fprintf(out, "<td></td>");
+
+    fprintf(out, "</tr>\n");
+}
+
+/* If which is non-empty, it is of the form host[:port], and only the
+   matching servers are listed; this is a hash lookup rather than a
+   walk over all known servers. */
 void
-listServers(FILE *out)
+listServers(FILE *out, char *which)
 {
     HTTPServerPtr server;
-    int i, n, m, entry;
+    int entry;
 
     fprintf(out, "<!DOCTYPE HTML PUBLIC "
             "\"-//W3C//DTD HTML 4.01 Transitional//EN\" "
@@ -2819,77 +3322,50 @@ listServers(FILE *out)
             "<th></th>"
             "<th>rtt</th>"
             "<th>rate</th>"
+            "<th>reuse</th>"
             "</tr></thead>\n");
     fprintf(out, "<tbody>\n");
-    server = servers;
     entry = 0;
-    while(server) {
-        fprintf(out, "<tr class=\"%s\">", entry % 2 == 0 ? "even" : "odd");
-        if(server->port == 80)
-            fprintf(out, "<td>%s</td>", server->name);
-        else
-            fprintf(out, "<td>%s:%d</td>", server->name, server->port);
-
-        if(server->version == HTTP_11)
-            fprintf(out, "<td>1.1</td>");
-        else if(server->version == HTTP_10)
-            fprintf(out, "<td>1.0</td>");
-        else
-            fprintf(out, "<td>unknown</td>");
-
-        if(server->persistent < 0)
-            fprintf(out, "<td>no</td>");
-        else if(server->persistent > 0)
-            fprintf(out, "<td>yes</td>");
-        else
-            fprintf(out, "<td>unknown</td>");
-
-        if(server->version != HTTP_11 || server->persistent <= 0)
-            fprintf(out, "<td></td>");
-        else if(server->pipeline < 0)
-            fprintf(out, "<td>no</td>");
-        else if(server->pipeline >= 0 && server->pipeline <= 1)
-            fprintf(out, "<td>unknown</td>");
-        else if(server->pipeline == 2 || server->pipeline == 3)
-            fprintf(out, "<td>probing</td>");
-        else 
-            fprintf(out, "<td>yes</td>");
-
-        n = 0; m = 0;
-        for(i = 0; i < server->maxslots; i++)
-            if(server->connection[i] && !server->connection[i]->connecting) {
-                if(i < server->numslots)
-                    n++;
-                else
-                    m++;
-            }
-            
-        fprintf(out, "<td>%d/%d", n, server->numslots);
-        if(m)
-            fprintf(out, " + %d</td>", m);
-        else
-            fprintf(out, "</td>");
-
-        if(server->lies > 0)
-            fprintf(out, "<td>(%d lies)</td>", (server->lies + 9) / 10);
-        else
-            fprintf(out, "<td></td>");
-
-        if(server->rtt > 0)
-            fprintf(out, "<td>%.3f</td>", (double)server->rtt / 1000000.0);
-        else
-            fprintf(out, "<td></td>");
-        if(server->rate > 0)
-            fprintf(out, "<td>%d</td>", server->rate);
-        else
-            fprintf(out, "<td></td>");
-
-        fprintf(out, "</tr>\n");
-        server = server->next;
-        entry++;
+    if(which && which[0] != '\0') {
+        char *colon = strrchr(which, ':');
+        int port = 80;
+        if(colon) {
+            port = atoi(colon + 1);
+            *colon = '\0';
+        }
+        server = findServer(which, port, 0);
+        if(server)
+            printServer(out, server, entry++);
+        server = findServer(which, port, 1);
+        if(server)
+            printServer(out, server, entry++);
+        if(colon)
+            *colon = ':';
+    } else {
+        server = servers;
+        while(server) {
+            printServer(out, server, entry++);
+            server = server->next;
+        }
     }
     fprintf(out, "</tbody>\n");
     fprintf(out, "</table>\n");
+    fprintf(out, "<p>%d connections to %d servers",
+            numServerConnections, numActiveServers);
+    if(maxServerConnections > 0)
+        fprintf(out, " (limit %d)", maxServerConnections);
+    fprintf(out, "; %d requests sent over %d connections",
+            serverRequestsSent, serverConnectionsOpened);
+    if(serverRequestsSent > 0)
+        fprintf(out, " (%d%% reused)",
+                100 * MAX(serverRequestsSent - serverConnectionsOpened, 0) /
+                serverRequestsSent);
+    fprintf(out, ".</p>\n");
+    fprintf(out, "<p>%d requests joined a fetch in progress, "
+            "%d of which would otherwise have been revalidated.</p>\n",
+            coalescedRequests, coalescedRevalidations);
+    fprintf(out, "<p>%d objects were revalidated before they became "
+            "stale.</p>\n", refreshedAhead);
     fprintf(out, "<p><a href=\"/polipo/\">back</a></p>");
     fprintf(out, "</body></html>\n");
 }
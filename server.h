@@ -20,13 +20,14 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
-extern int serverExpireTime, dontCacheRedirects;
+extern int serverExpireTime, dontCacheRedirects, maxServerConnections;
 
 typedef struct _HTTPServer {
     char *name;
     int port;
     int addrindex;
     int isProxy;
+    unsigned int hash;
     int version;
     int persistent;
     int pipeline;
@@ -38,8 +39,22 @@ typedef struct _HTTPServer {
     int maxslots;
     HTTPConnectionPtr *connection;
     FdEventHandlerPtr *idleHandler;
+    /* Slots of idle connections, least recently used first. */
+    int *idle;
+    int numidle;
+    int numconnections;
+    int numconnecting;
+    /* Connections opened and requests sent, for the reuse ratio. */
+    int connections;
+    int requests;
+    int waiting;
+    struct _HTTPServer *wnext;
+    /* Connections are streams of a shared HTTP/2 session. */
+    int h2;
+    struct _H2Session *h2session;
     HTTPRequestPtr request, request_last;
-    struct _HTTPServer *next;
+    struct _HTTPServer *next, *previous;
+    struct _HTTPServer *hnext;
 } HTTPServerRec, *HTTPServerPtr;
 
 extern AtomPtr parentHost;
@@ -110,4 +125,4 @@ int connectionAddData(HTTPConnectionPtr connection, int skip);
 int 
 httpWriteRequest(HTTPConnectionPtr connection, HTTPRequestPtr request, int);
 
-void listServers(FILE*);
+void listServers(FILE*, char*);
@@ -58,6 +58,12 @@ static int tunnelConnectionHandler(int, FdEventHandlerPtr, ConnectRequestPtr);
 static int tunnelSocksHandler(int, SocksRequestPtr);
 static int tunnelHandlerCommon(int, TunnelPtr);
 static int tunnelError(TunnelPtr, int, AtomPtr);
+#ifdef HAVE_SPLICE
+static int tunnelSpliceRead1Handler(int, FdEventHandlerPtr);
+static int tunnelSpliceRead2Handler(int, FdEventHandlerPtr);
+static int tunnelSpliceWrite1Handler(int, FdEventHandlerPtr);
+static int tunnelSpliceWrite2Handler(int, FdEventHandlerPtr);
+#endif
 
 static int
 circularBufferFull(CircularBufferPtr buf)
@@ -108,6 +114,10 @@ makeTunnel(int fd, char *buf, int offset, int len)
     tunnel->buf2.buf = NULL;
     tunnel->buf2.tail = 0;
     tunnel->buf2.head = 0;
+    tunnel->pipe1[0] = tunnel->pipe1[1] = -1;
+    tunnel->piped1 = 0;
+    tunnel->pipe2[0] = tunnel->pipe2[1] = -1;
+    tunnel->piped2 = 0;
     return tunnel;
 }
 
@@ -120,9 +130,47 @@ destroyTunnel(TunnelPtr tunnel)
         dispose_chunk(tunnel->buf1.buf);
     if(tunnel->buf2.buf)
         dispose_chunk(tunnel->buf2.buf);
+    if(tunnel->pipe1[0] >= 0) {
+        CLOSE(tunnel->pipe1[0]);
+        CLOSE(tunnel->pipe1[1]);
+    }
+    if(tunnel->pipe2[0] >= 0) {
+        CLOSE(tunnel->pipe2[0]);
+        CLOSE(tunnel->pipe2[1]);
+    }
     free(tunnel);
 }
 
+/* Once both ends are connected, data is moved between the sockets by
+   the kernel through a pair of pipes.  The circular buffers are only
+   used for whatever is already in them (the client's pipelined data,
+   our reply or the CONNECT to the parent), which is always written out
+   before anything that goes through the pipes. */
+
+static void
+tunnelSetupSplice(TunnelPtr tunnel)
+{
+#ifdef HAVE_SPLICE
+    int rc;
+
+    rc = pipe2(tunnel->pipe1, O_NONBLOCK | O_CLOEXEC);
+    if(rc < 0)
+        goto fail;
+    rc = pipe2(tunnel->pipe2, O_NONBLOCK | O_CLOEXEC);
+    if(rc < 0) {
+        CLOSE(tunnel->pipe1[0]);
+        CLOSE(tunnel->pipe1[1]);
+        tunnel->pipe1[0] = tunnel->pipe1[1] = -1;
+        goto fail;
+    }
+    tunnel->flags |= TUNNEL_SPLICE;
+    return;
+
+ fail:
+    do_log_error(L_WARN, errno, "Couldn't create tunnel pipe");
+#endif
+}
+
 void 
 do_tunnel(int fd, char *buf, int offset, int len, AtomPtr url)
 {
@@ -303,6 +351,8 @@ tunnelHandlerCommon(int fd, TunnelPtr tunnel)
 
     tunnel->fd2 = fd;
 
+    tunnelSetupSplice(tunnel);
+
     if(parentHost)
         return tunnelHandlerParent(fd, tunnel);
 
@@ -338,7 +388,7 @@ bufRead(int fd, CircularBufferPtr buf,
                       fd, 0,
                       &buf->buf, tail,
                       handler, data);
-    else if(buf->tail > buf->head)
+    else if(buf->tail > buf->head || buf->tail == 0)
         do_stream(IO_READ | IO_NOTNOW,
                   fd, buf->head,
                   buf->buf, tail,
@@ -368,13 +418,33 @@ bufWrite(int fd, CircularBufferPtr buf,
                     buf->buf, buf->head,
                     handler, data);
 }
-                    
+
+#ifdef HAVE_SPLICE
+
+static int
+spliceWait(int fd, int poll_events,
+           int (*handler)(int, FdEventHandlerPtr), TunnelPtr tunnel)
+{
+    FdEventHandlerPtr event;
+    event = registerFdEvent(fd, poll_events,
+                            handler, sizeof(tunnel), &tunnel);
+    if(event == NULL) {
+        do_log(L_ERROR, "Couldn't register tunnel event.\n");
+        return 0;
+    }
+    return 1;
+}
+
+#endif
+
 static void
 tunnelDispatch(TunnelPtr tunnel)
 {
     if(circularBufferEmpty(&tunnel->buf1)) {
         if(tunnel->buf1.buf && 
-           !(tunnel->flags & (TUNNEL_READER1 | TUNNEL_WRITER2))) {
+           !(tunnel->flags & TUNNEL_WRITER2) &&
+           ((tunnel->flags & TUNNEL_SPLICE) ||
+            !(tunnel->flags & TUNNEL_READER1))) {
             dispose_chunk(tunnel->buf1.buf);
             tunnel->buf1.buf = NULL;
             tunnel->buf1.head = tunnel->buf1.tail = 0;
@@ -383,7 +453,9 @@ tunnelDispatch(TunnelPtr tunnel)
 
     if(circularBufferEmpty(&tunnel->buf2)) {
         if(tunnel->buf2.buf &&
-           !(tunnel->flags & (TUNNEL_READER2 | TUNNEL_WRITER1))) {
+           !(tunnel->flags & TUNNEL_WRITER1) &&
+           ((tunnel->flags & TUNNEL_SPLICE) ||
+            !(tunnel->flags & TUNNEL_READER2))) {
             dispose_chunk(tunnel->buf2.buf);
             tunnel->buf2.buf = NULL;
             tunnel->buf2.head = tunnel->buf2.tail = 0;
@@ -391,6 +463,19 @@ tunnelDispatch(TunnelPtr tunnel)
     }
 
     if(tunnel->fd1 >= 0) {
+#ifdef HAVE_SPLICE
+        if(tunnel->flags & TUNNEL_SPLICE) {
+            if(!(tunnel->flags & (TUNNEL_READER1 | TUNNEL_EOF1 |
+                                  TUNNEL_FULL1)) &&
+               tunnel->piped1 < TUNNEL_PIPE_SIZE) {
+                if(spliceWait(tunnel->fd1, POLLIN,
+                              tunnelSpliceRead1Handler, tunnel))
+                    tunnel->flags |= TUNNEL_READER1;
+                else
+                    tunnel->flags |= TUNNEL_EOF1;
+            }
+        } else
+#endif
         if(!(tunnel->flags & (TUNNEL_READER1 | TUNNEL_EOF1)) && 
            !circularBufferFull(&tunnel->buf1)) {
             tunnel->flags |= TUNNEL_READER1;
@@ -405,7 +490,21 @@ tunnelDispatch(TunnelPtr tunnel)
             bufWrite(tunnel->fd1, &tunnel->buf2, tunnelWrite1Handler, tunnel);
             return;
         }
-        if(tunnel->fd2 < 0 || (tunnel->flags & TUNNEL_EOF2)) {
+#ifdef HAVE_SPLICE
+        if(!(tunnel->flags & (TUNNEL_WRITER1 | TUNNEL_EPIPE1)) &&
+           tunnel->piped2 > 0) {
+            if(spliceWait(tunnel->fd1, POLLOUT,
+                          tunnelSpliceWrite1Handler, tunnel)) {
+                tunnel->flags |= TUNNEL_WRITER1;
+            } else {
+                tunnel->flags |= TUNNEL_EPIPE1;
+            }
+        }
+#endif
+        if(!(tunnel->flags & TUNNEL_EPIPE1) &&
+           (!circularBufferEmpty(&tunnel->buf2) || tunnel->piped2 > 0)) {
+            /* Don't shut down until everything has been written. */
+        } else if(tunnel->fd2 < 0 || (tunnel->flags & TUNNEL_EOF2)) {
             if(!(tunnel->flags & TUNNEL_EPIPE1))
                 shutdown(tunnel->fd1, 1);
             tunnel->flags |= TUNNEL_EPIPE1;
@@ -423,6 +522,19 @@ tunnelDispatch(TunnelPtr tunnel)
     }
 
     if(tunnel->fd2 >= 0) {
+#ifdef HAVE_SPLICE
+        if(tunnel->flags & TUNNEL_SPLICE) {
+            if(!(tunnel->flags & (TUNNEL_READER2 | TUNNEL_EOF2 |
+                                  TUNNEL_FULL2)) &&
+               tunnel->piped2 < TUNNEL_PIPE_SIZE) {
+                if(spliceWait(tunnel->fd2, POLLIN,
+                              tunnelSpliceRead2Handler, tunnel))
+                    tunnel->flags |= TUNNEL_READER2;
+                else
+                    tunnel->flags |= TUNNEL_EOF2;
+            }
+        } else
+#endif
         if(!(tunnel->flags & (TUNNEL_READER2 | TUNNEL_EOF2)) && 
            !circularBufferFull(&tunnel->buf2)) {
             tunnel->flags |= TUNNEL_READER2;
@@ -434,7 +546,21 @@ tunnelDispatch(TunnelPtr tunnel)
             bufWrite(tunnel->fd2, &tunnel->buf1, tunnelWrite2Handler, tunnel);
             return;
         }
-        if(tunnel->fd1 < 0 || (tunnel->flags & TUNNEL_EOF1)) {
+#ifdef HAVE_SPLICE
+        if(!(tunnel->flags & (TUNNEL_WRITER2 | TUNNEL_EPIPE2)) &&
+           tunnel->piped1 > 0) {
+            if(spliceWait(tunnel->fd2, POLLOUT,
+                          tunnelSpliceWrite2Handler, tunnel)) {
+                tunnel->flags |= TUNNEL_WRITER2;
+            } else {
+                tunnel->flags |= TUNNEL_EPIPE2;
+            }
+        }
+#endif
+        if(!(tunnel->flags & TUNNEL_EPIPE2) &&
+           (!circularBufferEmpty(&tunnel->buf1) || tunnel->piped1 > 0)) {
+            /* Don't shut down until everything has been written. */
+        } else if(tunnel->fd1 < 0 || (tunnel->flags & TUNNEL_EOF1)) {
             if(!(tunnel->flags & TUNNEL_EPIPE2))
                 shutdown(tunnel->fd2, 1);
             tunnel->flags |= TUNNEL_EPIPE2;
@@ -540,6 +666,142 @@ tunnelWrite2Handler(int status,
     return 1;
 }
         
+#ifdef HAVE_SPLICE
+
+static int
+tunnelSpliceRead(int status, TunnelPtr tunnel, int fd, int *pipe_fd,
+                 int *piped, int full)
+{
+    int rc;
+
+    if(status)
+        return status;
+
+    rc = splice(fd, NULL, pipe_fd[1], NULL, TUNNEL_PIPE_SIZE - *piped,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(rc < 0) {
+        if(errno == EINTR)
+            return 0;
+        if(errno == EAGAIN) {
+            /* Either the socket is empty or the pipe is full; we cannot
+               tell which, so stop reading until the pipe is drained. */
+            if(*piped > 0) {
+                tunnel->flags |= full;
+                return 1;
+            }
+            return 0;
+        }
+        return -errno;
+    } else if(rc == 0) {
+        return 1;
+    }
+    *piped += rc;
+    return 1;
+}
+
+static int
+tunnelSpliceWrite(int status, TunnelPtr tunnel, int fd, int *pipe_fd,
+                  int *piped, int full)
+{
+    int rc;
+
+    if(status)
+        return status;
+
+    rc = splice(pipe_fd[0], NULL, fd, NULL, *piped,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(rc < 0) {
+        if(errno == EAGAIN || errno == EINTR)
+            return 0;
+        return -errno;
+    }
+    *piped -= rc;
+    tunnel->flags &= ~full;
+    return 1;
+}
+
+static int
+tunnelSpliceRead1Handler(int status, FdEventHandlerPtr event)
+{
+    TunnelPtr tunnel = *(TunnelPtr*)event->data;
+    int piped = tunnel->piped1;
+
+    status = tunnelSpliceRead(status, tunnel, tunnel->fd1,
+                              tunnel->pipe1, &tunnel->piped1, TUNNEL_FULL1);
+    if(status == 0)
+        return 0;
+    if(status < 0 || tunnel->piped1 == piped) {
+        if(status < 0 && status != -EPIPE && status != -ECONNRESET)
+            do_log_error(L_ERROR, -status, "Couldn't read from client");
+        if(!(tunnel->flags & TUNNEL_FULL1))
+            tunnel->flags |= TUNNEL_EOF1;
+    }
+    tunnel->flags &= ~TUNNEL_READER1;
+    tunnelDispatch(tunnel);
+    return 1;
+}
+
+static int
+tunnelSpliceRead2Handler(int status, FdEventHandlerPtr event)
+{
+    TunnelPtr tunnel = *(TunnelPtr*)event->data;
+    int piped = tunnel->piped2;
+
+    status = tunnelSpliceRead(status, tunnel, tunnel->fd2,
+                              tunnel->pipe2, &tunnel->piped2, TUNNEL_FULL2);
+    if(status == 0)
+        return 0;
+    if(status < 0 || tunnel->piped2 == piped) {
+        if(status < 0 && status != -EPIPE && status != -ECONNRESET)
+            do_log_error(L_ERROR, -status, "Couldn't read from server");
+        if(!(tunnel->flags & TUNNEL_FULL2))
+            tunnel->flags |= TUNNEL_EOF2;
+    }
+    tunnel->flags &= ~TUNNEL_READER2;
+    tunnelDispatch(tunnel);
+    return 1;
+}
+
+static int
+tunnelSpliceWrite1Handler(int status, FdEventHandlerPtr event)
+{
+    TunnelPtr tunnel = *(TunnelPtr*)event->data;
+
+    status = tunnelSpliceWrite(status, tunnel, tunnel->fd1,
+                               tunnel->pipe2, &tunnel->piped2, TUNNEL_FULL2);
+    if(status == 0)
+        return 0;
+    if(status < 0) {
+        if(status != -EPIPE && status != -ECONNRESET)
+            do_log_error(L_ERROR, -status, "Couldn't write to client");
+        tunnel->flags |= TUNNEL_EPIPE1;
+    }
+    tunnel->flags &= ~TUNNEL_WRITER1;
+    tunnelDispatch(tunnel);
+    return 1;
+}
+
+static int
+tunnelSpliceWrite2Handler(int status, FdEventHandlerPtr event)
+{
+    TunnelPtr tunnel = *(TunnelPtr*)event->data;
+
+    status = tunnelSpliceWrite(status, tunnel, tunnel->fd2,
+                               tunnel->pipe1, &tunnel->piped1, TUNNEL_FULL1);
+    if(status == 0)
+        return 0;
+    if(status < 0) {
+        if(status != -EPIPE && status != -ECONNRESET)
+            do_log_error(L_ERROR, -status, "Couldn't write to server");
+        tunnel->flags |= TUNNEL_EPIPE2;
+    }
+    tunnel->flags &= ~TUNNEL_WRITER2;
+    tunnelDispatch(tunnel);
+    return 1;
+}
+
+#endif
+
 static int
 tunnelError(TunnelPtr tunnel, int code, AtomPtr message)
 {
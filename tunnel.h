@@ -34,6 +34,12 @@ typedef struct _CircularBuffer {
 #define TUNNEL_WRITER2 32
 #define TUNNEL_EOF2 64
 #define TUNNEL_EPIPE2 128
+#define TUNNEL_SPLICE 256
+#define TUNNEL_FULL1 512
+#define TUNNEL_FULL2 1024
+
+/* Data moved with splice() goes through a pipe of this size. */
+#define TUNNEL_PIPE_SIZE (64 * 1024)
 
 typedef struct _Tunnel {
     AtomPtr hostname;
@@ -41,8 +47,12 @@ typedef struct _Tunnel {
     int flags;
     int fd1;
     CircularBufferRec buf1;
+    int pipe1[2];
+    int piped1;
     int fd2;
     CircularBufferRec buf2;
+    int pipe2[2];
+    int piped2;
 } TunnelRec, *TunnelPtr;
 
 void do_tunnel(int fd, char *buf, int offset, int len, AtomPtr url);
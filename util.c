@@ -317,18 +317,128 @@ sprintf_a(const char *f, ...)
     return s;
 }    
 
+/* The hash function is XXH64, with a random seed chosen at startup so
+   that clients cannot choose URLs that collide. */
+
+static unsigned long long hashSeed = 0;
+
+#define HASH_P1 11400714785074694791ULL
+#define HASH_P2 14029467366897019727ULL
+#define HASH_P3 1609587929392839161ULL
+#define HASH_P4 9650029242287828579ULL
+#define HASH_P5 2870177450012600261ULL
+
+#define HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline unsigned long long
+hash_round(unsigned long long acc, unsigned long long input)
+{
+    acc += input * HASH_P2;
+    acc = HASH_ROTL(acc, 31);
+    return acc * HASH_P1;
+}
+
+static inline unsigned long long
+hash_merge(unsigned long long acc, unsigned long long val)
+{
+    acc ^= hash_round(0, val);
+    return acc * HASH_P1 + HASH_P4;
+}
+
+static inline unsigned long long
+hash_read64(const unsigned char *p)
+{
+    unsigned long long v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline unsigned long long
+hash_read32(const unsigned char *p)
+{
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+void
+initHash()
+{
+    int fd, rc;
+    struct timeval t;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if(fd >= 0) {
+        rc = read(fd, &hashSeed, sizeof(hashSeed));
+        close(fd);
+        if(rc == sizeof(hashSeed))
+            return;
+    }
+    gettimeofday(&t, NULL);
+    hashSeed = ((unsigned long long)t.tv_sec << 32) ^ t.tv_usec ^
+        ((unsigned long long)getpid() << 16);
+}
+
 unsigned int
 hash(unsigned int seed, const void *restrict key, int key_size,
      unsigned int hash_size)
 {
-    int i;
-    unsigned int h;
+    const unsigned char *p = key;
+    const unsigned char *end = p + key_size;
+    unsigned long long s = hashSeed + seed;
+    unsigned long long h;
+
+    /* Four independent lanes of 8 bytes each, so that the
+       multiplications can proceed in parallel. */
+    if(key_size >= 32) {
+        unsigned long long v1 = s + HASH_P1 + HASH_P2;
+        unsigned long long v2 = s + HASH_P2;
+        unsigned long long v3 = s;
+        unsigned long long v4 = s - HASH_P1;
+        do {
+            v1 = hash_round(v1, hash_read64(p));
+            v2 = hash_round(v2, hash_read64(p + 8));
+            v3 = hash_round(v3, hash_read64(p + 16));
+            v4 = hash_round(v4, hash_read64(p + 24));
+            p += 32;
+        } while(p + 32 <= end);
+        h = HASH_ROTL(v1, 1) + HASH_ROTL(v2, 7) +
+            HASH_ROTL(v3, 12) + HASH_ROTL(v4, 18);
+        h = hash_merge(h, v1);
+        h = hash_merge(h, v2);
+        h = hash_merge(h, v3);
+        h = hash_merge(h, v4);
+    } else {
+        h = s + HASH_P5;
+    }
+
+    h += key_size;
+
+    while(p + 8 <= end) {
+        h ^= hash_round(0, hash_read64(p));
+        h = HASH_ROTL(h, 27) * HASH_P1 + HASH_P4;
+        p += 8;
+    }
+    if(p + 4 <= end) {
+        h ^= hash_read32(p) * HASH_P1;
+        h = HASH_ROTL(h, 23) * HASH_P2 + HASH_P3;
+        p += 4;
+    }
+    while(p < end) {
+        h ^= *p * HASH_P5;
+        h = HASH_ROTL(h, 11) * HASH_P1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_P2;
+    h ^= h >> 29;
+    h *= HASH_P3;
+    h ^= h >> 32;
 
-    h = seed;
-    for(i = 0; i < key_size; i++)
-        h = (h << 5) + (h >> (hash_size - 5)) +
-            ((unsigned char*)key)[i];
-    return h & ((1 << hash_size) - 1);
+    if(hash_size >= 32)
+        return (unsigned int)h;
+    return (unsigned int)h & ((1 << hash_size) - 1);
 }
 
 char *
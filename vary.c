@@ -0,0 +1,251 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "polipo.h"
+#include "md5import.h"
+
+#define VARY_SUFFIX " vary "
+#define VARY_SUFFIX_LENGTH 6
+
+/* Objects that vary on more headers than this are treated as if they
+   carried "Vary: *". */
+#define MAX_VARY_NAMES 16
+
+/* A URL never contains a space, so the URL of an object is the part of
+   its key before the first space. */
+int
+objectUrlLength(ObjectPtr object)
+{
+    char *space = memchr(object->key, ' ', object->key_size);
+    return space ? space - object->key : object->key_size;
+}
+
+/* Collect the names of the headers listed in Vary, ignoring Host which
+   is already part of the URL.  Returns the number of names, or -1 if
+   the object cannot be selected on. */
+static int
+varyNames(AtomPtr headers, AtomPtr *names)
+{
+    char *buf;
+    int len, i, j, k, b, e, rc;
+    int n = 0;
+
+    if(headers == NULL)
+        return 0;
+
+    buf = headers->string;
+    len = headers->length;
+    i = 0;
+    while(i < len) {
+        rc = httpFindHeader(atomVary, buf + i, len - i, &b, &e);
+        if(rc == 0)
+            break;
+        b += i;
+        e += i;
+        j = b;
+        while(j < e) {
+            while(j < e && (buf[j] == ' ' || buf[j] == '\t' || buf[j] == ','))
+                j++;
+            k = j;
+            while(k < e && buf[k] != ' ' && buf[k] != '\t' && buf[k] != ',')
+                k++;
+            if(k - j == 1 && buf[j] == '*')
+                goto fail;
+            if(k > j && !(k - j == 4 && lwrcmp(buf + j, "host", 4) == 0)) {
+                if(n >= MAX_VARY_NAMES)
+                    goto fail;
+                names[n] = internAtomLowerN(buf + j, k - j);
+                if(names[n] == NULL)
+                    goto fail;
+                n++;
+            }
+            j = k;
+        }
+        i = e;
+    }
+    return n;
+
+ fail:
+    while(n > 0)
+        releaseAtom(names[--n]);
+    return -1;
+}
+
+static void
+releaseVaryNames(AtomPtr *names, int n)
+{
+    int i;
+    for(i = 0; i < n; i++)
+        releaseAtom(names[i]);
+}
+
+/* Whether request headers select this object.  Objects that we cannot
+   select on are dealt with by objectMustRevalidate. */
+int
+httpVaryMatch(ObjectPtr object, AtomPtr headers)
+{
+    AtomPtr names[MAX_VARY_NAMES];
+    int i, n, match;
+
+    if(mindlesslyCacheVary ||
+       !(object->cache_control & CACHE_VARY) ||
+       (object->cache_control & CACHE_VARY_ANY) ||
+       objectUrlLength(object) != object->key_size)
+        return 1;
+
+    if(object->vary_headers == NULL || headers == NULL)
+        return 0;
+
+    n = varyNames(object->headers, names);
+    if(n < 0)
+        return 1;
+
+    match = 1;
+    for(i = 0; i < n; i++) {
+        if(!httpHeaderMatch(names[i], object->vary_headers, headers)) {
+            match = 0;
+            break;
+        }
+    }
+    releaseVaryNames(names, n);
+    return match;
+}
+
+/* Remember the values of the varying headers of the request that
+   caused this instance of the object to be fetched.  This is called
+   before the reply headers are stored in the object. */
+void
+httpVaryRecord(ObjectPtr object, AtomPtr reply_headers, AtomPtr headers)
+{
+    AtomPtr names[MAX_VARY_NAMES];
+    char buf[2048];
+    int i, n, b, e, rc;
+    int j = 0;
+
+    if(object->vary_headers) {
+        releaseAtom(object->vary_headers);
+        object->vary_headers = NULL;
+    }
+
+    if(!(object->cache_control & CACHE_VARY) || headers == NULL)
+        return;
+
+    n = varyNames(reply_headers, names);
+    if(n < 0) {
+        object->cache_control |= CACHE_VARY_ANY;
+        return;
+    }
+
+    for(i = 0; i < n; i++) {
+        rc = httpFindHeader(names[i], headers->string, headers->length,
+                            &b, &e);
+        if(rc == 0)
+            continue;
+        j = snnprintf(buf, j, 2048, "\r\n%s: ", names[i]->string);
+        j = snnprint_n(buf, j, 2048, headers->string + b, e - b);
+    }
+    releaseVaryNames(names, n);
+
+    if(j < 0) {
+        do_log(L_WARN, "Varying headers too long for %s.\n",
+               scrub(object->key));
+        return;
+    }
+
+    object->vary_headers = internAtomN(buf, j);
+}
+
+static void
+varyDigestValue(MD5_CTX *ctx, const char *value, int len)
+{
+    int i, space = 0;
+    char last = ',';
+
+    /* Whitespace around separators is dropped, other runs of
+       whitespace are collapsed. */
+    for(i = 0; i < len; i++) {
+        char c = value[i];
+        if(c == ' ' || c == '\t') {
+            space = 1;
+            continue;
+        }
+        if(space && last != ',' && last != ';' && c != ',' && c != ';')
+            MD5Update(ctx, (unsigned char*)" ", 1);
+        space = 0;
+        MD5Update(ctx, (unsigned char*)&c, 1);
+        last = c;
+    }
+}
+
+/* Return the secondary object selected by the given request headers,
+   retained. */
+ObjectPtr
+httpVaryVariant(ObjectPtr object, AtomPtr headers)
+{
+    static const char hex[] = "0123456789abcdef";
+    AtomPtr names[MAX_VARY_NAMES];
+    MD5_CTX ctx;
+    ObjectPtr variant;
+    char *key;
+    int key_size, i, n, b, e, rc;
+
+    n = varyNames(object->headers, names);
+    if(n < 0)
+        return NULL;
+
+    MD5Init(&ctx);
+    for(i = 0; i < n; i++) {
+        MD5Update(&ctx, (unsigned char*)names[i]->string, names[i]->length);
+        if(headers) {
+            rc = httpFindHeader(names[i], headers->string, headers->length,
+                                &b, &e);
+            if(rc) {
+                MD5Update(&ctx, (unsigned char*)":", 1);
+                varyDigestValue(&ctx, headers->string + b, e - b);
+            }
+        }
+        MD5Update(&ctx, (unsigned char*)"\n", 1);
+    }
+    MD5Final(&ctx);
+    releaseVaryNames(names, n);
+
+    if(object->key_size + VARY_SUFFIX_LENGTH + 32 >= 50000)
+        return NULL;
+    key_size = object->key_size + VARY_SUFFIX_LENGTH + 32;
+    key = malloc(key_size);
+    if(key == NULL)
+        return NULL;
+    memcpy(key, object->key, object->key_size);
+    memcpy(key + object->key_size, VARY_SUFFIX, VARY_SUFFIX_LENGTH);
+    for(i = 0; i < 16; i++) {
+        key[object->key_size + VARY_SUFFIX_LENGTH + 2 * i] =
+            hex[ctx.digest[i] >> 4];
+        key[object->key_size + VARY_SUFFIX_LENGTH + 2 * i + 1] =
+            hex[ctx.digest[i] & 0x0F];
+    }
+
+    variant = makeObject(object->type, key, key_size, 1, 1,
+                         object->request, object->request_closure);
+    free(key);
+    return variant;
+}
@@ -0,0 +1,34 @@
+/*
+Copyright (c) 2003-2010 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* Secondary keys for objects carrying Vary.  A response with Vary is
+   stored under its URL as usual, and remembers the values of the
+   varying headers sent by the client that caused it to be fetched.
+   A request that doesn't match them is redirected to a secondary
+   object, whose key is the URL followed by " vary " and a digest of
+   the request's own (normalised) values of these headers. */
+
+int objectUrlLength(ObjectPtr object);
+int httpVaryMatch(ObjectPtr object, AtomPtr headers);
+void httpVaryRecord(ObjectPtr object, AtomPtr reply_headers, AtomPtr headers);
+ObjectPtr httpVaryVariant(ObjectPtr object, AtomPtr headers);